@@ -25,6 +25,7 @@
 #include "block_int.h"
 #include <zlib.h>
 #include "aes.h"
+#include "sys-queue.h"
 #include <assert.h>
 
 /*
@@ -97,7 +98,59 @@ typedef struct __attribute__((packed)) QCowSnapshotHeader {
     /* name follows  */
 } QCowSnapshotHeader;
 
-#define L2_CACHE_SIZE 16
+/* default and maximum number of L2 tables kept in memory */
+#define L2_CACHE_SIZE     16
+#define L2_CACHE_SIZE_MAX 65536
+
+typedef struct QCowL2CacheEntry {
+    uint64_t offset; /* offset of the table in the image, 0 if unused */
+    uint64_t *table;
+    struct QCowL2CacheEntry *hash_next;
+    TAILQ_ENTRY(QCowL2CacheEntry) lru;
+} QCowL2CacheEntry;
+
+struct QCowAIOCB;
+TAILQ_HEAD(QCowWaitQueue, QCowAIOCB);
+
+/* asynchronous read of an L2 table that is not in the cache */
+typedef struct QCowL2Load {
+    BlockDriverState *bs;
+    uint64_t offset;
+    uint64_t *table;
+    int stale; /* the table was written while the read was in flight */
+    struct QCowWaitQueue waiters;
+    struct QCowL2Load *next;
+} QCowL2Load;
+
+/* clusters allocated by a request but not yet linked in the L2 table */
+typedef struct QCowL2Meta
+{
+    uint64_t offset;
+    int n_start;
+    int nb_available;
+    int nb_clusters;
+    struct QCowL2Meta *depends_on;
+
+    /* the L2 entries being written, NULL until the L2 update starts */
+    uint64_t l2_offset;
+    int l2_index;
+    uint64_t *l2_entries;
+
+    struct QCowWaitQueue dependent_requests;
+    LIST_ENTRY(QCowL2Meta) next_in_flight;
+} QCowL2Meta;
+
+/* number of refcount blocks kept in memory */
+#define REFCOUNT_CACHE_SIZE 8
+
+typedef struct QCowRefcountBlock {
+    int64_t offset;      /* offset of the block in the image, 0 if unused */
+    uint16_t *block;
+    uint64_t lru_stamp;
+    /* range of modified entries not yet written, empty if start >= end */
+    int dirty_start;
+    int dirty_end;
+} QCowRefcountBlock;
 
 typedef struct QCowSnapshot {
     uint64_t l1_table_offset;
@@ -125,8 +178,15 @@ typedef struct BDRVQcowState {
     uint64_t l1_table_offset;
     uint64_t *l1_table;
     uint64_t *l2_cache;
-    uint64_t l2_cache_offsets[L2_CACHE_SIZE];
-    uint32_t l2_cache_counts[L2_CACHE_SIZE];
+    QCowL2CacheEntry *l2_cache_entries;
+    QCowL2CacheEntry **l2_cache_hash;
+    TAILQ_HEAD(, QCowL2CacheEntry) l2_cache_lru; /* least recently used first */
+    int l2_cache_size;
+    int l2_cache_hash_size;
+    uint64_t l2_cache_hits;
+    uint64_t l2_cache_misses;
+    QCowL2Load *l2_loads;
+    LIST_HEAD(QCowClusterAllocs, QCowL2Meta) cluster_allocs;
     uint8_t *cluster_cache;
     uint8_t *cluster_data;
     uint64_t cluster_cache_offset;
@@ -134,8 +194,8 @@ typedef struct BDRVQcowState {
     uint64_t *refcount_table;
     uint64_t refcount_table_offset;
     uint32_t refcount_table_size;
-    uint64_t refcount_block_cache_offset;
-    uint16_t *refcount_block_cache;
+    QCowRefcountBlock refcount_cache[REFCOUNT_CACHE_SIZE];
+    uint64_t refcount_cache_clock;
     int64_t free_cluster_index;
     int64_t free_byte_offset;
 
@@ -154,12 +214,15 @@ typedef struct BDRVQcowState {
 } BDRVQcowState;
 
 static int decompress_cluster(BDRVQcowState *s, uint64_t cluster_offset);
+static void l2_cache_init(BlockDriverState *bs);
+static void l2_cache_close(BlockDriverState *bs);
 static int qcow_read(BlockDriverState *bs, int64_t sector_num,
                      uint8_t *buf, int nb_sectors);
 static int qcow_read_snapshots(BlockDriverState *bs);
 static void qcow_free_snapshots(BlockDriverState *bs);
 static int refcount_init(BlockDriverState *bs);
 static void refcount_close(BlockDriverState *bs);
+static int refcount_cache_flush(BlockDriverState *bs);
 static int get_refcount(BlockDriverState *bs, int64_t cluster_index);
 static int update_cluster_refcount(BlockDriverState *bs,
                                    int64_t cluster_index,
@@ -266,7 +329,8 @@ static int qcow_open(BlockDriverState *bs, const char *filename, int flags)
         be64_to_cpus(&s->l1_table[i]);
     }
     /* alloc L2 cache */
-    s->l2_cache = qemu_malloc(s->l2_size * L2_CACHE_SIZE * sizeof(uint64_t));
+    l2_cache_init(bs);
+    LIST_INIT(&s->cluster_allocs);
     s->cluster_cache = qemu_malloc(s->cluster_size);
     /* one more sector for decompressed data alignment */
     s->cluster_data = qemu_malloc(QCOW_MAX_CRYPT_CLUSTERS * s->cluster_size
@@ -299,7 +363,7 @@ static int qcow_open(BlockDriverState *bs, const char *filename, int flags)
     qcow_free_snapshots(bs);
     refcount_close(bs);
     qemu_free(s->l1_table);
-    qemu_free(s->l2_cache);
+    l2_cache_close(bs);
     qemu_free(s->cluster_cache);
     qemu_free(s->cluster_data);
     bdrv_delete(s->hd);
@@ -398,31 +462,159 @@ static int copy_sectors(BlockDriverState *bs, uint64_t start_sect,
     return 0;
 }
 
-static void l2_cache_reset(BlockDriverState *bs)
+/*
+ * L2 table cache
+ *
+ * Entries are found through a hash table indexed by the cluster number of
+ * the L2 table and replaced in LRU order.  The cache is write-through: any
+ * update to a cached table is written to the image immediately, so an entry
+ * can be dropped at any time.
+ */
+
+static void l2_cache_init(BlockDriverState *bs)
 {
     BDRVQcowState *s = bs->opaque;
+    int i;
 
-    memset(s->l2_cache, 0, s->l2_size * L2_CACHE_SIZE * sizeof(uint64_t));
-    memset(s->l2_cache_offsets, 0, L2_CACHE_SIZE * sizeof(uint64_t));
-    memset(s->l2_cache_counts, 0, L2_CACHE_SIZE * sizeof(uint32_t));
+    s->l2_cache_size = bs->l2_cache_size;
+    if (s->l2_cache_size <= 0)
+        s->l2_cache_size = L2_CACHE_SIZE;
+    if (s->l2_cache_size > L2_CACHE_SIZE_MAX)
+        s->l2_cache_size = L2_CACHE_SIZE_MAX;
+
+    /* keep the hash chains short: at least two buckets per entry */
+    s->l2_cache_hash_size = 1;
+    while (s->l2_cache_hash_size < 2 * s->l2_cache_size)
+        s->l2_cache_hash_size <<= 1;
+
+    s->l2_cache = qemu_malloc(s->l2_size * s->l2_cache_size * sizeof(uint64_t));
+    s->l2_cache_entries = qemu_mallocz(s->l2_cache_size *
+                                       sizeof(QCowL2CacheEntry));
+    s->l2_cache_hash = qemu_mallocz(s->l2_cache_hash_size *
+                                    sizeof(QCowL2CacheEntry *));
+    TAILQ_INIT(&s->l2_cache_lru);
+    for(i = 0; i < s->l2_cache_size; i++) {
+        s->l2_cache_entries[i].table = s->l2_cache + (i << s->l2_bits);
+        TAILQ_INSERT_TAIL(&s->l2_cache_lru, &s->l2_cache_entries[i], lru);
+    }
 }
 
-static inline int l2_cache_new_entry(BlockDriverState *bs)
+static void l2_cache_close(BlockDriverState *bs)
 {
     BDRVQcowState *s = bs->opaque;
-    uint32_t min_count;
-    int min_index, i;
-
-    /* find a new entry in the least used one */
-    min_index = 0;
-    min_count = 0xffffffff;
-    for(i = 0; i < L2_CACHE_SIZE; i++) {
-        if (s->l2_cache_counts[i] < min_count) {
-            min_count = s->l2_cache_counts[i];
-            min_index = i;
+
+    qemu_free(s->l2_cache);
+    qemu_free(s->l2_cache_entries);
+    qemu_free(s->l2_cache_hash);
+    s->l2_cache = NULL;
+    s->l2_cache_entries = NULL;
+    s->l2_cache_hash = NULL;
+}
+
+static inline QCowL2CacheEntry **l2_cache_bucket(BDRVQcowState *s,
+                                                 uint64_t l2_offset)
+{
+    return &s->l2_cache_hash[(l2_offset >> s->cluster_bits) &
+                             (s->l2_cache_hash_size - 1)];
+}
+
+static void l2_cache_unhash(BDRVQcowState *s, QCowL2CacheEntry *e)
+{
+    QCowL2CacheEntry **pe;
+
+    if (!e->offset)
+        return;
+    for(pe = l2_cache_bucket(s, e->offset); *pe != NULL;
+        pe = &(*pe)->hash_next) {
+        if (*pe == e) {
+            *pe = e->hash_next;
+            break;
+        }
+    }
+    e->hash_next = NULL;
+    e->offset = 0;
+}
+
+static QCowL2CacheEntry *l2_cache_find(BDRVQcowState *s, uint64_t l2_offset)
+{
+    QCowL2CacheEntry *e;
+
+    for(e = *l2_cache_bucket(s, l2_offset); e != NULL; e = e->hash_next) {
+        if (e->offset == l2_offset)
+            return e;
+    }
+    return NULL;
+}
+
+/* A table read from the image misses the entries of L2 updates that are
+   still being written: copy them from the in flight allocations. */
+static void l2_cache_apply_inflight(BDRVQcowState *s, uint64_t l2_offset,
+                                    uint64_t *l2_table)
+{
+    QCowL2Meta *m;
+
+    LIST_FOREACH(m, &s->cluster_allocs, next_in_flight) {
+        if (m->l2_entries && m->l2_offset == l2_offset) {
+            memcpy(l2_table + m->l2_index, m->l2_entries,
+                   m->nb_clusters * sizeof(uint64_t));
         }
     }
-    return min_index;
+}
+
+/* Asynchronous reads of a table that has just been written may return
+   old data: do not insert them in the cache.  0 means all tables. */
+static void l2_load_invalidate(BDRVQcowState *s, uint64_t l2_offset)
+{
+    QCowL2Load *l;
+
+    for(l = s->l2_loads; l != NULL; l = l->next) {
+        if (l2_offset == 0 || l->offset == l2_offset)
+            l->stale = 1;
+    }
+}
+
+static void l2_cache_reset(BlockDriverState *bs)
+{
+    BDRVQcowState *s = bs->opaque;
+    int i;
+
+    l2_load_invalidate(s, 0);
+
+    memset(s->l2_cache, 0, s->l2_size * s->l2_cache_size * sizeof(uint64_t));
+    memset(s->l2_cache_hash, 0,
+           s->l2_cache_hash_size * sizeof(QCowL2CacheEntry *));
+    for(i = 0; i < s->l2_cache_size; i++) {
+        s->l2_cache_entries[i].offset = 0;
+        s->l2_cache_entries[i].hash_next = NULL;
+    }
+}
+
+/*
+ * l2_cache_new_entry
+ *
+ * evict the least recently used entry and bind it to l2_offset. The
+ * table of the returned entry has undefined contents and must be filled
+ * by the caller.
+ */
+
+static QCowL2CacheEntry *l2_cache_new_entry(BlockDriverState *bs,
+                                            uint64_t l2_offset)
+{
+    BDRVQcowState *s = bs->opaque;
+    QCowL2CacheEntry *e, **bucket;
+
+    e = TAILQ_FIRST(&s->l2_cache_lru);
+    l2_cache_unhash(s, e);
+
+    TAILQ_REMOVE(&s->l2_cache_lru, e, lru);
+    TAILQ_INSERT_TAIL(&s->l2_cache_lru, e, lru);
+
+    bucket = l2_cache_bucket(s, l2_offset);
+    e->offset = l2_offset;
+    e->hash_next = *bucket;
+    *bucket = e;
+
+    return e;
 }
 
 static int64_t align_offset(int64_t offset, int n)
@@ -465,6 +657,8 @@ static int grow_l1_table(BlockDriverState *bs, int min_size)
         new_l1_table[i] = be64_to_cpu(new_l1_table[i]);
 
     /* set new table */
+    if (refcount_cache_flush(bs) < 0)
+        goto fail;
     cpu_to_be32w((uint32_t*)data, new_l1_size);
     cpu_to_be64w((uint64_t*)(data + 4), new_l1_table_offset);
     if (bdrv_pwrite(s->hd, offsetof(QCowHeader, l1_size), data,
@@ -487,28 +681,24 @@ static int grow_l1_table(BlockDriverState *bs, int min_size)
  * seek l2_offset in the l2_cache table
  * if not found, return NULL,
  * if found,
- *   increments the l2 cache hit count of the entry,
- *   if counter overflow, divide by two all counters
+ *   mark the entry as most recently used
  *   return the pointer to the l2 cache entry
  *
  */
 
 static uint64_t *seek_l2_table(BDRVQcowState *s, uint64_t l2_offset)
 {
-    int i, j;
+    QCowL2CacheEntry *e;
 
-    for(i = 0; i < L2_CACHE_SIZE; i++) {
-        if (l2_offset == s->l2_cache_offsets[i]) {
-            /* increment the hit count */
-            if (++s->l2_cache_counts[i] == 0xffffffff) {
-                for(j = 0; j < L2_CACHE_SIZE; j++) {
-                    s->l2_cache_counts[j] >>= 1;
-                }
-            }
-            return s->l2_cache + (i << s->l2_bits);
-        }
+    e = l2_cache_find(s, l2_offset);
+    if (e == NULL) {
+        s->l2_cache_misses++;
+        return NULL;
     }
-    return NULL;
+    TAILQ_REMOVE(&s->l2_cache_lru, e, lru);
+    TAILQ_INSERT_TAIL(&s->l2_cache_lru, e, lru);
+    s->l2_cache_hits++;
+    return e->table;
 }
 
 /*
@@ -524,7 +714,7 @@ static uint64_t *seek_l2_table(BDRVQcowState *s, uint64_t l2_offset)
 static uint64_t *l2_load(BlockDriverState *bs, uint64_t l2_offset)
 {
     BDRVQcowState *s = bs->opaque;
-    int min_index;
+    QCowL2CacheEntry *e;
     uint64_t *l2_table;
 
     /* seek if the table for the given offset is in the cache */
@@ -533,17 +723,17 @@ static uint64_t *l2_load(BlockDriverState *bs, uint64_t l2_offset)
     if (l2_table != NULL)
         return l2_table;
 
-    /* not found: load a new entry in the least used one */
+    /* not found: load a new entry in the least recently used one */
 
-    min_index = l2_cache_new_entry(bs);
-    l2_table = s->l2_cache + (min_index << s->l2_bits);
-    if (bdrv_pread(s->hd, l2_offset, l2_table, s->l2_size * sizeof(uint64_t)) !=
-        s->l2_size * sizeof(uint64_t))
+    e = l2_cache_new_entry(bs, l2_offset);
+    if (bdrv_pread(s->hd, l2_offset, e->table, s->l2_size * sizeof(uint64_t)) !=
+        s->l2_size * sizeof(uint64_t)) {
+        l2_cache_unhash(s, e);
         return NULL;
-    s->l2_cache_offsets[min_index] = l2_offset;
-    s->l2_cache_counts[min_index] = 1;
+    }
+    l2_cache_apply_inflight(s, l2_offset, e->table);
 
-    return l2_table;
+    return e->table;
 }
 
 /*
@@ -559,7 +749,7 @@ static uint64_t *l2_load(BlockDriverState *bs, uint64_t l2_offset)
 static uint64_t *l2_allocate(BlockDriverState *bs, int l1_index)
 {
     BDRVQcowState *s = bs->opaque;
-    int min_index;
+    QCowL2CacheEntry *e, *old_e;
     uint64_t old_l2_offset, tmp;
     uint64_t *l2_table, l2_offset;
 
@@ -568,6 +758,8 @@ static uint64_t *l2_allocate(BlockDriverState *bs, int l1_index)
     /* allocate a new l2 entry */
 
     l2_offset = alloc_clusters(bs, s->l2_size * sizeof(uint64_t));
+    if (refcount_cache_flush(bs) < 0)
+        return NULL;
 
     /* update the L1 entry */
 
@@ -580,31 +772,34 @@ static uint64_t *l2_allocate(BlockDriverState *bs, int l1_index)
 
     /* allocate a new entry in the l2 cache */
 
-    min_index = l2_cache_new_entry(bs);
-    l2_table = s->l2_cache + (min_index << s->l2_bits);
+    old_e = old_l2_offset ? l2_cache_find(s, old_l2_offset) : NULL;
+    e = l2_cache_new_entry(bs, l2_offset);
+    l2_table = e->table;
 
     if (old_l2_offset == 0) {
         /* if there was no old l2 table, clear the new table */
         memset(l2_table, 0, s->l2_size * sizeof(uint64_t));
+    } else if (old_e) {
+        /* the old table is cached (if it was just evicted, e is old_e) */
+        if (old_e != e)
+            memcpy(l2_table, old_e->table, s->l2_size * sizeof(uint64_t));
     } else {
         /* if there was an old l2 table, read it from the disk */
         if (bdrv_pread(s->hd, old_l2_offset,
                        l2_table, s->l2_size * sizeof(uint64_t)) !=
             s->l2_size * sizeof(uint64_t))
-            return NULL;
+            goto fail;
     }
     /* write the l2 table to the file */
     if (bdrv_pwrite(s->hd, l2_offset,
                     l2_table, s->l2_size * sizeof(uint64_t)) !=
         s->l2_size * sizeof(uint64_t))
-        return NULL;
-
-    /* update the l2 cache entry */
-
-    s->l2_cache_offsets[min_index] = l2_offset;
-    s->l2_cache_counts[min_index] = 1;
+        goto fail;
 
     return l2_table;
+ fail:
+    l2_cache_unhash(s, e);
+    return NULL;
 }
 
 static int size_to_clusters(BDRVQcowState *s, int64_t size)
@@ -678,6 +873,10 @@ static uint64_t get_cluster_offset(BlockDriverState *bs,
 
     nb_available = (nb_available >> 9) + index_in_cluster;
 
+    /* do not look past the end of the L2 table */
+    if (nb_needed > nb_available)
+        nb_needed = nb_available;
+
     cluster_offset = 0;
 
     /* seek the the l2 offset in the l1 table */
@@ -855,6 +1054,8 @@ static uint64_t alloc_compressed_cluster_offset(BlockDriverState *bs,
 
     /* compressed clusters never have the copied flag */
 
+    if (refcount_cache_flush(bs) < 0)
+        return 0;
     l2_table[l2_index] = cpu_to_be64(cluster_offset);
     if (bdrv_pwrite(s->hd,
                     l2_offset + l2_index * sizeof(uint64_t),
@@ -865,20 +1066,52 @@ static uint64_t alloc_compressed_cluster_offset(BlockDriverState *bs,
     return cluster_offset;
 }
 
-typedef struct QCowL2Meta
+/*
+ * alloc_cluster_update_l2
+ *
+ * point the cached L2 entries of an allocation to the new clusters and
+ * record in m where they live. The previous entries that must be freed
+ * once the table is written are stored in old_cluster.
+ *
+ * Return the number of old clusters, or < 0 on error.
+ *
+ */
+
+static int alloc_cluster_update_l2(BlockDriverState *bs,
+                                   uint64_t cluster_offset, QCowL2Meta *m,
+                                   uint64_t **pl2_table, uint64_t *old_cluster)
 {
-    uint64_t offset;
-    int n_start;
-    int nb_available;
-    int nb_clusters;
-} QCowL2Meta;
+    BDRVQcowState *s = bs->opaque;
+    int i, j = 0, l2_index;
+    uint64_t l2_offset, *l2_table;
+
+    if (!get_cluster_table(bs, m->offset, &l2_table, &l2_offset, &l2_index))
+        return -EIO;
+
+    /* the new clusters must be referenced on disk before the L2 entries */
+    if (refcount_cache_flush(bs) < 0)
+        return -EIO;
+
+    for (i = 0; i < m->nb_clusters; i++) {
+        if(l2_table[l2_index + i] != 0)
+            old_cluster[j++] = l2_table[l2_index + i];
+
+        l2_table[l2_index + i] = cpu_to_be64((cluster_offset +
+                    (i << s->cluster_bits)) | QCOW_OFLAG_COPIED);
+    }
+
+    m->l2_offset = l2_offset;
+    m->l2_index = l2_index;
+    *pl2_table = l2_table;
+    return j;
+}
 
 static int alloc_cluster_link_l2(BlockDriverState *bs, uint64_t cluster_offset,
         QCowL2Meta *m)
 {
     BDRVQcowState *s = bs->opaque;
-    int i, j = 0, l2_index, ret;
-    uint64_t *old_cluster, start_sect, l2_offset, *l2_table;
+    int i, j, ret;
+    uint64_t *old_cluster, start_sect, *l2_table;
 
     if (m->nb_clusters == 0)
         return 0;
@@ -901,23 +1134,19 @@ static int alloc_cluster_link_l2(BlockDriverState *bs, uint64_t cluster_offset,
             goto err;
     }
 
-    ret = -EIO;
     /* update L2 table */
-    if (!get_cluster_table(bs, m->offset, &l2_table, &l2_offset, &l2_index))
+    j = alloc_cluster_update_l2(bs, cluster_offset, m, &l2_table, old_cluster);
+    if (j < 0) {
+        ret = j;
         goto err;
+    }
 
-    for (i = 0; i < m->nb_clusters; i++) {
-        if(l2_table[l2_index + i] != 0)
-            old_cluster[j++] = l2_table[l2_index + i];
-
-        l2_table[l2_index + i] = cpu_to_be64((cluster_offset +
-                    (i << s->cluster_bits)) | QCOW_OFLAG_COPIED);
-     }
-
-    if (bdrv_pwrite(s->hd, l2_offset + l2_index * sizeof(uint64_t),
-                l2_table + l2_index, m->nb_clusters * sizeof(uint64_t)) !=
+    ret = -EIO;
+    if (bdrv_pwrite(s->hd, m->l2_offset + m->l2_index * sizeof(uint64_t),
+                l2_table + m->l2_index, m->nb_clusters * sizeof(uint64_t)) !=
             m->nb_clusters * sizeof(uint64_t))
         goto err;
+    l2_load_invalidate(s, m->l2_offset);
 
     for (i = 0; i < j; i++)
         free_any_clusters(bs, old_cluster[i], 1);
@@ -937,7 +1166,9 @@ err:
  * If the offset is not found, allocate a new cluster.
  *
  * Return the cluster offset if successful,
- * Return 0, otherwise.
+ * Return 0, otherwise. If the first cluster is being allocated by another
+ * request, 0 is returned and m->depends_on is set to that allocation: the
+ * caller must retry once it has been linked.
  *
  */
 
@@ -949,7 +1180,12 @@ static uint64_t alloc_cluster_offset(BlockDriverState *bs,
     BDRVQcowState *s = bs->opaque;
     int l2_index, ret;
     uint64_t l2_offset, *l2_table, cluster_offset;
+    uint64_t start, end, old_start, old_end;
     int nb_clusters, i = 0;
+    QCowL2Meta *old;
+
+    m->depends_on = NULL;
+    m->l2_entries = NULL;
 
     ret = get_cluster_table(bs, offset, &l2_table, &l2_offset, &l2_index);
     if (ret == 0)
@@ -998,6 +1234,25 @@ static uint64_t alloc_cluster_offset(BlockDriverState *bs,
     }
     nb_clusters = i;
 
+    /* do not allocate clusters that another request is still linking */
+
+    start = offset & ~(s->cluster_size - 1);
+    end = start + ((uint64_t)nb_clusters << s->cluster_bits);
+    LIST_FOREACH(old, &s->cluster_allocs, next_in_flight) {
+        old_start = old->offset & ~(s->cluster_size - 1);
+        old_end = old_start + ((uint64_t)old->nb_clusters << s->cluster_bits);
+        if (end <= old_start || start >= old_end)
+            continue;
+        if (start < old_start) {
+            nb_clusters = (old_start - start) >> s->cluster_bits;
+            end = old_start;
+        } else {
+            m->depends_on = old;
+            m->nb_clusters = 0;
+            return 0;
+        }
+    }
+
     /* allocate a new cluster */
 
     cluster_offset = alloc_clusters(bs, nb_clusters * s->cluster_size);
@@ -1026,6 +1281,25 @@ static int qcow_is_allocated(BlockDriverState *bs, int64_t sector_num,
     return (cluster_offset != 0);
 }
 
+static int64_t qcow_get_file_offset(BlockDriverState *bs, int64_t sector_num,
+                                    int nb_sectors, int *pnum)
+{
+    BDRVQcowState *s = bs->opaque;
+    uint64_t cluster_offset;
+
+    if (s->crypt_method)
+        return -ENOTSUP;
+
+    *pnum = nb_sectors;
+    cluster_offset = get_cluster_offset(bs, sector_num << 9, pnum);
+    if (!cluster_offset)
+        return 0;
+    if (cluster_offset & QCOW_OFLAG_COMPRESSED)
+        return -ENOTSUP;
+
+    return cluster_offset + ((sector_num & (s->cluster_sectors - 1)) << 9);
+}
+
 static int decompress_buffer(uint8_t *out_buf, int out_buf_size,
                              const uint8_t *buf, int buf_size)
 {
@@ -1152,8 +1426,13 @@ static int qcow_write(BlockDriverState *bs, int64_t sector_num,
         cluster_offset = alloc_cluster_offset(bs, sector_num << 9,
                                               index_in_cluster,
                                               n_end, &n, &l2meta);
-        if (!cluster_offset)
-            return -1;
+        if (!cluster_offset) {
+            if (!l2meta.depends_on)
+                return -1;
+            /* an asynchronous request is allocating the same cluster */
+            qemu_aio_wait();
+            continue;
+        }
         if (s->crypt_method) {
             encrypt_sectors(s, sector_num, s->cluster_data, buf, n, 1,
                             &s->aes_encrypt_key);
@@ -1174,19 +1453,195 @@ static int qcow_write(BlockDriverState *bs, int64_t sector_num,
     return 0;
 }
 
+/*
+ * Asynchronous I/O
+ *
+ * Requests are state machines driven by the completion of the I/Os they
+ * issue.  L2 tables missing from the cache are read asynchronously; all
+ * requests needing the same table wait for a single read.  A write that
+ * allocates clusters keeps its QCowL2Meta in s->cluster_allocs until the
+ * new L2 entries are on disk, and any other write that wants to allocate
+ * the same clusters waits for it.
+ *
+ * Allocating a new L2 table, reading compressed clusters and writing back
+ * the refcount cache are still synchronous.
+ */
+
+enum {
+    QCOW_AIO_NEXT,          /* start the next chunk of the request */
+    QCOW_AIO_DATA,          /* guest data transfer completed */
+    QCOW_AIO_COW_HEAD,      /* copy the sectors before the written ones */
+    QCOW_AIO_COW_HEAD_READ,
+    QCOW_AIO_COW_TAIL,      /* copy the sectors after the written ones */
+    QCOW_AIO_COW_TAIL_READ,
+    QCOW_AIO_LINK_L2,       /* write the new L2 entries */
+    QCOW_AIO_LINK_L2_DONE,
+};
+
 typedef struct QCowAIOCB {
     BlockDriverAIOCB common;
     int64_t sector_num;
     uint8_t *buf;
     int nb_sectors;
     int n;
+    int state;
     uint64_t cluster_offset;
     uint8_t *cluster_data;
     BlockDriverAIOCB *hd_aiocb;
     QEMUBH *bh;
     QCowL2Meta l2meta;
+
+    /* copy on write of partially written clusters */
+    uint8_t *cow_buf;
+    int64_t cow_sector;
+    int cow_sectors;
+
+    /* L2 update in flight */
+    uint64_t *l2_buf;
+    uint64_t *old_cluster;
+    int nb_old_clusters;
+
+    /* set while waiting for an L2 table or another allocation */
+    struct QCowWaitQueue *wait_queue;
+    BlockDriverCompletionFunc *resume;
+    TAILQ_ENTRY(QCowAIOCB) wait_link;
 } QCowAIOCB;
 
+static BlockDriverAIOCB *qcow_aio_read(BlockDriverState *bs,
+        int64_t sector_num, uint8_t *buf, int nb_sectors,
+        BlockDriverCompletionFunc *cb, void *opaque);
+
+static void qcow_aio_wait(QCowAIOCB *acb, struct QCowWaitQueue *queue,
+                          BlockDriverCompletionFunc *resume)
+{
+    acb->wait_queue = queue;
+    acb->resume = resume;
+    TAILQ_INSERT_TAIL(queue, acb, wait_link);
+}
+
+/* resume all the requests of a wait queue */
+static void qcow_aio_wake_up(struct QCowWaitQueue *queue, int ret)
+{
+    struct QCowWaitQueue waiters;
+    QCowAIOCB *acb;
+
+    /* the resumed requests may queue themselves again */
+    TAILQ_INIT(&waiters);
+    while ((acb = TAILQ_FIRST(queue)) != NULL) {
+        TAILQ_REMOVE(queue, acb, wait_link);
+        TAILQ_INSERT_TAIL(&waiters, acb, wait_link);
+    }
+    while ((acb = TAILQ_FIRST(&waiters)) != NULL) {
+        TAILQ_REMOVE(&waiters, acb, wait_link);
+        acb->wait_queue = NULL;
+        acb->resume(acb, ret);
+    }
+}
+
+static void l2_load_cb(void *opaque, int ret)
+{
+    QCowL2Load *l = opaque, **pl;
+    BlockDriverState *bs = l->bs;
+    BDRVQcowState *s = bs->opaque;
+    QCowL2CacheEntry *e;
+
+    for(pl = &s->l2_loads; *pl != l; pl = &(*pl)->next)
+        ;
+    *pl = l->next;
+
+    /* if the table was modified meanwhile, the waiters will find it
+       missing again and read it from the image once more */
+    if (ret >= 0 && !l->stale && !l2_cache_find(s, l->offset)) {
+        e = l2_cache_new_entry(bs, l->offset);
+        memcpy(e->table, l->table, s->l2_size * sizeof(uint64_t));
+        l2_cache_apply_inflight(s, l->offset, e->table);
+    }
+
+    qcow_aio_wake_up(&l->waiters, ret < 0 ? ret : 0);
+    qemu_free(l->table);
+    qemu_free(l);
+}
+
+/*
+ * qcow_aio_l2_ready
+ *
+ * check that the L2 table mapping 'offset' is in the cache, or start
+ * reading it.
+ *
+ * Return 1 if the table is cached or does not exist,
+ * Return 0 if the request will be resumed when the table has been read,
+ * Return < 0 on error.
+ *
+ */
+
+static int qcow_aio_l2_ready(QCowAIOCB *acb, uint64_t offset,
+                             BlockDriverCompletionFunc *resume)
+{
+    BlockDriverState *bs = acb->common.bs;
+    BDRVQcowState *s = bs->opaque;
+    uint64_t l2_offset;
+    int l1_index;
+    QCowL2Load *l;
+
+    l1_index = offset >> (s->l2_bits + s->cluster_bits);
+    if (l1_index >= s->l1_size)
+        return 1;
+    l2_offset = s->l1_table[l1_index] & ~QCOW_OFLAG_COPIED;
+    if (!l2_offset || l2_cache_find(s, l2_offset))
+        return 1;
+
+    for(l = s->l2_loads; l != NULL; l = l->next) {
+        if (l->offset == l2_offset && !l->stale) {
+            qcow_aio_wait(acb, &l->waiters, resume);
+            return 0;
+        }
+    }
+
+    l = qemu_mallocz(sizeof(QCowL2Load));
+    l->bs = bs;
+    l->offset = l2_offset;
+    l->table = qemu_malloc(s->l2_size * sizeof(uint64_t));
+    TAILQ_INIT(&l->waiters);
+    l->next = s->l2_loads;
+    s->l2_loads = l;
+    qcow_aio_wait(acb, &l->waiters, resume);
+    s->l2_cache_misses++;
+
+    if (!bdrv_aio_read(s->hd, l2_offset >> 9, (uint8_t *)l->table,
+                       s->cluster_sectors, l2_load_cb, l)) {
+        s->l2_loads = l->next;
+        TAILQ_REMOVE(&l->waiters, acb, wait_link);
+        acb->wait_queue = NULL;
+        qemu_free(l->table);
+        qemu_free(l);
+        return -EIO;
+    }
+    return 0;
+}
+
+/* the allocation of acb is linked (or failed): let the requests waiting
+   for its clusters go on */
+static void qcow_aio_alloc_done(QCowAIOCB *acb)
+{
+    QCowL2Meta *m = &acb->l2meta;
+
+    if (m->nb_clusters == 0)
+        return;
+    LIST_REMOVE(m, next_in_flight);
+    m->nb_clusters = 0;
+    m->l2_entries = NULL;
+    qcow_aio_wake_up(&m->dependent_requests, 0);
+}
+
+static void qcow_aio_release(QCowAIOCB *acb)
+{
+    qemu_free(acb->cluster_data);
+    qemu_free(acb->cow_buf);
+    qemu_free(acb->l2_buf);
+    qemu_free(acb->old_cluster);
+    qemu_aio_release(acb);
+}
+
 static void qcow_aio_read_cb(void *opaque, int ret);
 static void qcow_aio_read_bh(void *opaque)
 {
@@ -1221,35 +1676,46 @@ static void qcow_aio_read_cb(void *opaque, int ret)
     if (ret < 0) {
 fail:
         acb->common.cb(acb->common.opaque, ret);
-        qemu_aio_release(acb);
+        qcow_aio_release(acb);
         return;
     }
 
-    /* post process the read buffer */
-    if (!acb->cluster_offset) {
-        /* nothing to do */
-    } else if (acb->cluster_offset & QCOW_OFLAG_COMPRESSED) {
-        /* nothing to do */
-    } else {
-        if (s->crypt_method) {
-            encrypt_sectors(s, acb->sector_num, acb->buf, acb->buf,
-                            acb->n, 0,
-                            &s->aes_decrypt_key);
+    if (acb->state == QCOW_AIO_DATA) {
+        /* post process the read buffer */
+        if (!acb->cluster_offset) {
+            /* nothing to do */
+        } else if (acb->cluster_offset & QCOW_OFLAG_COMPRESSED) {
+            /* nothing to do */
+        } else {
+            if (s->crypt_method) {
+                encrypt_sectors(s, acb->sector_num, acb->buf, acb->buf,
+                                acb->n, 0,
+                                &s->aes_decrypt_key);
+            }
         }
-    }
 
-    acb->nb_sectors -= acb->n;
-    acb->sector_num += acb->n;
-    acb->buf += acb->n * 512;
+        acb->nb_sectors -= acb->n;
+        acb->sector_num += acb->n;
+        acb->buf += acb->n * 512;
+        acb->state = QCOW_AIO_NEXT;
+    }
 
     if (acb->nb_sectors == 0) {
         /* request completed */
         acb->common.cb(acb->common.opaque, 0);
-        qemu_aio_release(acb);
+        qcow_aio_release(acb);
         return;
     }
 
+    /* make sure the lookup below does not block */
+    ret = qcow_aio_l2_ready(acb, acb->sector_num << 9, qcow_aio_read_cb);
+    if (ret < 0)
+        goto fail;
+    if (ret == 0)
+        return;
+
     /* prepare next AIO request */
+    acb->state = QCOW_AIO_DATA;
     acb->n = acb->nb_sectors;
     acb->cluster_offset = get_cluster_offset(bs, acb->sector_num << 9, &acb->n);
     index_in_cluster = acb->sector_num & (s->cluster_sectors - 1);
@@ -1308,12 +1774,21 @@ static QCowAIOCB *qcow_aio_setup(BlockDriverState *bs,
     if (!acb)
         return NULL;
     acb->hd_aiocb = NULL;
+    acb->bh = NULL;
     acb->sector_num = sector_num;
     acb->buf = buf;
     acb->nb_sectors = nb_sectors;
     acb->n = 0;
+    acb->state = QCOW_AIO_NEXT;
     acb->cluster_offset = 0;
+    acb->cluster_data = NULL;
     acb->l2meta.nb_clusters = 0;
+    acb->l2meta.l2_entries = NULL;
+    TAILQ_INIT(&acb->l2meta.dependent_requests);
+    acb->cow_buf = NULL;
+    acb->l2_buf = NULL;
+    acb->old_cluster = NULL;
+    acb->wait_queue = NULL;
     return acb;
 }
 
@@ -1331,40 +1806,230 @@ static BlockDriverAIOCB *qcow_aio_read(BlockDriverState *bs,
     return &acb->common;
 }
 
+/* start the copy of the unmodified sectors [n_start, n_end) of the first
+   cluster at start_sect into the newly allocated cluster_offset */
+static int qcow_aio_cow_read(QCowAIOCB *acb, uint64_t start_sect,
+                             uint64_t cluster_offset, int n_start, int n_end,
+                             BlockDriverCompletionFunc *cb)
+{
+    BlockDriverState *bs = acb->common.bs;
+    BDRVQcowState *s = bs->opaque;
+
+    if (!acb->cow_buf)
+        acb->cow_buf = qemu_malloc(s->cluster_size);
+    acb->cow_sector = (cluster_offset >> 9) + n_start;
+    acb->cow_sectors = n_end - n_start;
+
+    /* the old mapping of the clusters is still in place: reading our own
+       image returns the backing file, zeroes or the shared cluster */
+    acb->hd_aiocb = qcow_aio_read(bs, start_sect + n_start, acb->cow_buf,
+                                  acb->cow_sectors, cb, acb);
+    if (acb->hd_aiocb == NULL)
+        return -EIO;
+    return 0;
+}
+
+static int qcow_aio_cow_write(QCowAIOCB *acb, int64_t guest_sector,
+                              BlockDriverCompletionFunc *cb)
+{
+    BlockDriverState *bs = acb->common.bs;
+    BDRVQcowState *s = bs->opaque;
+
+    if (s->crypt_method) {
+        encrypt_sectors(s, guest_sector, acb->cow_buf, acb->cow_buf,
+                        acb->cow_sectors, 1, &s->aes_encrypt_key);
+    }
+    acb->hd_aiocb = bdrv_aio_write(s->hd, acb->cow_sector, acb->cow_buf,
+                                   acb->cow_sectors, cb, acb);
+    if (acb->hd_aiocb == NULL)
+        return -EIO;
+    return 0;
+}
+
+/* L2 entries are written by whole sectors of 64 entries */
+#define L2_SECTOR_START(index) ((index) & ~63)
+#define L2_SECTOR_END(index)   (((index) + 63) & ~63)
+
+/*
+ * qcow_aio_link_l2
+ *
+ * update the cached L2 table and write the modified sectors of it.
+ *
+ * Return 0 if the write was started,
+ * Return 1 if an update of the same sectors must be written first (it is
+ * stored in m->depends_on),
+ * Return < 0 on error.
+ *
+ */
+
+static int qcow_aio_link_l2(QCowAIOCB *acb, BlockDriverCompletionFunc *cb)
+{
+    BlockDriverState *bs = acb->common.bs;
+    BDRVQcowState *s = bs->opaque;
+    QCowL2Meta *m = &acb->l2meta, *old;
+    uint64_t *l2_table, l2_offset;
+    int first, last, l2_index;
+
+    /* our sectors include the entries of any update in flight, so they
+       must reach the disk after it */
+    l2_offset = s->l1_table[m->offset >> (s->l2_bits + s->cluster_bits)] &
+        ~QCOW_OFLAG_COPIED;
+    l2_index = (m->offset >> s->cluster_bits) & (s->l2_size - 1);
+    first = L2_SECTOR_START(l2_index);
+    last = L2_SECTOR_END(l2_index + m->nb_clusters);
+    LIST_FOREACH(old, &s->cluster_allocs, next_in_flight) {
+        if (old->l2_entries && old->l2_offset == l2_offset &&
+            L2_SECTOR_START(old->l2_index) < last &&
+            L2_SECTOR_END(old->l2_index + old->nb_clusters) > first) {
+            m->depends_on = old;
+            return 1;
+        }
+    }
+
+    acb->old_cluster = qemu_malloc(m->nb_clusters * sizeof(uint64_t));
+    acb->nb_old_clusters = alloc_cluster_update_l2(bs, acb->cluster_offset, m,
+                                                   &l2_table,
+                                                   acb->old_cluster);
+    if (acb->nb_old_clusters < 0)
+        return acb->nb_old_clusters;
+
+    acb->l2_buf = qemu_malloc((last - first) * sizeof(uint64_t));
+    memcpy(acb->l2_buf, l2_table + first, (last - first) * sizeof(uint64_t));
+    m->l2_entries = acb->l2_buf + (m->l2_index - first);
+
+    acb->hd_aiocb = bdrv_aio_write(s->hd, (m->l2_offset >> 9) + (first >> 6),
+                                   (uint8_t *)acb->l2_buf, (last - first) >> 6,
+                                   cb, acb);
+    if (acb->hd_aiocb == NULL)
+        return -EIO;
+    return 0;
+}
+
 static void qcow_aio_write_cb(void *opaque, int ret)
 {
     QCowAIOCB *acb = opaque;
     BlockDriverState *bs = acb->common.bs;
     BDRVQcowState *s = bs->opaque;
-    int index_in_cluster;
+    QCowL2Meta *m = &acb->l2meta;
+    int index_in_cluster, i;
     const uint8_t *src_buf;
+    uint64_t start_sect, end;
     int n_end;
 
     acb->hd_aiocb = NULL;
 
     if (ret < 0) {
     fail:
+        if (m->nb_clusters) {
+            free_any_clusters(bs, acb->cluster_offset, m->nb_clusters);
+            qcow_aio_alloc_done(acb);
+        }
         acb->common.cb(acb->common.opaque, ret);
-        qemu_aio_release(acb);
+        qcow_aio_release(acb);
         return;
     }
 
-    if (alloc_cluster_link_l2(bs, acb->cluster_offset, &acb->l2meta) < 0) {
-        free_any_clusters(bs, acb->cluster_offset, acb->l2meta.nb_clusters);
-        goto fail;
-    }
+    start_sect = (m->offset & ~(s->cluster_size - 1)) >> 9;
 
-    acb->nb_sectors -= acb->n;
-    acb->sector_num += acb->n;
-    acb->buf += acb->n * 512;
+    for(;;) {
+        switch(acb->state) {
+        case QCOW_AIO_NEXT:
+            goto next;
+        case QCOW_AIO_DATA:
+            acb->state = m->nb_clusters ? QCOW_AIO_COW_HEAD : QCOW_AIO_NEXT;
+            if (acb->state == QCOW_AIO_NEXT) {
+                acb->nb_sectors -= acb->n;
+                acb->sector_num += acb->n;
+                acb->buf += acb->n * 512;
+            }
+            break;
+        case QCOW_AIO_COW_HEAD:
+            acb->state = QCOW_AIO_COW_TAIL;
+            if (m->n_start) {
+                acb->state = QCOW_AIO_COW_HEAD_READ;
+                if (qcow_aio_cow_read(acb, start_sect, acb->cluster_offset,
+                                      0, m->n_start, qcow_aio_write_cb) < 0)
+                    goto eio;
+                return;
+            }
+            break;
+        case QCOW_AIO_COW_HEAD_READ:
+            acb->state = QCOW_AIO_COW_TAIL;
+            if (qcow_aio_cow_write(acb, start_sect, qcow_aio_write_cb) < 0)
+                goto eio;
+            return;
+        case QCOW_AIO_COW_TAIL:
+            acb->state = QCOW_AIO_LINK_L2;
+            if (m->nb_available & (s->cluster_sectors - 1)) {
+                end = m->nb_available & ~(uint64_t)(s->cluster_sectors - 1);
+                acb->state = QCOW_AIO_COW_TAIL_READ;
+                if (qcow_aio_cow_read(acb, start_sect + end,
+                                      acb->cluster_offset + (end << 9),
+                                      m->nb_available - end,
+                                      s->cluster_sectors,
+                                      qcow_aio_write_cb) < 0)
+                    goto eio;
+                return;
+            }
+            break;
+        case QCOW_AIO_COW_TAIL_READ:
+            acb->state = QCOW_AIO_LINK_L2;
+            end = m->nb_available & ~(uint64_t)(s->cluster_sectors - 1);
+            if (qcow_aio_cow_write(acb, start_sect + end +
+                                   (m->nb_available - end),
+                                   qcow_aio_write_cb) < 0)
+                goto eio;
+            return;
+        case QCOW_AIO_LINK_L2:
+            ret = qcow_aio_l2_ready(acb, m->offset, qcow_aio_write_cb);
+            if (ret < 0)
+                goto fail;
+            if (ret == 0)
+                return;
+            ret = qcow_aio_link_l2(acb, qcow_aio_write_cb);
+            if (ret < 0)
+                goto fail;
+            if (ret > 0) {
+                qcow_aio_wait(acb, &m->depends_on->dependent_requests,
+                              qcow_aio_write_cb);
+                return;
+            }
+            acb->state = QCOW_AIO_LINK_L2_DONE;
+            return;
+        case QCOW_AIO_LINK_L2_DONE:
+            /* the table may have been evicted and read again meanwhile */
+            l2_load_invalidate(s, m->l2_offset);
+            for (i = 0; i < acb->nb_old_clusters; i++)
+                free_any_clusters(bs, acb->old_cluster[i], 1);
+            qemu_free(acb->l2_buf);
+            qemu_free(acb->old_cluster);
+            acb->l2_buf = NULL;
+            acb->old_cluster = NULL;
+            qcow_aio_alloc_done(acb);
+
+            acb->nb_sectors -= acb->n;
+            acb->sector_num += acb->n;
+            acb->buf += acb->n * 512;
+            acb->state = QCOW_AIO_NEXT;
+            break;
+        }
+    }
 
+ next:
     if (acb->nb_sectors == 0) {
         /* request completed */
         acb->common.cb(acb->common.opaque, 0);
-        qemu_aio_release(acb);
+        qcow_aio_release(acb);
         return;
     }
 
+    /* the cluster allocation below must not block on an L2 read */
+    ret = qcow_aio_l2_ready(acb, acb->sector_num << 9, qcow_aio_write_cb);
+    if (ret < 0)
+        goto fail;
+    if (ret == 0)
+        return;
+
     index_in_cluster = acb->sector_num & (s->cluster_sectors - 1);
     n_end = index_in_cluster + acb->nb_sectors;
     if (s->crypt_method &&
@@ -1373,11 +2038,20 @@ static void qcow_aio_write_cb(void *opaque, int ret)
 
     acb->cluster_offset = alloc_cluster_offset(bs, acb->sector_num << 9,
                                           index_in_cluster,
-                                          n_end, &acb->n, &acb->l2meta);
+                                          n_end, &acb->n, m);
+    if (!acb->cluster_offset && m->depends_on) {
+        /* another request is allocating this cluster: retry after it */
+        qcow_aio_wait(acb, &m->depends_on->dependent_requests,
+                      qcow_aio_write_cb);
+        return;
+    }
     if (!acb->cluster_offset || (acb->cluster_offset & 511) != 0) {
         ret = -EIO;
         goto fail;
     }
+    if (m->nb_clusters)
+        LIST_INSERT_HEAD(&s->cluster_allocs, m, next_in_flight);
+
     if (s->crypt_method) {
         if (!acb->cluster_data) {
             acb->cluster_data = qemu_mallocz(QCOW_MAX_CRYPT_CLUSTERS *
@@ -1389,12 +2063,18 @@ static void qcow_aio_write_cb(void *opaque, int ret)
     } else {
         src_buf = acb->buf;
     }
+    acb->state = QCOW_AIO_DATA;
     acb->hd_aiocb = bdrv_aio_write(s->hd,
                                    (acb->cluster_offset >> 9) + index_in_cluster,
                                    src_buf, acb->n,
                                    qcow_aio_write_cb, acb);
     if (acb->hd_aiocb == NULL)
-        goto fail;
+        goto eio;
+    return;
+
+ eio:
+    ret = -EIO;
+    goto fail;
 }
 
 static BlockDriverAIOCB *qcow_aio_write(BlockDriverState *bs,
@@ -1417,16 +2097,24 @@ static BlockDriverAIOCB *qcow_aio_write(BlockDriverState *bs,
 static void qcow_aio_cancel(BlockDriverAIOCB *blockacb)
 {
     QCowAIOCB *acb = (QCowAIOCB *)blockacb;
+    if (acb->wait_queue)
+        TAILQ_REMOVE(acb->wait_queue, acb, wait_link);
     if (acb->hd_aiocb)
         bdrv_aio_cancel(acb->hd_aiocb);
-    qemu_aio_release(acb);
+    if (acb->bh) {
+        qemu_bh_delete(acb->bh);
+        acb->bh = NULL;
+    }
+    qcow_aio_alloc_done(acb);
+    qcow_aio_release(acb);
 }
 
 static void qcow_close(BlockDriverState *bs)
 {
     BDRVQcowState *s = bs->opaque;
+    refcount_cache_flush(bs);
     qemu_free(s->l1_table);
-    qemu_free(s->l2_cache);
+    l2_cache_close(bs);
     qemu_free(s->cluster_cache);
     qemu_free(s->cluster_data);
     refcount_close(bs);
@@ -1637,6 +2325,7 @@ static int qcow_write_compressed(BlockDriverState *bs, int64_t sector_num,
 static void qcow_flush(BlockDriverState *bs)
 {
     BDRVQcowState *s = bs->opaque;
+    refcount_cache_flush(bs);
     bdrv_flush(s->hd);
 }
 
@@ -1648,6 +2337,9 @@ static int qcow_get_info(BlockDriverState *bs, BlockDriverInfo *bdi)
         (s->cluster_bits + s->l2_bits);
     bdi->highest_alloc = s->highest_alloc << s->cluster_bits;
     bdi->num_free_bytes = s->nc_free  << s->cluster_bits;
+    bdi->l2_cache_size = s->l2_cache_size;
+    bdi->l2_cache_hits = s->l2_cache_hits;
+    bdi->l2_cache_misses = s->l2_cache_misses;
     return 0;
 }
 
@@ -1887,6 +2579,8 @@ static int qcow_write_snapshots(BlockDriverState *bs)
     }
 
     /* update the various header fields */
+    if (refcount_cache_flush(bs) < 0)
+        goto fail;
     data64 = cpu_to_be64(snapshots_offset);
     if (bdrv_pwrite(s->hd, offsetof(QCowHeader, snapshots_offset),
                     &data64, sizeof(data64)) != sizeof(data64))
@@ -2052,6 +2746,8 @@ static int qcow_snapshot_goto(BlockDriverState *bs,
 
     if (update_snapshot_refcount(bs, s->l1_table_offset, s->l1_size, 1) < 0)
         goto fail;
+    if (refcount_cache_flush(bs) < 0)
+        goto fail;
 
 #ifdef DEBUG_ALLOC
     check_refcounts(bs);
@@ -2129,7 +2825,8 @@ static int refcount_init(BlockDriverState *bs)
     BDRVQcowState *s = bs->opaque;
     int ret, refcount_table_size2, i;
 
-    s->refcount_block_cache = qemu_malloc(s->cluster_size);
+    for(i = 0; i < REFCOUNT_CACHE_SIZE; i++)
+        s->refcount_cache[i].block = qemu_malloc(s->cluster_size);
     refcount_table_size2 = s->refcount_table_size * sizeof(uint64_t);
     s->refcount_table = qemu_malloc(refcount_table_size2);
     if (s->refcount_table_size > 0) {
@@ -2148,24 +2845,99 @@ static int refcount_init(BlockDriverState *bs)
 static void refcount_close(BlockDriverState *bs)
 {
     BDRVQcowState *s = bs->opaque;
-    qemu_free(s->refcount_block_cache);
+    int i;
+
+    for(i = 0; i < REFCOUNT_CACHE_SIZE; i++) {
+        qemu_free(s->refcount_cache[i].block);
+        s->refcount_cache[i].block = NULL;
+    }
     qemu_free(s->refcount_table);
 }
 
+/*
+ * Refcount block cache
+ *
+ * Refcount updates only modify the cached block and remember the range of
+ * entries that changed; the range is written back with a single write when
+ * the entry is evicted or the cache is flushed.  Newly allocated clusters
+ * must have their refcount on disk before any L1 or L2 entry points to
+ * them, so callers flush the cache before writing such tables.  Decrements
+ * may stay in memory longer: losing them only leaks clusters.
+ */
 
-static int load_refcount_block(BlockDriverState *bs,
-                               int64_t refcount_block_offset)
+static int refcount_block_writeback(BlockDriverState *bs,
+                                    QCowRefcountBlock *rb)
 {
     BDRVQcowState *s = bs->opaque;
-    int ret;
-    ret = bdrv_pread(s->hd, refcount_block_offset, s->refcount_block_cache,
-                     s->cluster_size);
-    if (ret != s->cluster_size)
+    int len;
+
+    if (rb->dirty_start >= rb->dirty_end)
+        return 0;
+    len = (rb->dirty_end - rb->dirty_start) << REFCOUNT_SHIFT;
+    if (bdrv_pwrite(s->hd, rb->offset + (rb->dirty_start << REFCOUNT_SHIFT),
+                    &rb->block[rb->dirty_start], len) != len)
         return -EIO;
-    s->refcount_block_cache_offset = refcount_block_offset;
+    rb->dirty_start = rb->dirty_end = 0;
     return 0;
 }
 
+static int refcount_cache_flush(BlockDriverState *bs)
+{
+    BDRVQcowState *s = bs->opaque;
+    int i, ret = 0;
+
+    for(i = 0; i < REFCOUNT_CACHE_SIZE; i++) {
+        if (refcount_block_writeback(bs, &s->refcount_cache[i]) < 0)
+            ret = -EIO;
+    }
+    return ret;
+}
+
+static void refcount_block_set_dirty(QCowRefcountBlock *rb, int block_index)
+{
+    if (rb->dirty_start >= rb->dirty_end) {
+        rb->dirty_start = block_index;
+        rb->dirty_end = block_index + 1;
+    } else if (block_index < rb->dirty_start) {
+        rb->dirty_start = block_index;
+    } else if (block_index >= rb->dirty_end) {
+        rb->dirty_end = block_index + 1;
+    }
+}
+
+/* return the cache entry of the refcount block at refcount_block_offset,
+   replacing the least recently used entry if needed.  If 'read' is zero,
+   a newly bound entry has undefined contents. */
+static QCowRefcountBlock *get_refcount_block(BlockDriverState *bs,
+                                             int64_t refcount_block_offset,
+                                             int read)
+{
+    BDRVQcowState *s = bs->opaque;
+    QCowRefcountBlock *rb, *victim;
+    int i;
+
+    victim = &s->refcount_cache[0];
+    for(i = 0; i < REFCOUNT_CACHE_SIZE; i++) {
+        rb = &s->refcount_cache[i];
+        if (rb->offset == refcount_block_offset) {
+            rb->lru_stamp = ++s->refcount_cache_clock;
+            return rb;
+        }
+        if (rb->lru_stamp < victim->lru_stamp)
+            victim = rb;
+    }
+
+    if (refcount_block_writeback(bs, victim) < 0)
+        return NULL;
+    victim->offset = 0;
+    if (read && bdrv_pread(s->hd, refcount_block_offset, victim->block,
+                           s->cluster_size) != s->cluster_size)
+        return NULL;
+    victim->offset = refcount_block_offset;
+    victim->lru_stamp = ++s->refcount_cache_clock;
+    return victim;
+}
+
 static void scan_refcount(BlockDriverState *bs, int64_t *high, int64_t *free)
 {
     BDRVQcowState *s = bs->opaque;
@@ -2202,6 +2974,7 @@ static void scan_refcount(BlockDriverState *bs, int64_t *high, int64_t *free)
 static int get_refcount(BlockDriverState *bs, int64_t cluster_index)
 {
     BDRVQcowState *s = bs->opaque;
+    QCowRefcountBlock *rb;
     int refcount_table_index, block_index;
     int64_t refcount_block_offset;
 
@@ -2211,14 +2984,13 @@ static int get_refcount(BlockDriverState *bs, int64_t cluster_index)
     refcount_block_offset = s->refcount_table[refcount_table_index];
     if (!refcount_block_offset)
         return 0;
-    if (refcount_block_offset != s->refcount_block_cache_offset) {
-        /* better than nothing: return allocated if read error */
-        if (load_refcount_block(bs, refcount_block_offset) < 0)
-            return 1;
-    }
+    rb = get_refcount_block(bs, refcount_block_offset, 1);
+    /* better than nothing: return allocated if read error */
+    if (!rb)
+        return 1;
     block_index = cluster_index &
         ((1 << (s->cluster_bits - REFCOUNT_SHIFT)) - 1);
-    return be16_to_cpu(s->refcount_block_cache[block_index]);
+    return be16_to_cpu(rb->block[block_index]);
 }
 
 /* return < 0 if error */
@@ -2368,12 +3140,12 @@ static int grow_refcount_table(BlockDriverState *bs, int min_size)
 }
 
 /* addend must be 1 or -1 */
-/* XXX: cache several refcount block clusters ? */
 static int update_cluster_refcount(BlockDriverState *bs,
                                    int64_t cluster_index,
                                    int addend)
 {
     BDRVQcowState *s = bs->opaque;
+    QCowRefcountBlock *rb;
     int64_t offset, refcount_block_offset;
     int ret, refcount_table_index, block_index, refcount;
     uint64_t data64;
@@ -2393,10 +3165,15 @@ static int update_cluster_refcount(BlockDriverState *bs,
         /* create a new refcount block */
         /* Note: we cannot update the refcount now to avoid recursion */
         offset = alloc_clusters_noref(bs, s->cluster_size);
-        memset(s->refcount_block_cache, 0, s->cluster_size);
-        ret = bdrv_pwrite(s->hd, offset, s->refcount_block_cache, s->cluster_size);
-        if (ret != s->cluster_size)
+        rb = get_refcount_block(bs, offset, 0);
+        if (!rb)
+            return -EIO;
+        memset(rb->block, 0, s->cluster_size);
+        ret = bdrv_pwrite(s->hd, offset, rb->block, s->cluster_size);
+        if (ret != s->cluster_size) {
+            rb->offset = 0;
             return -EINVAL;
+        }
         s->refcount_table[refcount_table_index] = offset;
         data64 = cpu_to_be64(offset);
         ret = bdrv_pwrite(s->hd, s->refcount_table_offset +
@@ -2406,18 +3183,17 @@ static int update_cluster_refcount(BlockDriverState *bs,
             return -EINVAL;
 
         refcount_block_offset = offset;
-        s->refcount_block_cache_offset = offset;
         update_refcount(bs, offset, s->cluster_size, 1);
-    } else {
-        if (refcount_block_offset != s->refcount_block_cache_offset) {
-            if (load_refcount_block(bs, refcount_block_offset) < 0)
-                return -EIO;
-        }
     }
-    /* we can update the count and save it */
+    /* the recursive update above may have evicted the block */
+    rb = get_refcount_block(bs, refcount_block_offset, 1);
+    if (!rb)
+        return -EIO;
+
+    /* we can update the count, it is written by the next flush */
     block_index = cluster_index &
         ((1 << (s->cluster_bits - REFCOUNT_SHIFT)) - 1);
-    refcount = be16_to_cpu(s->refcount_block_cache[block_index]);
+    refcount = be16_to_cpu(rb->block[block_index]);
 
     if (refcount == 1 && addend == -1)
         s->nc_free += 1;
@@ -2430,11 +3206,8 @@ static int update_cluster_refcount(BlockDriverState *bs,
     if (refcount == 0 && cluster_index < s->free_cluster_index) {
         s->free_cluster_index = cluster_index;
     }
-    s->refcount_block_cache[block_index] = cpu_to_be16(refcount);
-    if (bdrv_pwrite(s->hd,
-                    refcount_block_offset + (block_index << REFCOUNT_SHIFT),
-                    &s->refcount_block_cache[block_index], 2) != 2)
-        return -EIO;
+    rb->block[block_index] = cpu_to_be16(refcount);
+    refcount_block_set_dirty(rb, block_index);
     return refcount;
 }
 
@@ -2670,4 +3443,5 @@ BlockDriver bdrv_qcow2 = {
     .bdrv_snapshot_delete = qcow_snapshot_delete,
     .bdrv_snapshot_list = qcow_snapshot_list,
     .bdrv_get_info = qcow_get_info,
+    .bdrv_get_file_offset = qcow_get_file_offset,
 };
@@ -29,6 +29,9 @@
 #ifdef CONFIG_AIO
 #include "posix-aio-compat.h"
 #endif
+#ifdef CONFIG_LINUX_AIO
+#include "linux-aio.h"
+#endif
 
 #ifdef CONFIG_COCOA
 #include <paths.h>
@@ -106,9 +109,17 @@ typedef struct BDRVRawState {
     int fd_media_changed;
 #endif
     uint8_t* aligned_buf;
+#ifdef CONFIG_AIO
+    struct qemu_paioq *aio_queue;
+#endif
+#ifdef CONFIG_LINUX_AIO
+    void *aio_ctx; /* non NULL if the requests use Linux native AIO */
+#endif
 } BDRVRawState;
 
 static int posix_aio_init(void);
+static void raw_aio_queue_init(BlockDriverState *bs, const char *filename);
+static void raw_native_aio_init(BlockDriverState *bs, int flags);
 
 static int fd_open(BlockDriverState *bs);
 
@@ -157,6 +168,8 @@ static int raw_open(BlockDriverState *bs, const char *filename, int flags)
             return ret;
         }
     }
+    raw_aio_queue_init(bs, filename);
+    raw_native_aio_init(bs, flags);
     return 0;
 }
 
@@ -438,24 +451,54 @@ static int raw_pwrite(BlockDriverState *bs, int64_t offset,
 typedef struct RawAIOCB {
     BlockDriverAIOCB common;
     struct qemu_paiocb aiocb;
-    struct RawAIOCB *next;
     int ret;
+#ifdef CONFIG_LINUX_AIO
+    int native;
+    struct qemu_laiocb laiocb;
+#endif
 } RawAIOCB;
 
 typedef struct PosixAioState
 {
-    int rfd, wfd;
-    RawAIOCB *first_aio;
+    int rfd;
+    int count;                  /* requests not completed yet */
+    struct qemu_paiocb *reaped; /* completed, callback not called yet */
 } PosixAioState;
 
+static RawAIOCB *raw_aio_get(BlockDriverState *bs,
+                             BlockDriverCompletionFunc *cb, void *opaque)
+{
+    RawAIOCB *acb;
+
+    acb = qemu_aio_get(bs, cb, opaque);
+#ifdef CONFIG_LINUX_AIO
+    if (acb)
+        acb->native = 0;
+#endif
+    return acb;
+}
+
+/* append the requests completed since the last call to s->reaped */
+static void posix_aio_reap(PosixAioState *s)
+{
+    struct qemu_paiocb *list, **pnext;
+
+    list = qemu_paio_reap();
+    if (!list)
+        return;
+    for (pnext = &s->reaped; *pnext; pnext = &(*pnext)->done_next);
+    *pnext = list;
+}
+
 static void posix_aio_read(void *opaque)
 {
     PosixAioState *s = opaque;
-    RawAIOCB *acb, **pacb;
-    int ret;
+    struct qemu_paiocb *aiocb;
+    RawAIOCB *acb;
+    ssize_t ret;
     ssize_t len;
 
-    /* read all bytes from signal pipe */
+    /* read all bytes from the notification fd */
     for (;;) {
         char bytes[16];
 
@@ -467,58 +510,38 @@ static void posix_aio_read(void *opaque)
         break;
     }
 
-    for(;;) {
-        pacb = &s->first_aio;
-        for(;;) {
-            acb = *pacb;
-            if (!acb)
-                goto the_end;
-            ret = qemu_paio_error(&acb->aiocb);
-            if (ret == ECANCELED) {
-                /* remove the request */
-                *pacb = acb->next;
-                qemu_aio_release(acb);
-            } else if (ret != EINPROGRESS) {
-                /* end of aio */
-                if (ret == 0) {
-                    ret = qemu_paio_return(&acb->aiocb);
-                    if (ret == acb->aiocb.aio_nbytes)
-                        ret = 0;
-                    else
-                        ret = -EINVAL;
-                } else {
-                    ret = -ret;
-                }
-                /* remove the request */
-                *pacb = acb->next;
-                /* call the callback */
-                acb->common.cb(acb->common.opaque, ret);
-                qemu_aio_release(acb);
-                break;
-            } else {
-                pacb = &acb->next;
-            }
-        }
+    posix_aio_reap(s);
+
+    /* a callback may cancel another completed request, so unlink each
+       request before calling its callback */
+    while ((aiocb = s->reaped) != NULL) {
+        s->reaped = aiocb->done_next;
+        acb = container_of(aiocb, RawAIOCB, aiocb);
+
+        ret = qemu_paio_return(aiocb);
+        if (ret == aiocb->aio_nbytes)
+            ret = 0;
+        else if (ret >= 0)
+            ret = -EINVAL;
+
+        s->count--;
+        acb->common.cb(acb->common.opaque, ret);
+        qemu_aio_release(acb);
     }
- the_end: ;
 }
 
 static int posix_aio_flush(void *opaque)
 {
     PosixAioState *s = opaque;
-    return !!s->first_aio;
+    return s->count > 0;
 }
 
 static PosixAioState *posix_aio_state;
 
 static void aio_signal_handler(int signum)
 {
-    if (posix_aio_state) {
-        char byte = 0;
-
-        write(posix_aio_state->wfd, &byte, sizeof(byte));
-    }
-
+    /* the completions themselves are reported through the notification
+       fd; the signal only gets a running CPU back to the main loop */
     qemu_service_io();
 }
 
@@ -526,7 +549,6 @@ static int posix_aio_init(void)
 {
     struct sigaction act;
     PosixAioState *s;
-    int fds[2];
     struct qemu_paioinit ai;
   
     if (posix_aio_state)
@@ -535,29 +557,23 @@ static int posix_aio_init(void)
     s = qemu_malloc(sizeof(PosixAioState));
 
     sigfillset(&act.sa_mask);
-    act.sa_flags = 0; /* do not restart syscalls to interrupt select() */
+    /* select() is woken up by the notification fd, so there is no need
+       to interrupt the other syscalls */
+    act.sa_flags = SA_RESTART;
     act.sa_handler = aio_signal_handler;
     sigaction(SIGUSR2, &act, NULL);
 
-    s->first_aio = NULL;
-    if (pipe(fds) == -1) {
-        fprintf(stderr, "failed to create pipe\n");
-        return -errno;
-    }
-
-    s->rfd = fds[0];
-    s->wfd = fds[1];
-
-    fcntl(s->rfd, F_SETFL, O_NONBLOCK);
-    fcntl(s->wfd, F_SETFL, O_NONBLOCK);
-
-    qemu_aio_set_fd_handler(s->rfd, posix_aio_read, NULL, posix_aio_flush, s);
+    s->count = 0;
+    s->reaped = NULL;
 
     memset(&ai, 0, sizeof(ai));
     ai.aio_threads = 64;
     ai.aio_num = 64;
     qemu_paio_init(&ai);
 
+    s->rfd = qemu_paio_get_fd();
+    qemu_aio_set_fd_handler(s->rfd, posix_aio_read, NULL, posix_aio_flush, s);
+
     posix_aio_state = s;
 
     return 0;
@@ -573,22 +589,70 @@ static RawAIOCB *raw_aio_setup(BlockDriverState *bs,
     if (fd_open(bs) < 0)
         return NULL;
 
-    acb = qemu_aio_get(bs, cb, opaque);
+    acb = raw_aio_get(bs, cb, opaque);
     if (!acb)
         return NULL;
     acb->aiocb.aio_fildes = s->fd;
+    acb->aiocb.aio_queue = s->aio_queue;
     acb->aiocb.ev_signo = SIGUSR2;
     acb->aiocb.aio_buf = buf;
+    acb->aiocb.aio_iov = NULL;
+    acb->aiocb.aio_niov = 0;
     if (nb_sectors < 0)
         acb->aiocb.aio_nbytes = -nb_sectors;
     else
         acb->aiocb.aio_nbytes = nb_sectors * 512;
     acb->aiocb.aio_offset = sector_num * 512;
-    acb->next = posix_aio_state->first_aio;
-    posix_aio_state->first_aio = acb;
+    posix_aio_state->count++;
     return acb;
 }
 
+#ifdef CONFIG_LINUX_AIO
+static void raw_aio_native_cb(struct qemu_laiocb *laiocb, int ret)
+{
+    RawAIOCB *acb = laiocb->opaque;
+
+    acb->common.cb(acb->common.opaque, ret);
+    qemu_aio_release(acb);
+}
+
+/* buf is used if qiov is NULL */
+static BlockDriverAIOCB *raw_aio_native(BlockDriverState *bs,
+        int64_t sector_num, uint8_t *buf, QEMUIOVector *qiov, int nb_sectors,
+        BlockDriverCompletionFunc *cb, void *opaque, int is_write)
+{
+    BDRVRawState *s = bs->opaque;
+    RawAIOCB *acb;
+    struct iovec *iov;
+    int niov;
+
+    if (fd_open(bs) < 0)
+        return NULL;
+
+    acb = raw_aio_get(bs, cb, opaque);
+    if (!acb)
+        return NULL;
+    acb->native = 1;
+    acb->laiocb.complete = raw_aio_native_cb;
+    acb->laiocb.opaque = acb;
+    if (qiov) {
+        iov = qiov->iov;
+        niov = qiov->niov;
+    } else {
+        acb->laiocb.iov.iov_base = buf;
+        acb->laiocb.iov.iov_len = nb_sectors * 512;
+        iov = &acb->laiocb.iov;
+        niov = 1;
+    }
+    if (laio_submit(s->aio_ctx, &acb->laiocb, s->fd, sector_num * 512,
+                    iov, niov, is_write) < 0) {
+        qemu_aio_release(acb);
+        return NULL;
+    }
+    return &acb->common;
+}
+#endif
+
 static void raw_aio_em_cb(void* opaque)
 {
     RawAIOCB *acb = opaque;
@@ -596,22 +660,28 @@ static void raw_aio_em_cb(void* opaque)
     qemu_aio_release(acb);
 }
 
+/* forget a request that will not be reported by qemu_paio_reap() */
 static void raw_aio_remove(RawAIOCB *acb)
 {
-    RawAIOCB **pacb;
+    posix_aio_state->count--;
+    qemu_aio_release(acb);
+}
+
+/* wait until a request that could not be canceled is reaped, and
+   unlink it so that its callback is never called */
+static void raw_aio_wait_reaped(RawAIOCB *acb)
+{
+    PosixAioState *s = posix_aio_state;
+    struct qemu_paiocb **paiocb;
 
-    /* remove the callback from the queue */
-    pacb = &posix_aio_state->first_aio;
     for(;;) {
-        if (*pacb == NULL) {
-            fprintf(stderr, "raw_aio_remove: aio request not found!\n");
-            break;
-        } else if (*pacb == acb) {
-            *pacb = acb->next;
-            qemu_aio_release(acb);
-            break;
+        posix_aio_reap(s);
+        for (paiocb = &s->reaped; *paiocb; paiocb = &(*paiocb)->done_next) {
+            if (*paiocb == &acb->aiocb) {
+                *paiocb = acb->aiocb.done_next;
+                return;
+            }
         }
-        pacb = &(*pacb)->next;
     }
 }
 
@@ -629,13 +699,19 @@ static BlockDriverAIOCB *raw_aio_read(BlockDriverState *bs,
 
     if (unlikely(s->aligned_buf != NULL && ((uintptr_t) buf % 512))) {
         QEMUBH *bh;
-        acb = qemu_aio_get(bs, cb, opaque);
+        acb = raw_aio_get(bs, cb, opaque);
         acb->ret = raw_pread(bs, 512 * sector_num, buf, 512 * nb_sectors);
         bh = qemu_bh_new(raw_aio_em_cb, acb);
         qemu_bh_schedule(bh);
         return &acb->common;
     }
 
+#ifdef CONFIG_LINUX_AIO
+    if (s->aio_ctx)
+        return raw_aio_native(bs, sector_num, buf, NULL, nb_sectors,
+                              cb, opaque, 0);
+#endif
+
     acb = raw_aio_setup(bs, sector_num, buf, nb_sectors, cb, opaque);
     if (!acb)
         return NULL;
@@ -660,13 +736,19 @@ static BlockDriverAIOCB *raw_aio_write(BlockDriverState *bs,
 
     if (unlikely(s->aligned_buf != NULL && ((uintptr_t) buf % 512))) {
         QEMUBH *bh;
-        acb = qemu_aio_get(bs, cb, opaque);
+        acb = raw_aio_get(bs, cb, opaque);
         acb->ret = raw_pwrite(bs, 512 * sector_num, buf, 512 * nb_sectors);
         bh = qemu_bh_new(raw_aio_em_cb, acb);
         qemu_bh_schedule(bh);
         return &acb->common;
     }
 
+#ifdef CONFIG_LINUX_AIO
+    if (s->aio_ctx)
+        return raw_aio_native(bs, sector_num, (uint8_t *)buf, NULL,
+                              nb_sectors, cb, opaque, 1);
+#endif
+
     acb = raw_aio_setup(bs, sector_num, (uint8_t*)buf, nb_sectors, cb, opaque);
     if (!acb)
         return NULL;
@@ -677,16 +759,109 @@ static BlockDriverAIOCB *raw_aio_write(BlockDriverState *bs,
     return &acb->common;
 }
 
+static int raw_qiov_is_aligned(QEMUIOVector *qiov)
+{
+    int i;
+
+    for (i = 0; i < qiov->niov; i++) {
+        if ((uintptr_t) qiov->iov[i].iov_base % 512 ||
+            qiov->iov[i].iov_len % 512)
+            return 0;
+    }
+    return 1;
+}
+
+static BlockDriverAIOCB *raw_aio_rw_vector(BlockDriverState *bs,
+        int64_t sector_num, QEMUIOVector *qiov, int nb_sectors,
+        BlockDriverCompletionFunc *cb, void *opaque, int is_write)
+{
+    RawAIOCB *acb;
+    int ret;
+
+    /*
+     * If O_DIRECT is used and a segment is not aligned, fall back
+     * to synchronous IO through a linear buffer.
+     */
+    BDRVRawState *s = bs->opaque;
+
+    if (unlikely(s->aligned_buf != NULL && !raw_qiov_is_aligned(qiov))) {
+        QEMUBH *bh;
+        uint8_t *buf;
+
+        acb = raw_aio_get(bs, cb, opaque);
+        buf = qemu_memalign(512, qiov->size);
+        if (is_write) {
+            qemu_iovec_to_buffer(qiov, buf);
+            ret = raw_pwrite(bs, 512 * sector_num, buf, qiov->size);
+        } else {
+            ret = raw_pread(bs, 512 * sector_num, buf, qiov->size);
+            if (ret > 0)
+                qemu_iovec_from_buffer(qiov, buf, ret);
+        }
+        qemu_free(buf);
+        acb->ret = ret < 0 ? ret : 0;
+        bh = qemu_bh_new(raw_aio_em_cb, acb);
+        qemu_bh_schedule(bh);
+        return &acb->common;
+    }
+
+#ifdef CONFIG_LINUX_AIO
+    if (s->aio_ctx)
+        return raw_aio_native(bs, sector_num, NULL, qiov, nb_sectors,
+                              cb, opaque, is_write);
+#endif
+
+    acb = raw_aio_setup(bs, sector_num, NULL, nb_sectors, cb, opaque);
+    if (!acb)
+        return NULL;
+    acb->aiocb.aio_iov = qiov->iov;
+    acb->aiocb.aio_niov = qiov->niov;
+    acb->aiocb.aio_nbytes = qiov->size;
+    if (is_write)
+        ret = qemu_paio_write(&acb->aiocb);
+    else
+        ret = qemu_paio_read(&acb->aiocb);
+    if (ret < 0) {
+        raw_aio_remove(acb);
+        return NULL;
+    }
+    return &acb->common;
+}
+
+static BlockDriverAIOCB *raw_aio_readv(BlockDriverState *bs,
+        int64_t sector_num, QEMUIOVector *qiov, int nb_sectors,
+        BlockDriverCompletionFunc *cb, void *opaque)
+{
+    return raw_aio_rw_vector(bs, sector_num, qiov, nb_sectors, cb, opaque, 0);
+}
+
+static BlockDriverAIOCB *raw_aio_writev(BlockDriverState *bs,
+        int64_t sector_num, QEMUIOVector *qiov, int nb_sectors,
+        BlockDriverCompletionFunc *cb, void *opaque)
+{
+    return raw_aio_rw_vector(bs, sector_num, qiov, nb_sectors, cb, opaque, 1);
+}
+
 static void raw_aio_cancel(BlockDriverAIOCB *blockacb)
 {
     int ret;
     RawAIOCB *acb = (RawAIOCB *)blockacb;
 
+#ifdef CONFIG_LINUX_AIO
+    if (acb->native) {
+        BDRVRawState *s = blockacb->bs->opaque;
+
+        laio_cancel(s->aio_ctx, &acb->laiocb);
+        qemu_aio_release(acb);
+        return;
+    }
+#endif
+
     ret = qemu_paio_cancel(acb->aiocb.aio_fildes, &acb->aiocb);
-    if (ret == QEMU_PAIO_NOTCANCELED) {
+    if (ret != QEMU_PAIO_CANCELED) {
         /* fail safe: if the aio could not be canceled, we wait for
            it */
-        while (qemu_paio_error(&acb->aiocb) == EINPROGRESS);
+        raw_aio_wait_reaped(acb);
     }
 
     raw_aio_remove(acb);
@@ -698,10 +873,50 @@ static int posix_aio_init(void)
 }
 #endif /* CONFIG_AIO */
 
+/* give each drive its own queue in the thread pool */
+static void raw_aio_queue_init(BlockDriverState *bs, const char *filename)
+{
+#ifdef CONFIG_AIO
+    BDRVRawState *s = bs->opaque;
+
+    s->aio_queue = qemu_paio_queue_new(bs->device_name[0] ?
+                                       bs->device_name : filename);
+#endif
+}
+
+/* switch the requests of a cache=none drive to Linux native AIO if the
+   user asked for it */
+static void raw_native_aio_init(BlockDriverState *bs, int flags)
+{
+#if defined(CONFIG_AIO) && defined(CONFIG_LINUX_AIO)
+    BDRVRawState *s = bs->opaque;
+
+    s->aio_ctx = NULL;
+    if ((flags & BDRV_O_NATIVE_AIO) && (flags & BDRV_O_NOCACHE)) {
+        s->aio_ctx = laio_init();
+        if (!s->aio_ctx)
+            fprintf(stderr, "qemu: native AIO unavailable for %s, "
+                    "using threads\n", bs->filename);
+    }
+#endif
+}
+
 
 static void raw_close(BlockDriverState *bs)
 {
     BDRVRawState *s = bs->opaque;
+#if defined(CONFIG_AIO) && defined(CONFIG_LINUX_AIO)
+    if (s->aio_ctx) {
+        laio_cleanup(s->aio_ctx);
+        s->aio_ctx = NULL;
+    }
+#endif
+#ifdef CONFIG_AIO
+    if (s->aio_queue) {
+        qemu_paio_queue_delete(s->aio_queue);
+        s->aio_queue = NULL;
+    }
+#endif
     if (s->fd >= 0) {
         close(s->fd);
         s->fd = -1;
@@ -827,6 +1042,8 @@ BlockDriver bdrv_raw = {
     .bdrv_aio_write = raw_aio_write,
     .bdrv_aio_cancel = raw_aio_cancel,
     .aiocb_size = sizeof(RawAIOCB),
+    .bdrv_aio_readv = raw_aio_readv,
+    .bdrv_aio_writev = raw_aio_writev,
 #endif
 
     .bdrv_pread = raw_pread,
@@ -974,6 +1191,8 @@ static int hdev_open(BlockDriverState *bs, const char *filename, int flags)
         s->fd_media_changed = 1;
     }
 #endif
+    raw_aio_queue_init(bs, filename);
+    raw_native_aio_init(bs, flags);
     return 0;
 }
 
@@ -1181,6 +1400,8 @@ BlockDriver bdrv_host_device = {
     .bdrv_aio_write = raw_aio_write,
     .bdrv_aio_cancel = raw_aio_cancel,
     .aiocb_size = sizeof(RawAIOCB),
+    .bdrv_aio_readv = raw_aio_readv,
+    .bdrv_aio_writev = raw_aio_writev,
 #endif
 
     .bdrv_pread = raw_pread,
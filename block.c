@@ -396,7 +396,8 @@ int bdrv_open2(BlockDriverState *bs, const char *filename, int flags,
     /* Note: for compatibility, we open disk image files as RDWR, and
        RDONLY as fallback */
     if (!(flags & BDRV_O_FILE))
-        open_flags = BDRV_O_RDWR | (flags & BDRV_O_CACHE_MASK);
+        open_flags = BDRV_O_RDWR |
+            (flags & (BDRV_O_CACHE_MASK | BDRV_O_NATIVE_AIO));
     else
         open_flags = flags & ~(BDRV_O_FILE | BDRV_O_SNAPSHOT);
     ret = drv->bdrv_open(bs, filename, open_flags);
@@ -428,6 +429,7 @@ int bdrv_open2(BlockDriverState *bs, const char *filename, int flags,
         }
         path_combine(backing_filename, sizeof(backing_filename),
                      filename, bs->backing_file);
+        bs->backing_hd->l2_cache_size = bs->l2_cache_size;
         if (bdrv_open(bs->backing_hd, backing_filename, open_flags) < 0)
             goto fail;
     }
@@ -865,6 +867,11 @@ void bdrv_set_geometry_hint(BlockDriverState *bs,
     bs->secs = secs;
 }
 
+void bdrv_set_l2_cache_hint(BlockDriverState *bs, int l2_cache_size)
+{
+    bs->l2_cache_size = l2_cache_size;
+}
+
 void bdrv_set_type_hint(BlockDriverState *bs, int type)
 {
     bs->type = type;
@@ -1085,10 +1092,17 @@ void bdrv_info_stats (void)
 		     bs->device_name,
 		     bs->rd_bytes, bs->wr_bytes,
 		     bs->rd_ops, bs->wr_ops);
-        if (bdrv_get_info(bs, &bdi) == 0)
+        if (bdrv_get_info(bs, &bdi) == 0) {
             term_printf(" high=%" PRId64
                         " bytes_free=%" PRId64,
                         bdi.highest_alloc, bdi.num_free_bytes);
+            if (bdi.l2_cache_size)
+                term_printf(" l2_cache_size=%d"
+                            " l2_cache_hits=%" PRIu64
+                            " l2_cache_misses=%" PRIu64,
+                            bdi.l2_cache_size, bdi.l2_cache_hits,
+                            bdi.l2_cache_misses);
+        }
         term_printf("\n");
     }
 }
@@ -1125,6 +1139,40 @@ int bdrv_get_info(BlockDriverState *bs, BlockDriverInfo *bdi)
     return drv->bdrv_get_info(bs, bdi);
 }
 
+/**
+ * Return the byte offset in the image file (see bdrv_open_image_file()) of
+ * the data at 'sector_num', 0 if the sectors are not allocated, or a
+ * negative errno if the data is not stored there as is.
+ *
+ * 'pnum' is set as by bdrv_is_allocated(); the sectors it counts follow
+ * each other in the image file as well.
+ */
+int64_t bdrv_get_file_offset(BlockDriverState *bs, int64_t sector_num,
+                             int nb_sectors, int *pnum)
+{
+    BlockDriver *drv = bs->drv;
+    if (!drv)
+        return -ENOMEDIUM;
+    if (!drv->bdrv_get_file_offset)
+        return -ENOTSUP;
+    return drv->bdrv_get_file_offset(bs, sector_num, nb_sectors, pnum);
+}
+
+/**
+ * Open the image file of bs read-only on a file descriptor of its own, so
+ * that data found with bdrv_get_file_offset() can be read from any thread.
+ * Returns the file descriptor or a negative errno.
+ */
+int bdrv_open_image_file(BlockDriverState *bs)
+{
+    int fd;
+
+    fd = open(bs->filename, O_RDONLY | O_BINARY);
+    if (fd < 0)
+        return -errno;
+    return fd;
+}
+
 /**************************************************************/
 /* handling of snapshots */
 
@@ -1299,16 +1347,50 @@ BlockDriverAIOCB *bdrv_aio_readv(BlockDriverState *bs, int64_t sector_num,
                                  QEMUIOVector *iov, int nb_sectors,
                                  BlockDriverCompletionFunc *cb, void *opaque)
 {
-    return bdrv_aio_rw_vector(bs, sector_num, iov, nb_sectors,
-                              cb, opaque, 0);
+    BlockDriver *drv = bs->drv;
+    BlockDriverAIOCB *ret;
+
+    if (!drv)
+        return NULL;
+    if (!drv->bdrv_aio_readv)
+        return bdrv_aio_rw_vector(bs, sector_num, iov, nb_sectors,
+                                  cb, opaque, 0);
+
+    ret = drv->bdrv_aio_readv(bs, sector_num, iov, nb_sectors, cb, opaque);
+
+    if (ret) {
+	/* Update stats even though technically transfer has not happened. */
+	bs->rd_bytes += (unsigned) nb_sectors * SECTOR_SIZE;
+	bs->rd_ops ++;
+    }
+
+    return ret;
 }
 
 BlockDriverAIOCB *bdrv_aio_writev(BlockDriverState *bs, int64_t sector_num,
                                   QEMUIOVector *iov, int nb_sectors,
                                   BlockDriverCompletionFunc *cb, void *opaque)
 {
-    return bdrv_aio_rw_vector(bs, sector_num, iov, nb_sectors,
-                              cb, opaque, 1);
+    BlockDriver *drv = bs->drv;
+    BlockDriverAIOCB *ret;
+
+    if (!drv)
+        return NULL;
+    if (bs->read_only)
+        return NULL;
+    if (!drv->bdrv_aio_writev)
+        return bdrv_aio_rw_vector(bs, sector_num, iov, nb_sectors,
+                                  cb, opaque, 1);
+
+    ret = drv->bdrv_aio_writev(bs, sector_num, iov, nb_sectors, cb, opaque);
+
+    if (ret) {
+	/* Update stats even though technically transfer has not happened. */
+	bs->wr_bytes += (unsigned) nb_sectors * SECTOR_SIZE;
+	bs->wr_ops ++;
+    }
+
+    return ret;
 }
 
 BlockDriverAIOCB *bdrv_aio_read(BlockDriverState *bs, int64_t sector_num,
@@ -28,6 +28,10 @@ typedef struct BlockDriverInfo {
     int64_t vm_state_offset;
     int64_t highest_alloc; /* highest allocated block offset (in bytes) */
     int64_t num_free_bytes; /* below highest_alloc  */
+    /* metadata cache statistics, 0 if the format has no such cache */
+    int l2_cache_size;        /* in tables */
+    uint64_t l2_cache_hits;
+    uint64_t l2_cache_misses;
 } BlockDriverInfo;
 
 typedef struct QEMUSnapshotInfo {
@@ -53,6 +57,8 @@ typedef struct QEMUSnapshotInfo {
 #define BDRV_O_NOCACHE     0x0020 /* do not use the host page cache */
 #define BDRV_O_CACHE_WB    0x0040 /* use write-back caching */
 #define BDRV_O_CACHE_DEF   0x0080 /* use default caching */
+#define BDRV_O_NATIVE_AIO  0x0100 /* use the host native AIO interface
+                                     (with BDRV_O_NOCACHE only) */
 
 #define BDRV_O_CACHE_MASK  (BDRV_O_NOCACHE | BDRV_O_CACHE_WB | BDRV_O_CACHE_DEF)
 
@@ -125,6 +131,7 @@ void bdrv_set_geometry_hint(BlockDriverState *bs,
                             int cyls, int heads, int secs);
 void bdrv_set_type_hint(BlockDriverState *bs, int type);
 void bdrv_set_translation_hint(BlockDriverState *bs, int translation);
+void bdrv_set_l2_cache_hint(BlockDriverState *bs, int l2_cache_size);
 void bdrv_get_geometry_hint(BlockDriverState *bs,
                             int *pcyls, int *pheads, int *psecs);
 int bdrv_get_type_hint(BlockDriverState *bs);
@@ -150,6 +157,9 @@ const char *bdrv_get_device_name(BlockDriverState *bs);
 int bdrv_write_compressed(BlockDriverState *bs, int64_t sector_num,
                           const uint8_t *buf, int nb_sectors);
 int bdrv_get_info(BlockDriverState *bs, BlockDriverInfo *bdi);
+int64_t bdrv_get_file_offset(BlockDriverState *bs, int64_t sector_num,
+                             int nb_sectors, int *pnum);
+int bdrv_open_image_file(BlockDriverState *bs);
 
 void bdrv_get_backing_filename(BlockDriverState *bs,
                                char *filename, int filename_size);
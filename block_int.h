@@ -56,6 +56,13 @@ struct BlockDriver {
         BlockDriverCompletionFunc *cb, void *opaque);
     void (*bdrv_aio_cancel)(BlockDriverAIOCB *acb);
     int aiocb_size;
+    /* optional: without them, vectored requests use a bounce buffer */
+    BlockDriverAIOCB *(*bdrv_aio_readv)(BlockDriverState *bs,
+        int64_t sector_num, QEMUIOVector *iov, int nb_sectors,
+        BlockDriverCompletionFunc *cb, void *opaque);
+    BlockDriverAIOCB *(*bdrv_aio_writev)(BlockDriverState *bs,
+        int64_t sector_num, QEMUIOVector *iov, int nb_sectors,
+        BlockDriverCompletionFunc *cb, void *opaque);
 
     const char *protocol_name;
     int (*bdrv_pread)(BlockDriverState *bs, int64_t offset,
@@ -75,6 +82,8 @@ struct BlockDriver {
     int (*bdrv_snapshot_list)(BlockDriverState *bs,
                               QEMUSnapshotInfo **psn_info);
     int (*bdrv_get_info)(BlockDriverState *bs, BlockDriverInfo *bdi);
+    int64_t (*bdrv_get_file_offset)(BlockDriverState *bs, int64_t sector_num,
+                                    int nb_sectors, int *pnum);
 
     /* removable device specific */
     int (*bdrv_is_inserted)(BlockDriverState *bs);
@@ -115,6 +124,10 @@ struct BlockDriverState {
 
     void *sync_aiocb;
 
+    /* number of L2 tables the image format should cache (0 = default).
+       Must be set before the image is opened. */
+    int l2_cache_size;
+
     /* I/O stats (display with "info blockstats"). */
     uint64_t rd_bytes;
     uint64_t wr_bytes;
@@ -17,14 +17,21 @@
 #include "sysemu.h"
 #include "qemu-char.h"
 #include "buffered_file.h"
+#ifndef _WIN32
+#include <pthread.h>
+#include <signal.h>
+#endif
 
 //#define DEBUG_BUFFERED_FILE
 
+/* length in ms of a rate limiting period */
+#define BUFFER_DELAY 100
+
 typedef struct QEMUFileBuffered
 {
     BufferedPutFunc *put_buffer;
     BufferedPutReadyFunc *put_ready;
-    BufferedWaitForUnfreezeFunc *wait_for_unfreeze;
+    BufferedWaitFunc *wait;
     BufferedCloseFunc *close;
     void *opaque;
     QEMUFile *file;
@@ -32,10 +39,19 @@ typedef struct QEMUFileBuffered
     int freeze_output;
     size_t bytes_xfer;
     size_t xfer_limit;
+    BufferedWritevFunc *writev;
+    /* data that could not be sent yet, a ring of buffer_capacity bytes */
     uint8_t *buffer;
+    size_t buffer_head;
     size_t buffer_size;
     size_t buffer_capacity;
+#ifndef _WIN32
+    pthread_t thread;
+    int has_thread;
+    volatile int closing;
+#else
     QEMUTimer *timer;
+#endif
 } QEMUFileBuffered;
 
 #ifdef DEBUG_BUFFERED_FILE
@@ -49,30 +65,41 @@ typedef struct QEMUFileBuffered
 static void buffered_append(QEMUFileBuffered *s,
                             const uint8_t *buf, size_t size)
 {
+    size_t tail, len;
+
+    if (size == 0)
+        return;
+
     if (size > (s->buffer_capacity - s->buffer_size)) {
-        void *tmp;
+        size_t capacity = s->buffer_capacity + size + 1024;
+        uint8_t *tmp;
 
         dprintf("increasing buffer capacity from %ld by %ld\n",
                 s->buffer_capacity, size + 1024);
 
-        s->buffer_capacity += size + 1024;
-
-        tmp = qemu_realloc(s->buffer, s->buffer_capacity);
-        if (tmp == NULL) {
-            fprintf(stderr, "qemu file buffer expansion failed\n");
-            exit(1);
-        }
+        /* unwrap the queued data into the new buffer */
+        tmp = qemu_malloc(capacity);
+        len = MIN(s->buffer_size, s->buffer_capacity - s->buffer_head);
+        memcpy(tmp, s->buffer + s->buffer_head, len);
+        memcpy(tmp + len, s->buffer, s->buffer_size - len);
 
+        qemu_free(s->buffer);
         s->buffer = tmp;
+        s->buffer_capacity = capacity;
+        s->buffer_head = 0;
     }
 
-    memcpy(s->buffer + s->buffer_size, buf, size);
+    tail = (s->buffer_head + s->buffer_size) % s->buffer_capacity;
+    len = MIN(size, s->buffer_capacity - tail);
+    memcpy(s->buffer + tail, buf, len);
+    memcpy(s->buffer, buf + len, size - len);
     s->buffer_size += size;
 }
 
 static void buffered_flush(QEMUFileBuffered *s)
 {
-    size_t offset = 0;
+    struct iovec iov[2];
+    int iovcnt;
 
     if (s->has_error) {
         dprintf("flush when error, bailing\n");
@@ -81,11 +108,21 @@ static void buffered_flush(QEMUFileBuffered *s)
 
     dprintf("flushing %ld byte(s) of data\n", s->buffer_size);
 
-    while (offset < s->buffer_size) {
+    while (s->buffer_size) {
         ssize_t ret;
 
-        ret = s->put_buffer(s->opaque, s->buffer + offset,
-                            s->buffer_size - offset);
+        /* the queued data wraps around at most once */
+        iov[0].iov_base = s->buffer + s->buffer_head;
+        iov[0].iov_len = MIN(s->buffer_size,
+                             s->buffer_capacity - s->buffer_head);
+        iov[1].iov_base = s->buffer;
+        iov[1].iov_len = s->buffer_size - iov[0].iov_len;
+        iovcnt = iov[1].iov_len ? 2 : 1;
+
+        if (s->writev)
+            ret = s->writev(s->opaque, iov, iovcnt);
+        else
+            ret = s->put_buffer(s->opaque, iov[0].iov_base, iov[0].iov_len);
         if (ret == -EAGAIN) {
             dprintf("backend not ready, freezing\n");
             s->freeze_output = 1;
@@ -96,15 +133,15 @@ static void buffered_flush(QEMUFileBuffered *s)
             dprintf("error flushing data, %ld\n", ret);
             s->has_error = 1;
             break;
-        } else {
-            dprintf("flushed %ld byte(s)\n", ret);
-            offset += ret;
         }
+
+        dprintf("flushed %ld byte(s)\n", ret);
+        s->buffer_head = (s->buffer_head + ret) % s->buffer_capacity;
+        s->buffer_size -= ret;
     }
 
-    dprintf("flushed %ld of %ld byte(s)\n", offset, s->buffer_size);
-    memmove(s->buffer, s->buffer + offset, s->buffer_size - offset);
-    s->buffer_size -= offset;
+    if (s->buffer_size == 0)
+        s->buffer_head = 0;
 }
 
 static int buffered_put_buffer(void *opaque, const uint8_t *buf, int64_t pos, int size)
@@ -159,6 +196,87 @@ static int buffered_put_buffer(void *opaque, const uint8_t *buf, int64_t pos, in
     return offset;
 }
 
+/* Write straight from the caller's buffers while nothing is queued, only
+   what cannot be sent now is copied. */
+static int buffered_writev_buffer(void *opaque, struct iovec *iov, int iovcnt,
+                                  int64_t pos)
+{
+    QEMUFileBuffered *s = opaque;
+    size_t size = 0;
+    ssize_t ret;
+    int i;
+
+    for (i = 0; i < iovcnt; i++)
+        size += iov[i].iov_len;
+
+    dprintf("putting %ld bytes in %d iovecs at %Ld\n", size, iovcnt, pos);
+
+    if (s->has_error) {
+        dprintf("flush when error, bailing\n");
+        return -EINVAL;
+    }
+
+    s->freeze_output = 0;
+
+    buffered_flush(s);
+
+    i = 0;
+    while (!s->freeze_output && !s->buffer_size && i < iovcnt) {
+        if (s->bytes_xfer > s->xfer_limit) {
+            dprintf("transfer limit exceeded when putting\n");
+            break;
+        }
+
+        ret = s->writev(s->opaque, iov + i, iovcnt - i);
+        if (ret == -EAGAIN) {
+            dprintf("backend not ready, freezing\n");
+            s->freeze_output = 1;
+            break;
+        }
+
+        if (ret <= 0) {
+            dprintf("error putting\n");
+            s->has_error = 1;
+            return -EINVAL;
+        }
+
+        dprintf("put %ld byte(s)\n", ret);
+        s->bytes_xfer += ret;
+
+        while (i < iovcnt && ret >= iov[i].iov_len)
+            ret -= iov[i++].iov_len;
+        if (ret) {
+            iov[i].iov_base = (uint8_t *)iov[i].iov_base + ret;
+            iov[i].iov_len -= ret;
+        }
+    }
+
+    for (; i < iovcnt; i++)
+        buffered_append(s, iov[i].iov_base, iov[i].iov_len);
+
+    return size;
+}
+
+#ifndef _WIN32
+static void buffered_stop_thread(QEMUFileBuffered *s)
+{
+    s->closing = 1;
+    if (s->has_thread) {
+        pthread_join(s->thread, NULL);
+        s->has_thread = 0;
+    }
+}
+#endif
+
+/* The thread of the file may be using the file and its buffer, so it
+   must be stopped before anything else flushes or closes the file. */
+void qemu_buffered_file_stop(QEMUFile *f)
+{
+#ifndef _WIN32
+    buffered_stop_thread(qemu_file_get_opaque(f));
+#endif
+}
+
 static int buffered_close(void *opaque)
 {
     QEMUFileBuffered *s = opaque;
@@ -166,16 +284,22 @@ static int buffered_close(void *opaque)
 
     dprintf("closing\n");
 
+#ifndef _WIN32
+    buffered_stop_thread(s);
+#endif
+
     while (!s->has_error && s->buffer_size) {
         buffered_flush(s);
         if (s->freeze_output)
-            s->wait_for_unfreeze(s);
+            s->wait(s->opaque, 1, -1);
     }
 
     ret = s->close(s->opaque);
 
+#ifdef _WIN32
     qemu_del_timer(s->timer);
     qemu_free_timer(s->timer);
+#endif
     qemu_free(s->buffer);
     qemu_free(s);
 
@@ -198,6 +322,47 @@ static int buffered_rate_limit(void *opaque)
     return 0;
 }
 
+#ifndef _WIN32
+/* Does the work of the main loop timer where threads are available, so
+   that sending does not hold up the main loop.  Once per period the queued
+   data is sent and put_ready produces more, in between the thread waits
+   for the output to unfreeze. */
+static void *buffered_thread(void *opaque)
+{
+    QEMUFileBuffered *s = opaque;
+    int64_t now, expire;
+    sigset_t set;
+
+    /* signals are handled by the main thread */
+    sigfillset(&set);
+    pthread_sigmask(SIG_BLOCK, &set, NULL);
+
+    /* as with the timer, the first period starts after a delay */
+    expire = qemu_get_clock(rt_clock) + BUFFER_DELAY;
+    while (!s->closing) {
+        now = qemu_get_clock(rt_clock);
+        if (now >= expire) {
+            expire = now + BUFFER_DELAY;
+            if (!s->freeze_output) {
+                s->bytes_xfer = 0;
+                buffered_flush(s);
+            }
+            /* called even after an error, for the owner to notice it */
+            if (!s->freeze_output || s->has_error)
+                s->put_ready(s->opaque);
+            continue;
+        }
+
+        s->wait(s->opaque, s->freeze_output && !s->has_error, expire - now);
+        if (s->freeze_output && !s->has_error) {
+            s->freeze_output = 0;
+            buffered_flush(s);
+        }
+    }
+
+    return NULL;
+}
+#else
 static void buffered_rate_tick(void *opaque)
 {
     QEMUFileBuffered *s = opaque;
@@ -205,7 +370,7 @@ static void buffered_rate_tick(void *opaque)
     if (s->has_error)
         return;
 
-    qemu_mod_timer(s->timer, qemu_get_clock(rt_clock) + 100);
+    qemu_mod_timer(s->timer, qemu_get_clock(rt_clock) + BUFFER_DELAY);
 
     if (s->freeze_output)
         return;
@@ -217,12 +382,14 @@ static void buffered_rate_tick(void *opaque)
     /* Add some checks around this */
     s->put_ready(s->opaque);
 }
+#endif
 
 QEMUFile *qemu_fopen_ops_buffered(void *opaque,
                                   size_t bytes_per_sec,
                                   BufferedPutFunc *put_buffer,
+                                  BufferedWritevFunc *writev,
                                   BufferedPutReadyFunc *put_ready,
-                                  BufferedWaitForUnfreezeFunc *wait_for_unfreeze,
+                                  BufferedWaitFunc *wait,
                                   BufferedCloseFunc *close)
 {
     QEMUFileBuffered *s;
@@ -230,18 +397,29 @@ QEMUFile *qemu_fopen_ops_buffered(void *opaque,
     s = qemu_mallocz(sizeof(*s));
 
     s->opaque = opaque;
-    s->xfer_limit = bytes_per_sec / 10;
+    s->xfer_limit = bytes_per_sec / (1000 / BUFFER_DELAY);
     s->put_buffer = put_buffer;
+    s->writev = writev;
     s->put_ready = put_ready;
-    s->wait_for_unfreeze = wait_for_unfreeze;
+    s->wait = wait;
     s->close = close;
 
     s->file = qemu_fopen_ops(s, buffered_put_buffer, NULL,
                              buffered_close, buffered_rate_limit);
+    if (writev)
+        qemu_file_set_writev_buffer(s->file, buffered_writev_buffer);
 
+#ifndef _WIN32
+    if (pthread_create(&s->thread, NULL, buffered_thread, s)) {
+        qemu_fclose(s->file);
+        return NULL;
+    }
+    s->has_thread = 1;
+#else
     s->timer = qemu_new_timer(rt_clock, buffered_rate_tick, s);
 
-    qemu_mod_timer(s->timer, qemu_get_clock(rt_clock) + 100);
+    qemu_mod_timer(s->timer, qemu_get_clock(rt_clock) + BUFFER_DELAY);
+#endif
 
     return s->file;
 }
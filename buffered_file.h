@@ -17,14 +17,28 @@
 #include "hw/hw.h"
 
 typedef ssize_t (BufferedPutFunc)(void *opaque, const void *data, size_t size);
+typedef ssize_t (BufferedWritevFunc)(void *opaque, const struct iovec *iov,
+                                     int iovcnt);
 typedef void (BufferedPutReadyFunc)(void *opaque);
-typedef void (BufferedWaitForUnfreezeFunc)(void *opaque);
+/* Block until the output can take more data (if for_write is set), until
+   timeout ms have passed (-1 for no limit), or until the caller has other
+   work to do, whichever comes first. */
+typedef void (BufferedWaitFunc)(void *opaque, int for_write, int64_t timeout);
 typedef int (BufferedCloseFunc)(void *opaque);
 
+/* put_ready is called once per rate limiting period to produce more data.
+   Where threads are available it is called, together with wait, from a
+   thread of the file and never from the main loop; other threads may
+   only use the file while that thread waits for them. */
 QEMUFile *qemu_fopen_ops_buffered(void *opaque, size_t xfer_limit,
                                   BufferedPutFunc *put_buffer,
+                                  BufferedWritevFunc *writev,
                                   BufferedPutReadyFunc *put_ready,
-                                  BufferedWaitForUnfreezeFunc *wait_for_unfreeze,
+                                  BufferedWaitFunc *wait,
                                   BufferedCloseFunc *close);
 
+/* Stop the thread of a buffered file, to be called from the main loop
+   before qemu_fclose(). */
+void qemu_buffered_file_stop(QEMUFile *f);
+
 #endif
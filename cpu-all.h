@@ -757,9 +757,34 @@ void cpu_dump_statistics (CPUState *env, FILE *f,
 void QEMU_NORETURN cpu_abort(CPUState *env, const char *fmt, ...)
     __attribute__ ((__format__ (__printf__, 2, 3)));
 extern CPUState *first_cpu;
-extern CPUState *cpu_single_env;
 extern int64_t qemu_icount;
 extern int use_icount;
+extern int tb_profile_enabled;
+extern unsigned long tb_size_limit;
+
+/* Each VCPU can run TCG code in its own host thread (-vcpu-threads).
+   The guest atomic operations rely on the host compare-and-swap, so
+   the mode is limited to x86 hosts for now. */
+#if !defined(CONFIG_USER_ONLY) && !defined(_WIN32) && \
+    (defined(__i386__) || defined(__x86_64__))
+#define USE_VCPU_THREADS
+#endif
+
+#ifdef USE_VCPU_THREADS
+extern __thread CPUState *cpu_single_env;
+extern int vcpu_threads;
+#else
+extern CPUState *cpu_single_env;
+#define vcpu_threads 0
+#endif
+
+void qemu_cpu_kick(CPUState *env);
+void qemu_notify_event(void);
+void pause_all_vcpus(void);
+void resume_all_vcpus(void);
+void qemu_mutex_lock_iothread(void);
+void qemu_mutex_unlock_iothread(void);
+void qemu_mutex_reset_iothread(void);
 
 #define CPU_INTERRUPT_EXIT   0x01 /* wants exit from main loop */
 #define CPU_INTERRUPT_HARD   0x02 /* hardware interrupt pending */
@@ -856,7 +881,12 @@ extern ram_addr_t phys_ram_size;
 extern int phys_ram_fd;
 extern uint8_t *phys_ram_base;
 extern uint8_t *phys_ram_dirty;
+/* number of pages with MIGRATION_DIRTY_FLAG set */
+extern ram_addr_t migration_dirty_pages;
 extern ram_addr_t ram_size;
+/* incremented when the physical memory map changes, so that users of
+   cached translations know when to look them up again */
+extern unsigned int phys_map_generation;
 
 /* physical memory access */
 
@@ -952,6 +982,7 @@ int cpu_memory_rw_debug(CPUState *env, target_ulong addr,
 #define CODE_DIRTY_FLAG      0x02
 #define KQEMU_DIRTY_FLAG     0x04
 #define MIGRATION_DIRTY_FLAG 0x08
+#define SNAPSHOT_DIRTY_FLAG  0x10
 
 /* read dirty bit (return 0 or 1) */
 static inline int cpu_physical_memory_is_dirty(ram_addr_t addr)
@@ -965,13 +996,25 @@ static inline int cpu_physical_memory_get_dirty(ram_addr_t addr,
     return phys_ram_dirty[addr >> TARGET_PAGE_BITS] & dirty_flags;
 }
 
+static inline void cpu_physical_memory_set_dirty_flags(ram_addr_t addr,
+                                                      int dirty_flags)
+{
+    uint8_t *p = &phys_ram_dirty[addr >> TARGET_PAGE_BITS];
+
+    if ((dirty_flags & MIGRATION_DIRTY_FLAG) && !(*p & MIGRATION_DIRTY_FLAG))
+        migration_dirty_pages++;
+    *p |= dirty_flags;
+}
+
 static inline void cpu_physical_memory_set_dirty(ram_addr_t addr)
 {
-    phys_ram_dirty[addr >> TARGET_PAGE_BITS] = 0xff;
+    cpu_physical_memory_set_dirty_flags(addr, 0xff);
 }
 
 void cpu_physical_memory_reset_dirty(ram_addr_t start, ram_addr_t end,
                                      int dirty_flags);
+ram_addr_t cpu_physical_memory_find_dirty(ram_addr_t start, ram_addr_t end,
+                                          int dirty_flags);
 void cpu_tlb_update_dirty(CPUState *env);
 
 int cpu_physical_memory_set_dirty_tracking(int enable);
@@ -982,6 +1025,8 @@ void cpu_physical_sync_dirty_bitmap(target_phys_addr_t start_addr, target_phys_a
 
 void dump_exec_info(FILE *f,
                     int (*cpu_fprintf)(FILE *f, const char *fmt, ...));
+void dump_tb_profile(FILE *f,
+                     int (*cpu_fprintf)(FILE *f, const char *fmt, ...));
 
 /* Coalesced MMIO regions are areas where write operations can be reordered.
  * This usually implies that write operations are side-effect free.  This allows
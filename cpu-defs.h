@@ -204,6 +204,7 @@ typedef struct CPUWatchpoint {
     void *next_cpu; /* next CPU sharing TB cache */                     \
     int cpu_index; /* CPU index (informative) */                        \
     int running; /* Nonzero if cpu is currently running(usermode).  */  \
+    int stopped; /* Nonzero if the VCPU thread is parked */             \
     /* user data */                                                     \
     void *opaque;                                                       \
                                                                         \
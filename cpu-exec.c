@@ -47,6 +47,8 @@
 #endif
 
 int tb_invalidated_flag;
+/* number of TB lookups that missed the jump cache */
+uint64_t tb_lookup_count;
 
 //#define DEBUG_EXEC
 //#define DEBUG_SIGNAL
@@ -161,6 +163,9 @@ static TranslationBlock *tb_find_slow(target_ulong pc,
     tb = tb_gen_code(env, pc, cs_base, flags, 0);
 
  found:
+    /* cpu_exec() holds tb_lock, the counts are exact with -vcpu-threads */
+    tb->lookup_count++;
+    tb_lookup_count++;
     /* we add the TB in the virtual pc hash table */
     env->tb_jmp_cache[tb_jmp_cache_hash_func(pc)] = tb;
     return tb;
@@ -353,14 +358,14 @@ int cpu_exec(CPUState *env1)
                                                CPU_INTERRUPT_NMI);
                     }
                     if (interrupt_request & CPU_INTERRUPT_DEBUG) {
-                        env->interrupt_request &= ~CPU_INTERRUPT_DEBUG;
+                        cpu_reset_interrupt(env, CPU_INTERRUPT_DEBUG);
                         env->exception_index = EXCP_DEBUG;
                         cpu_loop_exit();
                     }
 #if defined(TARGET_ARM) || defined(TARGET_SPARC) || defined(TARGET_MIPS) || \
     defined(TARGET_PPC) || defined(TARGET_ALPHA) || defined(TARGET_CRIS)
                     if (interrupt_request & CPU_INTERRUPT_HALT) {
-                        env->interrupt_request &= ~CPU_INTERRUPT_HALT;
+                        cpu_reset_interrupt(env, CPU_INTERRUPT_HALT);
                         env->halted = 1;
                         env->exception_index = EXCP_HLT;
                         cpu_loop_exit();
@@ -371,12 +376,12 @@ int cpu_exec(CPUState *env1)
                         if ((interrupt_request & CPU_INTERRUPT_SMI) &&
                             !(env->hflags & HF_SMM_MASK)) {
                             svm_check_intercept(SVM_EXIT_SMI);
-                            env->interrupt_request &= ~CPU_INTERRUPT_SMI;
+                            cpu_reset_interrupt(env, CPU_INTERRUPT_SMI);
                             do_smm_enter();
                             next_tb = 0;
                         } else if ((interrupt_request & CPU_INTERRUPT_NMI) &&
                                    !(env->hflags2 & HF2_NMI_MASK)) {
-                            env->interrupt_request &= ~CPU_INTERRUPT_NMI;
+                            cpu_reset_interrupt(env, CPU_INTERRUPT_NMI);
                             env->hflags2 |= HF2_NMI_MASK;
                             do_interrupt(EXCP02_NMI, 0, 0, 0, 1);
                             next_tb = 0;
@@ -388,7 +393,7 @@ int cpu_exec(CPUState *env1)
                                       !(env->hflags & HF_INHIBIT_IRQ_MASK))))) {
                             int intno;
                             svm_check_intercept(SVM_EXIT_INTR);
-                            env->interrupt_request &= ~(CPU_INTERRUPT_HARD | CPU_INTERRUPT_VIRQ);
+                            cpu_reset_interrupt(env, CPU_INTERRUPT_HARD | CPU_INTERRUPT_VIRQ);
                             intno = cpu_get_pic_interrupt(env);
                             qemu_log_mask(CPU_LOG_TB_IN_ASM, "Servicing hardware INT=0x%02x\n", intno);
                             do_interrupt(intno, 0, 0, 0, 1);
@@ -405,7 +410,7 @@ int cpu_exec(CPUState *env1)
                             intno = ldl_phys(env->vm_vmcb + offsetof(struct vmcb, control.int_vector));
                             qemu_log_mask(CPU_LOG_TB_IN_ASM, "Servicing virtual hardware INT=0x%02x\n", intno);
                             do_interrupt(intno, 0, 0, 0, 1);
-                            env->interrupt_request &= ~CPU_INTERRUPT_VIRQ;
+                            cpu_reset_interrupt(env, CPU_INTERRUPT_VIRQ);
                             next_tb = 0;
 #endif
                         }
@@ -419,7 +424,7 @@ int cpu_exec(CPUState *env1)
                     if (interrupt_request & CPU_INTERRUPT_HARD) {
                         ppc_hw_interrupt(env);
                         if (env->pending_interrupts == 0)
-                            env->interrupt_request &= ~CPU_INTERRUPT_HARD;
+                            cpu_reset_interrupt(env, CPU_INTERRUPT_HARD);
                         next_tb = 0;
                     }
 #elif defined(TARGET_MIPS)
@@ -444,7 +449,7 @@ int cpu_exec(CPUState *env1)
 			if (((type == TT_EXTINT) &&
 			     (pil == 15 || pil > env->psrpil)) ||
 			    type != TT_EXTINT) {
-			    env->interrupt_request &= ~CPU_INTERRUPT_HARD;
+			    cpu_reset_interrupt(env, CPU_INTERRUPT_HARD);
                             env->exception_index = env->interrupt_index;
                             do_interrupt(env);
 			    env->interrupt_index = 0;
@@ -455,7 +460,7 @@ int cpu_exec(CPUState *env1)
 			}
 		    } else if (interrupt_request & CPU_INTERRUPT_TIMER) {
 			//do_interrupt(0, 0, 0, 0, 0);
-			env->interrupt_request &= ~CPU_INTERRUPT_TIMER;
+			cpu_reset_interrupt(env, CPU_INTERRUPT_TIMER);
 		    }
 #elif defined(TARGET_ARM)
                     if (interrupt_request & CPU_INTERRUPT_FIQ
@@ -520,13 +525,13 @@ int cpu_exec(CPUState *env1)
                    /* Don't use the cached interupt_request value,
                       do_interrupt may have updated the EXITTB flag. */
                     if (env->interrupt_request & CPU_INTERRUPT_EXITTB) {
-                        env->interrupt_request &= ~CPU_INTERRUPT_EXITTB;
+                        cpu_reset_interrupt(env, CPU_INTERRUPT_EXITTB);
                         /* ensure that no TB jump will be modified as
                            the program flow was changed */
                         next_tb = 0;
                     }
                     if (interrupt_request & CPU_INTERRUPT_EXIT) {
-                        env->interrupt_request &= ~CPU_INTERRUPT_EXIT;
+                        cpu_reset_interrupt(env, CPU_INTERRUPT_EXIT);
                         env->exception_index = EXCP_INTERRUPT;
                         cpu_loop_exit();
                     }
@@ -564,7 +569,7 @@ int cpu_exec(CPUState *env1)
 #endif
                 }
 #endif
-                spin_lock(&tb_lock);
+                tb_lock_acquire();
                 tb = tb_find_fast();
                 /* Note: we do it here to avoid a gcc bug on Mac OS X when
                    doing it in tb_find_slow */
@@ -592,8 +597,10 @@ int cpu_exec(CPUState *env1)
                     tb_add_jump((TranslationBlock *)(next_tb & ~3), next_tb & 3, tb);
                 }
                 }
-                spin_unlock(&tb_lock);
+                /* publish the TB before releasing the lock, cpu_interrupt()
+                   from another thread unlinks it under the lock */
                 env->current_tb = tb;
+                tb_lock_release();
 
                 /* cpu_interrupt might be called while translating the
                    TB, but before it is linked into a potentially
@@ -651,6 +658,12 @@ int cpu_exec(CPUState *env1)
 #endif
             } /* for(;;) */
         } else {
+            /* the exception may have been raised with locks held */
+            tb_lock_reset();
+#ifdef USE_VCPU_THREADS
+            cpu_atomic_reset();
+            qemu_mutex_reset_iothread();
+#endif
             env_to_regs();
         }
     } /* for(;;) */
@@ -23,6 +23,9 @@
  */
 #include "qemu-common.h"
 #include "host-utils.h"
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
 
 void pstrcpy(char *buf, int buf_size, const char *str)
 {
@@ -161,3 +164,44 @@ void qemu_iovec_from_buffer(QEMUIOVector *qiov, const void *buf, size_t count)
         count -= copy;
     }
 }
+
+/* Return 1 if the len bytes at buf are all zero.  Aligned buffers whose
+   length is a multiple of 64 are checked 64 bytes at a time. */
+int buffer_is_zero(const void *buf, size_t len)
+{
+    const uint8_t *p = buf;
+    size_t i;
+
+#ifdef __SSE2__
+    if (((unsigned long)p % 16) == 0 && (len % 64) == 0) {
+        const __m128i *v = (const __m128i *)p;
+        __m128i zero = _mm_setzero_si128();
+        __m128i t;
+
+        for (i = 0; i < len / 16; i += 4) {
+            t = _mm_or_si128(_mm_or_si128(v[i], v[i + 1]),
+                             _mm_or_si128(v[i + 2], v[i + 3]));
+            if (_mm_movemask_epi8(_mm_cmpeq_epi8(t, zero)) != 0xffff)
+                return 0;
+        }
+        return 1;
+    }
+#endif
+
+    if (((unsigned long)p % sizeof(long)) == 0 &&
+        (len % (4 * sizeof(long))) == 0) {
+        const long *l = (const long *)p;
+
+        for (i = 0; i < len / sizeof(long); i += 4) {
+            if (l[i] | l[i + 1] | l[i + 2] | l[i + 3])
+                return 0;
+        }
+        return 1;
+    }
+
+    for (i = 0; i < len; i++) {
+        if (p[i])
+            return 0;
+    }
+    return 1;
+}
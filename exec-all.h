@@ -155,6 +155,11 @@ struct TranslationBlock {
     struct TranslationBlock *jmp_next[2];
     struct TranslationBlock *jmp_first;
     uint32_t icount;
+    /* profiling counters for "info tbprofile": executions (only counted
+       with -tb-profile, approximate with -vcpu-threads) and lookups that
+       missed the jump cache */
+    uint64_t exec_count;
+    uint32_t lookup_count;
 };
 
 static inline unsigned int tb_jmp_cache_hash_page(target_ulong pc)
@@ -180,6 +185,7 @@ static inline unsigned int tb_phys_hash_func(unsigned long pc)
 TranslationBlock *tb_alloc(target_ulong pc);
 void tb_free(TranslationBlock *tb);
 void tb_flush(CPUState *env);
+void tb_flush_region(CPUState *env);
 void tb_link_phys(TranslationBlock *tb,
                   target_ulong phys_pc, target_ulong phys_page2);
 void tb_phys_invalidate(TranslationBlock *tb, target_ulong page_addr);
@@ -274,6 +280,27 @@ extern void *io_mem_opaque[IO_MEM_NB_ENTRIES];
 extern spinlock_t tb_lock;
 
 extern int tb_invalidated_flag;
+extern uint64_t tb_lookup_count;
+
+#ifdef USE_VCPU_THREADS
+/* values of tb_flush_requested */
+#define TB_FLUSH_REGION 1 /* the current code region is full */
+#define TB_FLUSH_ALL    2 /* tb_flush() */
+extern volatile int tb_flush_requested;
+
+void tb_lock_acquire(void);
+void tb_lock_release(void);
+void tb_lock_reset(void);
+void cpu_atomic_lock(void);
+void cpu_atomic_unlock(void);
+void cpu_atomic_reset(void);
+void cpu_notdirty_atomic(ram_addr_t ram_addr, int len);
+#else
+#define tb_flush_requested 0
+#define tb_lock_acquire() spin_lock(&tb_lock)
+#define tb_lock_release() spin_unlock(&tb_lock)
+#define tb_lock_reset() do { } while (0)
+#endif
 
 #if !defined(CONFIG_USER_ONLY)
 
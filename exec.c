@@ -43,6 +43,11 @@
 #include "kvm.h"
 #if defined(CONFIG_USER_ONLY)
 #include <qemu.h>
+#else
+#include "qemu-timer.h"
+#endif
+#ifdef USE_VCPU_THREADS
+#include <pthread.h>
 #endif
 
 //#define DEBUG_TB_INVALIDATE
@@ -85,13 +90,49 @@
 #define TARGET_PHYS_ADDR_SPACE_BITS 32
 #endif
 
-static TranslationBlock *tbs;
+/* The code buffer is split into regions that are filled in turn.  When
+   the last region is full, the buffer grows by one region until it
+   reaches tb_size_limit, then the TBs of the oldest region are
+   invalidated and the region is reused.  The TBs of each region are
+   allocated in order, so that tb_find_pc() can search them. */
+typedef struct CodeGenRegion {
+    uint8_t *start;
+    uint8_t *end;               /* end of the code, except in the
+                                   current region where it is
+                                   code_gen_ptr */
+    TranslationBlock *tbs;
+    int nb_tbs;
+} CodeGenRegion;
+
+#define CODE_GEN_REGIONS      8  /* regions of the initial buffer */
+#define CODE_GEN_MAX_REGIONS  64
+
+static CodeGenRegion code_gen_regions[CODE_GEN_MAX_REGIONS];
+static int code_gen_nb_regions;
+static int code_gen_max_regions;
+static int code_gen_cur_region;
+static unsigned long code_gen_region_size;
+/* maximum number of TBs per region */
 int code_gen_max_blocks;
 TranslationBlock *tb_phys_hash[CODE_GEN_PHYS_HASH_SIZE];
 static int nb_tbs;
 /* any access to the tbs or the page table must use this lock */
 spinlock_t tb_lock = SPIN_LOCK_UNLOCKED;
 
+#ifdef USE_VCPU_THREADS
+/* With -vcpu-threads, tb_lock is this recursive mutex: the TB
+   invalidation can run into tb_find_pc() and tb_gen_code(). */
+static pthread_mutex_t tb_mutex = PTHREAD_MUTEX_INITIALIZER;
+static __thread int tb_mutex_depth;
+/* the code buffer is full, the main loop flushes it once all the VCPU
+   threads are out of the generated code */
+volatile int tb_flush_requested;
+/* serializes the guest atomic operations the host cannot perform with
+   a single compare-and-swap */
+static pthread_mutex_t atomic_mutex = PTHREAD_MUTEX_INITIALIZER;
+static __thread int atomic_mutex_held;
+#endif
+
 #if defined(__arm__) || defined(__sparc_v9__)
 /* The prologue must be reachable with a direct jump. ARM and Sparc64
  have limited branch ranges (possibly also PPC) so place it in a
@@ -107,15 +148,19 @@ spinlock_t tb_lock = SPIN_LOCK_UNLOCKED;
 uint8_t code_gen_prologue[1024] code_gen_section;
 static uint8_t *code_gen_buffer;
 static unsigned long code_gen_buffer_size;
-/* threshold to flush the translated code buffer */
+/* threshold to move to the next region of the code buffer */
 static unsigned long code_gen_buffer_max_size;
 uint8_t *code_gen_ptr;
+/* maximum size of the code buffer, 0 for the default */
+unsigned long tb_size_limit;
 
 #if !defined(CONFIG_USER_ONLY)
 ram_addr_t phys_ram_size;
 int phys_ram_fd;
 uint8_t *phys_ram_base;
 uint8_t *phys_ram_dirty;
+ram_addr_t migration_dirty_pages;
+unsigned int phys_map_generation;
 static int in_migration;
 static ram_addr_t phys_ram_alloc_offset = 0;
 #endif
@@ -123,11 +168,17 @@ static ram_addr_t phys_ram_alloc_offset = 0;
 CPUState *first_cpu;
 /* current CPU in the current thread. It is only valid inside
    cpu_exec() */
+#ifdef USE_VCPU_THREADS
+__thread CPUState *cpu_single_env;
+#else
 CPUState *cpu_single_env;
+#endif
 /* 0 = Do not count executed instructions.
    1 = Precise instruction counting.
    2 = Adaptive rate instruction counting.  */
 int use_icount = 0;
+/* Count the executions of each TB in the generated code. */
+int tb_profile_enabled = 0;
 /* Current instruction counter.  While executing translated code this may
    include some instructions that have not yet been executed.  */
 int64_t qemu_icount;
@@ -139,6 +190,8 @@ typedef struct PageDesc {
        of lookups we do to a given page to use a bitmap */
     unsigned int code_write_count;
     uint8_t *code_bitmap;
+    /* number of TBs invalidated in this page, for "info tbprofile" */
+    unsigned int tb_invalidate_count;
 #if defined(CONFIG_USER_ONLY)
     unsigned long flags;
 #endif
@@ -188,6 +241,9 @@ static int io_mem_watch;
 static int tlb_flush_count;
 static int tb_flush_count;
 static int tb_phys_invalidate_count;
+static int tb_region_evict_count;
+static int64_t tb_evict_count;
+static int64_t tb_translate_count;
 
 #define SUBPAGE_IDX(addr) ((addr) & ~TARGET_PAGE_MASK)
 typedef struct subpage_t {
@@ -398,23 +454,33 @@ static uint8_t static_code_gen_buffer[DEFAULT_CODE_GEN_BUFFER_SIZE];
 
 static void code_gen_alloc(unsigned long tb_size)
 {
+    unsigned long size, max_block_size;
+
 #ifdef USE_STATIC_CODE_GEN_BUFFER
     code_gen_buffer = static_code_gen_buffer;
     code_gen_buffer_size = DEFAULT_CODE_GEN_BUFFER_SIZE;
+    size = code_gen_buffer_size;
     map_exec(code_gen_buffer, code_gen_buffer_size);
 #else
-    code_gen_buffer_size = tb_size;
-    if (code_gen_buffer_size == 0) {
+    size = tb_size;
+    if (size == 0) {
 #if defined(CONFIG_USER_ONLY)
         /* in user mode, phys_ram_size is not meaningful */
-        code_gen_buffer_size = DEFAULT_CODE_GEN_BUFFER_SIZE;
+        size = DEFAULT_CODE_GEN_BUFFER_SIZE;
 #else
         /* XXX: needs ajustments */
-        code_gen_buffer_size = (unsigned long)(phys_ram_size / 4);
+        size = (unsigned long)(phys_ram_size / 4);
 #endif
     }
-    if (code_gen_buffer_size < MIN_CODE_GEN_BUFFER_SIZE)
-        code_gen_buffer_size = MIN_CODE_GEN_BUFFER_SIZE;
+    if (size < MIN_CODE_GEN_BUFFER_SIZE)
+        size = MIN_CODE_GEN_BUFFER_SIZE;
+    /* the buffer is mapped at its maximum size, the pages of the
+       regions that are not used yet are never touched */
+    code_gen_buffer_size = tb_size_limit;
+    if (code_gen_buffer_size == 0)
+        code_gen_buffer_size = 4 * size;
+    if (code_gen_buffer_size < size)
+        code_gen_buffer_size = size;
     /* The code gen buffer location may have constraints depending on
        the host cpu and OS */
 #if defined(__linux__) 
@@ -475,21 +541,48 @@ static void code_gen_alloc(unsigned long tb_size)
     code_gen_buffer = qemu_malloc(code_gen_buffer_size);
     map_exec(code_gen_buffer, code_gen_buffer_size);
 #endif
+    if (size > code_gen_buffer_size)
+        size = code_gen_buffer_size;
 #endif /* !USE_STATIC_CODE_GEN_BUFFER */
     map_exec(code_gen_prologue, sizeof(code_gen_prologue));
-    code_gen_buffer_max_size = code_gen_buffer_size - 
-        code_gen_max_block_size();
-    code_gen_max_blocks = code_gen_buffer_size / CODE_GEN_AVG_BLOCK_SIZE;
-    tbs = qemu_malloc(code_gen_max_blocks * sizeof(TranslationBlock));
+
+    /* a region must hold at least a few of the largest blocks */
+    max_block_size = code_gen_max_block_size();
+    code_gen_region_size = (size / CODE_GEN_REGIONS) & ~(CODE_GEN_ALIGN - 1);
+    if (code_gen_region_size < 4 * max_block_size)
+        code_gen_region_size = 4 * max_block_size;
+    if (code_gen_region_size > size)
+        code_gen_region_size = size;
+    code_gen_nb_regions = size / code_gen_region_size;
+    code_gen_max_regions = code_gen_buffer_size / code_gen_region_size;
+    if (code_gen_max_regions > CODE_GEN_MAX_REGIONS)
+        code_gen_max_regions = CODE_GEN_MAX_REGIONS;
+    code_gen_buffer_max_size = code_gen_region_size - max_block_size;
+    code_gen_max_blocks = code_gen_region_size / CODE_GEN_AVG_BLOCK_SIZE;
+}
+
+static void code_gen_region_init(int i)
+{
+    CodeGenRegion *r = &code_gen_regions[i];
+
+    r->start = code_gen_buffer + i * code_gen_region_size;
+    r->end = r->start;
+    r->tbs = qemu_malloc(code_gen_max_blocks * sizeof(TranslationBlock));
+    r->nb_tbs = 0;
 }
 
-/* Must be called before using the QEMU cpus. 'tb_size' is the size
-   (in bytes) allocated to the translation buffer. Zero means default
-   size. */
+/* Must be called before using the QEMU cpus. 'tb_size' is the initial
+   size (in bytes) of the translation buffer, which can grow up to
+   tb_size_limit. Zero means default size. */
 void cpu_exec_init_all(unsigned long tb_size)
 {
+    int i;
+
     cpu_gen_init();
     code_gen_alloc(tb_size);
+    for(i = 0; i < code_gen_nb_regions; i++)
+        code_gen_region_init(i);
+    code_gen_cur_region = 0;
     code_gen_ptr = code_gen_buffer;
     page_init();
 #if !defined(CONFIG_USER_ONLY)
@@ -569,27 +662,97 @@ static void page_flush_tb(void)
             for(j = 0; j < L2_SIZE; j++) {
                 p->first_tb = NULL;
                 invalidate_page_bitmap(p);
+                p->tb_invalidate_count = 0;
                 p++;
             }
         }
     }
 }
 
-/* flush all the translation blocks */
-/* XXX: tb_flush is currently not thread safe */
-void tb_flush(CPUState *env1)
+#ifdef USE_VCPU_THREADS
+void tb_lock_acquire(void)
+{
+    if (!vcpu_threads)
+        return;
+    if (tb_mutex_depth++ == 0)
+        pthread_mutex_lock(&tb_mutex);
+}
+
+void tb_lock_release(void)
+{
+    if (!vcpu_threads)
+        return;
+    if (--tb_mutex_depth == 0)
+        pthread_mutex_unlock(&tb_mutex);
+}
+
+/* cpu_exec() calls it after a longjmp() */
+void tb_lock_reset(void)
+{
+    if (tb_mutex_depth > 0) {
+        tb_mutex_depth = 0;
+        pthread_mutex_unlock(&tb_mutex);
+    }
+}
+
+void cpu_atomic_lock(void)
+{
+    if (!vcpu_threads || atomic_mutex_held)
+        return;
+    pthread_mutex_lock(&atomic_mutex);
+    atomic_mutex_held = 1;
+}
+
+void cpu_atomic_unlock(void)
+{
+    if (!atomic_mutex_held)
+        return;
+    atomic_mutex_held = 0;
+    pthread_mutex_unlock(&atomic_mutex);
+}
+
+/* the guest faulted in the middle of an atomic operation */
+void cpu_atomic_reset(void)
+{
+    cpu_atomic_unlock();
+}
+#endif
+
+static void tb_phys_unlink(TranslationBlock *tb, target_ulong page_addr);
+
+static inline uint8_t *code_gen_region_end(CodeGenRegion *r)
+{
+    if (r == &code_gen_regions[code_gen_cur_region])
+        return code_gen_ptr;
+    return r->end;
+}
+
+static inline int code_gen_region_full(void)
+{
+    CodeGenRegion *r = &code_gen_regions[code_gen_cur_region];
+
+    return r->nb_tbs >= code_gen_max_blocks ||
+        (code_gen_ptr - r->start) >= code_gen_buffer_max_size;
+}
+
+static void do_tb_flush(CPUState *env1)
 {
     CPUState *env;
+    int i;
+
 #if defined(DEBUG_FLUSH)
-    printf("qemu: flush code_size=%ld nb_tbs=%d avg_tb_size=%ld\n",
-           (unsigned long)(code_gen_ptr - code_gen_buffer),
-           nb_tbs, nb_tbs > 0 ?
-           ((unsigned long)(code_gen_ptr - code_gen_buffer)) / nb_tbs : 0);
+    printf("qemu: flush regions=%d nb_tbs=%d\n",
+           code_gen_nb_regions, nb_tbs);
 #endif
-    if ((unsigned long)(code_gen_ptr - code_gen_buffer) > code_gen_buffer_size)
+    if ((unsigned long)(code_gen_ptr - code_gen_regions[code_gen_cur_region].start) >
+        code_gen_region_size)
         cpu_abort(env1, "Internal error: code buffer overflow\n");
 
     nb_tbs = 0;
+    for(i = 0; i < code_gen_nb_regions; i++) {
+        code_gen_regions[i].nb_tbs = 0;
+        code_gen_regions[i].end = code_gen_regions[i].start;
+    }
 
     for(env = first_cpu; env != NULL; env = env->next_cpu) {
         memset (env->tb_jmp_cache, 0, TB_JMP_CACHE_SIZE * sizeof (void *));
@@ -598,10 +761,101 @@ void tb_flush(CPUState *env1)
     memset (tb_phys_hash, 0, CODE_GEN_PHYS_HASH_SIZE * sizeof (void *));
     page_flush_tb();
 
+    code_gen_cur_region = 0;
     code_gen_ptr = code_gen_buffer;
     /* XXX: flush processor icache at this point if cache flush is
        expensive */
     tb_flush_count++;
+    /* "info tbprofile" reports the TBs and pages since the last flush */
+    tb_lookup_count = 0;
+}
+
+/* flush all the translation blocks */
+void tb_flush(CPUState *env1)
+{
+#ifdef USE_VCPU_THREADS
+    if (vcpu_threads) {
+        if (cpu_single_env) {
+            /* the other VCPUs may be running code from the buffer,
+               let the main loop flush it once they have left it */
+            tb_flush_requested = TB_FLUSH_ALL;
+            cpu_interrupt(cpu_single_env, CPU_INTERRUPT_EXIT);
+            qemu_notify_event();
+            return;
+        }
+        pause_all_vcpus();
+    }
+#endif
+    do_tb_flush(env1);
+#ifdef USE_VCPU_THREADS
+    if (vcpu_threads) {
+        tb_flush_requested = 0;
+        resume_all_vcpus();
+    }
+#endif
+}
+
+/* Move to the next region of the code buffer: grow the buffer if the
+   current region is the last one, otherwise invalidate the TBs of the
+   next region, which is the oldest one.  The jumps of the other TBs
+   to the invalidated ones are reset by tb_phys_unlink(). */
+static void code_gen_next_region(void)
+{
+    CodeGenRegion *r;
+    TranslationBlock *tb;
+    int i;
+
+    code_gen_regions[code_gen_cur_region].end = code_gen_ptr;
+    if (code_gen_cur_region == code_gen_nb_regions - 1 &&
+        code_gen_nb_regions < code_gen_max_regions) {
+        code_gen_region_init(code_gen_nb_regions);
+        code_gen_cur_region = code_gen_nb_regions++;
+        r = &code_gen_regions[code_gen_cur_region];
+    } else {
+        code_gen_cur_region = (code_gen_cur_region + 1) % code_gen_nb_regions;
+        r = &code_gen_regions[code_gen_cur_region];
+        for(i = 0; i < r->nb_tbs; i++) {
+            tb = &r->tbs[i];
+            /* skip the TBs already invalidated */
+            if (tb->page_addr[0] != -1)
+                tb_phys_unlink(tb, -1);
+        }
+        nb_tbs -= r->nb_tbs;
+        tb_evict_count += r->nb_tbs;
+        tb_region_evict_count++;
+        r->nb_tbs = 0;
+    }
+    code_gen_ptr = r->start;
+}
+
+/* make room for a new TB in the code buffer, called when tb_alloc()
+   fails */
+void tb_flush_region(CPUState *env1)
+{
+#ifdef USE_VCPU_THREADS
+    if (vcpu_threads) {
+        if (cpu_single_env) {
+            /* the other VCPUs may be running code from the region that
+               is reused, let the main loop do it */
+            __sync_bool_compare_and_swap(&tb_flush_requested, 0,
+                                         TB_FLUSH_REGION);
+            cpu_interrupt(cpu_single_env, CPU_INTERRUPT_EXIT);
+            qemu_notify_event();
+            return;
+        }
+        pause_all_vcpus();
+        if (tb_flush_requested == TB_FLUSH_ALL) {
+            do_tb_flush(env1);
+        } else if (code_gen_region_full()) {
+            /* several VCPUs may have asked for the same region */
+            code_gen_next_region();
+        }
+        tb_flush_requested = 0;
+        resume_all_vcpus();
+        return;
+    }
+#endif
+    code_gen_next_region();
 }
 
 #ifdef DEBUG_TB_CHECK
@@ -729,7 +983,7 @@ static inline void tb_reset_jump(TranslationBlock *tb, int n)
     tb_set_jmp_target(tb, n, (unsigned long)(tb->tc_ptr + tb->tb_next_offset[n]));
 }
 
-void tb_phys_invalidate(TranslationBlock *tb, target_ulong page_addr)
+static void tb_phys_unlink(TranslationBlock *tb, target_ulong page_addr)
 {
     CPUState *env;
     PageDesc *p;
@@ -782,6 +1036,13 @@ void tb_phys_invalidate(TranslationBlock *tb, target_ulong page_addr)
     }
     tb->jmp_first = (TranslationBlock *)((long)tb | 2); /* fail safe */
 
+    /* the TB is no longer in any list */
+    tb->page_addr[0] = -1;
+}
+
+void tb_phys_invalidate(TranslationBlock *tb, target_ulong page_addr)
+{
+    tb_phys_unlink(tb, page_addr);
     tb_phys_invalidate_count++;
 }
 
@@ -852,13 +1113,21 @@ TranslationBlock *tb_gen_code(CPUState *env,
     phys_pc = get_phys_addr_code(env, pc);
     tb = tb_alloc(pc);
     if (!tb) {
-        /* flush must be done */
-        tb_flush(env);
+#ifdef USE_VCPU_THREADS
+        if (vcpu_threads) {
+            /* leave cpu_exec() until the main loop has made room */
+            tb_flush_region(env);
+            env->exception_index = EXCP_INTERRUPT;
+            longjmp(env->jmp_env, 1);
+        }
+#endif
+        tb_flush_region(env);
         /* cannot fail at this point */
         tb = tb_alloc(pc);
         /* Don't forget to invalidate previous TB info.  */
         tb_invalidated_flag = 1;
     }
+    tb_translate_count++;
     tc_ptr = code_gen_ptr;
     tb->tc_ptr = tc_ptr;
     tb->cs_base = cs_base;
@@ -902,6 +1171,9 @@ void tb_invalidate_phys_page_range(target_phys_addr_t start, target_phys_addr_t
     p = page_find(start >> TARGET_PAGE_BITS);
     if (!p)
         return;
+#ifdef USE_VCPU_THREADS
+    tb_lock_acquire();
+#endif
     if (!p->code_bitmap &&
         ++p->code_write_count >= SMC_BITMAP_USE_THRESHOLD &&
         is_cpu_write_access) {
@@ -959,6 +1231,7 @@ void tb_invalidate_phys_page_range(target_phys_addr_t start, target_phys_addr_t
                 env->current_tb = NULL;
             }
             tb_phys_invalidate(tb, -1);
+            p->tb_invalidate_count++;
             if (env) {
                 env->current_tb = saved_tb;
                 if (env->interrupt_request && env->current_tb)
@@ -986,6 +1259,9 @@ void tb_invalidate_phys_page_range(target_phys_addr_t start, target_phys_addr_t
         cpu_resume_from_signal(env, NULL);
     }
 #endif
+#ifdef USE_VCPU_THREADS
+    tb_lock_release();
+#endif
 }
 
 /* len must be <= 8 and start must be a multiple of len */
@@ -1060,6 +1336,7 @@ static void tb_invalidate_phys_page(target_phys_addr_t addr,
         }
 #endif /* TARGET_HAS_PRECISE_SMC */
         tb_phys_invalidate(tb, addr);
+        p->tb_invalidate_count++;
         tb = tb->page_next[n];
     }
     p->first_tb = NULL;
@@ -1131,18 +1408,22 @@ static inline void tb_alloc_page(TranslationBlock *tb,
 #endif /* TARGET_HAS_SMC */
 }
 
-/* Allocate a new translation block. Flush the translation buffer if
-   too many translation blocks or too much generated code. */
+/* Allocate a new translation block in the current region of the code
+   buffer. Return NULL if the region has too many translation blocks or
+   too much generated code. */
 TranslationBlock *tb_alloc(target_ulong pc)
 {
+    CodeGenRegion *r = &code_gen_regions[code_gen_cur_region];
     TranslationBlock *tb;
 
-    if (nb_tbs >= code_gen_max_blocks ||
-        (code_gen_ptr - code_gen_buffer) >= code_gen_buffer_max_size)
+    if (code_gen_region_full())
         return NULL;
-    tb = &tbs[nb_tbs++];
+    tb = &r->tbs[r->nb_tbs++];
+    nb_tbs++;
     tb->pc = pc;
     tb->cflags = 0;
+    tb->exec_count = 0;
+    tb->lookup_count = 0;
     return tb;
 }
 
@@ -1151,8 +1432,11 @@ void tb_free(TranslationBlock *tb)
     /* In practice this is mostly used for single use temporary TB
        Ignore the hard cases and just back up if this TB happens to
        be the last one generated.  */
-    if (nb_tbs > 0 && tb == &tbs[nb_tbs - 1]) {
+    CodeGenRegion *r = &code_gen_regions[code_gen_cur_region];
+
+    if (r->nb_tbs > 0 && tb == &r->tbs[r->nb_tbs - 1]) {
         code_gen_ptr = tb->tc_ptr;
+        r->nb_tbs--;
         nb_tbs--;
     }
 }
@@ -1197,25 +1481,28 @@ void tb_link_phys(TranslationBlock *tb,
     mmap_unlock();
 }
 
-/* find the TB 'tb' such that tb[0].tc_ptr <= tc_ptr <
-   tb[1].tc_ptr. Return NULL if not found */
-TranslationBlock *tb_find_pc(unsigned long tc_ptr)
+static TranslationBlock *tb_search_pc(unsigned long tc_ptr)
 {
     int m_min, m_max, m;
     unsigned long v;
     TranslationBlock *tb;
+    CodeGenRegion *r;
 
-    if (nb_tbs <= 0)
-        return NULL;
     if (tc_ptr < (unsigned long)code_gen_buffer ||
-        tc_ptr >= (unsigned long)code_gen_ptr)
+        tc_ptr >= (unsigned long)code_gen_buffer +
+        code_gen_nb_regions * code_gen_region_size)
+        return NULL;
+    r = &code_gen_regions[(tc_ptr - (unsigned long)code_gen_buffer) /
+                          code_gen_region_size];
+    if (r->nb_tbs <= 0 ||
+        tc_ptr >= (unsigned long)code_gen_region_end(r))
         return NULL;
     /* binary search (cf Knuth) */
     m_min = 0;
-    m_max = nb_tbs - 1;
+    m_max = r->nb_tbs - 1;
     while (m_min <= m_max) {
         m = (m_min + m_max) >> 1;
-        tb = &tbs[m];
+        tb = &r->tbs[m];
         v = (unsigned long)tb->tc_ptr;
         if (v == tc_ptr)
             return tb;
@@ -1225,7 +1512,24 @@ TranslationBlock *tb_find_pc(unsigned long tc_ptr)
             m_min = m + 1;
         }
     }
-    return &tbs[m_max];
+    return &r->tbs[m_max];
+}
+
+/* find the TB 'tb' such that tb[0].tc_ptr <= tc_ptr <
+   tb[1].tc_ptr. Return NULL if not found */
+TranslationBlock *tb_find_pc(unsigned long tc_ptr)
+{
+#ifdef USE_VCPU_THREADS
+    TranslationBlock *tb;
+
+    /* another VCPU thread may be adding a TB */
+    tb_lock_acquire();
+    tb = tb_search_pc(tc_ptr);
+    tb_lock_release();
+    return tb;
+#else
+    return tb_search_pc(tc_ptr);
+#endif
 }
 
 static void tb_reset_jump_recursive(TranslationBlock *tb);
@@ -1460,6 +1764,26 @@ void cpu_interrupt(CPUState *env, int mask)
 #endif
     int old_mask;
 
+#ifdef USE_VCPU_THREADS
+    if (vcpu_threads) {
+        /* make another VCPU leave cpu_exec(): it may have fetched its
+           next TB before seeing the new request, and only rechecks
+           CPU_INTERRUPT_EXIT once it is published in current_tb */
+        if (env != cpu_single_env)
+            mask |= CPU_INTERRUPT_EXIT;
+        __sync_fetch_and_or(&env->interrupt_request, mask);
+        /* the jump lists are shared with the threads chaining TBs */
+        tb_lock_acquire();
+        tb = env->current_tb;
+        if (tb) {
+            env->current_tb = NULL;
+            tb_reset_jump_recursive(tb);
+        }
+        tb_lock_release();
+        qemu_cpu_kick(env);
+        return;
+    }
+#endif
     old_mask = env->interrupt_request;
     /* FIXME: This is probably not threadsafe.  A different thread could
        be in the middle of a read-modify-write operation.  */
@@ -1495,6 +1819,12 @@ void cpu_interrupt(CPUState *env, int mask)
 
 void cpu_reset_interrupt(CPUState *env, int mask)
 {
+#ifdef USE_VCPU_THREADS
+    if (vcpu_threads) {
+        __sync_fetch_and_and(&env->interrupt_request, ~mask);
+        return;
+    }
+#endif
     env->interrupt_request &= ~mask;
 }
 
@@ -1784,6 +2114,12 @@ void cpu_physical_memory_reset_dirty(ram_addr_t start, ram_addr_t end,
     if (length == 0)
         return;
     len = length >> TARGET_PAGE_BITS;
+#ifdef USE_VCPU_THREADS
+    /* a running VCPU could write through a TLB entry that is about to
+       lose its dirty bit, and the write would go unnoticed */
+    if (!cpu_single_env)
+        pause_all_vcpus();
+#endif
 #ifdef USE_KQEMU
     /* XXX: should not depend on cpu context */
     env = first_cpu;
@@ -1798,8 +2134,16 @@ void cpu_physical_memory_reset_dirty(ram_addr_t start, ram_addr_t end,
 #endif
     mask = ~dirty_flags;
     p = phys_ram_dirty + (start >> TARGET_PAGE_BITS);
-    for(i = 0; i < len; i++)
-        p[i] &= mask;
+    if (dirty_flags & MIGRATION_DIRTY_FLAG) {
+        for(i = 0; i < len; i++) {
+            if (p[i] & MIGRATION_DIRTY_FLAG)
+                migration_dirty_pages--;
+            p[i] &= mask;
+        }
+    } else {
+        for(i = 0; i < len; i++)
+            p[i] &= mask;
+    }
 
     /* we modify the TLB cache so that the dirty bit will be set again
        when accessing the range */
@@ -1818,6 +2162,44 @@ void cpu_physical_memory_reset_dirty(ram_addr_t start, ram_addr_t end,
 #endif
 #endif
     }
+#ifdef USE_VCPU_THREADS
+    if (!cpu_single_env)
+        resume_all_vcpus();
+#endif
+}
+
+/* Return the first page in [start, end) with one of dirty_flags set, or end
+   if there is none.  Clean pages are skipped a word at a time. */
+ram_addr_t cpu_physical_memory_find_dirty(ram_addr_t start, ram_addr_t end,
+                                          int dirty_flags)
+{
+    unsigned long page, end_page, mask;
+    const unsigned long *w;
+
+    page = start >> TARGET_PAGE_BITS;
+    end_page = end >> TARGET_PAGE_BITS;
+
+    /* byte at a time up to a word boundary */
+    while (page < end_page && (page % sizeof(unsigned long)) != 0) {
+        if (phys_ram_dirty[page] & dirty_flags)
+            return (ram_addr_t)page << TARGET_PAGE_BITS;
+        page++;
+    }
+
+    /* dirty_flags replicated in every byte of a word */
+    mask = (~0UL / 0xff) * (dirty_flags & 0xff);
+    w = (const unsigned long *)(phys_ram_dirty + page);
+    while (page + sizeof(unsigned long) <= end_page && !(*w & mask)) {
+        page += sizeof(unsigned long);
+        w++;
+    }
+
+    while (page < end_page) {
+        if (phys_ram_dirty[page] & dirty_flags)
+            return (ram_addr_t)page << TARGET_PAGE_BITS;
+        page++;
+    }
+    return end;
 }
 
 int cpu_physical_memory_set_dirty_tracking(int enable)
@@ -2241,6 +2623,8 @@ void cpu_register_physical_memory_offset(target_phys_addr_t start_addr,
     if (kvm_enabled())
         kvm_set_phys_mem(start_addr, size, phys_offset);
 
+    phys_map_generation++;
+
     if (phys_offset == IO_MEM_UNASSIGNED) {
         region_offset = start_addr;
     }
@@ -2442,6 +2826,8 @@ static void notdirty_mem_writeb(void *opaque, target_phys_addr_t ram_addr,
         (dirty_flags & KQEMU_MODIFY_PAGE_MASK) != KQEMU_MODIFY_PAGE_MASK)
         kqemu_modify_page(cpu_single_env, ram_addr);
 #endif
+    if (!(dirty_flags & MIGRATION_DIRTY_FLAG))
+        migration_dirty_pages++;
     dirty_flags |= (0xff & ~CODE_DIRTY_FLAG);
     phys_ram_dirty[ram_addr >> TARGET_PAGE_BITS] = dirty_flags;
     /* we remove the notdirty callback only if the code has been
@@ -2450,6 +2836,29 @@ static void notdirty_mem_writeb(void *opaque, target_phys_addr_t ram_addr,
         tlb_set_dirty(cpu_single_env, cpu_single_env->mem_io_vaddr);
 }
 
+#ifdef USE_VCPU_THREADS
+/* Same as the notdirty handlers, for a compare-and-swap which does the
+   store itself.  Called by the VCPU thread with mem_io_vaddr set. */
+void cpu_notdirty_atomic(ram_addr_t ram_addr, int len)
+{
+    int dirty_flags;
+
+    tb_lock_acquire();
+    dirty_flags = phys_ram_dirty[ram_addr >> TARGET_PAGE_BITS];
+    if (!(dirty_flags & CODE_DIRTY_FLAG)) {
+        tb_invalidate_phys_page_fast(ram_addr, len);
+        dirty_flags = phys_ram_dirty[ram_addr >> TARGET_PAGE_BITS];
+    }
+    if (!(dirty_flags & MIGRATION_DIRTY_FLAG))
+        migration_dirty_pages++;
+    dirty_flags |= (0xff & ~CODE_DIRTY_FLAG);
+    phys_ram_dirty[ram_addr >> TARGET_PAGE_BITS] = dirty_flags;
+    if (dirty_flags == 0xff)
+        tlb_set_dirty(cpu_single_env, cpu_single_env->mem_io_vaddr);
+    tb_lock_release();
+}
+#endif
+
 static void notdirty_mem_writew(void *opaque, target_phys_addr_t ram_addr,
                                 uint32_t val)
 {
@@ -2467,6 +2876,8 @@ static void notdirty_mem_writew(void *opaque, target_phys_addr_t ram_addr,
         (dirty_flags & KQEMU_MODIFY_PAGE_MASK) != KQEMU_MODIFY_PAGE_MASK)
         kqemu_modify_page(cpu_single_env, ram_addr);
 #endif
+    if (!(dirty_flags & MIGRATION_DIRTY_FLAG))
+        migration_dirty_pages++;
     dirty_flags |= (0xff & ~CODE_DIRTY_FLAG);
     phys_ram_dirty[ram_addr >> TARGET_PAGE_BITS] = dirty_flags;
     /* we remove the notdirty callback only if the code has been
@@ -2492,6 +2903,8 @@ static void notdirty_mem_writel(void *opaque, target_phys_addr_t ram_addr,
         (dirty_flags & KQEMU_MODIFY_PAGE_MASK) != KQEMU_MODIFY_PAGE_MASK)
         kqemu_modify_page(cpu_single_env, ram_addr);
 #endif
+    if (!(dirty_flags & MIGRATION_DIRTY_FLAG))
+        migration_dirty_pages++;
     dirty_flags |= (0xff & ~CODE_DIRTY_FLAG);
     phys_ram_dirty[ram_addr >> TARGET_PAGE_BITS] = dirty_flags;
     /* we remove the notdirty callback only if the code has been
@@ -2791,6 +3204,7 @@ static void io_mem_init(void)
     /* alloc dirty bits array */
     phys_ram_dirty = qemu_vmalloc(phys_ram_size >> TARGET_PAGE_BITS);
     memset(phys_ram_dirty, 0xff, phys_ram_size >> TARGET_PAGE_BITS);
+    migration_dirty_pages = phys_ram_size >> TARGET_PAGE_BITS;
 }
 
 /* mem_read and mem_write are arrays of functions containing the
@@ -2951,8 +3365,8 @@ void cpu_physical_memory_rw(target_phys_addr_t addr, uint8_t *buf,
                     /* invalidate code */
                     tb_invalidate_phys_page_range(addr1, addr1 + l, 0);
                     /* set dirty bit */
-                    phys_ram_dirty[addr1 >> TARGET_PAGE_BITS] |=
-                        (0xff & ~CODE_DIRTY_FLAG);
+                    cpu_physical_memory_set_dirty_flags(addr1,
+                        (0xff & ~CODE_DIRTY_FLAG));
                 }
             }
         } else {
@@ -3150,15 +3564,15 @@ void cpu_physical_memory_unmap(void *buffer, target_phys_addr_t len,
             unsigned long addr1 = (uint8_t *)buffer - phys_ram_base;
             while (access_len) {
                 unsigned l;
-                l = TARGET_PAGE_SIZE;
+                l = TARGET_PAGE_SIZE - (addr1 & ~TARGET_PAGE_MASK);
                 if (l > access_len)
                     l = access_len;
                 if (!cpu_physical_memory_is_dirty(addr1)) {
                     /* invalidate code */
                     tb_invalidate_phys_page_range(addr1, addr1 + l, 0);
                     /* set dirty bit */
-                    phys_ram_dirty[addr1 >> TARGET_PAGE_BITS] |=
-                        (0xff & ~CODE_DIRTY_FLAG);
+                    cpu_physical_memory_set_dirty_flags(addr1,
+                        (0xff & ~CODE_DIRTY_FLAG));
                 }
                 addr1 += l;
                 access_len -= l;
@@ -3292,8 +3706,8 @@ void stl_phys_notdirty(target_phys_addr_t addr, uint32_t val)
                 /* invalidate code */
                 tb_invalidate_phys_page_range(addr1, addr1 + 4, 0);
                 /* set dirty bit */
-                phys_ram_dirty[addr1 >> TARGET_PAGE_BITS] |=
-                    (0xff & ~CODE_DIRTY_FLAG);
+                cpu_physical_memory_set_dirty_flags(addr1,
+                    (0xff & ~CODE_DIRTY_FLAG));
             }
         }
     }
@@ -3361,8 +3775,8 @@ void stl_phys(target_phys_addr_t addr, uint32_t val)
             /* invalidate code */
             tb_invalidate_phys_page_range(addr1, addr1 + 4, 0);
             /* set dirty bit */
-            phys_ram_dirty[addr1 >> TARGET_PAGE_BITS] |=
-                (0xff & ~CODE_DIRTY_FLAG);
+            cpu_physical_memory_set_dirty_flags(addr1,
+                (0xff & ~CODE_DIRTY_FLAG));
         }
     }
 }
@@ -3480,39 +3894,52 @@ void dump_exec_info(FILE *f,
 {
     int i, target_code_size, max_target_code_size;
     int direct_jmp_count, direct_jmp2_count, cross_page;
+    long code_size;
     TranslationBlock *tb;
+    CodeGenRegion *r;
+#if !defined(CONFIG_USER_ONLY)
+    static int64_t last_time, last_translate_count;
+    int64_t now;
+#endif
 
     target_code_size = 0;
     max_target_code_size = 0;
     cross_page = 0;
     direct_jmp_count = 0;
     direct_jmp2_count = 0;
-    for(i = 0; i < nb_tbs; i++) {
-        tb = &tbs[i];
-        target_code_size += tb->size;
-        if (tb->size > max_target_code_size)
-            max_target_code_size = tb->size;
-        if (tb->page_addr[1] != -1)
-            cross_page++;
-        if (tb->tb_next_offset[0] != 0xffff) {
-            direct_jmp_count++;
-            if (tb->tb_next_offset[1] != 0xffff) {
-                direct_jmp2_count++;
+    code_size = 0;
+    for(r = code_gen_regions; r < code_gen_regions + code_gen_nb_regions; r++) {
+        code_size += code_gen_region_end(r) - r->start;
+        for(i = 0; i < r->nb_tbs; i++) {
+            tb = &r->tbs[i];
+            target_code_size += tb->size;
+            if (tb->size > max_target_code_size)
+                max_target_code_size = tb->size;
+            if (tb->page_addr[1] != -1)
+                cross_page++;
+            if (tb->tb_next_offset[0] != 0xffff) {
+                direct_jmp_count++;
+                if (tb->tb_next_offset[1] != 0xffff) {
+                    direct_jmp2_count++;
+                }
             }
         }
     }
     /* XXX: avoid using doubles ? */
     cpu_fprintf(f, "Translation buffer state:\n");
     cpu_fprintf(f, "gen code size       %ld/%ld\n",
-                code_gen_ptr - code_gen_buffer, code_gen_buffer_max_size);
+                code_size, code_gen_nb_regions * code_gen_region_size);
+    cpu_fprintf(f, "code regions        %d/%d of %ld KB (current %d)\n",
+                code_gen_nb_regions, code_gen_max_regions,
+                code_gen_region_size / 1024, code_gen_cur_region);
     cpu_fprintf(f, "TB count            %d/%d\n", 
-                nb_tbs, code_gen_max_blocks);
+                nb_tbs, code_gen_nb_regions * code_gen_max_blocks);
     cpu_fprintf(f, "TB avg target size  %d max=%d bytes\n",
                 nb_tbs ? target_code_size / nb_tbs : 0,
                 max_target_code_size);
     cpu_fprintf(f, "TB avg host size    %d bytes (expansion ratio: %0.1f)\n",
-                nb_tbs ? (code_gen_ptr - code_gen_buffer) / nb_tbs : 0,
-                target_code_size ? (double) (code_gen_ptr - code_gen_buffer) / target_code_size : 0);
+                nb_tbs ? code_size / nb_tbs : 0,
+                target_code_size ? (double) code_size / target_code_size : 0);
     cpu_fprintf(f, "cross page TB count %d (%d%%)\n",
             cross_page,
             nb_tbs ? (cross_page * 100) / nb_tbs : 0);
@@ -3523,11 +3950,131 @@ void dump_exec_info(FILE *f,
                 nb_tbs ? (direct_jmp2_count * 100) / nb_tbs : 0);
     cpu_fprintf(f, "\nStatistics:\n");
     cpu_fprintf(f, "TB flush count      %d\n", tb_flush_count);
+    cpu_fprintf(f, "TB region evictions %d (%" PRId64 " TBs)\n",
+                tb_region_evict_count, tb_evict_count);
     cpu_fprintf(f, "TB invalidate count %d\n", tb_phys_invalidate_count);
+    cpu_fprintf(f, "TB translate count  %" PRId64 "\n", tb_translate_count);
+#if !defined(CONFIG_USER_ONLY)
+    /* the translation rate shows the retranslations caused by the
+       flushes and evictions */
+    now = qemu_get_clock(rt_clock);
+    if (last_time && now > last_time) {
+        cpu_fprintf(f, "TB translate rate   %" PRId64 "/s over the last %" PRId64
+                    " ms\n",
+                    (tb_translate_count - last_translate_count) * 1000 /
+                    (now - last_time), now - last_time);
+    }
+    last_time = now;
+    last_translate_count = tb_translate_count;
+#endif
     cpu_fprintf(f, "TLB flush count     %d\n", tlb_flush_count);
     tcg_dump_info(f, cpu_fprintf);
 }
 
+#define TB_PROFILE_TOP 16
+
+/* TBs are ranked by execution count with -tb-profile, otherwise by the
+   number of lookups that missed the jump cache. */
+static inline uint64_t tb_profile_key(TranslationBlock *tb)
+{
+    return tb_profile_enabled ? tb->exec_count : tb->lookup_count;
+}
+
+void dump_tb_profile(FILE *f,
+                     int (*cpu_fprintf)(FILE *f, const char *fmt, ...))
+{
+    TranslationBlock *tb, *top_tb[TB_PROFILE_TOP];
+    CodeGenRegion *r, *top_region[TB_PROFILE_TOP];
+    PageDesc *p, *top_page[TB_PROFILE_TOP];
+    target_ulong top_index[TB_PROFILE_TOP];
+    uint64_t key, exec_count;
+    uint8_t *tc_end;
+    int i, j, k, n_tb, n_page;
+
+#ifdef USE_VCPU_THREADS
+    tb_lock_acquire();
+#endif
+    n_tb = 0;
+    exec_count = 0;
+    for(r = code_gen_regions; r < code_gen_regions + code_gen_nb_regions; r++) {
+        for(i = 0; i < r->nb_tbs; i++) {
+            tb = &r->tbs[i];
+            exec_count += tb->exec_count;
+            key = tb_profile_key(tb);
+            if (key == 0 ||
+                (n_tb == TB_PROFILE_TOP &&
+                 key <= tb_profile_key(top_tb[n_tb - 1])))
+                continue;
+            if (n_tb < TB_PROFILE_TOP)
+                n_tb++;
+            for(j = n_tb - 1; j > 0 && tb_profile_key(top_tb[j - 1]) < key; j--) {
+                top_tb[j] = top_tb[j - 1];
+                top_region[j] = top_region[j - 1];
+            }
+            top_tb[j] = tb;
+            top_region[j] = r;
+        }
+    }
+
+    n_page = 0;
+    for(i = 0; i < L1_SIZE; i++) {
+        p = l1_map[i];
+        if (!p)
+            continue;
+        for(j = 0; j < L2_SIZE; j++, p++) {
+            if (p->tb_invalidate_count == 0 ||
+                (n_page == TB_PROFILE_TOP &&
+                 p->tb_invalidate_count <=
+                 top_page[n_page - 1]->tb_invalidate_count))
+                continue;
+            if (n_page < TB_PROFILE_TOP)
+                n_page++;
+            for(k = n_page - 1; k > 0 &&
+                    top_page[k - 1]->tb_invalidate_count <
+                    p->tb_invalidate_count; k--) {
+                top_page[k] = top_page[k - 1];
+                top_index[k] = top_index[k - 1];
+            }
+            top_page[k] = p;
+            top_index[k] = ((target_ulong)i << L2_BITS) | j;
+        }
+    }
+
+    cpu_fprintf(f, "TB profile since the last flush (%d TBs in the code buffer):\n",
+                nb_tbs);
+    if (tb_profile_enabled)
+        cpu_fprintf(f, "TB exec count       %" PRIu64 "\n", exec_count);
+    else
+        cpu_fprintf(f, "TB exec count       not counted, use -tb-profile\n");
+    cpu_fprintf(f, "TB slow lookups     %" PRIu64 "\n", tb_lookup_count);
+    cpu_fprintf(f, "TB flush count      %d\n", tb_flush_count);
+    cpu_fprintf(f, "TB invalidate count %d\n", tb_phys_invalidate_count);
+
+    cpu_fprintf(f, "\nHottest TBs:\n");
+    cpu_fprintf(f, "%-*s %20s %10s %6s %6s\n",
+                (int)sizeof(target_ulong) * 2, "guest PC",
+                "exec count", "lookups", "size", "host");
+    for(i = 0; i < n_tb; i++) {
+        tb = top_tb[i];
+        r = top_region[i];
+        j = tb - r->tbs;
+        tc_end = j + 1 < r->nb_tbs ? r->tbs[j + 1].tc_ptr : code_gen_region_end(r);
+        cpu_fprintf(f, TARGET_FMT_lx " %20" PRIu64 " %10u %6u %6ld\n",
+                    tb->pc, tb->exec_count, tb->lookup_count,
+                    tb->size, (long)(tc_end - tb->tc_ptr));
+    }
+
+    cpu_fprintf(f, "\nPages with the most TB invalidations:\n");
+    for(i = 0; i < n_page; i++) {
+        cpu_fprintf(f, TARGET_FMT_lx " %10u\n",
+                    top_index[i] << TARGET_PAGE_BITS,
+                    top_page[i]->tb_invalidate_count);
+    }
+#ifdef USE_VCPU_THREADS
+    tb_lock_release();
+#endif
+}
+
 #if !defined(CONFIG_USER_ONLY)
 
 #define MMUSUFFIX _cmmu
@@ -464,6 +464,8 @@ static void apic_startup(APICState *s, int vector_num)
     cpu_x86_load_seg_cache(env, R_CS, vector_num << 8, vector_num << 12,
                            0xffff, 0);
     env->halted = 0;
+    /* nothing else wakes the thread of a waiting VCPU */
+    qemu_cpu_kick(env);
 }
 
 static void apic_deliver(APICState *s, uint8_t dest, uint8_t dest_mode,
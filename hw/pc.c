@@ -101,7 +101,7 @@ void cpu_smm_update(CPUState *env)
 
 
 /* IRQ handling */
-int cpu_get_pic_interrupt(CPUState *env)
+static int do_get_pic_interrupt(CPUState *env)
 {
     int intno;
 
@@ -120,6 +120,18 @@ int cpu_get_pic_interrupt(CPUState *env)
     return intno;
 }
 
+/* called from the VCPU thread, the PIC and APIC state belong to the
+   I/O thread */
+int cpu_get_pic_interrupt(CPUState *env)
+{
+    int intno;
+
+    qemu_mutex_lock_iothread();
+    intno = do_get_pic_interrupt(env);
+    qemu_mutex_unlock_iothread();
+    return intno;
+}
+
 static void pic_irq_request(void *opaque, int irq, int level)
 {
     CPUState *env = first_cpu;
@@ -16,12 +16,18 @@
 #include "virtio-blk.h"
 #include "block_int.h"
 
+#define VIRTIO_BLK_QUEUE_SIZE 128
+
+/* preadv/pwritev cannot take more segments than that */
+#define VIRTIO_BLK_MAX_MERGE_IOV 1024
+
 typedef struct VirtIOBlock
 {
     VirtIODevice vdev;
     BlockDriverState *bs;
     VirtQueue *vq;
     void *rq;
+    int merge_max;
 } VirtIOBlock;
 
 static VirtIOBlock *to_virtio_blk(VirtIODevice *vdev)
@@ -36,19 +42,30 @@ typedef struct VirtIOBlockReq
     struct virtio_blk_inhdr *in;
     struct virtio_blk_outhdr *out;
     size_t size;
-    uint8_t *buffer;
+    QEMUIOVector qiov;
     struct VirtIOBlockReq *next;
+    struct VirtIOBlockReq *merge_next;
+    int seq;
 } VirtIOBlockReq;
 
+/* requests adjacent on disk, submitted as a single I/O */
+typedef struct VirtIOBlockMerge
+{
+    VirtIOBlock *dev;
+    VirtIOBlockReq *reqs; /* linked by merge_next */
+    QEMUIOVector qiov;    /* unused for a single request */
+} VirtIOBlockMerge;
+
+/* the caller notifies the guest */
 static void virtio_blk_req_complete(VirtIOBlockReq *req, int status)
 {
     VirtIOBlock *s = req->dev;
 
     req->in->status = status;
     virtqueue_push(s->vq, &req->elem, req->size + sizeof(*req->in));
-    virtio_notify(&s->vdev, s->vq);
 
-    qemu_free(req->buffer);
+    if (req->qiov.iov)
+        qemu_iovec_destroy(&req->qiov);
     qemu_free(req);
 }
 
@@ -74,31 +91,26 @@ static int virtio_blk_handle_write_error(VirtIOBlockReq *req, int error)
 
 static void virtio_blk_rw_complete(void *opaque, int ret)
 {
-    VirtIOBlockReq *req = opaque;
+    VirtIOBlockMerge *m = opaque;
+    VirtIOBlock *s = m->dev;
+    VirtIOBlockReq *req, *next;
 
-    /* Copy read data to the guest */
-    if (!ret && !(req->out->type & VIRTIO_BLK_T_OUT)) {
-        size_t offset = 0;
-        int i;
-
-        for (i = 0; i < req->elem.in_num - 1; i++) {
-            size_t len;
-
-            /* Be pretty defensive wrt malicious guests */
-            len = MIN(req->elem.in_sg[i].iov_len,
-                      req->size - offset);
+    for (req = m->reqs; req; req = next) {
+        next = req->merge_next;
+        req->merge_next = NULL;
 
-            memcpy(req->elem.in_sg[i].iov_base,
-                   req->buffer + offset,
-                   len);
-            offset += len;
+        if (ret && (req->out->type & VIRTIO_BLK_T_OUT)) {
+            if (virtio_blk_handle_write_error(req, -ret))
+                continue;
         }
-    } else if (ret && (req->out->type & VIRTIO_BLK_T_OUT)) {
-        if (virtio_blk_handle_write_error(req, -ret))
-            return;
+
+        virtio_blk_req_complete(req, VIRTIO_BLK_S_OK);
     }
+    virtio_notify(&s->vdev, s->vq);
 
-    virtio_blk_req_complete(req, VIRTIO_BLK_S_OK);
+    if (m->qiov.iov)
+        qemu_iovec_destroy(&m->qiov);
+    qemu_free(m);
 }
 
 static VirtIOBlockReq *virtio_blk_alloc_request(VirtIOBlock *s)
@@ -122,48 +134,128 @@ static VirtIOBlockReq *virtio_blk_get_request(VirtIOBlock *s)
     return req;
 }
 
-static int virtio_blk_handle_write(VirtIOBlockReq *req)
+static void virtio_blk_init_write(VirtIOBlockReq *req)
 {
-    if (!req->buffer) {
-        size_t offset = 0;
+    if (!req->qiov.iov) {
         int i;
 
+        /* The SG list is passed as is: the data goes straight from guest
+           memory to the image */
+        qemu_iovec_init(&req->qiov, req->elem.out_num - 1);
         for (i = 1; i < req->elem.out_num; i++)
-            req->size += req->elem.out_sg[i].iov_len;
+            qemu_iovec_add(&req->qiov, req->elem.out_sg[i].iov_base,
+                           req->elem.out_sg[i].iov_len);
+        req->size = req->qiov.size;
+    }
+}
 
-        req->buffer = qemu_memalign(512, req->size);
-        if (req->buffer == NULL) {
-            qemu_free(req);
-            return -1;
-        }
+static void virtio_blk_init_read(VirtIOBlockReq *req)
+{
+    int i;
 
-        /* We copy the data from the SG list to avoid splitting up the request.
-           This helps performance a lot until we can pass full sg lists as AIO
-           operations */
-        for (i = 1; i < req->elem.out_num; i++) {
-            size_t len;
-
-            len = MIN(req->elem.out_sg[i].iov_len,
-                    req->size - offset);
-            memcpy(req->buffer + offset,
-                    req->elem.out_sg[i].iov_base,
-                    len);
-            offset += len;
-        }
+    qemu_iovec_init(&req->qiov, req->elem.in_num - 1);
+    for (i = 0; i < req->elem.in_num - 1; i++)
+        qemu_iovec_add(&req->qiov, req->elem.in_sg[i].iov_base,
+                       req->elem.in_sg[i].iov_len);
+    req->size = req->qiov.size;
+}
+
+static void virtio_blk_submit(VirtIOBlock *s, VirtIOBlockReq **reqs, int num,
+                              int is_write)
+{
+    VirtIOBlockMerge *m = qemu_mallocz(sizeof(*m));
+    BlockDriverAIOCB *acb;
+    QEMUIOVector *qiov;
+    int i, j, niov;
+
+    m->dev = s;
+    m->reqs = reqs[0];
+    for (i = 1; i < num; i++)
+        reqs[i - 1]->merge_next = reqs[i];
+    reqs[num - 1]->merge_next = NULL;
+
+    if (num == 1) {
+        qiov = &reqs[0]->qiov;
+    } else {
+        niov = 0;
+        for (i = 0; i < num; i++)
+            niov += reqs[i]->qiov.niov;
+        qemu_iovec_init(&m->qiov, niov);
+        for (i = 0; i < num; i++)
+            for (j = 0; j < reqs[i]->qiov.niov; j++)
+                qemu_iovec_add(&m->qiov, reqs[i]->qiov.iov[j].iov_base,
+                               reqs[i]->qiov.iov[j].iov_len);
+        qiov = &m->qiov;
     }
 
-    bdrv_aio_write(req->dev->bs, req->out->sector, req->buffer, req->size / 512,
-            virtio_blk_rw_complete, req);
-    return 0;
+    if (is_write)
+        acb = bdrv_aio_writev(s->bs, reqs[0]->out->sector, qiov,
+                              qiov->size / 512, virtio_blk_rw_complete, m);
+    else
+        acb = bdrv_aio_readv(s->bs, reqs[0]->out->sector, qiov,
+                             qiov->size / 512, virtio_blk_rw_complete, m);
+    if (!acb)
+        virtio_blk_rw_complete(m, -EIO);
+}
+
+static int virtio_blk_req_cmp(const void *p1, const void *p2)
+{
+    const VirtIOBlockReq *r1 = *(VirtIOBlockReq **)p1;
+    const VirtIOBlockReq *r2 = *(VirtIOBlockReq **)p2;
+
+    if (r1->out->sector != r2->out->sector)
+        return r1->out->sector < r2->out->sector ? -1 : 1;
+    return r1->seq - r2->seq;
+}
+
+/*
+ * Sort the requests by sector and submit each run of adjacent requests
+ * as a single I/O of at most merge_max bytes.
+ */
+static void virtio_blk_submit_batch(VirtIOBlock *s, VirtIOBlockReq **reqs,
+                                    int num, int is_write)
+{
+    VirtIOBlockReq *prev;
+    size_t size;
+    int start, niov, i;
+
+    if (num == 0)
+        return;
+
+    qsort(reqs, num, sizeof(*reqs), virtio_blk_req_cmp);
+
+    start = 0;
+    size = reqs[0]->size;
+    niov = reqs[0]->qiov.niov;
+    for (i = 1; i < num; i++) {
+        prev = reqs[i - 1];
+        if (prev->size % 512 == 0 &&
+            prev->out->sector + prev->size / 512 == reqs[i]->out->sector &&
+            size + reqs[i]->size <= s->merge_max &&
+            niov + reqs[i]->qiov.niov <= VIRTIO_BLK_MAX_MERGE_IOV) {
+            size += reqs[i]->size;
+            niov += reqs[i]->qiov.niov;
+            continue;
+        }
+        virtio_blk_submit(s, &reqs[start], i - start, is_write);
+        start = i;
+        size = reqs[i]->size;
+        niov = reqs[i]->qiov.niov;
+    }
+    virtio_blk_submit(s, &reqs[start], num - start, is_write);
 }
 
 static void virtio_blk_handle_output(VirtIODevice *vdev, VirtQueue *vq)
 {
     VirtIOBlock *s = to_virtio_blk(vdev);
     VirtIOBlockReq *req;
+    VirtIOBlockReq *reads[VIRTIO_BLK_QUEUE_SIZE];
+    VirtIOBlockReq *writes[VIRTIO_BLK_QUEUE_SIZE];
+    int nb_reads = 0, nb_writes = 0, notify = 0;
 
+    /* collect all the requests of this notification before submitting
+       them, so that adjacent ones can be merged */
     while ((req = virtio_blk_get_request(s))) {
-        int i;
 
         if (req->elem.out_num < 1 || req->elem.in_num < 1) {
             fprintf(stderr, "virtio-blk missing headers\n");
@@ -184,28 +276,33 @@ static void virtio_blk_handle_output(VirtIODevice *vdev, VirtQueue *vq)
 
             req->in->status = VIRTIO_BLK_S_UNSUPP;
             virtqueue_push(vq, &req->elem, len);
-            virtio_notify(vdev, vq);
+            notify = 1;
             qemu_free(req);
         } else if (req->out->type & VIRTIO_BLK_T_OUT) {
-            if (virtio_blk_handle_write(req) < 0)
-                break;
+            virtio_blk_init_write(req);
+            req->seq = nb_writes;
+            writes[nb_writes++] = req;
         } else {
-            for (i = 0; i < req->elem.in_num - 1; i++)
-                req->size += req->elem.in_sg[i].iov_len;
-
-            req->buffer = qemu_memalign(512, req->size);
-            if (req->buffer == NULL) {
-                qemu_free(req);
-                break;
-            }
-
-            bdrv_aio_read(s->bs, req->out->sector,
-                          req->buffer,
-                          req->size / 512,
-                          virtio_blk_rw_complete,
-                          req);
+            virtio_blk_init_read(req);
+            req->seq = nb_reads;
+            reads[nb_reads++] = req;
+        }
+
+        /* the ring cannot hold more, but do not rely on the guest */
+        if (nb_reads == VIRTIO_BLK_QUEUE_SIZE) {
+            virtio_blk_submit_batch(s, reads, nb_reads, 0);
+            nb_reads = 0;
+        }
+        if (nb_writes == VIRTIO_BLK_QUEUE_SIZE) {
+            virtio_blk_submit_batch(s, writes, nb_writes, 1);
+            nb_writes = 0;
         }
     }
+
+    virtio_blk_submit_batch(s, reads, nb_reads, 0);
+    virtio_blk_submit_batch(s, writes, nb_writes, 1);
+    if (notify)
+        virtio_notify(vdev, vq);
     /*
      * FIXME: Want to check for completions before returning to guest mode,
      * so cached reads and writes are reported as quickly as possible. But
@@ -216,7 +313,9 @@ static void virtio_blk_handle_output(VirtIODevice *vdev, VirtQueue *vq)
 static void virtio_blk_dma_restart_cb(void *opaque, int running, int reason)
 {
     VirtIOBlock *s = opaque;
-    VirtIOBlockReq *req = s->rq;
+    VirtIOBlockReq *req = s->rq, *next;
+    VirtIOBlockReq *writes[VIRTIO_BLK_QUEUE_SIZE];
+    int nb_writes = 0;
 
     if (!running)
         return;
@@ -224,9 +323,17 @@ static void virtio_blk_dma_restart_cb(void *opaque, int running, int reason)
     s->rq = NULL;
 
     while (req) {
-        virtio_blk_handle_write(req);
-        req = req->next;
+        next = req->next;
+        virtio_blk_init_write(req);
+        req->seq = nb_writes;
+        writes[nb_writes++] = req;
+        if (nb_writes == VIRTIO_BLK_QUEUE_SIZE) {
+            virtio_blk_submit_batch(s, writes, nb_writes, 1);
+            nb_writes = 0;
+        }
+        req = next;
     }
+    virtio_blk_submit_batch(s, writes, nb_writes, 1);
 }
 
 static void virtio_blk_reset(VirtIODevice *vdev)
@@ -314,11 +421,13 @@ void *virtio_blk_init(PCIBus *bus, BlockDriverState *bs)
     s->vdev.reset = virtio_blk_reset;
     s->bs = bs;
     s->rq = NULL;
+    s->merge_max = drive_get_merge_max(bs);
     bs->private = &s->vdev.pci_dev;
     bdrv_guess_geometry(s->bs, &cylinders, &heads, &secs);
     bdrv_set_geometry_hint(s->bs, cylinders, heads, secs);
 
-    s->vq = virtio_add_queue(&s->vdev, 128, virtio_blk_handle_output);
+    s->vq = virtio_add_queue(&s->vdev, VIRTIO_BLK_QUEUE_SIZE,
+                             virtio_blk_handle_output);
 
     qemu_add_vm_change_state_handler(virtio_blk_dma_restart_cb, s);
     register_savevm("virtio-blk", virtio_blk_id++, 2,
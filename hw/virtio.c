@@ -15,8 +15,8 @@
 
 #include "virtio.h"
 #include "sysemu.h"
-
-//#define VIRTIO_ZERO_COPY
+#include "console.h"
+#include "qemu-timer.h"
 
 /* from Linux's linux/virtio_pci.h */
 
@@ -93,6 +93,15 @@ typedef struct VRingUsed
     VRingUsedElem ring[0];
 } VRingUsed;
 
+/* number of guest pages whose host address each queue remembers */
+#define VIRTQUEUE_TLB_SIZE 64
+
+typedef struct VirtQueueTLBEntry
+{
+    target_phys_addr_t page;
+    uint8_t *host;
+} VirtQueueTLBEntry;
+
 typedef struct VRing
 {
     unsigned int num;
@@ -108,47 +117,82 @@ struct VirtQueue
     uint16_t last_avail_idx;
     int inuse;
     void (*handle_output)(VirtIODevice *vdev, VirtQueue *vq);
+    VirtIODevice *vdev;
+
+    /* host address of the ring, NULL if it is not in contiguous RAM.  The
+       ring and the tlb are looked up again when map_generation goes stale */
+    uint8_t *ring;
+    unsigned int map_generation;
+    VirtQueueTLBEntry tlb[VIRTQUEUE_TLB_SIZE];
+
+    /* notification coalescing: the guest is interrupted after max_pending
+       notifications (0 for no limit) or max_delay us, whichever comes
+       first.  A max_delay of 0 disables coalescing. */
+    int max_pending;
+    int max_delay;
+    int pending;
+    QEMUTimer *notify_timer;
+
+    /* statistics */
+    uint64_t notify_calls;
+    uint64_t notify_sent;
 };
 
 #define VIRTIO_PCI_QUEUE_MAX        16
 
 /* virt queue functions */
-#ifdef VIRTIO_ZERO_COPY
-static void *virtio_map_gpa(target_phys_addr_t addr, size_t size)
+
+/* host address of a guest physical range, NULL if it is not contiguous RAM */
+static uint8_t *virtio_map_ram(target_phys_addr_t addr, target_phys_addr_t size)
 {
-    ram_addr_t off;
+    ram_addr_t off, off1;
     target_phys_addr_t addr1;
 
     off = cpu_get_physical_page_desc(addr);
-    if ((off & ~TARGET_PAGE_MASK) != IO_MEM_RAM) {
-        fprintf(stderr, "virtio DMA to IO ram\n");
-        exit(1);
-    }
+    if ((off & ~TARGET_PAGE_MASK) != IO_MEM_RAM)
+        return NULL;
 
     off = (off & TARGET_PAGE_MASK) | (addr & ~TARGET_PAGE_MASK);
 
-    for (addr1 = addr + TARGET_PAGE_SIZE;
-         addr1 < TARGET_PAGE_ALIGN(addr + size);
-         addr1 += TARGET_PAGE_SIZE) {
-        ram_addr_t off1;
-
+    for (addr1 = (addr & TARGET_PAGE_MASK) + TARGET_PAGE_SIZE;
+         addr1 < addr + size; addr1 += TARGET_PAGE_SIZE) {
         off1 = cpu_get_physical_page_desc(addr1);
-        if ((off1 & ~TARGET_PAGE_MASK) != IO_MEM_RAM) {
-            fprintf(stderr, "virtio DMA to IO ram\n");
-            exit(1);
-        }
-
-        off1 = (off1 & TARGET_PAGE_MASK) | (addr1 & ~TARGET_PAGE_MASK);
-
-        if (off1 != (off + (addr1 - addr))) {
-            fprintf(stderr, "discontigous virtio memory\n");
-            exit(1);
-        }
+        if ((off1 & ~TARGET_PAGE_MASK) != IO_MEM_RAM ||
+            (off1 & TARGET_PAGE_MASK) != off + (addr1 - addr))
+            return NULL;
     }
 
     return phys_ram_base + off;
 }
-#endif
+
+static int virtio_is_ram(void *ptr)
+{
+    return (uint8_t *)ptr >= phys_ram_base &&
+           (uint8_t *)ptr < phys_ram_base + phys_ram_size;
+}
+
+/* mark guest RAM written by the device, invalidating translated code */
+static void virtio_ram_written(void *ptr, target_phys_addr_t len)
+{
+    cpu_physical_memory_unmap(ptr, len, 1, len);
+}
+
+static void virtqueue_map_ring(VirtQueue *vq)
+{
+    target_phys_addr_t size;
+    int i;
+
+    vq->map_generation = phys_map_generation;
+    for (i = 0; i < VIRTQUEUE_TLB_SIZE; i++)
+        vq->tlb[i].page = -1;
+
+    vq->ring = NULL;
+    if (vq->vring.desc) {
+        size = vq->vring.used + offsetof(VRingUsed, ring[vq->vring.num]) -
+               vq->vring.desc;
+        vq->ring = virtio_map_ram(vq->vring.desc, size);
+    }
+}
 
 static void virtqueue_init(VirtQueue *vq, target_phys_addr_t pa)
 {
@@ -157,97 +201,196 @@ static void virtqueue_init(VirtQueue *vq, target_phys_addr_t pa)
     vq->vring.used = vring_align(vq->vring.avail +
                                  offsetof(VRingAvail, ring[vq->vring.num]),
                                  VIRTIO_PCI_VRING_ALIGN);
+    virtqueue_map_ring(vq);
+}
+
+/* host address of a ring field, NULL to use the physical memory
+   accessors */
+static inline uint8_t *vring_map(VirtQueue *vq, target_phys_addr_t pa)
+{
+    if (unlikely(vq->map_generation != phys_map_generation))
+        virtqueue_map_ring(vq);
+    return vq->ring ? vq->ring + (pa - vq->vring.desc) : NULL;
+}
+
+/* host address of a guest buffer, NULL if it is not contiguous RAM */
+static uint8_t *virtqueue_map_buf(VirtQueue *vq, target_phys_addr_t addr,
+                                  target_phys_addr_t len)
+{
+    VirtQueueTLBEntry *entry;
+    target_phys_addr_t page;
+    ram_addr_t pd;
+    uint8_t *ret = NULL, *host;
+
+    if (len == 0)
+        return NULL;
+    if (unlikely(vq->map_generation != phys_map_generation))
+        virtqueue_map_ring(vq);
+
+    for (page = addr & TARGET_PAGE_MASK; page < addr + len;
+         page += TARGET_PAGE_SIZE) {
+        entry = &vq->tlb[(page >> TARGET_PAGE_BITS) % VIRTQUEUE_TLB_SIZE];
+        if (entry->page != page) {
+            pd = cpu_get_physical_page_desc(page);
+            if ((pd & ~TARGET_PAGE_MASK) != IO_MEM_RAM)
+                return NULL;
+            entry->page = page;
+            entry->host = phys_ram_base + (pd & TARGET_PAGE_MASK);
+        }
+
+        if (!ret) {
+            ret = entry->host + (addr & ~TARGET_PAGE_MASK);
+        } else {
+            host = entry->host;
+            if (host != ret + (page - addr))
+                return NULL;
+        }
+    }
+
+    return ret;
 }
 
 static inline uint64_t vring_desc_addr(VirtQueue *vq, int i)
 {
     target_phys_addr_t pa;
+    uint8_t *ptr;
     pa = vq->vring.desc + sizeof(VRingDesc) * i + offsetof(VRingDesc, addr);
-    return ldq_phys(pa);
+    ptr = vring_map(vq, pa);
+    return ptr ? ldq_p(ptr) : ldq_phys(pa);
 }
 
 static inline uint32_t vring_desc_len(VirtQueue *vq, int i)
 {
     target_phys_addr_t pa;
+    uint8_t *ptr;
     pa = vq->vring.desc + sizeof(VRingDesc) * i + offsetof(VRingDesc, len);
-    return ldl_phys(pa);
+    ptr = vring_map(vq, pa);
+    return ptr ? ldl_p(ptr) : ldl_phys(pa);
 }
 
 static inline uint16_t vring_desc_flags(VirtQueue *vq, int i)
 {
     target_phys_addr_t pa;
+    uint8_t *ptr;
     pa = vq->vring.desc + sizeof(VRingDesc) * i + offsetof(VRingDesc, flags);
-    return lduw_phys(pa);
+    ptr = vring_map(vq, pa);
+    return ptr ? lduw_p(ptr) : lduw_phys(pa);
 }
 
 static inline uint16_t vring_desc_next(VirtQueue *vq, int i)
 {
     target_phys_addr_t pa;
+    uint8_t *ptr;
     pa = vq->vring.desc + sizeof(VRingDesc) * i + offsetof(VRingDesc, next);
-    return lduw_phys(pa);
+    ptr = vring_map(vq, pa);
+    return ptr ? lduw_p(ptr) : lduw_phys(pa);
 }
 
 static inline uint16_t vring_avail_flags(VirtQueue *vq)
 {
     target_phys_addr_t pa;
+    uint8_t *ptr;
     pa = vq->vring.avail + offsetof(VRingAvail, flags);
-    return lduw_phys(pa);
+    ptr = vring_map(vq, pa);
+    return ptr ? lduw_p(ptr) : lduw_phys(pa);
 }
 
 static inline uint16_t vring_avail_idx(VirtQueue *vq)
 {
     target_phys_addr_t pa;
+    uint8_t *ptr;
     pa = vq->vring.avail + offsetof(VRingAvail, idx);
-    return lduw_phys(pa);
+    ptr = vring_map(vq, pa);
+    return ptr ? lduw_p(ptr) : lduw_phys(pa);
 }
 
 static inline uint16_t vring_avail_ring(VirtQueue *vq, int i)
 {
     target_phys_addr_t pa;
+    uint8_t *ptr;
     pa = vq->vring.avail + offsetof(VRingAvail, ring[i]);
-    return lduw_phys(pa);
+    ptr = vring_map(vq, pa);
+    return ptr ? lduw_p(ptr) : lduw_phys(pa);
 }
 
 static inline void vring_used_ring_id(VirtQueue *vq, int i, uint32_t val)
 {
     target_phys_addr_t pa;
+    uint8_t *ptr;
     pa = vq->vring.used + offsetof(VRingUsed, ring[i].id);
-    stl_phys(pa, val);
+    ptr = vring_map(vq, pa);
+    if (ptr) {
+        stl_p(ptr, val);
+        virtio_ram_written(ptr, 4);
+    } else {
+        stl_phys(pa, val);
+    }
 }
 
 static inline void vring_used_ring_len(VirtQueue *vq, int i, uint32_t val)
 {
     target_phys_addr_t pa;
+    uint8_t *ptr;
     pa = vq->vring.used + offsetof(VRingUsed, ring[i].len);
-    stl_phys(pa, val);
+    ptr = vring_map(vq, pa);
+    if (ptr) {
+        stl_p(ptr, val);
+        virtio_ram_written(ptr, 4);
+    } else {
+        stl_phys(pa, val);
+    }
 }
 
 static uint16_t vring_used_idx(VirtQueue *vq)
 {
     target_phys_addr_t pa;
+    uint8_t *ptr;
     pa = vq->vring.used + offsetof(VRingUsed, idx);
-    return lduw_phys(pa);
+    ptr = vring_map(vq, pa);
+    return ptr ? lduw_p(ptr) : lduw_phys(pa);
+}
+
+static inline void vring_used_set(VirtQueue *vq, target_phys_addr_t pa,
+                                  uint16_t val)
+{
+    uint8_t *ptr = vring_map(vq, pa);
+
+    if (ptr) {
+        stw_p(ptr, val);
+        virtio_ram_written(ptr, 2);
+    } else {
+        stw_phys(pa, val);
+    }
 }
 
 static inline void vring_used_idx_increment(VirtQueue *vq, uint16_t val)
 {
     target_phys_addr_t pa;
     pa = vq->vring.used + offsetof(VRingUsed, idx);
-    stw_phys(pa, vring_used_idx(vq) + val);
+    vring_used_set(vq, pa, vring_used_idx(vq) + val);
+}
+
+static inline uint16_t vring_used_flags(VirtQueue *vq)
+{
+    target_phys_addr_t pa;
+    uint8_t *ptr;
+    pa = vq->vring.used + offsetof(VRingUsed, flags);
+    ptr = vring_map(vq, pa);
+    return ptr ? lduw_p(ptr) : lduw_phys(pa);
 }
 
 static inline void vring_used_flags_set_bit(VirtQueue *vq, int mask)
 {
     target_phys_addr_t pa;
     pa = vq->vring.used + offsetof(VRingUsed, flags);
-    stw_phys(pa, lduw_phys(pa) | mask);
+    vring_used_set(vq, pa, vring_used_flags(vq) | mask);
 }
 
 static inline void vring_used_flags_unset_bit(VirtQueue *vq, int mask)
 {
     target_phys_addr_t pa;
     pa = vq->vring.used + offsetof(VRingUsed, flags);
-    stw_phys(pa, lduw_phys(pa) & ~mask);
+    vring_used_set(vq, pa, vring_used_flags(vq) & ~mask);
 }
 
 void virtio_queue_set_notification(VirtQueue *vq, int enable)
@@ -274,32 +417,26 @@ void virtqueue_fill(VirtQueue *vq, const VirtQueueElement *elem,
     unsigned int offset;
     int i;
 
-#ifndef VIRTIO_ZERO_COPY
     for (i = 0; i < elem->out_num; i++)
-        qemu_free(elem->out_sg[i].iov_base);
-#endif
+        if (!virtio_is_ram(elem->out_sg[i].iov_base))
+            qemu_free(elem->out_sg[i].iov_base);
 
     offset = 0;
     for (i = 0; i < elem->in_num; i++) {
         size_t size = MIN(len - offset, elem->in_sg[i].iov_len);
 
-#ifdef VIRTIO_ZERO_COPY
-        if (size) {
-            ram_addr_t addr = (uint8_t *)elem->in_sg[i].iov_base - phys_ram_base;
-            ram_addr_t off;
+        if (virtio_is_ram(elem->in_sg[i].iov_base)) {
+            if (size)
+                virtio_ram_written(elem->in_sg[i].iov_base, size);
+        } else {
+            if (size)
+                cpu_physical_memory_write(elem->in_addr[i],
+                                          elem->in_sg[i].iov_base,
+                                          size);
 
-            for (off = 0; off < size; off += TARGET_PAGE_SIZE)
-                cpu_physical_memory_set_dirty(addr + off);
+            qemu_free(elem->in_sg[i].iov_base);
         }
-#else
-        if (size)
-            cpu_physical_memory_write(elem->in_addr[i],
-                                      elem->in_sg[i].iov_base,
-                                      size);
-
-        qemu_free(elem->in_sg[i].iov_base);
-#endif
-        
+
         offset += size;
     }
 
@@ -434,25 +571,26 @@ int virtqueue_pop(VirtQueue *vq, VirtQueueElement *elem)
         /* Grab the first descriptor, and check it's OK. */
         sg->iov_len = vring_desc_len(vq, i);
 
-#ifdef VIRTIO_ZERO_COPY
-        sg->iov_base = virtio_map_gpa(vring_desc_addr(vq, i), sg->iov_len);
-#else
-        /* cap individual scatter element size to prevent unbounded allocations
-           of memory from the guest.  Practically speaking, no virtio driver
-           will ever pass more than a page in each element.  We set the cap to
-           be 2MB in case for some reason a large page makes it way into the
-           sg list.  When we implement a zero copy API, this limitation will
-           disappear */
-        if (sg->iov_len > (2 << 20))
-            sg->iov_len = 2 << 20;
-
-        sg->iov_base = qemu_malloc(sg->iov_len);
-        if (!(vring_desc_flags(vq, i) & VRING_DESC_F_WRITE)) {
-            cpu_physical_memory_read(vring_desc_addr(vq, i),
-                                     sg->iov_base,
-                                     sg->iov_len);
+        /* buffers in guest RAM are used in place; anything else (MMIO,
+           or a range that is not contiguous on the host) is bounced */
+        sg->iov_base = virtqueue_map_buf(vq, vring_desc_addr(vq, i),
+                                         sg->iov_len);
+        if (sg->iov_base == NULL) {
+            /* cap individual scatter element size to prevent unbounded
+               allocations of memory from the guest.  Practically speaking,
+               no virtio driver will ever pass more than a page in each
+               element.  We set the cap to be 2MB in case for some reason a
+               large page makes it way into the sg list. */
+            if (sg->iov_len > (2 << 20))
+                sg->iov_len = 2 << 20;
+
+            sg->iov_base = qemu_malloc(sg->iov_len);
+            if (!(vring_desc_flags(vq, i) & VRING_DESC_F_WRITE)) {
+                cpu_physical_memory_read(vring_desc_addr(vq, i),
+                                         sg->iov_base,
+                                         sg->iov_len);
+            }
         }
-#endif
         if (sg->iov_base == NULL) {
             fprintf(stderr, "Invalid mapping\n");
             exit(1);
@@ -474,6 +612,8 @@ int virtqueue_pop(VirtQueue *vq, VirtQueueElement *elem)
 
 /* virtio device */
 
+static VirtIODevice *first_vdev;
+
 static VirtIODevice *to_virtio_device(PCIDevice *pci_dev)
 {
     return (VirtIODevice *)pci_dev;
@@ -484,6 +624,31 @@ static void virtio_update_irq(VirtIODevice *vdev)
     qemu_set_irq(vdev->pci_dev.irq[0], vdev->isr & 1);
 }
 
+static void virtio_queue_notify_now(VirtQueue *vq)
+{
+    VirtIODevice *vdev = vq->vdev;
+
+    vq->pending = 0;
+    qemu_del_timer(vq->notify_timer);
+
+    /* Always notify when queue is empty */
+    if ((vq->inuse || vring_avail_idx(vq) != vq->last_avail_idx) &&
+        (vring_avail_flags(vq) & VRING_AVAIL_F_NO_INTERRUPT))
+        return;
+
+    vq->notify_sent++;
+    vdev->isr |= 0x01;
+    virtio_update_irq(vdev);
+}
+
+static void virtio_queue_notify_timer(void *opaque)
+{
+    VirtQueue *vq = opaque;
+
+    if (vq->pending)
+        virtio_queue_notify_now(vq);
+}
+
 static void virtio_reset(void *opaque)
 {
     VirtIODevice *vdev = opaque;
@@ -504,6 +669,10 @@ static void virtio_reset(void *opaque)
         vdev->vq[i].vring.used = 0;
         vdev->vq[i].last_avail_idx = 0;
         vdev->vq[i].pfn = 0;
+        virtqueue_map_ring(&vdev->vq[i]);
+        vdev->vq[i].pending = 0;
+        if (vdev->vq[i].notify_timer)
+            qemu_del_timer(vdev->vq[i].notify_timer);
     }
 }
 
@@ -720,19 +889,38 @@ VirtQueue *virtio_add_queue(VirtIODevice *vdev, int queue_size,
 
     vdev->vq[i].vring.num = queue_size;
     vdev->vq[i].handle_output = handle_output;
+    vdev->vq[i].vdev = vdev;
+    vdev->vq[i].max_pending = virtio_coalesce_max_pending;
+    vdev->vq[i].max_delay = virtio_coalesce_max_delay;
+    vdev->vq[i].notify_timer = qemu_new_timer(vm_clock,
+                                              virtio_queue_notify_timer,
+                                              &vdev->vq[i]);
 
     return &vdev->vq[i];
 }
 
+void virtio_queue_set_coalescing(VirtQueue *vq, int max_pending,
+                                 int max_delay)
+{
+    vq->max_pending = max_pending;
+    vq->max_delay = max_delay;
+    if (vq->pending)
+        virtio_queue_notify_now(vq);
+}
+
 void virtio_notify(VirtIODevice *vdev, VirtQueue *vq)
 {
-    /* Always notify when queue is empty */
-    if ((vq->inuse || vring_avail_idx(vq) != vq->last_avail_idx) &&
-        (vring_avail_flags(vq) & VRING_AVAIL_F_NO_INTERRUPT))
-        return;
+    vq->notify_calls++;
+
+    if (vq->max_delay) {
+        if (vq->pending++ == 0)
+            qemu_mod_timer(vq->notify_timer, qemu_get_clock(vm_clock) +
+                           (int64_t)vq->max_delay * 1000);
+        if (vq->max_pending == 0 || vq->pending < vq->max_pending)
+            return;
+    }
 
-    vdev->isr |= 0x01;
-    virtio_update_irq(vdev);
+    virtio_queue_notify_now(vq);
 }
 
 void virtio_notify_config(VirtIODevice *vdev)
@@ -748,6 +936,12 @@ void virtio_save(VirtIODevice *vdev, QEMUFile *f)
 {
     int i;
 
+    /* the timers are not migrated: deliver the delayed notifications */
+    for (i = 0; i < VIRTIO_PCI_QUEUE_MAX; i++) {
+        if (vdev->vq[i].pending)
+            virtio_queue_notify_now(&vdev->vq[i]);
+    }
+
     pci_device_save(&vdev->pci_dev, f);
 
     qemu_put_be32s(f, &vdev->addr);
@@ -807,13 +1001,81 @@ void virtio_load(VirtIODevice *vdev, QEMUFile *f)
     virtio_update_irq(vdev);
 }
 
+static VirtIODevice *virtio_find_device(int index)
+{
+    VirtIODevice *vdev;
+
+    for (vdev = first_vdev; vdev && index > 0; vdev = vdev->next)
+        index--;
+    return vdev;
+}
+
+void virtio_info(void)
+{
+    VirtIODevice *vdev;
+    VirtQueue *vq;
+    int index, i;
+
+    for (vdev = first_vdev, index = 0; vdev; vdev = vdev->next, index++) {
+        for (i = 0; i < VIRTIO_PCI_QUEUE_MAX; i++) {
+            vq = &vdev->vq[i];
+            if (vq->vring.num == 0)
+                break;
+            term_printf("%d: %s queue %d: notifications sent=%" PRIu64
+                        " suppressed=%" PRIu64 " coalescing pending=%d"
+                        " delay=%dus\n", index, vdev->name, i,
+                        vq->notify_sent, vq->notify_calls - vq->notify_sent,
+                        vq->max_pending, vq->max_delay);
+        }
+    }
+}
+
+void do_virtio_coalesce(int index, int queue, int max_pending,
+                        int max_delay)
+{
+    VirtIODevice *vdev = virtio_find_device(index);
+
+    if (!vdev || queue < 0 || queue >= VIRTIO_PCI_QUEUE_MAX ||
+        vdev->vq[queue].vring.num == 0) {
+        term_printf("invalid virtio queue\n");
+        return;
+    }
+    if (max_pending < 0 || max_delay < 0) {
+        term_printf("invalid coalescing parameters\n");
+        return;
+    }
+    virtio_queue_set_coalescing(&vdev->vq[queue], max_pending, max_delay);
+}
+
+static int virtio_exit_pci(PCIDevice *pci_dev)
+{
+    VirtIODevice *vdev = to_virtio_device(pci_dev);
+    VirtIODevice **pvdev;
+    int i;
+
+    for (pvdev = &first_vdev; *pvdev; pvdev = &(*pvdev)->next) {
+        if (*pvdev == vdev) {
+            *pvdev = vdev->next;
+            break;
+        }
+    }
+
+    for (i = 0; i < VIRTIO_PCI_QUEUE_MAX; i++) {
+        if (vdev->vq[i].notify_timer) {
+            qemu_del_timer(vdev->vq[i].notify_timer);
+            qemu_free_timer(vdev->vq[i].notify_timer);
+        }
+    }
+    return 0;
+}
+
 VirtIODevice *virtio_init_pci(PCIBus *bus, const char *name,
                               uint16_t vendor, uint16_t device,
                               uint16_t subvendor, uint16_t subdevice,
                               uint16_t class_code, uint8_t pif,
                               size_t config_size, size_t struct_size)
 {
-    VirtIODevice *vdev;
+    VirtIODevice *vdev, **pvdev;
     PCIDevice *pci_dev;
     uint8_t *config;
     uint32_t size;
@@ -861,6 +1123,12 @@ VirtIODevice *virtio_init_pci(PCIBus *bus, const char *name,
     pci_register_io_region(pci_dev, 0, size, PCI_ADDRESS_SPACE_IO,
                            virtio_map);
     qemu_register_reset(virtio_reset, vdev);
+    pci_dev->unregister = virtio_exit_pci;
+
+    /* keep the devices in creation order for the monitor */
+    for (pvdev = &first_vdev; *pvdev; pvdev = &(*pvdev)->next);
+    vdev->next = NULL;
+    *pvdev = vdev;
 
     return vdev;
 }
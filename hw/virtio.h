@@ -87,6 +87,7 @@ struct VirtIODevice
     void (*set_config)(VirtIODevice *vdev, const uint8_t *config);
     void (*reset)(VirtIODevice *vdev);
     VirtQueue *vq;
+    VirtIODevice *next;
 };
 
 VirtIODevice *virtio_init_pci(PCIBus *bus, const char *name,
@@ -110,6 +111,9 @@ int virtqueue_avail_bytes(VirtQueue *vq, int in_bytes, int out_bytes);
 
 void virtio_notify(VirtIODevice *vdev, VirtQueue *vq);
 
+void virtio_queue_set_coalescing(VirtQueue *vq, int max_pending,
+                                 int max_delay);
+
 void virtio_save(VirtIODevice *vdev, QEMUFile *f);
 
 void virtio_load(VirtIODevice *vdev, QEMUFile *f);
@@ -122,4 +126,9 @@ int virtio_queue_ready(VirtQueue *vq);
 
 int virtio_queue_empty(VirtQueue *vq);
 
+void virtio_info(void);
+
+void do_virtio_coalesce(int index, int queue, int max_pending,
+                        int max_delay);
+
 #endif
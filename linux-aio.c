@@ -0,0 +1,271 @@
+/*
+ * QEMU Linux native AIO support
+ *
+ * This work is licensed under the terms of the GNU GPL, version 2.  See
+ * the COPYING file in the top-level directory.
+ *
+ */
+
+#include "qemu-common.h"
+#include "qemu-aio.h"
+
+#include <sys/syscall.h>
+#include <sys/eventfd.h>
+
+#include "linux-aio.h"
+
+/*
+ * Requests are queued and handed to the kernel by a bottom half, so that
+ * all the requests a device submits before returning to the main loop go
+ * in a single io_submit().  The kernel signals completions on an eventfd
+ * and they are all reaped at once by io_getevents().
+ */
+
+#define MAX_EVENTS 128
+
+/* qemu_laiocb states */
+#define LAIO_DONE     0
+#define LAIO_PENDING  1 /* waiting for io_submit() */
+#define LAIO_INFLIGHT 2
+
+struct qemu_laio_state {
+    aio_context_t ctx;
+    int efd;
+    int count;      /* requests owned by the kernel */
+    int nb_pending; /* requests waiting for io_submit() */
+    TAILQ_HEAD(, qemu_laiocb) pending;
+    QEMUBH *bh;
+};
+
+static int laio_io_setup(unsigned int nr_events, aio_context_t *ctx)
+{
+    return syscall(__NR_io_setup, nr_events, ctx);
+}
+
+static int laio_io_submit(aio_context_t ctx, long nr, struct iocb **iocbs)
+{
+    return syscall(__NR_io_submit, ctx, nr, iocbs);
+}
+
+static int laio_io_getevents(aio_context_t ctx, long min_nr, long nr,
+                             struct io_event *events, struct timespec *timeout)
+{
+    return syscall(__NR_io_getevents, ctx, min_nr, nr, events, timeout);
+}
+
+static int laio_io_cancel(aio_context_t ctx, struct iocb *iocb,
+                          struct io_event *result)
+{
+    return syscall(__NR_io_cancel, ctx, iocb, result);
+}
+
+static void laio_complete(struct qemu_laio_state *s,
+                          struct qemu_laiocb *laiocb, ssize_t ret)
+{
+    if (ret >= 0)
+        ret = (ret == laiocb->nbytes) ? 0 : -EINVAL;
+    laiocb->state = LAIO_DONE;
+    /* a NULL callback means the request was canceled */
+    if (laiocb->complete)
+        laiocb->complete(laiocb, ret);
+}
+
+/* reap the completed requests, waiting for at least min_nr of them */
+static void laio_process_events(struct qemu_laio_state *s, int min_nr)
+{
+    struct io_event events[MAX_EVENTS];
+    struct timespec ts = { 0, 0 };
+    struct qemu_laiocb *laiocb;
+    int nevents, i;
+
+    for (;;) {
+        nevents = laio_io_getevents(s->ctx, min_nr, MAX_EVENTS, events,
+                                    min_nr ? NULL : &ts);
+        if (nevents == -1 && errno == EINTR)
+            continue;
+        if (nevents <= 0)
+            break;
+
+        for (i = 0; i < nevents; i++) {
+            laiocb = (struct qemu_laiocb *)(uintptr_t)events[i].data;
+            s->count--;
+            laio_complete(s, laiocb, events[i].res);
+        }
+        if (nevents < MAX_EVENTS)
+            break;
+        min_nr = 0;
+    }
+}
+
+static void laio_submit_pending(struct qemu_laio_state *s)
+{
+    struct iocb *iocbs[MAX_EVENTS];
+    struct qemu_laiocb *laiocb;
+    int n, ret;
+
+    while (s->nb_pending) {
+        /* never submit more requests than the ring can complete */
+        n = 0;
+        TAILQ_FOREACH(laiocb, &s->pending, node) {
+            if (n == MAX_EVENTS - s->count)
+                break;
+            iocbs[n++] = &laiocb->iocb;
+        }
+        if (n == 0)
+            break; /* retried when requests complete */
+
+        ret = laio_io_submit(s->ctx, n, iocbs);
+        if (ret == -1 && errno == EINTR)
+            continue;
+        if (ret == -1 && errno == EAGAIN && s->count)
+            break;
+        if (ret == -1) {
+            /* fail the first request and try again with the others */
+            ret = -errno;
+            laiocb = TAILQ_FIRST(&s->pending);
+            TAILQ_REMOVE(&s->pending, laiocb, node);
+            s->nb_pending--;
+            laio_complete(s, laiocb, ret);
+            continue;
+        }
+
+        while (ret-- > 0) {
+            laiocb = TAILQ_FIRST(&s->pending);
+            TAILQ_REMOVE(&s->pending, laiocb, node);
+            s->nb_pending--;
+            s->count++;
+            laiocb->state = LAIO_INFLIGHT;
+        }
+    }
+}
+
+static void qemu_laio_submit_bh(void *opaque)
+{
+    laio_submit_pending(opaque);
+}
+
+static void qemu_laio_completion_cb(void *opaque)
+{
+    struct qemu_laio_state *s = opaque;
+    uint64_t val;
+    ssize_t len;
+
+    /* reset the counter: all the completions are reaped below */
+    do {
+        len = read(s->efd, &val, sizeof(val));
+    } while (len == -1 && errno == EINTR);
+
+    laio_process_events(s, 0);
+
+    /* completions made room in the ring */
+    laio_submit_pending(s);
+}
+
+static int qemu_laio_flush_cb(void *opaque)
+{
+    struct qemu_laio_state *s = opaque;
+
+    return (s->count + s->nb_pending) > 0;
+}
+
+void *laio_init(void)
+{
+    struct qemu_laio_state *s;
+
+    s = qemu_mallocz(sizeof(*s));
+    s->efd = eventfd(0, 0);
+    if (s->efd == -1)
+        goto out_free_state;
+    fcntl(s->efd, F_SETFL, O_NONBLOCK);
+
+    if (laio_io_setup(MAX_EVENTS, &s->ctx) != 0)
+        goto out_close_efd;
+
+    TAILQ_INIT(&s->pending);
+    s->bh = qemu_bh_new(qemu_laio_submit_bh, s);
+    qemu_aio_set_fd_handler(s->efd, qemu_laio_completion_cb, NULL,
+                            qemu_laio_flush_cb, s);
+
+    return s;
+
+out_close_efd:
+    close(s->efd);
+out_free_state:
+    qemu_free(s);
+    return NULL;
+}
+
+int laio_submit(void *aio_ctx, struct qemu_laiocb *laiocb, int fd,
+                off_t offset, struct iovec *iov, int niov, int is_write)
+{
+    struct qemu_laio_state *s = aio_ctx;
+    struct iocb *iocb = &laiocb->iocb;
+    int i;
+
+    laiocb->nbytes = 0;
+    for (i = 0; i < niov; i++)
+        laiocb->nbytes += iov[i].iov_len;
+
+    memset(iocb, 0, sizeof(*iocb));
+    iocb->aio_data = (uintptr_t)laiocb;
+    iocb->aio_lio_opcode = is_write ? IOCB_CMD_PWRITEV : IOCB_CMD_PREADV;
+    iocb->aio_fildes = fd;
+    iocb->aio_buf = (uintptr_t)iov;
+    iocb->aio_nbytes = niov;
+    iocb->aio_offset = offset;
+    iocb->aio_flags = IOCB_FLAG_RESFD;
+    iocb->aio_resfd = s->efd;
+
+    laiocb->state = LAIO_PENDING;
+    TAILQ_INSERT_TAIL(&s->pending, laiocb, node);
+    s->nb_pending++;
+    qemu_bh_schedule(s->bh);
+
+    return 0;
+}
+
+int laio_cancel(void *aio_ctx, struct qemu_laiocb *laiocb)
+{
+    struct qemu_laio_state *s = aio_ctx;
+    struct io_event event;
+
+    switch (laiocb->state) {
+    case LAIO_PENDING:
+        TAILQ_REMOVE(&s->pending, laiocb, node);
+        s->nb_pending--;
+        laiocb->state = LAIO_DONE;
+        return QEMU_LAIO_CANCELED;
+    case LAIO_INFLIGHT:
+        if (laio_io_cancel(s->ctx, &laiocb->iocb, &event) == 0) {
+            s->count--;
+            laiocb->state = LAIO_DONE;
+            return QEMU_LAIO_CANCELED;
+        }
+        /* the kernel could not stop it: wait for it without calling the
+           completion callback */
+        laiocb->complete = NULL;
+        while (laiocb->state != LAIO_DONE)
+            laio_process_events(s, 1);
+        return QEMU_LAIO_ALLDONE;
+    default:
+        return QEMU_LAIO_ALLDONE;
+    }
+}
+
+/* wait for all the requests and release the context */
+void laio_cleanup(void *aio_ctx)
+{
+    struct qemu_laio_state *s = aio_ctx;
+
+    while (s->count + s->nb_pending > 0) {
+        laio_submit_pending(s);
+        if (s->count)
+            laio_process_events(s, 1);
+    }
+
+    qemu_aio_set_fd_handler(s->efd, NULL, NULL, NULL, NULL);
+    qemu_bh_delete(s->bh);
+    syscall(__NR_io_destroy, s->ctx);
+    close(s->efd);
+    qemu_free(s);
+}
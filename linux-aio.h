@@ -0,0 +1,42 @@
+/*
+ * QEMU Linux native AIO support
+ *
+ * This work is licensed under the terms of the GNU GPL, version 2.  See
+ * the COPYING file in the top-level directory.
+ *
+ */
+
+#ifndef QEMU_LINUX_AIO_H
+#define QEMU_LINUX_AIO_H
+
+#include <sys/types.h>
+#include <sys/uio.h>
+#include <linux/aio_abi.h>
+
+#include "sys-queue.h"
+
+#define QEMU_LAIO_CANCELED     0x01
+#define QEMU_LAIO_ALLDONE      0x03
+
+struct qemu_laiocb
+{
+    /* called from the main loop with 0 or -errno */
+    void (*complete)(struct qemu_laiocb *laiocb, int ret);
+    void *opaque;
+    /* storage for requests with a single buffer */
+    struct iovec iov;
+
+    /* private */
+    struct iocb iocb;
+    size_t nbytes;
+    int state;
+    TAILQ_ENTRY(qemu_laiocb) node;
+};
+
+void *laio_init(void);
+int laio_submit(void *aio_ctx, struct qemu_laiocb *laiocb, int fd,
+                off_t offset, struct iovec *iov, int niov, int is_write);
+int laio_cancel(void *aio_ctx, struct qemu_laiocb *laiocb);
+void laio_cleanup(void *aio_ctx);
+
+#endif
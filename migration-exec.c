@@ -42,6 +42,12 @@ static int file_write(FdMigrationState *s, const void * buf, size_t size)
     return write(s->fd, buf, size);
 }
 
+static int file_writev(FdMigrationState *s, const struct iovec *iov,
+                       int iovcnt)
+{
+    return writev(s->fd, iov, iovcnt);
+}
+
 static int exec_close(FdMigrationState *s)
 {
     dprintf("exec_close\n");
@@ -84,6 +90,7 @@ MigrationState *exec_start_outgoing_migration(const char *command,
     s->close = exec_close;
     s->get_error = file_errno;
     s->write = file_write;
+    s->writev = file_writev;
     s->mig_state.cancel = migrate_fd_cancel;
     s->mig_state.get_status = migrate_fd_get_status;
     s->mig_state.release = migrate_fd_release;
@@ -121,6 +128,8 @@ int exec_start_incoming_migration(const char *command)
     }
     vm_stop(0); /* just in case */
     ret = qemu_loadvm_state(f);
+    if (ret == 0)
+        ret = ram_load_postcopy(f, -1);
     if (ret < 0) {
         fprintf(stderr, "load of migration failed\n");
         goto err;
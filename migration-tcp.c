@@ -40,6 +40,14 @@ static int socket_write(FdMigrationState *s, const void * buf, size_t size)
     return send(s->fd, buf, size, 0);
 }
 
+#ifndef _WIN32
+static int socket_writev(FdMigrationState *s, const struct iovec *iov,
+                         int iovcnt)
+{
+    return writev(s->fd, iov, iovcnt);
+}
+#endif
+
 static int tcp_close(FdMigrationState *s)
 {
     dprintf("tcp_close\n");
@@ -92,6 +100,9 @@ MigrationState *tcp_start_outgoing_migration(const char *host_port,
 
     s->get_error = socket_errno;
     s->write = socket_write;
+#ifndef _WIN32
+    s->writev = socket_writev;
+#endif
     s->close = tcp_close;
     s->mig_state.cancel = migrate_fd_cancel;
     s->mig_state.get_status = migrate_fd_get_status;
@@ -165,6 +176,14 @@ static void tcp_accept_incoming_migration(void *opaque)
         fprintf(stderr, "load of migration failed\n");
         goto out_fopen;
     }
+
+    /* with post-copy, the remaining pages follow while the guest runs */
+    ret = ram_load_postcopy(f, c);
+    if (ret < 0) {
+        fprintf(stderr, "load of migration failed\n");
+        goto out_fopen;
+    }
+
     qemu_announce_self();
     dprintf("successfully loaded vm state\n");
 
@@ -174,6 +193,9 @@ static void tcp_accept_incoming_migration(void *opaque)
 
     vm_start();
 
+    if (ret > 0)
+        return;
+
 out_fopen:
     qemu_fclose(f);
 out:
@@ -18,6 +18,7 @@
 #include "sysemu.h"
 #include "block.h"
 #include "qemu_socket.h"
+#include "qemu-timer.h"
 
 //#define DEBUG_MIGRATION
 
@@ -32,8 +33,54 @@
 /* Migration speed throttling */
 static uint32_t max_throttle = (32 << 20);
 
+/* XBZRLE page cache size, disabled by default because older destinations
+   cannot decode it */
+static int64_t xbzrle_cache_size;
+
+XBZRLEStats xbzrle_stats;
+
+/* switch over when the rest of RAM can be sent in that many ms */
+static int64_t max_downtime = 30;
+
+/* throttle the CPUs when the guest dirties memory faster than it is sent */
+static int auto_converge;
+
+#define THROTTLE_INITIAL    20
+#define THROTTLE_STEP       10
+#define THROTTLE_MAX        90
+/* ms between throttle adjustments */
+#define THROTTLE_PERIOD     1000
+
+static struct {
+    uint64_t transferred;   /* bytes written to the destination */
+    uint64_t bandwidth;     /* bytes per ms */
+    uint64_t dirty_rate;    /* bytes of RAM dirtied per second */
+    int iterations;
+
+    /* state at the last update */
+    int64_t time;
+    uint64_t last_transferred;
+    uint64_t last_remaining;
+    uint64_t last_sent;
+    int64_t throttle_time;
+} mig_stats;
+
+/* switch to post-copy after the first pass over RAM */
+static int postcopy_enabled;
+static int postcopy_start_requested;
+
 static MigrationState *current_migration;
 
+#ifndef _WIN32
+/* Outgoing migrations run in the thread of their buffered file: RAM is
+   scanned and sent there while the main loop goes on with the guest, the
+   devices and the monitor.  The thread comes back to the main loop only
+   for what involves the rest of the emulator: starting the save, syncing
+   the dirty log, the final stop-and-copy and cleaning up. */
+static FdMigrationState *thread_migration;
+static pthread_t main_thread;
+#endif
+
 void qemu_start_incoming_migration(const char *uri)
 {
     const char *p;
@@ -53,23 +100,35 @@ void do_migrate(int detach, const char *uri)
     MigrationState *s = NULL;
     const char *p;
 
-    if (strstart(uri, "tcp:", &p))
+    /* one migration at a time, they would share the RAM save state */
+    if (current_migration) {
+        current_migration->release(current_migration);
+        current_migration = NULL;
+    }
+
+    memset(&mig_stats, 0, sizeof(mig_stats));
+    postcopy_start_requested = 0;
+
+    if (strstart(uri, "tcp:", &p)) {
         s = tcp_start_outgoing_migration(p, max_throttle, detach);
+        /* post-copy needs the socket to carry the page requests back */
+        if (s && postcopy_enabled)
+            migrate_to_fms(s)->postcopy = MIG_POSTCOPY_ALLOWED;
+    }
 #if !defined(WIN32)
-    else if (strstart(uri, "exec:", &p))
+    else if (strstart(uri, "exec:", &p)) {
+        if (postcopy_enabled)
+            term_printf("post-copy needs a tcp: migration, using pre-copy\n");
         s = exec_start_outgoing_migration(p, max_throttle, detach);
+    }
 #endif
     else
         term_printf("unknown migration protocol: %s\n", uri);
 
     if (s == NULL)
         term_printf("migration failed\n");
-    else {
-        if (current_migration)
-            current_migration->release(current_migration);
-
+    else
         current_migration = s;
-    }
 }
 
 void do_migrate_cancel(void)
@@ -80,7 +139,7 @@ void do_migrate_cancel(void)
         s->cancel(s);
 }
 
-void do_migrate_set_speed(const char *value)
+static double parse_size(const char *value)
 {
     double d;
     char *ptr;
@@ -97,7 +156,139 @@ void do_migrate_set_speed(const char *value)
         break;
     }
 
-    max_throttle = (uint32_t)d;
+    return d;
+}
+
+void do_migrate_set_speed(const char *value)
+{
+    max_throttle = (uint32_t)parse_size(value);
+}
+
+void do_migrate_set_cache_size(const char *value)
+{
+    double d = parse_size(value);
+
+    if (d < 0) {
+        term_printf("invalid cache size\n");
+        return;
+    }
+    xbzrle_cache_size = (int64_t)d;
+}
+
+int64_t migrate_xbzrle_cache_size(void)
+{
+    return xbzrle_cache_size;
+}
+
+void do_migrate_set_downtime(const char *value)
+{
+    double d;
+    char *ptr;
+
+    d = strtod(value, &ptr);
+    if (!strcmp(ptr, "ms"))
+        d /= 1000;
+    else if (*ptr != '\0' && strcmp(ptr, "s")) {
+        term_printf("invalid downtime '%s'\n", value);
+        return;
+    }
+    if (d < 0) {
+        term_printf("invalid downtime '%s'\n", value);
+        return;
+    }
+    max_downtime = (int64_t)(d * 1000);
+}
+
+int64_t migrate_max_downtime(void)
+{
+    return max_downtime;
+}
+
+void do_migrate_set_auto_converge(const char *value)
+{
+    if (!strcmp(value, "on"))
+        auto_converge = 1;
+    else if (!strcmp(value, "off"))
+        auto_converge = 0;
+    else
+        term_printf("expected 'on' or 'off'\n");
+}
+
+void do_migrate_set_postcopy(const char *value)
+{
+    if (!strcmp(value, "on"))
+        postcopy_enabled = 1;
+    else if (!strcmp(value, "off"))
+        postcopy_enabled = 0;
+    else
+        term_printf("expected 'on' or 'off'\n");
+}
+
+void do_migrate_start_postcopy(void)
+{
+    MigrationState *s = current_migration;
+
+    if (!s || s->get_status(s) != MIG_STATE_ACTIVE) {
+        term_printf("no migration in progress\n");
+        return;
+    }
+    if (migrate_to_fms(s)->postcopy == MIG_POSTCOPY_OFF) {
+        term_printf("post-copy is not enabled for this migration\n");
+        return;
+    }
+    postcopy_start_requested = 1;
+}
+
+uint64_t migrate_bandwidth(void)
+{
+    return mig_stats.bandwidth;
+}
+
+/* Called before each iteration: estimate the link bandwidth and the rate at
+   which the guest dirties memory, and slow the guest down if it keeps
+   ahead of the migration. */
+static void migrate_update_stats(void)
+{
+    int64_t now = qemu_get_clock(rt_clock);
+    int64_t delta = now - mig_stats.time;
+    uint64_t remaining = ram_bytes_remaining();
+    uint64_t sent = ram_bytes_sent();
+    uint64_t bw, dirtied;
+
+    if (mig_stats.iterations++ == 0) {
+        /* the first pass marks all of RAM dirty, nothing to measure yet */
+        mig_stats.throttle_time = now;
+        goto out;
+    }
+    if (delta < 100)
+        return;
+
+    bw = (mig_stats.transferred - mig_stats.last_transferred) / delta;
+    if (mig_stats.bandwidth)
+        bw = (mig_stats.bandwidth * 3 + bw) / 4;
+    mig_stats.bandwidth = bw;
+
+    /* pages dirtied = pages still dirty now - before + pages sent since */
+    dirtied = remaining + (sent - mig_stats.last_sent);
+    dirtied = dirtied > mig_stats.last_remaining ?
+              dirtied - mig_stats.last_remaining : 0;
+    mig_stats.dirty_rate = dirtied * 1000 / delta;
+
+    if (auto_converge && mig_stats.dirty_rate > mig_stats.bandwidth * 1000 &&
+        now - mig_stats.throttle_time >= THROTTLE_PERIOD) {
+        if (cpu_throttle_percentage == 0)
+            cpu_throttle_percentage = THROTTLE_INITIAL;
+        else if (cpu_throttle_percentage < THROTTLE_MAX)
+            cpu_throttle_percentage += THROTTLE_STEP;
+        mig_stats.throttle_time = now;
+        dprintf("throttling cpus to %d%%\n", cpu_throttle_percentage);
+    }
+
+out:
+    mig_stats.time = now;
+    mig_stats.last_transferred = mig_stats.transferred;
+    mig_stats.last_remaining = remaining;
+    mig_stats.last_sent = sent;
 }
 
 void do_info_migrate(void)
@@ -109,9 +300,31 @@ void do_info_migrate(void)
         switch (s->get_status(s)) {
         case MIG_STATE_ACTIVE:
             term_printf("active\n");
+            term_printf("transferred ram: %" PRIu64 " kbytes\n",
+                        mig_stats.transferred >> 10);
+            term_printf("remaining ram: %" PRIu64 " kbytes\n",
+                        ram_bytes_remaining() >> 10);
+            term_printf("total ram: %" PRIu64 " kbytes\n",
+                        ram_bytes_total() >> 10);
+            term_printf("bandwidth: %" PRIu64 " kbytes/s\n",
+                        mig_stats.bandwidth * 1000 >> 10);
+            term_printf("dirty rate: %" PRIu64 " kbytes/s\n",
+                        mig_stats.dirty_rate >> 10);
+            if (mig_stats.bandwidth)
+                term_printf("expected downtime: %" PRIu64 " ms\n",
+                            ram_bytes_remaining() / mig_stats.bandwidth);
+            term_printf("iterations: %d\n", mig_stats.iterations);
+            if (cpu_throttle_percentage)
+                term_printf("cpu throttle: %d%%\n", cpu_throttle_percentage);
+            if (migrate_to_fms(s)->postcopy == MIG_POSTCOPY_ACTIVE)
+                term_printf("post-copy: active, %" PRIu64 " page requests\n",
+                            migrate_to_fms(s)->requests);
             break;
         case MIG_STATE_COMPLETED:
             term_printf("completed\n");
+            term_printf("transferred ram: %" PRIu64 " kbytes\n",
+                        mig_stats.transferred >> 10);
+            term_printf("iterations: %d\n", mig_stats.iterations);
             break;
         case MIG_STATE_ERROR:
             term_printf("failed\n");
@@ -121,10 +334,126 @@ void do_info_migrate(void)
             break;
         }
     }
+
+    if (xbzrle_cache_size) {
+        term_printf("XBZRLE cache size: %" PRId64 " kbytes\n",
+                    xbzrle_cache_size >> 10);
+        term_printf("XBZRLE pages: %" PRIu64 "\n", xbzrle_stats.pages);
+        term_printf("XBZRLE cache miss: %" PRIu64 "\n",
+                    xbzrle_stats.cache_miss);
+        term_printf("XBZRLE overflow: %" PRIu64 "\n", xbzrle_stats.overflow);
+        term_printf("XBZRLE bytes saved: %" PRIu64 "\n",
+                    xbzrle_stats.bytes_saved);
+    }
 }
 
 /* shared migration helpers */
 
+#ifndef _WIN32
+static void migrate_fd_notify(FdMigrationState *s)
+{
+    char c = 0;
+    ssize_t len;
+
+    do {
+        len = write(s->notify_fds[1], &c, 1);
+    } while (len == -1 && errno == EINTR);
+}
+
+/* in the main loop, on behalf of the migration thread */
+static void migrate_fd_main_loop_work(void *opaque)
+{
+    FdMigrationState *s = opaque;
+    void (*call)(void *opaque);
+    char buf[16];
+    ssize_t len;
+    int finished;
+
+    do {
+        len = read(s->notify_fds[0], buf, sizeof(buf));
+    } while (len > 0 || (len == -1 && errno == EINTR));
+
+    pthread_mutex_lock(&s->lock);
+    call = s->call;
+    finished = s->finished;
+    pthread_mutex_unlock(&s->lock);
+
+    if (call) {
+        call(s->call_opaque);
+
+        pthread_mutex_lock(&s->lock);
+        s->call = NULL;
+        s->call_ret = 0;
+        pthread_cond_broadcast(&s->cond);
+        pthread_mutex_unlock(&s->lock);
+    }
+
+    if (finished)
+        migrate_fd_cleanup(s);
+}
+
+int migrate_run_in_main_loop(void (*func)(void *opaque), void *opaque)
+{
+    FdMigrationState *s = thread_migration;
+    int ret;
+
+    if (!s || pthread_equal(pthread_self(), main_thread)) {
+        func(opaque);
+        return 0;
+    }
+
+    pthread_mutex_lock(&s->lock);
+    if (s->state != MIG_STATE_ACTIVE) {
+        pthread_mutex_unlock(&s->lock);
+        return -1;
+    }
+    s->call = func;
+    s->call_opaque = opaque;
+    s->call_ret = -1;
+    migrate_fd_notify(s);
+    while (s->call)
+        pthread_cond_wait(&s->cond, &s->lock);
+    ret = s->call_ret;
+    pthread_mutex_unlock(&s->lock);
+
+    return ret;
+}
+#else
+int migrate_run_in_main_loop(void (*func)(void *opaque), void *opaque)
+{
+    func(opaque);
+    return 0;
+}
+#endif
+
+/* called from put_ready once the migration is over */
+static void migrate_fd_finish(FdMigrationState *s)
+{
+#ifndef _WIN32
+    pthread_mutex_lock(&s->lock);
+    s->finished = 1;
+    migrate_fd_notify(s);
+    pthread_mutex_unlock(&s->lock);
+#else
+    migrate_fd_cleanup(s);
+#endif
+}
+
+static void migrate_fd_postcopy_request(void *opaque);
+
+/* during post-copy, also listen to the destination asking for pages */
+static void migrate_fd_set_handlers(FdMigrationState *s, IOHandler *fd_write)
+{
+#ifdef _WIN32
+    IOHandler *fd_read = NULL;
+
+    if (s->postcopy == MIG_POSTCOPY_ACTIVE)
+        fd_read = migrate_fd_postcopy_request;
+    qemu_set_fd_handler2(s->fd, NULL, fd_read, fd_write, s);
+#endif
+    /* otherwise the migration thread polls the socket in migrate_fd_wait() */
+}
+
 void migrate_fd_error(FdMigrationState *s)
 {
     dprintf("setting error state\n");
@@ -136,14 +465,41 @@ void migrate_fd_cleanup(FdMigrationState *s)
 {
     qemu_set_fd_handler2(s->fd, NULL, NULL, NULL, NULL);
 
+#ifndef _WIN32
+    if (thread_migration == s) {
+        /* do not leave the thread waiting for the main loop */
+        pthread_mutex_lock(&s->lock);
+        s->call = NULL;
+        pthread_cond_broadcast(&s->cond);
+        pthread_mutex_unlock(&s->lock);
+    }
+#endif
+
     if (s->file) {
         dprintf("closing file\n");
+        /* qemu_fclose() flushes the file, the migration thread must not
+           be using it anymore */
+        qemu_buffered_file_stop(s->file);
         qemu_fclose(s->file);
+        s->file = NULL;
+    }
+
+#ifndef _WIN32
+    if (thread_migration == s) {
+        qemu_set_fd_handler2(s->notify_fds[0], NULL, NULL, NULL, NULL);
+        close(s->notify_fds[0]);
+        close(s->notify_fds[1]);
+        pthread_cond_destroy(&s->cond);
+        pthread_mutex_destroy(&s->lock);
+        thread_migration = NULL;
     }
+#endif
 
     if (s->fd != -1)
         close(s->fd);
 
+    cpu_throttle_percentage = 0;
+
     /* Don't resume monitor until we've flushed all of the buffers */
     if (s->detach == 2) {
         monitor_resume();
@@ -157,7 +513,7 @@ void migrate_fd_put_notify(void *opaque)
 {
     FdMigrationState *s = opaque;
 
-    qemu_set_fd_handler2(s->fd, NULL, NULL, NULL, NULL);
+    migrate_fd_set_handlers(s, NULL);
     qemu_file_put_notify(s->file);
 }
 
@@ -172,33 +528,150 @@ ssize_t migrate_fd_put_buffer(void *opaque, const void *data, size_t size)
 
     if (ret == -1)
         ret = -(s->get_error(s));
+    else
+        mig_stats.transferred += ret;
 
     if (ret == -EAGAIN)
-        qemu_set_fd_handler2(s->fd, NULL, NULL, migrate_fd_put_notify, s);
+        migrate_fd_set_handlers(s, migrate_fd_put_notify);
+
+    return ret;
+}
+
+ssize_t migrate_fd_writev(void *opaque, const struct iovec *iov, int iovcnt)
+{
+    FdMigrationState *s = opaque;
+    ssize_t ret;
+
+    do {
+        ret = s->writev(s, iov, iovcnt);
+    } while (ret == -1 && ((s->get_error(s)) == EINTR || (s->get_error(s)) == EWOULDBLOCK));
+
+    if (ret == -1)
+        ret = -(s->get_error(s));
+    else
+        mig_stats.transferred += ret;
+
+    if (ret == -EAGAIN)
+        migrate_fd_set_handlers(s, migrate_fd_put_notify);
 
     return ret;
 }
 
 void migrate_fd_connect(FdMigrationState *s)
 {
-    int ret;
+#ifndef _WIN32
+    if (pipe(s->notify_fds) == -1) {
+        dprintf("cannot create the notification pipe\n");
+        migrate_fd_error(s);
+        return;
+    }
+    fcntl(s->notify_fds[0], F_SETFL, O_NONBLOCK);
+    fcntl(s->notify_fds[1], F_SETFL, O_NONBLOCK);
+    pthread_mutex_init(&s->lock, NULL);
+    pthread_cond_init(&s->cond, NULL);
+    qemu_set_fd_handler2(s->notify_fds[0], NULL, migrate_fd_main_loop_work,
+                         NULL, s);
+    main_thread = pthread_self();
+    thread_migration = s;
+#endif
 
     s->file = qemu_fopen_ops_buffered(s,
                                       s->bandwidth_limit,
                                       migrate_fd_put_buffer,
+                                      s->writev ? migrate_fd_writev : NULL,
                                       migrate_fd_put_ready,
-                                      migrate_fd_wait_for_unfreeze,
+                                      migrate_fd_wait,
                                       migrate_fd_close);
+    if (s->file == NULL) {
+        dprintf("cannot start the migration thread\n");
+        migrate_fd_error(s);
+    }
+}
+
+static void migrate_fd_begin(void *opaque)
+{
+    FdMigrationState *s = opaque;
+    int ret;
 
     dprintf("beginning savevm\n");
     ret = qemu_savevm_state_begin(s->file);
     if (ret < 0) {
         dprintf("failed, %d\n", ret);
-        migrate_fd_error(s);
+        s->state = MIG_STATE_ERROR;
+    }
+}
+
+/* stop the guest and send what is left */
+static void migrate_fd_complete(void *opaque)
+{
+    FdMigrationState *s = opaque;
+
+    dprintf("done iterating\n");
+    vm_stop(0);
+
+    bdrv_flush_all();
+    qemu_savevm_state_complete(s->file);
+    s->state = MIG_STATE_COMPLETED;
+}
+
+/* Stop the guest and send the device state, the destination resumes the
+   guest right away and the pages still dirty follow. */
+static void migrate_fd_start_postcopy(void *opaque)
+{
+    FdMigrationState *s = opaque;
+
+    dprintf("switching to post-copy\n");
+    vm_stop(0);
+
+    bdrv_flush_all();
+    if (ram_save_postcopy() < 0) {
+        dprintf("post-copy not possible, completing with pre-copy\n");
+        qemu_savevm_state_complete(s->file);
+        s->state = MIG_STATE_COMPLETED;
         return;
     }
 
-    migrate_fd_put_ready(s);
+    qemu_savevm_state_complete(s->file);
+    s->postcopy = MIG_POSTCOPY_ACTIVE;
+    migrate_fd_set_handlers(s, NULL);
+}
+
+static void migrate_fd_postcopy_request(void *opaque)
+{
+    FdMigrationState *s = opaque;
+    uint64_t addr;
+    ssize_t len;
+    int i;
+
+    for (;;) {
+        len = recv(s->fd, (void *)(s->request + s->request_len),
+                   sizeof(s->request) - s->request_len, 0);
+        if (len == -1 && socket_error() == EINTR)
+            continue;
+        if (len == -1 && (socket_error() == EAGAIN ||
+                          socket_error() == EWOULDBLOCK))
+            break;
+        if (len <= 0) {
+            dprintf("destination closed the connection during post-copy\n");
+            s->state = MIG_STATE_ERROR;
+            migrate_fd_finish(s);
+            return;
+        }
+
+        s->request_len += len;
+        if (s->request_len < sizeof(s->request))
+            continue;
+        s->request_len = 0;
+
+        addr = 0;
+        for (i = 0; i < 8; i++)
+            addr = (addr << 8) | s->request[i];
+        ram_save_postcopy_request(s->file, addr);
+        s->requests++;
+    }
+
+    /* do not let the pages wait in the buffer */
+    qemu_fflush(s->file);
 }
 
 void migrate_fd_put_ready(void *opaque)
@@ -210,16 +683,34 @@ void migrate_fd_put_ready(void *opaque)
         return;
     }
 
-    dprintf("iterate\n");
-    if (qemu_savevm_state_iterate(s->file) == 1) {
-        dprintf("done iterating\n");
-        vm_stop(0);
+    if (!s->started) {
+        s->started = 1;
+        migrate_run_in_main_loop(migrate_fd_begin, s);
+    }
 
-        bdrv_flush_all();
-        qemu_savevm_state_complete(s->file);
-        s->state = MIG_STATE_COMPLETED;
-        migrate_fd_cleanup(s);
+    if (s->state != MIG_STATE_ACTIVE) {
+        /* failed or cancelled while waiting for the main loop */
+    } else if (qemu_file_has_error(s->file)) {
+        dprintf("error writing to the destination\n");
+        s->state = MIG_STATE_ERROR;
+    } else if (s->postcopy == MIG_POSTCOPY_ACTIVE) {
+        if (ram_save_postcopy_iterate(s->file) == 1) {
+            dprintf("post-copy done\n");
+            s->state = MIG_STATE_COMPLETED;
+        }
+    } else {
+        migrate_update_stats();
+
+        dprintf("iterate\n");
+        if (qemu_savevm_state_iterate(s->file) == 1)
+            migrate_run_in_main_loop(migrate_fd_complete, s);
+        else if (s->postcopy == MIG_POSTCOPY_ALLOWED &&
+                 (postcopy_start_requested || ram_save_pass_complete()))
+            migrate_run_in_main_loop(migrate_fd_start_postcopy, s);
     }
+
+    if (s->state != MIG_STATE_ACTIVE)
+        migrate_fd_finish(s);
 }
 
 int migrate_fd_get_status(MigrationState *mig_state)
@@ -248,30 +739,49 @@ void migrate_fd_release(MigrationState *mig_state)
 
     dprintf("releasing state\n");
    
-    if (s->state == MIG_STATE_ACTIVE) {
+    if (s->state == MIG_STATE_ACTIVE)
         s->state = MIG_STATE_CANCELLED;
-        migrate_fd_cleanup(s);
-    }
+    /* also when the thread has finished and the main loop not yet
+       cleaned up after it */
+    migrate_fd_cleanup(s);
     free(s);
 }
 
-void migrate_fd_wait_for_unfreeze(void *opaque)
+void migrate_fd_wait(void *opaque, int for_write, int64_t timeout)
 {
     FdMigrationState *s = opaque;
+    fd_set rfds, wfds;
+    struct timeval tv, *tvp = NULL;
+    int requests = 0;
     int ret;
 
-    dprintf("wait for unfreeze\n");
-    if (s->state != MIG_STATE_ACTIVE)
-        return;
+    dprintf("wait%s\n", for_write ? " for unfreeze" : "");
 
-    do {
-        fd_set wfds;
+#ifndef _WIN32
+    /* page requests from the destination are served by the thread */
+    requests = s->postcopy == MIG_POSTCOPY_ACTIVE &&
+               s->state == MIG_STATE_ACTIVE;
+#endif
 
-        FD_ZERO(&wfds);
+    FD_ZERO(&rfds);
+    FD_ZERO(&wfds);
+    if (requests)
+        FD_SET(s->fd, &rfds);
+    if (for_write)
         FD_SET(s->fd, &wfds);
 
-        ret = select(s->fd + 1, NULL, &wfds, NULL, NULL);
+    if (timeout >= 0) {
+        tv.tv_sec = timeout / 1000;
+        tv.tv_usec = (timeout % 1000) * 1000;
+        tvp = &tv;
+    }
+
+    do {
+        ret = select(s->fd + 1, &rfds, &wfds, NULL, tvp);
     } while (ret == -1 && (s->get_error(s)) == EINTR);
+
+    if (ret > 0 && requests && FD_ISSET(s->fd, &rfds))
+        migrate_fd_postcopy_request(s);
 }
 
 int migrate_fd_close(void *opaque)
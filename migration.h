@@ -14,11 +14,19 @@
 #ifndef QEMU_MIGRATION_H
 #define QEMU_MIGRATION_H
 
+#ifndef _WIN32
+#include <pthread.h>
+#endif
+
 #define MIG_STATE_ERROR		-1
 #define MIG_STATE_COMPLETED	0
 #define MIG_STATE_CANCELLED	1
 #define MIG_STATE_ACTIVE	2
 
+#define MIG_POSTCOPY_OFF	0
+#define MIG_POSTCOPY_ALLOWED	1
+#define MIG_POSTCOPY_ACTIVE	2
+
 typedef struct MigrationState MigrationState;
 
 struct MigrationState
@@ -39,10 +47,27 @@ struct FdMigrationState
     int fd;
     int detach;
     int state;
+    int postcopy;
+    uint8_t request[8];     /* partial page request from the destination */
+    int request_len;
+    uint64_t requests;
     int (*get_error)(struct FdMigrationState*);
     int (*close)(struct FdMigrationState*);
     int (*write)(struct FdMigrationState*, const void *, size_t);
+    /* optional, lets page data go out without being copied */
+    int (*writev)(struct FdMigrationState*, const struct iovec *, int);
     void *opaque;
+    int started;
+#ifndef _WIN32
+    /* the migration thread waiting for the main loop */
+    int notify_fds[2];
+    pthread_mutex_t lock;
+    pthread_cond_t cond;
+    void (*call)(void *opaque);
+    void *call_opaque;
+    int call_ret;
+    int finished;
+#endif
 };
 
 void qemu_start_incoming_migration(const char *uri);
@@ -53,8 +78,54 @@ void do_migrate_cancel(void);
 
 void do_migrate_set_speed(const char *value);
 
+void do_migrate_set_cache_size(const char *value);
+
+/* size in bytes of the XBZRLE page cache, 0 if XBZRLE is disabled */
+int64_t migrate_xbzrle_cache_size(void);
+
+typedef struct XBZRLEStats {
+    uint64_t pages;         /* pages sent as a delta */
+    uint64_t cache_miss;    /* dirty pages that were not in the cache */
+    uint64_t overflow;      /* deltas that were too large to be useful */
+    uint64_t bytes_saved;   /* page bytes that did not have to be sent */
+} XBZRLEStats;
+
+extern XBZRLEStats xbzrle_stats;
+
+void do_migrate_set_downtime(const char *value);
+
+void do_migrate_set_auto_converge(const char *value);
+
+/* maximum downtime in ms when switching over to the destination */
+int64_t migrate_max_downtime(void);
+
+/* measured throughput in bytes per ms, 0 while unknown */
+uint64_t migrate_bandwidth(void);
+
+/* RAM migration progress, provided by the "ram" save handler */
+uint64_t ram_bytes_remaining(void);
+uint64_t ram_bytes_sent(void);
+uint64_t ram_bytes_total(void);
+
+void do_migrate_set_postcopy(const char *value);
+
+void do_migrate_start_postcopy(void);
+
+/* post-copy support in the "ram" save handler */
+int ram_save_pass_complete(void);
+int ram_save_postcopy(void);
+void ram_save_postcopy_request(QEMUFile *f, uint64_t addr);
+int ram_save_postcopy_iterate(QEMUFile *f);
+int ram_load_postcopy(QEMUFile *f, int fd);
+
 void do_info_migrate(void);
 
+/* Run func in the main loop and wait for it to return.  Called from the
+   migration thread for what may only be done there, otherwise func is
+   simply called.  Returns -1 if the migration ended before func could
+   run. */
+int migrate_run_in_main_loop(void (*func)(void *opaque), void *opaque);
+
 int exec_start_incoming_migration(const char *host_port);
 
 MigrationState *exec_start_outgoing_migration(const char *host_port,
@@ -75,6 +146,8 @@ void migrate_fd_put_notify(void *opaque);
 
 ssize_t migrate_fd_put_buffer(void *opaque, const void *data, size_t size);
 
+ssize_t migrate_fd_writev(void *opaque, const struct iovec *iov, int iovcnt);
+
 void migrate_fd_connect(FdMigrationState *s);
 
 void migrate_fd_put_ready(void *opaque);
@@ -85,7 +158,7 @@ void migrate_fd_cancel(MigrationState *mig_state);
 
 void migrate_fd_release(MigrationState *mig_state);
 
-void migrate_fd_wait_for_unfreeze(void *opaque);
+void migrate_fd_wait(void *opaque, int for_write, int64_t timeout);
 
 int migrate_fd_close(void *opaque);
 
@@ -39,6 +39,10 @@
 #include "qemu-timer.h"
 #include "migration.h"
 #include "kvm.h"
+#include "hw/virtio.h"
+#ifdef CONFIG_AIO
+#include "posix-aio-compat.h"
+#endif
 
 #include "qemu-log.h"
 
@@ -354,6 +358,11 @@ static void do_info_jit(void)
     dump_exec_info(NULL, monitor_fprintf);
 }
 
+static void do_info_tbprofile(void)
+{
+    dump_tb_profile(NULL, monitor_fprintf);
+}
+
 static void do_info_history (void)
 {
     int i;
@@ -1449,8 +1458,8 @@ static const term_cmd_t term_cmds[] = {
       "item1[,...]", "activate logging of the specified items to '/tmp/qemu.log'" },
     { "savevm", "s?", do_savevm,
       "tag|id", "save a VM snapshot. If no tag or id are provided, a new snapshot is created" },
-    { "loadvm", "s", do_loadvm,
-      "tag|id", "restore a VM snapshot from its tag or id" },
+    { "loadvm", "-ls", do_loadvm,
+      "[-l] tag|id", "restore a VM snapshot from its tag or id (using -l to resume the guest before its RAM is read)" },
     { "delvm", "s", do_delvm,
       "tag|id", "delete a VM snapshot from its tag or id" },
     { "stop", "", do_stop,
@@ -1513,6 +1522,18 @@ static const term_cmd_t term_cmds[] = {
       "", "cancel the current VM migration" },
     { "migrate_set_speed", "s", do_migrate_set_speed,
       "value", "set maximum speed (in bytes) for migrations" },
+    { "migrate_set_downtime", "s", do_migrate_set_downtime,
+      "value", "set maximum tolerated downtime (in seconds, or with an ms suffix) for migrations" },
+    { "migrate_set_auto_converge", "s", do_migrate_set_auto_converge,
+      "on|off", "throttle the guest CPUs when it dirties memory faster than migration sends it" },
+    { "migrate_set_postcopy", "s", do_migrate_set_postcopy,
+      "on|off", "let tcp: migrations resume the guest on the destination after one pass over RAM and fetch the rest on demand" },
+    { "migrate_start_postcopy", "", do_migrate_start_postcopy,
+      "", "switch the current migration to post-copy now" },
+    { "migrate_set_compression", "si?i?", do_migrate_set_compression,
+      "codec [threads [level]]", "compress migration and savevm streams with codec (none, zlib or lz) on that many threads" },
+    { "migrate_set_cache_size", "s", do_migrate_set_cache_size,
+      "value", "set the XBZRLE page cache size (in bytes) for migrations, 0 to disable" },
 #if defined(TARGET_I386)
     { "drive_add", "ss", drive_hot_add, "pci_addr=[[<domain>:]<bus>:]<slot>\n"
                                          "[file=file][,if=type][,bus=n]\n"
@@ -1531,6 +1552,8 @@ static const term_cmd_t term_cmds[] = {
       "target", "request VM to change it's memory allocation (in MB)" },
     { "set_link", "ss", do_set_link,
       "name [up|down]", "change the link status of a network adapter" },
+    { "virtio_coalesce", "iiii", do_virtio_coalesce,
+      "dev queue pending delay", "delay the interrupts of a virtio queue by up to 'delay' us or 'pending' notifications (see 'info virtio')" },
     { NULL, NULL, },
 };
 
@@ -1546,6 +1569,10 @@ static const term_cmd_t info_cmds[] = {
       "", "show the block devices" },
     { "blockstats", "", do_info_blockstats,
       "", "show block device statistics" },
+#ifdef CONFIG_AIO
+    { "aio", "", qemu_paio_info,
+      "", "show the AIO thread pool and its per-drive queues" },
+#endif
     { "registers", "", do_info_registers,
       "", "show the cpu registers" },
     { "cpus", "", do_info_cpus,
@@ -1568,6 +1595,8 @@ static const term_cmd_t info_cmds[] = {
 #endif
     { "jit", "", do_info_jit,
       "", "show dynamic compiler info", },
+    { "tbprofile", "", do_info_tbprofile,
+      "", "show the hottest translated blocks and invalidated pages", },
     { "kqemu", "", do_info_kqemu,
       "", "show KQEMU information", },
     { "kvm", "", do_info_kvm,
@@ -1594,6 +1623,8 @@ static const term_cmd_t info_cmds[] = {
       "", "show the current VM name" },
     { "uuid", "", do_info_uuid,
       "", "show the current VM UUID" },
+    { "virtio", "", virtio_info,
+      "", "show the notification statistics of the virtio queues" },
 #if defined(TARGET_PPC)
     { "cpustats", "", do_info_cpu_stats,
       "", "show CPU statistics", },
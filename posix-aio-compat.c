@@ -18,7 +18,13 @@
 #include <string.h>
 #include <stdlib.h>
 #include <stdio.h>
-#include "osdep.h"
+#include <fcntl.h>
+#include <sys/uio.h>
+#include "qemu-common.h"
+#include "console.h"
+#ifdef CONFIG_EVENTFD
+#include <sys/eventfd.h>
+#endif
 
 #include "posix-aio-compat.h"
 
@@ -27,9 +33,75 @@ static pthread_cond_t cond = PTHREAD_COND_INITIALIZER;
 static pthread_t thread_id;
 static pthread_attr_t attr;
 static int max_threads = 64;
+static int target_threads = 16;
 static int cur_threads = 0;
 static int idle_threads = 0;
-static TAILQ_HEAD(, qemu_paiocb) request_list;
+static int idle_time = 10;
+
+/* at most that many adjacent requests are merged in one syscall */
+#define MAX_MERGE_REQS  32
+#define MAX_MERGE_IOV   256
+
+/* the pool size is adapted every ADAPT_PERIOD dispatches */
+#define ADAPT_PERIOD    64
+#define MIN_THREADS     2
+
+struct qemu_paioq
+{
+    TAILQ_HEAD(, qemu_paiocb) requests;
+    TAILQ_ENTRY(qemu_paioq) node;
+    /* on sched_list while requests is not empty */
+    TAILQ_ENTRY(qemu_paioq) sched_node;
+    int scheduled;
+    int deleted;
+    char name[64];
+
+    /* statistics */
+    int queued;
+    int inflight;
+    int64_t completed;
+    int64_t merged;
+    int64_t latency; /* moving average of submission to completion, in us */
+};
+
+static struct qemu_paioq default_queue;
+static TAILQ_HEAD(, qemu_paioq) queue_list =
+    TAILQ_HEAD_INITIALIZER(queue_list);
+static TAILQ_HEAD(, qemu_paioq) sched_list =
+    TAILQ_HEAD_INITIALIZER(sched_list);
+
+/* pool adaptation state */
+static int64_t service_time; /* moving average of the syscall time */
+static int64_t period_service;
+static int period_backlog;
+static int period_count;
+
+/*
+ * Finished requests are pushed on a lock-free list.  Only the request
+ * that finds the list empty wakes up the main loop, which then takes the
+ * whole list at once with qemu_paio_reap().
+ */
+static struct qemu_paiocb *done_list;
+static int notify_rfd = -1, notify_wfd = -1;
+
+#if defined(__GNUC__) && (__GNUC__ > 4 || (__GNUC__ == 4 && __GNUC_MINOR__ >= 1))
+#define done_list_cmpxchg(old, new) \
+    __sync_bool_compare_and_swap(&done_list, old, new)
+#else
+static pthread_mutex_t done_lock = PTHREAD_MUTEX_INITIALIZER;
+
+static int done_list_cmpxchg(struct qemu_paiocb *old, struct qemu_paiocb *new)
+{
+    int ret;
+
+    pthread_mutex_lock(&done_lock);
+    ret = (done_list == old);
+    if (ret)
+        done_list = new;
+    pthread_mutex_unlock(&done_lock);
+    return ret;
+}
+#endif
 
 static void die2(int err, const char *what)
 {
@@ -62,6 +134,14 @@ static int cond_timedwait(pthread_cond_t *cond, pthread_mutex_t *mutex,
     return ret;
 }
 
+static int64_t get_time_us(void)
+{
+    qemu_timeval tv;
+
+    qemu_gettimeofday(&tv);
+    return tv.tv_sec * 1000000LL + tv.tv_usec;
+}
+
 static void cond_signal(pthread_cond_t *cond)
 {
     int ret = pthread_cond_signal(cond);
@@ -75,6 +155,238 @@ static void thread_create(pthread_t *thread, pthread_attr_t *attr,
     if (ret) die2(ret, "pthread_create");
 }
 
+/* transfer nbytes at offset, return the number of bytes done or -errno */
+static ssize_t handle_aiocb_rw_linear(struct qemu_paiocb *aiocb, char *buf,
+                                      size_t nbytes, off_t offset)
+{
+    size_t done = 0;
+
+    while (done < nbytes) {
+        ssize_t len;
+
+        if (aiocb->is_write)
+            len = pwrite(aiocb->aio_fildes, buf + done, nbytes - done,
+                         offset + done);
+        else
+            len = pread(aiocb->aio_fildes, buf + done, nbytes - done,
+                        offset + done);
+
+        if (len == -1 && errno == EINTR)
+            continue;
+        else if (len == -1)
+            return -errno;
+        else if (len == 0)
+            break;
+
+        done += len;
+    }
+
+    return done;
+}
+
+#ifdef HAVE_PREADV
+static int preadv_present = 1;
+#else
+#define preadv_present 0
+#endif
+
+static ssize_t handle_aiocb_rw_vector(struct qemu_paiocb *aiocb)
+{
+    size_t done = 0, seg_start = 0, skip;
+    ssize_t len;
+    int i;
+
+#ifdef HAVE_PREADV
+    if (preadv_present) {
+        do {
+            if (aiocb->is_write)
+                len = pwritev(aiocb->aio_fildes, aiocb->aio_iov,
+                              aiocb->aio_niov, aiocb->aio_offset);
+            else
+                len = preadv(aiocb->aio_fildes, aiocb->aio_iov,
+                             aiocb->aio_niov, aiocb->aio_offset);
+        } while (len == -1 && errno == EINTR);
+
+        if (len == -1 && errno == ENOSYS)
+            preadv_present = 0;
+        else if (len == -1)
+            return -errno;
+        else if (len == aiocb->aio_nbytes || len == 0)
+            return len;
+        else
+            done = len; /* short transfer: finish it segment by segment */
+    }
+#endif
+
+    for (i = 0; i < aiocb->aio_niov && done < aiocb->aio_nbytes; i++) {
+        struct iovec *iov = &aiocb->aio_iov[i];
+
+        if (done < seg_start + iov->iov_len) {
+            skip = done - seg_start;
+            len = handle_aiocb_rw_linear(aiocb, (char *)iov->iov_base + skip,
+                                         iov->iov_len - skip,
+                                         aiocb->aio_offset + done);
+            if (len < 0)
+                return len;
+            done += len;
+            if (len < iov->iov_len - skip)
+                break; /* end of file */
+        }
+        seg_start += iov->iov_len;
+    }
+
+    return done;
+}
+
+static ssize_t handle_aiocb(struct qemu_paiocb *aiocb)
+{
+    if (aiocb->aio_iov)
+        return handle_aiocb_rw_vector(aiocb);
+    else
+        return handle_aiocb_rw_linear(aiocb, aiocb->aio_buf,
+                                      aiocb->aio_nbytes, aiocb->aio_offset);
+}
+
+static int aiocb_segments(struct qemu_paiocb *aiocb)
+{
+    return aiocb->aio_iov ? aiocb->aio_niov : 1;
+}
+
+/*
+ * Take the next request of q, followed by the queued requests that
+ * continue it on disk so that they can be done with a single syscall.
+ * Called with the lock held.
+ */
+static int dequeue_requests(struct qemu_paioq *q, struct qemu_paiocb **reqs)
+{
+    struct qemu_paiocb *aiocb, *next;
+    int nreqs = 0, niov = 0;
+
+    aiocb = TAILQ_FIRST(&q->requests);
+    for (;;) {
+        TAILQ_REMOVE(&q->requests, aiocb, node);
+        aiocb->active = 1;
+        q->queued--;
+        q->inflight++;
+        reqs[nreqs++] = aiocb;
+        niov += aiocb_segments(aiocb);
+
+        if (!preadv_present || nreqs == MAX_MERGE_REQS)
+            break;
+        TAILQ_FOREACH(next, &q->requests, node) {
+            if (next->aio_fildes == aiocb->aio_fildes &&
+                next->is_write == aiocb->is_write &&
+                next->aio_offset == aiocb->aio_offset + aiocb->aio_nbytes &&
+                niov + aiocb_segments(next) <= MAX_MERGE_IOV)
+                break;
+        }
+        if (!next)
+            break;
+        aiocb = next;
+    }
+
+    return nreqs;
+}
+
+static void handle_requests(struct qemu_paiocb **reqs, int nreqs,
+                            ssize_t *rets)
+{
+    struct iovec iov[MAX_MERGE_IOV];
+    struct qemu_paiocb merged;
+    ssize_t len;
+    int i, niov = 0;
+
+    if (nreqs > 1) {
+        merged = *reqs[0];
+        merged.aio_nbytes = 0;
+        for (i = 0; i < nreqs; i++) {
+            if (reqs[i]->aio_iov) {
+                memcpy(&iov[niov], reqs[i]->aio_iov,
+                       reqs[i]->aio_niov * sizeof(struct iovec));
+                niov += reqs[i]->aio_niov;
+            } else {
+                iov[niov].iov_base = reqs[i]->aio_buf;
+                iov[niov].iov_len = reqs[i]->aio_nbytes;
+                niov++;
+            }
+            merged.aio_nbytes += reqs[i]->aio_nbytes;
+        }
+        merged.aio_iov = iov;
+        merged.aio_niov = niov;
+
+        len = handle_aiocb_rw_vector(&merged);
+        if (len == merged.aio_nbytes) {
+            for (i = 0; i < nreqs; i++)
+                rets[i] = reqs[i]->aio_nbytes;
+            return;
+        }
+        /* error or end of file: let each request find its own result */
+    }
+
+    for (i = 0; i < nreqs; i++)
+        rets[i] = handle_aiocb(reqs[i]);
+}
+
+/*
+ * Adapt the pool size to the device.  If the average syscall time per
+ * request reaches twice its long-term average, the device is saturated
+ * and more threads would only queue up in the kernel.  If requests keep
+ * waiting for a free thread, the pool is too small.  Called with the lock
+ * held.
+ */
+static void adapt_pool(int64_t service, int backlog)
+{
+    int64_t avg;
+
+    period_service += service;
+    period_backlog += backlog;
+    if (++period_count < ADAPT_PERIOD)
+        return;
+
+    avg = period_service / period_count;
+    if (service_time && avg > service_time * 2 &&
+        target_threads > MIN_THREADS) {
+        target_threads -= (target_threads + 3) / 4;
+        if (target_threads < MIN_THREADS)
+            target_threads = MIN_THREADS;
+    } else if (period_backlog > period_count / 2 &&
+               target_threads < max_threads) {
+        target_threads += (target_threads + 1) / 2;
+        if (target_threads > max_threads)
+            target_threads = max_threads;
+    }
+
+    service_time = service_time ? (service_time * 3 + avg) / 4 : avg;
+    period_service = 0;
+    period_backlog = 0;
+    period_count = 0;
+}
+
+static void aio_complete(struct qemu_paiocb *aiocb, pid_t pid)
+{
+    struct qemu_paiocb *old;
+    ssize_t ret;
+
+    do {
+        old = done_list;
+        aiocb->done_next = old;
+    } while (!done_list_cmpxchg(old, aiocb));
+
+    if (old == NULL) {
+#ifdef CONFIG_EVENTFD
+        uint64_t val = 1;
+#else
+        char val = 0;
+#endif
+        do {
+            ret = write(notify_wfd, &val, sizeof(val));
+        } while (ret == -1 && errno == EINTR);
+
+        if (aiocb->ev_signo && kill(pid, aiocb->ev_signo))
+            die("kill failed");
+    }
+}
+
 static void *aio_thread(void *unused)
 {
     pid_t pid;
@@ -87,70 +399,74 @@ static void *aio_thread(void *unused)
     if (sigprocmask(SIG_BLOCK, &set, NULL)) die("sigprocmask");
 
     while (1) {
-        struct qemu_paiocb *aiocb;
-        size_t offset;
+        struct qemu_paiocb *reqs[MAX_MERGE_REQS];
+        ssize_t rets[MAX_MERGE_REQS];
+        struct qemu_paioq *q;
+        int64_t start, now, latency;
+        int nreqs, backlog, free_queue, i;
         int ret = 0;
         qemu_timeval tv;
         struct timespec ts;
 
         qemu_gettimeofday(&tv);
-        ts.tv_sec = tv.tv_sec + 10;
+        ts.tv_sec = tv.tv_sec + idle_time;
         ts.tv_nsec = 0;
 
         mutex_lock(&lock);
 
-        while (TAILQ_EMPTY(&request_list) &&
+        while (TAILQ_EMPTY(&sched_list) && cur_threads <= target_threads &&
                !(ret == ETIMEDOUT)) {
             ret = cond_timedwait(&cond, &lock, &ts);
         }
 
-        if (TAILQ_EMPTY(&request_list))
+        /* leave if idle, or if the pool was shrunk */
+        if (TAILQ_EMPTY(&sched_list) || cur_threads > target_threads)
             break;
 
-        aiocb = TAILQ_FIRST(&request_list);
-        TAILQ_REMOVE(&request_list, aiocb, node);
-
-        offset = 0;
-        aiocb->active = 1;
+        /* serve the queues in turn */
+        q = TAILQ_FIRST(&sched_list);
+        TAILQ_REMOVE(&sched_list, q, sched_node);
+        nreqs = dequeue_requests(q, reqs);
+        if (TAILQ_EMPTY(&q->requests))
+            q->scheduled = 0;
+        else
+            TAILQ_INSERT_TAIL(&sched_list, q, sched_node);
 
         idle_threads--;
+        backlog = !TAILQ_EMPTY(&sched_list) && idle_threads == 0;
         mutex_unlock(&lock);
 
-        while (offset < aiocb->aio_nbytes) {
-            ssize_t len;
+        start = get_time_us();
+        handle_requests(reqs, nreqs, rets);
+        now = get_time_us();
 
-            if (aiocb->is_write)
-                len = pwrite(aiocb->aio_fildes,
-                             (const char *)aiocb->aio_buf + offset,
-                             aiocb->aio_nbytes - offset,
-                             aiocb->aio_offset + offset);
+        mutex_lock(&lock);
+        for (i = 0; i < nreqs; i++) {
+            reqs[i]->ret = rets[i];
+            latency = now - reqs[i]->submit_time;
+            if (q->completed++)
+                q->latency = (q->latency * 7 + latency) / 8;
             else
-                len = pread(aiocb->aio_fildes,
-                            (char *)aiocb->aio_buf + offset,
-                            aiocb->aio_nbytes - offset,
-                            aiocb->aio_offset + offset);
-
-            if (len == -1 && errno == EINTR)
-                continue;
-            else if (len == -1) {
-                offset = -errno;
-                break;
-            } else if (len == 0)
-                break;
-
-            offset += len;
+                q->latency = latency;
         }
-
-        mutex_lock(&lock);
-        aiocb->ret = offset;
+        q->inflight -= nreqs;
+        q->merged += nreqs - 1;
+        free_queue = q->deleted && q->queued + q->inflight == 0;
+        adapt_pool((now - start) / nreqs, backlog);
         idle_threads++;
         mutex_unlock(&lock);
 
-        if (kill(pid, aiocb->ev_signo)) die("kill failed");
+        if (free_queue)
+            free(q);
+        for (i = 0; i < nreqs; i++)
+            aio_complete(reqs[i], pid);
     }
 
     idle_threads--;
     cur_threads--;
+    /* hand over the wakeup that this thread is not going to serve */
+    if (!TAILQ_EMPTY(&sched_list))
+        cond_signal(&cond);
     mutex_unlock(&lock);
 
     return NULL;
@@ -173,20 +489,131 @@ int qemu_paio_init(struct qemu_paioinit *aioinit)
     ret = pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_DETACHED);
     if (ret) die2(ret, "pthread_attr_setdetachstate");
 
-    TAILQ_INIT(&request_list);
+    if (aioinit->aio_threads)
+        max_threads = aioinit->aio_threads;
+    target_threads = max_threads / 4;
+    if (target_threads < MIN_THREADS)
+        target_threads = MIN_THREADS;
+    if (aioinit->aio_idle_time)
+        idle_time = aioinit->aio_idle_time;
+
+    TAILQ_INIT(&default_queue.requests);
+    pstrcpy(default_queue.name, sizeof(default_queue.name), "default");
+    TAILQ_INSERT_TAIL(&queue_list, &default_queue, node);
+
+#ifdef CONFIG_EVENTFD
+    notify_rfd = notify_wfd = eventfd(0, 0);
+    if (notify_rfd == -1)
+        die("eventfd");
+#else
+    {
+        int fds[2];
+
+        if (pipe(fds) == -1)
+            die("pipe");
+        notify_rfd = fds[0];
+        notify_wfd = fds[1];
+    }
+#endif
+    fcntl(notify_rfd, F_SETFL, O_NONBLOCK);
+    fcntl(notify_wfd, F_SETFL, O_NONBLOCK);
 
     return 0;
 }
 
+/* the main loop must drain this fd before calling qemu_paio_reap() */
+int qemu_paio_get_fd(void)
+{
+    return notify_rfd;
+}
+
+/* take all the finished requests, linked by done_next in completion
+   order */
+struct qemu_paiocb *qemu_paio_reap(void)
+{
+    struct qemu_paiocb *list, *next, *fifo = NULL;
+
+    do {
+        list = done_list;
+    } while (!done_list_cmpxchg(list, NULL));
+
+    while (list) {
+        next = list->done_next;
+        list->done_next = fifo;
+        fifo = list;
+        list = next;
+    }
+    return fifo;
+}
+
+struct qemu_paioq *qemu_paio_queue_new(const char *name)
+{
+    struct qemu_paioq *q;
+
+    q = calloc(1, sizeof(*q));
+    if (!q)
+        die("calloc");
+    TAILQ_INIT(&q->requests);
+    pstrcpy(q->name, sizeof(q->name), name);
+
+    mutex_lock(&lock);
+    TAILQ_INSERT_TAIL(&queue_list, q, node);
+    mutex_unlock(&lock);
+
+    return q;
+}
+
+/* the queue is freed once its last request is done */
+void qemu_paio_queue_delete(struct qemu_paioq *q)
+{
+    int free_queue;
+
+    mutex_lock(&lock);
+    TAILQ_REMOVE(&queue_list, q, node);
+    q->deleted = 1;
+    free_queue = q->queued + q->inflight == 0;
+    mutex_unlock(&lock);
+
+    if (free_queue)
+        free(q);
+}
+
+void qemu_paio_info(void)
+{
+    struct qemu_paioq *q;
+
+    mutex_lock(&lock);
+    term_printf("threads=%d idle=%d target=%d max=%d service_time=%" PRId64
+                "us\n", cur_threads, idle_threads, target_threads,
+                max_threads, service_time);
+    TAILQ_FOREACH(q, &queue_list, node) {
+        term_printf("%s: queued=%d active=%d completed=%" PRId64
+                    " merged=%" PRId64 " latency=%" PRId64 "us\n",
+                    q->name, q->queued, q->inflight, q->completed,
+                    q->merged, q->latency);
+    }
+    mutex_unlock(&lock);
+}
+
 static int qemu_paio_submit(struct qemu_paiocb *aiocb, int is_write)
 {
+    struct qemu_paioq *q;
+
+    q = aiocb->aio_queue ? aiocb->aio_queue : &default_queue;
+    aiocb->queue = q;
     aiocb->is_write = is_write;
     aiocb->ret = -EINPROGRESS;
     aiocb->active = 0;
+    aiocb->submit_time = get_time_us();
     mutex_lock(&lock);
-    if (idle_threads == 0 && cur_threads < max_threads)
+    if (idle_threads == 0 && cur_threads < target_threads)
         spawn_thread();
-    TAILQ_INSERT_TAIL(&request_list, aiocb, node);
+    TAILQ_INSERT_TAIL(&q->requests, aiocb, node);
+    q->queued++;
+    if (!q->scheduled) {
+        q->scheduled = 1;
+        TAILQ_INSERT_TAIL(&sched_list, q, sched_node);
+    }
     mutex_unlock(&lock);
     cond_signal(&cond);
 
@@ -232,7 +659,14 @@ int qemu_paio_cancel(int fd, struct qemu_paiocb *aiocb)
 
     mutex_lock(&lock);
     if (!aiocb->active) {
-        TAILQ_REMOVE(&request_list, aiocb, node);
+        struct qemu_paioq *q = aiocb->queue;
+
+        TAILQ_REMOVE(&q->requests, aiocb, node);
+        q->queued--;
+        if (TAILQ_EMPTY(&q->requests) && q->scheduled) {
+            TAILQ_REMOVE(&sched_list, q, sched_node);
+            q->scheduled = 0;
+        }
         aiocb->ret = -ECANCELED;
         ret = QEMU_PAIO_CANCELED;
     } else if (aiocb->ret == -EINPROGRESS)
@@ -15,6 +15,7 @@
 #define QEMU_POSIX_AIO_COMPAT_H
 
 #include <sys/types.h>
+#include <sys/uio.h>
 #include <unistd.h>
 #include <signal.h>
 
@@ -24,19 +25,34 @@
 #define QEMU_PAIO_NOTCANCELED  0x02
 #define QEMU_PAIO_ALLDONE      0x03
 
+/* per-drive submission queue; the worker threads serve the queues in
+   turn so that one busy drive cannot starve the others */
+struct qemu_paioq;
+
 struct qemu_paiocb
 {
     int aio_fildes;
     void *aio_buf;
+    /* if aio_iov is not NULL, the transfer goes to its aio_niov segments
+       instead of aio_buf. aio_nbytes is then the sum of their lengths */
+    struct iovec *aio_iov;
+    int aio_niov;
     size_t aio_nbytes;
+    /* if not 0, sent to the process when a batch of completions starts */
     int ev_signo;
     off_t aio_offset;
+    /* NULL to use the default queue */
+    struct qemu_paioq *aio_queue;
+    /* links the requests returned by qemu_paio_reap() */
+    struct qemu_paiocb *done_next;
 
     /* private */
     TAILQ_ENTRY(qemu_paiocb) node;
+    struct qemu_paioq *queue;
     int is_write;
     ssize_t ret;
     int active;
+    int64_t submit_time;
 };
 
 struct qemu_paioinit
@@ -52,5 +68,10 @@ int qemu_paio_write(struct qemu_paiocb *aiocb);
 int qemu_paio_error(struct qemu_paiocb *aiocb);
 ssize_t qemu_paio_return(struct qemu_paiocb *aiocb);
 int qemu_paio_cancel(int fd, struct qemu_paiocb *aiocb);
+int qemu_paio_get_fd(void);
+struct qemu_paiocb *qemu_paio_reap(void);
+struct qemu_paioq *qemu_paio_queue_new(const char *name);
+void qemu_paio_queue_delete(struct qemu_paioq *q);
+void qemu_paio_info(void);
 
 #endif
@@ -0,0 +1,473 @@
+/*
+ * Post-copy migration of guest RAM, destination side
+ *
+ * This work is licensed under the terms of the GNU GPL, version 2.  See
+ * the COPYING file in the top-level directory.
+ *
+ */
+
+#include "qemu-common.h"
+#include "qemu_socket.h"
+#include "hw/hw.h"
+#include "postcopy-ram.h"
+
+#ifdef CONFIG_POSTCOPY
+
+#include <pthread.h>
+#include <signal.h>
+#include <poll.h>
+#include <sys/ioctl.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <linux/userfaultfd.h>
+
+/* The pages that were still dirty when the source stopped are dropped and
+ * the range is registered with userfaultfd.  A thread touching one of them
+ * blocks in the kernel until the page is installed with UFFDIO_COPY, which
+ * is atomic, so the page is never seen half written.  The fault thread
+ * asks the source for the pages that are touched, the receive thread
+ * installs the pages as they come, requested or pushed in the background.
+ *
+ * When the pages are read locally instead, the fault thread reads the pages
+ * that are touched itself and the receive thread reads the others in order;
+ * a page is claimed under pc_lock by the thread that reads it.
+ */
+
+/* state of each page in missing[] */
+#define PAGE_PRESENT    0
+#define PAGE_MISSING    1
+#define PAGE_REQUESTED  2
+
+static struct {
+    int uffd;
+    int quit_fds[2];
+    uint8_t *base;
+    size_t size;
+    size_t page_size;
+    volatile uint8_t *missing;
+    QEMUFile *file;
+    int fd;
+    PostcopyLoadFunc *load;
+    PostcopyReadFunc *read;
+    PostcopyDoneFunc *done;
+    uint8_t *fault_buf;
+    uint8_t *read_buf;
+    int active;
+    pthread_t fault_thread;
+    pthread_t recv_thread;
+} pc;
+
+/* protects the claims on missing pages and pc.active */
+static pthread_mutex_t pc_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t pc_cond = PTHREAD_COND_INITIALIZER;
+
+/* pages read at once by the receive thread when they are read locally */
+#define POSTCOPY_READ_PAGES 64
+
+int postcopy_ram_supported(void)
+{
+    struct uffdio_api api;
+    int fd;
+
+    fd = syscall(__NR_userfaultfd, O_CLOEXEC);
+    if (fd < 0)
+        return 0;
+
+    memset(&api, 0, sizeof(api));
+    api.api = UFFD_API;
+    if (ioctl(fd, UFFDIO_API, &api) < 0) {
+        close(fd);
+        return 0;
+    }
+    close(fd);
+    return 1;
+}
+
+static void postcopy_fail(const char *msg)
+{
+    fprintf(stderr, "post-copy migration failed: %s, guest memory is "
+            "incomplete\n", msg);
+    exit(1);
+}
+
+static void postcopy_block_signals(void)
+{
+    sigset_t set;
+
+    /* signals are handled by the main thread */
+    sigfillset(&set);
+    pthread_sigmask(SIG_BLOCK, &set, NULL);
+}
+
+static int postcopy_request_page(uint64_t offset)
+{
+    uint8_t buf[8];
+    int i, len;
+
+    for (i = 0; i < 8; i++)
+        buf[i] = offset >> (56 - i * 8);
+
+    for (i = 0; i < 8; i += len) {
+        len = send(pc.fd, buf + i, 8 - i, 0);
+        if (len < 0 && errno == EINTR) {
+            len = 0;
+            continue;
+        }
+        if (len <= 0)
+            return -1;
+    }
+    return 0;
+}
+
+static int postcopy_place(uint64_t offset, const void *data, size_t len);
+
+/* Claim up to n missing pages from i on for reading them, returns how many
+   were claimed; they stop at the first page that is not missing. */
+static size_t postcopy_claim(size_t i, size_t n)
+{
+    size_t j;
+
+    pthread_mutex_lock(&pc_lock);
+    for (j = 0; j < n && pc.missing[i + j] == PAGE_MISSING; j++)
+        pc.missing[i + j] = PAGE_REQUESTED;
+    pthread_mutex_unlock(&pc_lock);
+    return j;
+}
+
+/* read and install the n pages from i on, that the caller claimed */
+static void postcopy_read(size_t i, size_t n, uint8_t *buf)
+{
+    uint64_t offset = (uint64_t)i * pc.page_size;
+
+    if (pc.read(offset, buf, n * pc.page_size) < 0)
+        postcopy_fail("cannot read pages");
+    if (postcopy_place(offset, buf, n * pc.page_size) < 0)
+        postcopy_fail("cannot install pages");
+
+    pthread_mutex_lock(&pc_lock);
+    pthread_cond_broadcast(&pc_cond);
+    pthread_mutex_unlock(&pc_lock);
+}
+
+static void *postcopy_fault_thread(void *opaque)
+{
+    struct uffd_msg msg;
+    struct pollfd pfd[2];
+    uint64_t offset;
+    size_t i;
+    int ret;
+
+    postcopy_block_signals();
+
+    pfd[0].fd = pc.uffd;
+    pfd[0].events = POLLIN;
+    pfd[1].fd = pc.quit_fds[0];
+    pfd[1].events = POLLIN;
+
+    for (;;) {
+        pfd[0].revents = pfd[1].revents = 0;
+        ret = poll(pfd, 2, -1);
+        if (ret < 0 && errno == EINTR)
+            continue;
+        if (ret < 0 || pfd[1].revents)
+            break;
+
+        ret = read(pc.uffd, &msg, sizeof(msg));
+        if (ret != sizeof(msg))
+            continue;
+        if (msg.event != UFFD_EVENT_PAGEFAULT)
+            continue;
+
+        offset = msg.arg.pagefault.address - (unsigned long)pc.base;
+        offset &= ~(uint64_t)(pc.page_size - 1);
+        i = offset / pc.page_size;
+
+        switch (pc.missing[i]) {
+        case PAGE_MISSING:
+            if (pc.read) {
+                if (postcopy_claim(i, 1))
+                    postcopy_read(i, 1, pc.fault_buf);
+                break;
+            }
+            pc.missing[i] = PAGE_REQUESTED;
+            if (postcopy_request_page(offset) < 0)
+                postcopy_fail("cannot request pages");
+            break;
+        case PAGE_PRESENT:
+            /* a zero page that was never written on this side */
+            postcopy_ram_place_zero_page(offset);
+            break;
+        default:
+            /* already on its way */
+            break;
+        }
+    }
+
+    return NULL;
+}
+
+/* fetch the pages that are still missing from the local source */
+static void postcopy_read_all(void)
+{
+    size_t i, n, nb_pages = pc.size / pc.page_size;
+
+    for (i = 0; i < nb_pages; i += n) {
+        n = MIN(POSTCOPY_READ_PAGES, nb_pages - i);
+        n = postcopy_claim(i, n);
+        if (n)
+            postcopy_read(i, n, pc.read_buf);
+        else
+            n = 1;
+    }
+
+    /* wait for the pages that the fault thread is reading */
+    pthread_mutex_lock(&pc_lock);
+    for (i = 0; i < nb_pages; i++) {
+        while (pc.missing[i] != PAGE_PRESENT)
+            pthread_cond_wait(&pc_cond, &pc_lock);
+    }
+    pthread_mutex_unlock(&pc_lock);
+}
+
+static void *postcopy_recv_thread(void *opaque)
+{
+    struct uffdio_range range;
+    char c = 0;
+    int ret;
+
+    postcopy_block_signals();
+
+    if (pc.read) {
+        postcopy_read_all();
+    } else {
+        while ((ret = pc.load(pc.file)) > 0)
+            ;
+        if (ret < 0)
+            postcopy_fail("error receiving pages");
+    }
+
+    /* every page is present, stop catching accesses */
+    range.start = (unsigned long)pc.base;
+    range.len = pc.size;
+    ioctl(pc.uffd, UFFDIO_UNREGISTER, &range);
+
+    if (write(pc.quit_fds[1], &c, 1) != 1)
+        postcopy_fail("cannot stop the fault thread");
+    pthread_join(pc.fault_thread, NULL);
+
+    close(pc.quit_fds[0]);
+    close(pc.quit_fds[1]);
+    close(pc.uffd);
+    if (pc.read) {
+        qemu_vfree(pc.fault_buf);
+        qemu_vfree(pc.read_buf);
+        pc.done();
+    } else {
+        qemu_fclose(pc.file);
+        close(pc.fd);
+    }
+    qemu_free((void *)pc.missing);
+    pc.missing = NULL;
+
+    pthread_mutex_lock(&pc_lock);
+    pc.active = 0;
+    pthread_cond_broadcast(&pc_cond);
+    pthread_mutex_unlock(&pc_lock);
+
+    return NULL;
+}
+
+/* drop the pages of a run of missing pages so that they fault */
+static int postcopy_discard(size_t start, size_t end)
+{
+    if (start == end)
+        return 0;
+    return madvise(pc.base + start * pc.page_size,
+                   (end - start) * pc.page_size, MADV_DONTNEED);
+}
+
+static int postcopy_start(uint8_t *base, size_t size, size_t page_size,
+                          uint8_t *missing)
+{
+    struct uffdio_api api;
+    struct uffdio_register reg;
+    pthread_attr_t attr;
+    size_t i, run, nb_pages = size / page_size;
+
+    pc.base = base;
+    pc.size = size;
+    pc.page_size = page_size;
+    pc.missing = missing;
+
+    pc.uffd = syscall(__NR_userfaultfd, O_CLOEXEC | O_NONBLOCK);
+    if (pc.uffd < 0)
+        return -errno;
+
+    memset(&api, 0, sizeof(api));
+    api.api = UFFD_API;
+    if (ioctl(pc.uffd, UFFDIO_API, &api) < 0)
+        goto fail;
+
+#ifdef MADV_NOHUGEPAGE
+    /* pages are fetched one at a time, keep them small */
+    madvise(base, size, MADV_NOHUGEPAGE);
+#endif
+
+    for (i = run = 0; i < nb_pages; i++) {
+        if (missing[i] != PAGE_MISSING) {
+            if (postcopy_discard(run, i) < 0)
+                goto fail;
+            run = i + 1;
+        }
+    }
+    if (postcopy_discard(run, nb_pages) < 0)
+        goto fail;
+
+    memset(&reg, 0, sizeof(reg));
+    reg.range.start = (unsigned long)base;
+    reg.range.len = size;
+    reg.mode = UFFDIO_REGISTER_MODE_MISSING;
+    if (ioctl(pc.uffd, UFFDIO_REGISTER, &reg) < 0)
+        goto fail;
+
+    if (pipe(pc.quit_fds) < 0)
+        goto fail_unregister;
+
+    pc.active = 1;
+    pthread_attr_init(&attr);
+    if (pthread_create(&pc.fault_thread, &attr, postcopy_fault_thread, NULL))
+        goto fail_pipe;
+    pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_DETACHED);
+    if (pthread_create(&pc.recv_thread, &attr, postcopy_recv_thread, NULL))
+        postcopy_fail("cannot start the receive thread");
+    pthread_attr_destroy(&attr);
+
+    return 0;
+
+fail_pipe:
+    pc.active = 0;
+    pthread_attr_destroy(&attr);
+    close(pc.quit_fds[0]);
+    close(pc.quit_fds[1]);
+fail_unregister:
+    ioctl(pc.uffd, UFFDIO_UNREGISTER, &reg.range);
+fail:
+    i = errno;
+    close(pc.uffd);
+    return -i;
+}
+
+int postcopy_ram_incoming_start(uint8_t *base, size_t size, size_t page_size,
+                                uint8_t *missing, QEMUFile *f, int fd,
+                                PostcopyLoadFunc *load)
+{
+    pc.file = f;
+    pc.fd = fd;
+    pc.load = load;
+    pc.read = NULL;
+    return postcopy_start(base, size, page_size, missing);
+}
+
+int postcopy_ram_local_start(uint8_t *base, size_t size, size_t page_size,
+                             uint8_t *missing, PostcopyReadFunc *read,
+                             PostcopyDoneFunc *done)
+{
+    int ret;
+
+    pc.read = read;
+    pc.done = done;
+    pc.fault_buf = qemu_vmalloc(page_size);
+    pc.read_buf = qemu_vmalloc(page_size * POSTCOPY_READ_PAGES);
+    ret = postcopy_start(base, size, page_size, missing);
+    if (ret < 0) {
+        qemu_vfree(pc.fault_buf);
+        qemu_vfree(pc.read_buf);
+    }
+    return ret;
+}
+
+void postcopy_ram_wait(void)
+{
+    pthread_mutex_lock(&pc_lock);
+    while (pc.active)
+        pthread_cond_wait(&pc_cond, &pc_lock);
+    pthread_mutex_unlock(&pc_lock);
+}
+
+static int postcopy_place(uint64_t offset, const void *data, size_t len)
+{
+    struct uffdio_copy copy;
+    size_t i;
+
+    copy.dst = (unsigned long)pc.base + offset;
+    copy.src = (unsigned long)data;
+    copy.len = len;
+    copy.mode = 0;
+    copy.copy = 0;
+
+    /* EEXIST: the page was zero-filled after a fault, write over it */
+    if (ioctl(pc.uffd, UFFDIO_COPY, &copy) < 0) {
+        if (errno != EEXIST)
+            return -errno;
+        memcpy(pc.base + offset, data, len);
+    }
+    for (i = 0; i < len; i += pc.page_size)
+        pc.missing[(offset + i) / pc.page_size] = PAGE_PRESENT;
+    return 0;
+}
+
+int postcopy_ram_place_page(uint64_t offset, const void *data)
+{
+    return postcopy_place(offset, data, pc.page_size);
+}
+
+int postcopy_ram_place_zero_page(uint64_t offset)
+{
+    struct uffdio_zeropage zero;
+
+    zero.range.start = (unsigned long)pc.base + offset;
+    zero.range.len = pc.page_size;
+    zero.mode = 0;
+
+    if (ioctl(pc.uffd, UFFDIO_ZEROPAGE, &zero) < 0 && errno != EEXIST)
+        return -errno;
+    pc.missing[offset / pc.page_size] = PAGE_PRESENT;
+    return 0;
+}
+
+#else
+
+int postcopy_ram_supported(void)
+{
+    return 0;
+}
+
+int postcopy_ram_incoming_start(uint8_t *base, size_t size, size_t page_size,
+                                uint8_t *missing, QEMUFile *f, int fd,
+                                PostcopyLoadFunc *load)
+{
+    return -ENOSYS;
+}
+
+int postcopy_ram_local_start(uint8_t *base, size_t size, size_t page_size,
+                             uint8_t *missing, PostcopyReadFunc *read,
+                             PostcopyDoneFunc *done)
+{
+    return -ENOSYS;
+}
+
+void postcopy_ram_wait(void)
+{
+}
+
+int postcopy_ram_place_page(uint64_t offset, const void *data)
+{
+    return -ENOSYS;
+}
+
+int postcopy_ram_place_zero_page(uint64_t offset)
+{
+    return -ENOSYS;
+}
+
+#endif
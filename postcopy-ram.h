@@ -0,0 +1,48 @@
+/*
+ * Post-copy migration of guest RAM, destination side
+ *
+ * This work is licensed under the terms of the GNU GPL, version 2.  See
+ * the COPYING file in the top-level directory.
+ *
+ */
+
+#ifndef QEMU_POSTCOPY_RAM_H
+#define QEMU_POSTCOPY_RAM_H
+
+/* Read one page record from the stream and install it with
+   postcopy_ram_place_page() or postcopy_ram_place_zero_page().  Returns 1,
+   0 once all pages have been received, or a negative errno. */
+typedef int PostcopyLoadFunc(QEMUFile *f);
+
+/* Read the len bytes of guest RAM at offset into buf, from a source that
+   can be used from any thread.  Returns 0 or a negative errno. */
+typedef int PostcopyReadFunc(uint64_t offset, uint8_t *buf, size_t len);
+/* called from a helper thread once all pages are present */
+typedef void PostcopyDoneFunc(void);
+
+/* non-zero if the host can catch accesses to missing pages */
+int postcopy_ram_supported(void);
+
+/* Drop the pages of the size bytes at base for which missing[] is set (one
+   byte per page of page_size bytes) and start fetching them on demand: the
+   offset of each missing page that is touched is written as a be64 to fd,
+   while load receives pages from f in a helper thread.  The helper threads
+   own f and fd from then on and close them when all pages are present. */
+int postcopy_ram_incoming_start(uint8_t *base, size_t size, size_t page_size,
+                                uint8_t *missing, QEMUFile *f, int fd,
+                                PostcopyLoadFunc *load);
+
+/* Like postcopy_ram_incoming_start(), but the missing pages are read with
+   read, those that are touched first, then done is called. */
+int postcopy_ram_local_start(uint8_t *base, size_t size, size_t page_size,
+                             uint8_t *missing, PostcopyReadFunc *read,
+                             PostcopyDoneFunc *done);
+
+/* wait until the pages fetched on demand, if any, are all present */
+void postcopy_ram_wait(void);
+
+/* install a page at offset, waking up the threads waiting for it */
+int postcopy_ram_place_page(uint64_t offset, const void *data);
+int postcopy_ram_place_zero_page(uint64_t offset);
+
+#endif
@@ -0,0 +1,419 @@
+/*
+ * QEMU block compression and a worker pool to run it in parallel
+ *
+ * This work is licensed under the terms of the GNU GPL, version 2.  See
+ * the COPYING file in the top-level directory.
+ *
+ */
+
+#include "qemu-common.h"
+#include "qemu-compress.h"
+#include <zlib.h>
+#ifndef _WIN32
+#include <pthread.h>
+#include <signal.h>
+#endif
+
+/* LZ codec
+ *
+ * A byte oriented LZ77 variant.  The block is a sequence of
+ *
+ *   token: literal length (high nibble), match length - 4 (low nibble),
+ *          15 meaning that more length bytes follow (255 continues)
+ *   literal bytes
+ *   match offset, 16 bit little endian, then the extra match length bytes
+ *
+ * The last sequence has literals only and ends the block.
+ */
+
+#define LZ_MIN_MATCH    4
+#define LZ_HASH_BITS    13
+#define LZ_MAX_OFFSET   65535
+
+static inline uint32_t lz_read32(const uint8_t *p)
+{
+    uint32_t v;
+    memcpy(&v, p, 4);
+    return v;
+}
+
+static inline int lz_hash(uint32_t v)
+{
+    return (v * 2654435761U) >> (32 - LZ_HASH_BITS);
+}
+
+static int lz_put_len(uint8_t *out, int o, int out_len, int len)
+{
+    while (len >= 255) {
+        if (o >= out_len)
+            return -1;
+        out[o++] = 255;
+        len -= 255;
+    }
+    if (o >= out_len)
+        return -1;
+    out[o++] = len;
+    return o;
+}
+
+static int lz_put_seq(uint8_t *out, int o, int out_len,
+                      const uint8_t *lit, int lit_len, int offset,
+                      int match_len)
+{
+    int ml = match_len ? match_len - LZ_MIN_MATCH : 0;
+
+    if (o >= out_len)
+        return -1;
+    out[o++] = ((lit_len < 15 ? lit_len : 15) << 4) | (ml < 15 ? ml : 15);
+    if (lit_len >= 15 && (o = lz_put_len(out, o, out_len, lit_len - 15)) < 0)
+        return -1;
+    if (lit_len > out_len - o)
+        return -1;
+    memcpy(out + o, lit, lit_len);
+    o += lit_len;
+
+    if (match_len) {
+        if (out_len - o < 2)
+            return -1;
+        out[o++] = offset & 0xff;
+        out[o++] = offset >> 8;
+        if (ml >= 15 && (o = lz_put_len(out, o, out_len, ml - 15)) < 0)
+            return -1;
+    }
+    return o;
+}
+
+static int lz_compress(const uint8_t *in, int in_len, uint8_t *out,
+                       int out_len)
+{
+    int table[1 << LZ_HASH_BITS];
+    int ip = 0, anchor = 0, o = 0, ref, len, h;
+
+    memset(table, 0xff, sizeof(table));
+
+    while (ip + LZ_MIN_MATCH <= in_len) {
+        h = lz_hash(lz_read32(in + ip));
+        ref = table[h];
+        table[h] = ip;
+        if (ref < 0 || ip - ref > LZ_MAX_OFFSET ||
+            lz_read32(in + ref) != lz_read32(in + ip)) {
+            ip++;
+            continue;
+        }
+
+        len = LZ_MIN_MATCH;
+        while (ip + len < in_len && in[ref + len] == in[ip + len])
+            len++;
+
+        o = lz_put_seq(out, o, out_len, in + anchor, ip - anchor,
+                       ip - ref, len);
+        if (o < 0)
+            return -1;
+        ip += len;
+        anchor = ip;
+    }
+
+    return lz_put_seq(out, o, out_len, in + anchor, in_len - anchor, 0, 0);
+}
+
+static int lz_get_len(const uint8_t *in, int *i, int in_len, int *len)
+{
+    int b;
+
+    do {
+        if (*i >= in_len)
+            return -1;
+        b = in[(*i)++];
+        *len += b;
+    } while (b == 255);
+    return 0;
+}
+
+static int lz_decompress(const uint8_t *in, int in_len, uint8_t *out,
+                         int out_len)
+{
+    int i = 0, o = 0, token, lit_len, match_len, offset;
+
+    for (;;) {
+        if (i >= in_len)
+            return -1;
+        token = in[i++];
+
+        lit_len = token >> 4;
+        if (lit_len == 15 && lz_get_len(in, &i, in_len, &lit_len) < 0)
+            return -1;
+        if (lit_len > in_len - i || lit_len > out_len - o)
+            return -1;
+        memcpy(out + o, in + i, lit_len);
+        i += lit_len;
+        o += lit_len;
+
+        if (i == in_len)
+            return o;
+
+        if (in_len - i < 2)
+            return -1;
+        offset = in[i] | (in[i + 1] << 8);
+        i += 2;
+        match_len = token & 15;
+        if (match_len == 15 && lz_get_len(in, &i, in_len, &match_len) < 0)
+            return -1;
+        match_len += LZ_MIN_MATCH;
+        if (offset == 0 || offset > o || match_len > out_len - o)
+            return -1;
+
+        /* may overlap the output being written */
+        while (match_len--) {
+            out[o] = out[o - offset];
+            o++;
+        }
+    }
+}
+
+int qemu_compress_block(int codec, int level, const uint8_t *in, int in_len,
+                        uint8_t *out, int out_len)
+{
+    uLongf len;
+
+    switch (codec) {
+    case QEMU_COMPRESS_ZLIB:
+        len = out_len;
+        if (compress2(out, &len, in, in_len, level) != Z_OK)
+            return -1;
+        return len;
+    case QEMU_COMPRESS_LZ:
+        return lz_compress(in, in_len, out, out_len);
+    default:
+        if (in_len > out_len)
+            return -1;
+        memcpy(out, in, in_len);
+        return in_len;
+    }
+}
+
+int qemu_decompress_block(int codec, const uint8_t *in, int in_len,
+                          uint8_t *out, int out_len)
+{
+    uLongf len;
+
+    switch (codec) {
+    case QEMU_COMPRESS_NONE:
+        if (in_len > out_len)
+            return -1;
+        memcpy(out, in, in_len);
+        return in_len;
+    case QEMU_COMPRESS_ZLIB:
+        len = out_len;
+        if (uncompress(out, &len, in, in_len) != Z_OK)
+            return -1;
+        return len;
+    case QEMU_COMPRESS_LZ:
+        return lz_decompress(in, in_len, out, out_len);
+    default:
+        return -1;
+    }
+}
+
+static const char *codec_names[] = {
+    [QEMU_COMPRESS_NONE] = "none",
+    [QEMU_COMPRESS_ZLIB] = "zlib",
+    [QEMU_COMPRESS_LZ] = "lz",
+};
+
+int qemu_compress_codec_parse(const char *name)
+{
+    int i;
+
+    for (i = 0; i < ARRAY_SIZE(codec_names); i++) {
+        if (!strcmp(name, codec_names[i]))
+            return i;
+    }
+    return -1;
+}
+
+const char *qemu_compress_codec_name(int codec)
+{
+    if (codec < 0 || codec >= ARRAY_SIZE(codec_names))
+        return "unknown";
+    return codec_names[codec];
+}
+
+/* worker pool */
+
+static void compress_job_run(QEMUCompressJob *job)
+{
+    if (job->decompress)
+        job->out_len = qemu_decompress_block(job->codec, job->in, job->in_len,
+                                             job->out, job->out_len);
+    else
+        job->out_len = qemu_compress_block(job->codec, job->level, job->in,
+                                           job->in_len, job->out,
+                                           job->out_len);
+}
+
+#ifdef _WIN32
+
+struct QEMUCompressPool
+{
+    int unused;
+};
+
+QEMUCompressPool *qemu_compress_pool_new(int threads)
+{
+    return qemu_mallocz(sizeof(QEMUCompressPool));
+}
+
+void qemu_compress_pool_submit(QEMUCompressPool *pool, QEMUCompressJob *job)
+{
+    compress_job_run(job);
+    job->done = 1;
+}
+
+void qemu_compress_pool_wait(QEMUCompressPool *pool, QEMUCompressJob *job)
+{
+}
+
+int qemu_compress_pool_done(QEMUCompressPool *pool, QEMUCompressJob *job)
+{
+    return 1;
+}
+
+void qemu_compress_pool_delete(QEMUCompressPool *pool)
+{
+    qemu_free(pool);
+}
+
+#else
+
+struct QEMUCompressPool
+{
+    pthread_mutex_t lock;
+    pthread_cond_t work_cond;
+    pthread_cond_t done_cond;
+    QEMUCompressJob *head, *tail;
+    int nb_threads;
+    pthread_t *threads;
+    int quit;
+};
+
+static void *compress_thread(void *opaque)
+{
+    QEMUCompressPool *pool = opaque;
+    QEMUCompressJob *job;
+    sigset_t set;
+
+    /* block all signals, they are handled by the main thread */
+    sigfillset(&set);
+    pthread_sigmask(SIG_BLOCK, &set, NULL);
+
+    pthread_mutex_lock(&pool->lock);
+    for (;;) {
+        while (!pool->head && !pool->quit)
+            pthread_cond_wait(&pool->work_cond, &pool->lock);
+        if (!pool->head)
+            break;
+
+        job = pool->head;
+        pool->head = job->next;
+        if (!pool->head)
+            pool->tail = NULL;
+        pthread_mutex_unlock(&pool->lock);
+
+        compress_job_run(job);
+
+        pthread_mutex_lock(&pool->lock);
+        job->done = 1;
+        pthread_cond_broadcast(&pool->done_cond);
+    }
+    pthread_mutex_unlock(&pool->lock);
+
+    return NULL;
+}
+
+QEMUCompressPool *qemu_compress_pool_new(int threads)
+{
+    QEMUCompressPool *pool;
+    int i;
+
+    pool = qemu_mallocz(sizeof(QEMUCompressPool));
+    pthread_mutex_init(&pool->lock, NULL);
+    pthread_cond_init(&pool->work_cond, NULL);
+    pthread_cond_init(&pool->done_cond, NULL);
+
+    if (threads > 0)
+        pool->threads = qemu_mallocz(threads * sizeof(pthread_t));
+    for (i = 0; i < threads; i++) {
+        if (pthread_create(&pool->threads[i], NULL, compress_thread, pool))
+            break;
+    }
+    /* fall back to synchronous operation if no thread could be started */
+    pool->nb_threads = i;
+
+    return pool;
+}
+
+void qemu_compress_pool_submit(QEMUCompressPool *pool, QEMUCompressJob *job)
+{
+    job->done = 0;
+    job->next = NULL;
+
+    if (pool->nb_threads == 0) {
+        compress_job_run(job);
+        job->done = 1;
+        return;
+    }
+
+    pthread_mutex_lock(&pool->lock);
+    if (pool->tail)
+        pool->tail->next = job;
+    else
+        pool->head = job;
+    pool->tail = job;
+    pthread_cond_signal(&pool->work_cond);
+    pthread_mutex_unlock(&pool->lock);
+}
+
+void qemu_compress_pool_wait(QEMUCompressPool *pool, QEMUCompressJob *job)
+{
+    if (pool->nb_threads == 0)
+        return;
+
+    pthread_mutex_lock(&pool->lock);
+    while (!job->done)
+        pthread_cond_wait(&pool->done_cond, &pool->lock);
+    pthread_mutex_unlock(&pool->lock);
+}
+
+int qemu_compress_pool_done(QEMUCompressPool *pool, QEMUCompressJob *job)
+{
+    int done;
+
+    if (pool->nb_threads == 0)
+        return 1;
+
+    pthread_mutex_lock(&pool->lock);
+    done = job->done;
+    pthread_mutex_unlock(&pool->lock);
+    return done;
+}
+
+void qemu_compress_pool_delete(QEMUCompressPool *pool)
+{
+    int i;
+
+    pthread_mutex_lock(&pool->lock);
+    pool->quit = 1;
+    pthread_cond_broadcast(&pool->work_cond);
+    pthread_mutex_unlock(&pool->lock);
+
+    for (i = 0; i < pool->nb_threads; i++)
+        pthread_join(pool->threads[i], NULL);
+
+    pthread_cond_destroy(&pool->done_cond);
+    pthread_cond_destroy(&pool->work_cond);
+    pthread_mutex_destroy(&pool->lock);
+    qemu_free(pool->threads);
+    qemu_free(pool);
+}
+
+#endif
@@ -0,0 +1,59 @@
+/*
+ * QEMU block compression and a worker pool to run it in parallel
+ *
+ * This work is licensed under the terms of the GNU GPL, version 2.  See
+ * the COPYING file in the top-level directory.
+ *
+ */
+
+#ifndef QEMU_COMPRESS_H
+#define QEMU_COMPRESS_H
+
+#include <stdint.h>
+
+/* codec identifiers, also stored in the stream */
+#define QEMU_COMPRESS_NONE      0
+#define QEMU_COMPRESS_ZLIB      1
+#define QEMU_COMPRESS_LZ        2
+
+/* Compress in_len bytes into out.  Returns the compressed length, or -1 if
+   it would not fit in out_len bytes. */
+int qemu_compress_block(int codec, int level, const uint8_t *in, int in_len,
+                        uint8_t *out, int out_len);
+
+/* Returns the decompressed length, or -1 if the input is malformed or the
+   result does not fit in out_len bytes. */
+int qemu_decompress_block(int codec, const uint8_t *in, int in_len,
+                          uint8_t *out, int out_len);
+
+int qemu_compress_codec_parse(const char *name);
+const char *qemu_compress_codec_name(int codec);
+
+typedef struct QEMUCompressJob QEMUCompressJob;
+
+struct QEMUCompressJob
+{
+    int decompress;
+    int codec;
+    int level;
+    uint8_t *in;
+    int in_len;
+    uint8_t *out;
+    int out_len;        /* size of out, then the result or -1 */
+
+    /* private */
+    int done;
+    QEMUCompressJob *next;
+};
+
+typedef struct QEMUCompressPool QEMUCompressPool;
+
+/* with 0 threads, jobs run synchronously in qemu_compress_pool_submit() */
+QEMUCompressPool *qemu_compress_pool_new(int threads);
+void qemu_compress_pool_submit(QEMUCompressPool *pool, QEMUCompressJob *job);
+void qemu_compress_pool_wait(QEMUCompressPool *pool, QEMUCompressJob *job);
+int qemu_compress_pool_done(QEMUCompressPool *pool, QEMUCompressJob *job);
+/* all submitted jobs must have completed */
+void qemu_compress_pool_delete(QEMUCompressPool *pool);
+
+#endif
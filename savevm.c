@@ -32,6 +32,8 @@
 #include "audio/audio.h"
 #include "migration.h"
 #include "qemu_socket.h"
+#include "qemu-compress.h"
+#include "postcopy-ram.h"
 
 #include <unistd.h>
 #include <fcntl.h>
@@ -132,6 +134,9 @@ void qemu_announce_self(void)
 /* savevm/loadvm support */
 
 #define IO_BUF_SIZE 32768
+#define MAX_IOV_SIZE 128
+
+typedef struct QEMUFileCompress QEMUFileCompress;
 
 struct QEMUFile {
     QEMUFilePutBufferFunc *put_buffer;
@@ -148,8 +153,377 @@ struct QEMUFile {
     uint8_t buf[IO_BUF_SIZE];
 
     int has_error;
+
+    /* writing: buffers queued by reference and the parts of buf between
+       them, written with writev_buffer on the next flush */
+    QEMUFileWritevBufferFunc *writev_buffer;
+    struct iovec iov[MAX_IOV_SIZE];
+    int iovcnt;
+    int buf_iov_index;  /* bytes of buf already in iov */
+    int64_t iov_bytes;  /* bytes in iov that are not in buf */
+
+    /* set when the rest of the stream is compressed */
+    QEMUFileCompress *comp;
+};
+
+/* Compressed streams
+ *
+ * The stream is cut into blocks of at most COMPRESS_BLOCK_SIZE bytes (an
+ * explicit qemu_fflush() ends the current one early) that are compressed
+ * independently by a pool of threads, and written in order as
+ *
+ *   be32 uncompressed length (0 ends the stream)
+ *   byte codec
+ *   be32 compressed length
+ *   compressed data
+ *
+ * Loading reads blocks ahead and decompresses them in parallel as well.
+ * buf_offset counts uncompressed bytes, raw_offset the bytes in the
+ * underlying file.
+ */
+
+#define COMPRESS_BLOCK_SIZE     (256 * 1024)
+#define COMPRESS_HEADER_SIZE    9
+
+typedef struct CompressBlock {
+    QEMUCompressJob job;
+    int raw_len;        /* uncompressed length from the block header */
+    struct CompressBlock *next;
+} CompressBlock;
+
+struct QEMUFileCompress {
+    QEMUCompressPool *pool;
+    int codec;
+    int level;
+    int64_t raw_offset;
+
+    /* blocks being compressed or decompressed, in stream order */
+    CompressBlock *head, *tail;
+    int inflight, max_inflight;
+
+    /* writing: the block being filled */
+    uint8_t *cur;
+    int cur_len;
+
+    /* reading: stream bytes read before decompression started */
+    uint8_t *raw;
+    int raw_index, raw_size;
+    /* the block being consumed */
+    CompressBlock *out;
+    int out_index;
+    int eof;
 };
 
+static int savevm_compress_codec = QEMU_COMPRESS_NONE;
+static int savevm_compress_level = 1;
+static int savevm_compress_threads = 4;
+
+static QEMUFileCompress *compress_new(int codec, int level, int threads)
+{
+    QEMUFileCompress *c = qemu_mallocz(sizeof(*c));
+
+    c->codec = codec;
+    c->level = level;
+    c->pool = qemu_compress_pool_new(threads);
+    c->max_inflight = threads > 0 ? 2 * threads : 1;
+    return c;
+}
+
+static void compress_block_free(CompressBlock *b)
+{
+    qemu_free(b->job.in);
+    qemu_free(b->job.out);
+    qemu_free(b);
+}
+
+static CompressBlock *compress_pop(QEMUFile *f)
+{
+    QEMUFileCompress *c = f->comp;
+    CompressBlock *b = c->head;
+
+    qemu_compress_pool_wait(c->pool, &b->job);
+    c->head = b->next;
+    if (!c->head)
+        c->tail = NULL;
+    c->inflight--;
+    return b;
+}
+
+static void compress_push(QEMUFile *f, CompressBlock *b)
+{
+    QEMUFileCompress *c = f->comp;
+
+    b->next = NULL;
+    if (c->tail)
+        c->tail->next = b;
+    else
+        c->head = b;
+    c->tail = b;
+    c->inflight++;
+    qemu_compress_pool_submit(c->pool, &b->job);
+}
+
+static void compress_raw_write(QEMUFile *f, const uint8_t *buf, int size)
+{
+    QEMUFileCompress *c = f->comp;
+    int len;
+
+    if (f->has_error)
+        return;
+    len = f->put_buffer(f->opaque, buf, c->raw_offset, size);
+    if (len > 0)
+        c->raw_offset += size;
+    else
+        f->has_error = 1;
+}
+
+static void compress_write_header(QEMUFile *f, int raw_len, int codec,
+                                  int len)
+{
+    uint8_t hdr[COMPRESS_HEADER_SIZE];
+
+    cpu_to_be32wu((uint32_t *)hdr, raw_len);
+    hdr[4] = codec;
+    cpu_to_be32wu((uint32_t *)(hdr + 5), len);
+    compress_raw_write(f, hdr, sizeof(hdr));
+}
+
+/* write out compressed blocks in order; wait for all of them if all is
+   set, otherwise only until a new block can be queued */
+static void compress_write_blocks(QEMUFile *f, int all)
+{
+    QEMUFileCompress *c = f->comp;
+    CompressBlock *b;
+
+    while (c->head && (all || c->inflight >= c->max_inflight ||
+                       qemu_compress_pool_done(c->pool, &c->head->job))) {
+        b = compress_pop(f);
+        if (b->job.out_len < 0) {
+            /* did not shrink */
+            compress_write_header(f, b->job.in_len, QEMU_COMPRESS_NONE,
+                                  b->job.in_len);
+            compress_raw_write(f, b->job.in, b->job.in_len);
+        } else {
+            compress_write_header(f, b->job.in_len, b->job.codec,
+                                  b->job.out_len);
+            compress_raw_write(f, b->job.out, b->job.out_len);
+        }
+        compress_block_free(b);
+    }
+}
+
+static void compress_submit(QEMUFile *f)
+{
+    QEMUFileCompress *c = f->comp;
+    CompressBlock *b;
+
+    if (c->cur_len == 0)
+        return;
+
+    b = qemu_mallocz(sizeof(*b));
+    b->job.codec = c->codec;
+    b->job.level = c->level;
+    b->job.in = c->cur;
+    b->job.in_len = c->cur_len;
+    b->job.out = qemu_malloc(c->cur_len);
+    b->job.out_len = c->cur_len;
+    c->cur = NULL;
+    c->cur_len = 0;
+
+    compress_push(f, b);
+    compress_write_blocks(f, 0);
+}
+
+static void compress_put_buffer(QEMUFile *f, const uint8_t *buf, int size)
+{
+    QEMUFileCompress *c = f->comp;
+    int l;
+
+    while (size > 0) {
+        if (!c->cur)
+            c->cur = qemu_malloc(COMPRESS_BLOCK_SIZE);
+        l = MIN(size, COMPRESS_BLOCK_SIZE - c->cur_len);
+        memcpy(c->cur + c->cur_len, buf, l);
+        c->cur_len += l;
+        buf += l;
+        size -= l;
+        if (c->cur_len == COMPRESS_BLOCK_SIZE)
+            compress_submit(f);
+    }
+}
+
+/* read exactly size bytes of the underlying stream */
+static int compress_raw_read(QEMUFile *f, uint8_t *buf, int size)
+{
+    QEMUFileCompress *c = f->comp;
+    int l, done = 0;
+
+    l = MIN(size, c->raw_size - c->raw_index);
+    if (l > 0) {
+        memcpy(buf, c->raw + c->raw_index, l);
+        c->raw_index += l;
+        done = l;
+    }
+
+    while (done < size) {
+        l = f->get_buffer(f->opaque, buf + done, c->raw_offset, size - done);
+        if (l == -EAGAIN)
+            continue;
+        if (l <= 0)
+            return -1;
+        c->raw_offset += l;
+        done += l;
+    }
+
+    return 0;
+}
+
+/* queue blocks for decompression until enough are in flight */
+static void decompress_read_ahead(QEMUFile *f)
+{
+    QEMUFileCompress *c = f->comp;
+    uint8_t hdr[COMPRESS_HEADER_SIZE];
+    CompressBlock *b;
+    uint32_t raw_len, len;
+
+    while (!c->eof && c->inflight < c->max_inflight) {
+        if (compress_raw_read(f, hdr, sizeof(hdr)) < 0) {
+            c->eof = 1;
+            f->has_error = 1;
+            break;
+        }
+        raw_len = be32_to_cpupu((uint32_t *)hdr);
+        len = be32_to_cpupu((uint32_t *)(hdr + 5));
+        if (raw_len == 0) {
+            c->eof = 1;
+            break;
+        }
+        if (raw_len > COMPRESS_BLOCK_SIZE || len > COMPRESS_BLOCK_SIZE) {
+            c->eof = 1;
+            f->has_error = 1;
+            break;
+        }
+
+        b = qemu_mallocz(sizeof(*b));
+        b->job.decompress = 1;
+        b->job.codec = hdr[4];
+        b->job.in = qemu_malloc(len);
+        b->job.in_len = len;
+        b->job.out = qemu_malloc(raw_len);
+        b->job.out_len = raw_len;
+        b->raw_len = raw_len;
+        if (compress_raw_read(f, b->job.in, len) < 0) {
+            compress_block_free(b);
+            c->eof = 1;
+            f->has_error = 1;
+            break;
+        }
+        compress_push(f, b);
+    }
+}
+
+static int decompress_get_buffer(QEMUFile *f, uint8_t *buf, int size)
+{
+    QEMUFileCompress *c = f->comp;
+    int l;
+
+    if (c->out && c->out_index == c->out->job.out_len) {
+        compress_block_free(c->out);
+        c->out = NULL;
+    }
+
+    if (!c->out) {
+        decompress_read_ahead(f);
+        if (!c->head)
+            return 0;
+        c->out = compress_pop(f);
+        c->out_index = 0;
+        if (c->out->job.out_len <= 0 ||
+            c->out->job.out_len != c->out->raw_len) {
+            compress_block_free(c->out);
+            c->out = NULL;
+            c->eof = 1;
+            return -EINVAL;
+        }
+        decompress_read_ahead(f);
+    }
+
+    l = MIN(size, c->out->job.out_len - c->out_index);
+    memcpy(buf, c->out->job.out + c->out_index, l);
+    c->out_index += l;
+    return l;
+}
+
+static void qemu_file_compress(QEMUFile *f, int codec, int level, int threads)
+{
+    qemu_fflush(f);
+    f->comp = compress_new(codec, level, threads);
+    f->comp->raw_offset = f->buf_offset;
+}
+
+static void qemu_file_decompress(QEMUFile *f, int threads)
+{
+    QEMUFileCompress *c = compress_new(QEMU_COMPRESS_NONE, 0, threads);
+
+    /* keep what was read past the current position */
+    c->raw_size = f->buf_size - f->buf_index;
+    c->raw = qemu_malloc(c->raw_size + 1);
+    memcpy(c->raw, f->buf + f->buf_index, c->raw_size);
+    c->raw_offset = f->buf_offset;
+
+    f->buf_offset = qemu_ftell(f);
+    f->buf_index = 0;
+    f->buf_size = 0;
+    f->comp = c;
+}
+
+static void qemu_file_compress_close(QEMUFile *f)
+{
+    QEMUFileCompress *c = f->comp;
+
+    if (f->put_buffer) {
+        compress_submit(f);
+        compress_write_blocks(f, 1);
+        compress_write_header(f, 0, QEMU_COMPRESS_NONE, 0);
+    } else {
+        while (c->head)
+            compress_block_free(compress_pop(f));
+        if (c->out)
+            compress_block_free(c->out);
+    }
+
+    qemu_compress_pool_delete(c->pool);
+    qemu_free(c->cur);
+    qemu_free(c->raw);
+    qemu_free(c);
+    f->comp = NULL;
+}
+
+void do_migrate_set_compression(const char *codec, int has_threads,
+                                int threads, int has_level, int level)
+{
+    int c = qemu_compress_codec_parse(codec);
+
+    if (c < 0) {
+        term_printf("unknown compression codec '%s'\n", codec);
+        return;
+    }
+    if (has_threads && (threads < 0 || threads > 64)) {
+        term_printf("invalid number of threads\n");
+        return;
+    }
+    if (has_level && (level < 1 || level > 9)) {
+        term_printf("invalid compression level\n");
+        return;
+    }
+
+    savevm_compress_codec = c;
+    if (has_threads)
+        savevm_compress_threads = threads;
+    if (has_level)
+        savevm_compress_level = level;
+}
+
 typedef struct QEMUFilePopen
 {
     FILE *popen_file;
@@ -359,17 +733,73 @@ QEMUFile *qemu_fopen_ops(void *opaque, QEMUFilePutBufferFunc *put_buffer,
     return f;
 }
 
+void qemu_file_set_writev_buffer(QEMUFile *f,
+                                 QEMUFileWritevBufferFunc *writev_buffer)
+{
+    f->writev_buffer = writev_buffer;
+}
+
 int qemu_file_has_error(QEMUFile *f)
 {
     return f->has_error;
 }
 
-void qemu_fflush(QEMUFile *f)
+void qemu_file_set_error(QEMUFile *f)
+{
+    f->has_error = 1;
+}
+
+static void qemu_iov_add(QEMUFile *f, const uint8_t *buf, int size)
+{
+    struct iovec *last;
+
+    if (size == 0)
+        return;
+    if (f->iovcnt > 0) {
+        last = &f->iov[f->iovcnt - 1];
+        if ((uint8_t *)last->iov_base + last->iov_len == buf) {
+            last->iov_len += size;
+            return;
+        }
+    }
+    f->iov[f->iovcnt].iov_base = (uint8_t *)buf;
+    f->iov[f->iovcnt].iov_len = size;
+    f->iovcnt++;
+}
+
+/* queue the bytes written to buf since the last queued buffer */
+static void qemu_iov_add_buf(QEMUFile *f)
+{
+    qemu_iov_add(f, f->buf + f->buf_iov_index, f->buf_index - f->buf_iov_index);
+    f->buf_iov_index = f->buf_index;
+}
+
+/* write out the buffer; with compression it only goes to the block
+   being filled */
+static void qemu_file_flush_buffer(QEMUFile *f)
 {
     if (!f->put_buffer)
         return;
 
-    if (f->is_write && f->buf_index > 0) {
+    if (f->is_write && f->iovcnt > 0) {
+        int64_t size = f->buf_index + f->iov_bytes;
+        int len;
+
+        qemu_iov_add_buf(f);
+        len = f->writev_buffer(f->opaque, f->iov, f->iovcnt, f->buf_offset);
+        if (len == size)
+            f->buf_offset += size;
+        else
+            f->has_error = 1;
+        f->iovcnt = 0;
+        f->iov_bytes = 0;
+        f->buf_index = 0;
+        f->buf_iov_index = 0;
+    } else if (f->is_write && f->buf_index > 0 && f->comp) {
+        compress_put_buffer(f, f->buf, f->buf_index);
+        f->buf_offset += f->buf_index;
+        f->buf_index = 0;
+    } else if (f->is_write && f->buf_index > 0) {
         int len;
 
         len = f->put_buffer(f->opaque, f->buf, f->buf_offset, f->buf_index);
@@ -381,6 +811,17 @@ void qemu_fflush(QEMUFile *f)
     }
 }
 
+/* An explicit flush also ends the current compressed block, so that the
+   data written so far does not wait for the block to fill up. */
+void qemu_fflush(QEMUFile *f)
+{
+    qemu_file_flush_buffer(f);
+    if (f->comp && f->put_buffer) {
+        compress_submit(f);
+        compress_write_blocks(f, 1);
+    }
+}
+
 static void qemu_fill_buffer(QEMUFile *f)
 {
     int len;
@@ -391,7 +832,10 @@ static void qemu_fill_buffer(QEMUFile *f)
     if (f->is_write)
         abort();
 
-    len = f->get_buffer(f->opaque, f->buf, f->buf_offset, IO_BUF_SIZE);
+    if (f->comp)
+        len = decompress_get_buffer(f, f->buf, IO_BUF_SIZE);
+    else
+        len = f->get_buffer(f->opaque, f->buf, f->buf_offset, IO_BUF_SIZE);
     if (len > 0) {
         f->buf_index = 0;
         f->buf_size = len;
@@ -404,12 +848,19 @@ int qemu_fclose(QEMUFile *f)
 {
     int ret = 0;
     qemu_fflush(f);
+    if (f->comp)
+        qemu_file_compress_close(f);
     if (f->close)
         ret = f->close(f->opaque);
     qemu_free(f);
     return ret;
 }
 
+void *qemu_file_get_opaque(QEMUFile *f)
+{
+    return f->opaque;
+}
+
 void qemu_file_put_notify(QEMUFile *f)
 {
     f->put_buffer(f->opaque, NULL, 0, 0);
@@ -435,8 +886,36 @@ void qemu_put_buffer(QEMUFile *f, const uint8_t *buf, int size)
         buf += l;
         size -= l;
         if (f->buf_index >= IO_BUF_SIZE)
-            qemu_fflush(f);
+            qemu_file_flush_buffer(f);
+    }
+}
+
+void qemu_put_buffer_async(QEMUFile *f, const uint8_t *buf, int size)
+{
+    /* compression consumes the data right away */
+    if (!f->writev_buffer || f->comp) {
+        qemu_put_buffer(f, buf, size);
+        return;
+    }
+
+    if (!f->has_error && f->is_write == 0 && f->buf_index > 0) {
+        fprintf(stderr,
+                "Attempted to write to buffer while read buffer is not empty\n");
+        abort();
     }
+    if (f->has_error)
+        return;
+
+    f->is_write = 1;
+    qemu_iov_add_buf(f);
+    qemu_iov_add(f, buf, size);
+    f->iov_bytes += size;
+
+    /* keep one entry for the rest of buf, and flush as often as when
+       copying so that rate limiting stays as precise */
+    if (f->iovcnt >= MAX_IOV_SIZE - 1 ||
+        f->buf_index + f->iov_bytes >= IO_BUF_SIZE)
+        qemu_file_flush_buffer(f);
 }
 
 void qemu_put_byte(QEMUFile *f, int v)
@@ -450,7 +929,7 @@ void qemu_put_byte(QEMUFile *f, int v)
     f->buf[f->buf_index++] = v;
     f->is_write = 1;
     if (f->buf_index >= IO_BUF_SIZE)
-        qemu_fflush(f);
+        qemu_file_flush_buffer(f);
 }
 
 int qemu_get_buffer(QEMUFile *f, uint8_t *buf, int size1)
@@ -494,7 +973,7 @@ int qemu_get_byte(QEMUFile *f)
 
 int64_t qemu_ftell(QEMUFile *f)
 {
-    return f->buf_offset - f->buf_size + f->buf_index;
+    return f->buf_offset - f->buf_size + f->buf_index + f->iov_bytes;
 }
 
 int64_t qemu_fseek(QEMUFile *f, int64_t pos, int whence)
@@ -507,6 +986,20 @@ int64_t qemu_fseek(QEMUFile *f, int64_t pos, int whence)
         /* SEEK_END not supported */
         return -1;
     }
+    if (f->comp) {
+        uint8_t buf[256];
+        int l;
+
+        /* compressed streams can only skip forward while reading */
+        if (f->put_buffer || pos < qemu_ftell(f))
+            return -1;
+        while (qemu_ftell(f) < pos) {
+            l = qemu_get_buffer(f, buf, MIN(sizeof(buf), pos - qemu_ftell(f)));
+            if (l <= 0)
+                return -1;
+        }
+        return pos;
+    }
     if (f->put_buffer) {
         qemu_fflush(f);
         f->buf_offset = pos;
@@ -637,6 +1130,8 @@ int register_savevm(const char *idstr,
 }
 
 #define QEMU_VM_FILE_MAGIC           0x5145564d
+/* the rest of the file is a compressed stream starting with the magic */
+#define QEMU_VM_FILE_MAGIC_COMPRESS  0x5145565a
 #define QEMU_VM_FILE_VERSION_COMPAT  0x00000002
 #define QEMU_VM_FILE_VERSION         0x00000003
 
@@ -650,6 +1145,12 @@ int qemu_savevm_state_begin(QEMUFile *f)
 {
     SaveStateEntry *se;
 
+    if (savevm_compress_codec != QEMU_COMPRESS_NONE) {
+        qemu_put_be32(f, QEMU_VM_FILE_MAGIC_COMPRESS);
+        qemu_file_compress(f, savevm_compress_codec, savevm_compress_level,
+                           savevm_compress_threads);
+    }
+
     qemu_put_be32(f, QEMU_VM_FILE_MAGIC);
     qemu_put_be32(f, QEMU_VM_FILE_VERSION);
 
@@ -848,6 +1349,10 @@ int qemu_loadvm_state(QEMUFile *f)
     int ret;
 
     v = qemu_get_be32(f);
+    if (v == QEMU_VM_FILE_MAGIC_COMPRESS && !f->comp) {
+        qemu_file_decompress(f, savevm_compress_threads);
+        v = qemu_get_be32(f);
+    }
     if (v != QEMU_VM_FILE_MAGIC)
         return -EINVAL;
 
@@ -993,6 +1498,25 @@ static int bdrv_snapshot_find(BlockDriverState *bs, QEMUSnapshotInfo *sn_info,
     return ret;
 }
 
+/* the snapshot being saved or loaded */
+static QEMUFile *snapshot_file;
+static BlockDriverState *snapshot_area_bs;
+static int64_t snapshot_area_offset;
+static int snapshot_lazy;
+
+BlockDriverState *qemu_savevm_snapshot_area(QEMUFile *f, int64_t *offset)
+{
+    if (f != snapshot_file)
+        return NULL;
+    *offset = snapshot_area_offset;
+    return snapshot_area_bs;
+}
+
+int qemu_loadvm_snapshot_lazy(QEMUFile *f)
+{
+    return f == snapshot_file && snapshot_lazy;
+}
+
 void do_savevm(const char *name)
 {
     BlockDriverState *bs, *bs1;
@@ -1017,6 +1541,9 @@ void do_savevm(const char *name)
     /* ??? Should this occur after vm_stop?  */
     qemu_aio_flush();
 
+    /* the VM state area may be rewritten, finish reading it first */
+    postcopy_ram_wait();
+
     saved_vm_running = vm_running;
     vm_stop(0);
 
@@ -1060,7 +1587,11 @@ void do_savevm(const char *name)
         term_printf("Could not open VM state file\n");
         goto the_end;
     }
+    snapshot_file = f;
+    snapshot_area_bs = bs;
+    snapshot_area_offset = bdi->vm_state_offset;
     ret = qemu_savevm_state(f);
+    snapshot_file = NULL;
     vm_state_size = qemu_ftell(f);
     qemu_fclose(f);
     if (ret < 0) {
@@ -1095,7 +1626,7 @@ void do_savevm(const char *name)
         vm_start();
 }
 
-void do_loadvm(const char *name)
+void do_loadvm(int lazy, const char *name)
 {
     BlockDriverState *bs, *bs1;
     BlockDriverInfo bdi1, *bdi = &bdi1;
@@ -1116,6 +1647,10 @@ void do_loadvm(const char *name)
     saved_vm_running = vm_running;
     vm_stop(0);
 
+    /* the VM state area is replaced by the snapshot's */
+    postcopy_ram_wait();
+    ram_snapshot_invalidate();
+
     for(i = 0; i <= nb_drives; i++) {
         bs1 = drives_table[i].bdrv;
         if (bdrv_has_snapshot(bs1)) {
@@ -1161,7 +1696,12 @@ void do_loadvm(const char *name)
         term_printf("Could not open VM state file\n");
         goto the_end;
     }
+    snapshot_file = f;
+    snapshot_area_bs = bs;
+    snapshot_area_offset = bdi->vm_state_offset;
+    snapshot_lazy = lazy;
     ret = qemu_loadvm_state(f);
+    snapshot_file = NULL;
     qemu_fclose(f);
     if (ret < 0) {
         term_printf("Error %d while loading VM state\n", ret);
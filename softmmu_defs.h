@@ -9,6 +9,16 @@ uint32_t REGPARM __ldl_mmu(target_ulong addr, int mmu_idx);
 void REGPARM __stl_mmu(target_ulong addr, uint32_t val, int mmu_idx);
 uint64_t REGPARM __ldq_mmu(target_ulong addr, int mmu_idx);
 void REGPARM __stq_mmu(target_ulong addr, uint64_t val, int mmu_idx);
+#ifdef USE_VCPU_THREADS
+int __cmpxchgb_mmu(target_ulong addr, uint8_t old, uint8_t val, int mmu_idx,
+                   void *retaddr);
+int __cmpxchgw_mmu(target_ulong addr, uint16_t old, uint16_t val, int mmu_idx,
+                   void *retaddr);
+int __cmpxchgl_mmu(target_ulong addr, uint32_t old, uint32_t val, int mmu_idx,
+                   void *retaddr);
+int __cmpxchgq_mmu(target_ulong addr, uint64_t old, uint64_t val, int mmu_idx,
+                   void *retaddr);
+#endif
 
 uint8_t REGPARM __ldb_cmmu(target_ulong addr, int mmu_idx);
 void REGPARM __stb_cmmu(target_ulong addr, uint8_t val, int mmu_idx);
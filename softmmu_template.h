@@ -65,6 +65,7 @@ static inline DATA_TYPE glue(io_read, SUFFIX)(target_phys_addr_t physaddr,
     }
 
     env->mem_io_vaddr = addr;
+    qemu_mutex_lock_iothread();
 #if SHIFT <= 2
     res = io_mem_read[index][SHIFT](io_mem_opaque[index], physaddr);
 #else
@@ -76,6 +77,7 @@ static inline DATA_TYPE glue(io_read, SUFFIX)(target_phys_addr_t physaddr,
     res |= (uint64_t)io_mem_read[index][2](io_mem_opaque[index], physaddr + 4) << 32;
 #endif
 #endif /* SHIFT > 2 */
+    qemu_mutex_unlock_iothread();
 #ifdef USE_KQEMU
     env->last_io_time = cpu_get_time_fast();
 #endif
@@ -210,6 +212,12 @@ static inline void glue(io_write, SUFFIX)(target_phys_addr_t physaddr,
 
     env->mem_io_vaddr = addr;
     env->mem_io_pc = (unsigned long)retaddr;
+    /* the writes to RAM holding code update the TBs and the dirty
+       flags, not the devices */
+    if (index == (IO_MEM_NOTDIRTY >> IO_MEM_SHIFT))
+        tb_lock_acquire();
+    else
+        qemu_mutex_lock_iothread();
 #if SHIFT <= 2
     io_mem_write[index][SHIFT](io_mem_opaque[index], physaddr, val);
 #else
@@ -221,6 +229,10 @@ static inline void glue(io_write, SUFFIX)(target_phys_addr_t physaddr,
     io_mem_write[index][2](io_mem_opaque[index], physaddr + 4, val >> 32);
 #endif
 #endif /* SHIFT > 2 */
+    if (index == (IO_MEM_NOTDIRTY >> IO_MEM_SHIFT))
+        tb_lock_release();
+    else
+        qemu_mutex_unlock_iothread();
 #ifdef USE_KQEMU
     env->last_io_time = cpu_get_time_fast();
 #endif
@@ -323,6 +335,57 @@ static void glue(glue(slow_st, SUFFIX), MMUSUFFIX)(target_ulong addr,
     }
 }
 
+#ifdef USE_VCPU_THREADS
+/* Store 'val' only if the memory still holds 'old', for the atomic
+   instructions of the guest.  Return zero if another VCPU modified it.
+   MMIO accesses and accesses crossing a page are done as plain stores. */
+int glue(glue(__cmpxchg, SUFFIX), MMUSUFFIX)(target_ulong addr,
+                                             DATA_TYPE old, DATA_TYPE val,
+                                             int mmu_idx, void *retaddr)
+{
+    target_ulong tlb_addr;
+    unsigned long host;
+    int index;
+
+#ifdef ALIGNED_ONLY
+    if ((addr & (DATA_SIZE - 1)) != 0)
+        do_unaligned_access(addr, 1, mmu_idx, retaddr);
+#endif
+    index = (addr >> TARGET_PAGE_BITS) & (CPU_TLB_SIZE - 1);
+ redo:
+    tlb_addr = env->tlb_table[mmu_idx][index].addr_write;
+    if ((addr & TARGET_PAGE_MASK) != (tlb_addr & (TARGET_PAGE_MASK | TLB_INVALID_MASK))) {
+        tlb_fill(addr, 1, mmu_idx, retaddr);
+        goto redo;
+    }
+    if ((tlb_addr & TLB_MMIO) ||
+        ((addr & ~TARGET_PAGE_MASK) + DATA_SIZE - 1) >= TARGET_PAGE_SIZE) {
+        glue(glue(slow_st, SUFFIX), MMUSUFFIX)(addr, val, mmu_idx, retaddr);
+        return 1;
+    }
+    host = addr + env->tlb_table[mmu_idx][index].addend;
+    if (tlb_addr & TLB_NOTDIRTY) {
+        env->mem_io_vaddr = addr;
+        env->mem_io_pc = (unsigned long)retaddr;
+        cpu_notdirty_atomic(host - (unsigned long)phys_ram_base, DATA_SIZE);
+    }
+#if DATA_SIZE == 8 && HOST_LONG_BITS != 64
+    glue(glue(st, SUFFIX), _raw)((uint8_t *)host, val);
+    return 1;
+#else
+    {
+        DATA_TYPE old_raw, val_raw;
+
+        /* compare in the byte order of the guest memory */
+        glue(glue(st, SUFFIX), _raw)((uint8_t *)&old_raw, old);
+        glue(glue(st, SUFFIX), _raw)((uint8_t *)&val_raw, val);
+        return __sync_bool_compare_and_swap((DATA_TYPE *)host,
+                                            old_raw, val_raw);
+    }
+#endif
+}
+#endif
+
 #endif /* !defined(SOFTMMU_CODE_ACCESS) */
 
 #undef READ_ACCESS_TYPE
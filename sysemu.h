@@ -21,6 +21,9 @@ void qemu_del_vm_change_state_handler(VMChangeStateEntry *e);
 void vm_start(void);
 void vm_stop(int reason);
 
+/* percentage of the time the CPUs are kept from running */
+extern int cpu_throttle_percentage;
+
 int64_t cpu_get_ticks(void);
 void cpu_enable_ticks(void);
 void cpu_disable_ticks(void);
@@ -40,7 +43,9 @@ void qemu_system_powerdown(void);
 void qemu_system_reset(void);
 
 void do_savevm(const char *name);
-void do_loadvm(const char *name);
+void do_loadvm(int lazy, const char *name);
+void do_migrate_set_compression(const char *codec, int has_threads,
+                                int threads, int has_level, int level);
 void do_delvm(const char *name);
 void do_info_snapshots(void);
 
@@ -53,6 +58,14 @@ int qemu_savevm_state_iterate(QEMUFile *f);
 int qemu_savevm_state_complete(QEMUFile *f);
 int qemu_savevm_state(QEMUFile *f);
 int qemu_loadvm_state(QEMUFile *f);
+/* The VM state area of the snapshot that f saves or loads, or NULL if f is
+   not a snapshot.  State handlers may keep data there, beside the stream,
+   that is meant to stay at the same offset from one snapshot to the next. */
+BlockDriverState *qemu_savevm_snapshot_area(QEMUFile *f, int64_t *offset);
+/* non-zero if the snapshot that f loads may be read after the guest runs */
+int qemu_loadvm_snapshot_lazy(QEMUFile *f);
+/* Guest RAM no longer matches the RAM image of the last snapshot */
+void ram_snapshot_invalidate(void);
 
 #ifdef _WIN32
 /* Polling handling */
@@ -89,6 +102,8 @@ extern const char *keyboard_layout;
 extern int win2k_install_hack;
 extern int rtc_td_hack;
 extern int alt_grab;
+extern int virtio_coalesce_max_pending;
+extern int virtio_coalesce_max_delay;
 extern int usb_enabled;
 extern int smp_cpus;
 extern int cursor_hide;
@@ -137,6 +152,7 @@ typedef struct DriveInfo {
     int used;
     int drive_opt_idx;
     BlockInterfaceErrorAction onerror;
+    int merge_max;
     char serial[21];
 } DriveInfo;
 
@@ -144,6 +160,9 @@ typedef struct DriveInfo {
 #define MAX_SCSI_DEVS	7
 #define MAX_DRIVES 32
 
+/* in bytes, for the drives that merge adjacent guest requests */
+#define DRIVE_DEFAULT_MERGE_MAX (256 * 1024)
+
 extern int nb_drives;
 extern DriveInfo drives_table[MAX_DRIVES+1];
 
@@ -153,6 +172,7 @@ extern void drive_uninit(BlockDriverState *bdrv);
 extern void drive_remove(int index);
 extern const char *drive_get_serial(BlockDriverState *bdrv);
 extern BlockInterfaceErrorAction drive_get_onerror(BlockDriverState *bdrv);
+extern int drive_get_merge_max(BlockDriverState *bdrv);
 
 struct drive_opt {
     const char *file;
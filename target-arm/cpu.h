@@ -183,6 +183,7 @@ typedef struct CPUARMState {
     struct mmon_state *mmon_entry;
 #else
     uint32_t mmon_addr;
+    uint32_t mmon_val[2]; /* value loaded by ldrex, for -vcpu-threads */
 #endif
 
     /* iwMMXt coprocessor state.  */
@@ -868,7 +868,7 @@ void do_interrupt(CPUARMState *env)
     env->thumb = 0;
     env->regs[14] = env->regs[15] + offset;
     env->regs[15] = addr;
-    env->interrupt_request |= CPU_INTERRUPT_EXITTB;
+    cpu_interrupt(env, CPU_INTERRUPT_EXITTB);
 }
 
 /* Check section/page access permissions.
@@ -1268,9 +1268,12 @@ void HELPER(set_cp)(CPUState *env, uint32_t insn, uint32_t val)
     int src = (insn >> 16) & 0xf;
     int operand = insn & 0xf;
 
-    if (env->cp[cp_num].cp_write)
+    if (env->cp[cp_num].cp_write) {
+        qemu_mutex_lock_iothread();
         env->cp[cp_num].cp_write(env->cp[cp_num].opaque,
                                  cp_info, src, operand, val);
+        qemu_mutex_unlock_iothread();
+    }
 }
 
 uint32_t HELPER(get_cp)(CPUState *env, uint32_t insn)
@@ -1279,11 +1282,15 @@ uint32_t HELPER(get_cp)(CPUState *env, uint32_t insn)
     int cp_info = (insn >> 5) & 7;
     int dest = (insn >> 16) & 0xf;
     int operand = insn & 0xf;
+    uint32_t val = 0;
 
-    if (env->cp[cp_num].cp_read)
-        return env->cp[cp_num].cp_read(env->cp[cp_num].opaque,
-                                       cp_info, dest, operand);
-    return 0;
+    if (env->cp[cp_num].cp_read) {
+        qemu_mutex_lock_iothread();
+        val = env->cp[cp_num].cp_read(env->cp[cp_num].opaque,
+                                      cp_info, dest, operand);
+        qemu_mutex_unlock_iothread();
+    }
+    return val;
 }
 
 /* Return basic MPU access permission bits.  */
@@ -71,6 +71,10 @@ DEF_HELPER_3(set_r13_banked, void, env, i32, i32)
 DEF_HELPER_2(mark_exclusive, void, env, i32)
 DEF_HELPER_2(test_exclusive, i32, env, i32)
 DEF_HELPER_1(clrex, void, env)
+#ifdef USE_VCPU_THREADS
+DEF_HELPER_3(strex, i32, i32, i32, i32)
+DEF_HELPER_4(strexd, i32, i32, i32, i32, i32)
+#endif
 
 DEF_HELPER_1(get_user_reg, i32, i32)
 DEF_HELPER_2(set_user_reg, void, i32, i32)
@@ -112,6 +112,46 @@ void tlb_fill (target_ulong addr, int is_write, int mmu_idx, void *retaddr)
     }
     env = saved_env;
 }
+
+#ifdef USE_VCPU_THREADS
+/* Store exclusive with -vcpu-threads: the store only happens if the
+   memory still holds the value read by the load exclusive.  Returns
+   nonzero if it does not.  */
+uint32_t HELPER(strex)(uint32_t addr, uint32_t val, uint32_t flags)
+{
+    int mmu_idx = flags >> 4;
+    void *retaddr = GETPC();
+    int ok;
+
+    switch (flags & 0xf) {
+    case 1:
+        ok = __cmpxchgb_mmu(addr, env->mmon_val[0], val, mmu_idx, retaddr);
+        break;
+    case 2:
+        ok = __cmpxchgw_mmu(addr, env->mmon_val[0], val, mmu_idx, retaddr);
+        break;
+    default:
+        ok = __cmpxchgl_mmu(addr, env->mmon_val[0], val, mmu_idx, retaddr);
+        break;
+    }
+    return !ok;
+}
+
+uint32_t HELPER(strexd)(uint32_t addr, uint32_t lo, uint32_t hi,
+                        uint32_t mmu_idx)
+{
+    uint64_t old, val;
+
+#ifdef TARGET_WORDS_BIGENDIAN
+    old = ((uint64_t)env->mmon_val[0] << 32) | env->mmon_val[1];
+    val = ((uint64_t)lo << 32) | hi;
+#else
+    old = ((uint64_t)env->mmon_val[1] << 32) | env->mmon_val[0];
+    val = ((uint64_t)hi << 32) | lo;
+#endif
+    return !__cmpxchgq_mmu(addr, old, val, mmu_idx, GETPC());
+}
+#endif
 #endif
 
 /* FIXME: Pass an axplicit pointer to QF to CPUState, and move saturating
@@ -857,6 +857,55 @@ static inline void gen_st32(TCGv val, TCGv addr, int index)
     dead_tmp(val);
 }
 
+/* Record word 'n' of the value read by a load exclusive.  */
+static inline void gen_load_exclusive(TCGv val, int n)
+{
+#ifdef USE_VCPU_THREADS
+    if (vcpu_threads)
+        tcg_gen_st_i32(val, cpu_env, offsetof(CPUState, mmon_val[n]));
+#endif
+}
+
+/* Store exclusive of 'size' bytes, val2 is the word at addr + 4 of a
+   doubleword.  With -vcpu-threads T0 is set to 1 if another VCPU
+   modified the memory since the load exclusive.  */
+static void gen_store_exclusive(TCGv val, TCGv val2, TCGv addr, int size,
+                                int index)
+{
+#ifdef USE_VCPU_THREADS
+    if (vcpu_threads) {
+        TCGv tmp;
+        if (size == 8) {
+            tmp = tcg_const_i32(index);
+            gen_helper_strexd(cpu_T[0], addr, val, val2, tmp);
+            dead_tmp(val2);
+        } else {
+            tmp = tcg_const_i32(size | (index << 4));
+            gen_helper_strex(cpu_T[0], addr, val, tmp);
+        }
+        tcg_temp_free_i32(tmp);
+        dead_tmp(val);
+        return;
+    }
+#endif
+    switch (size) {
+    case 1:
+        gen_st8(val, addr, index);
+        break;
+    case 2:
+        gen_st16(val, addr, index);
+        break;
+    case 4:
+        gen_st32(val, addr, index);
+        break;
+    default:
+        gen_st32(val, addr, index);
+        tcg_gen_addi_i32(addr, addr, 4);
+        gen_st32(val2, addr, index);
+        break;
+    }
+}
+
 static inline void gen_movl_T0_reg(DisasContext *s, int reg)
 {
     load_reg_var(s, cpu_T[0], reg);
@@ -6302,19 +6351,24 @@ static void disas_arm_insn(CPUState * env, DisasContext *s)
                             switch (op1) {
                             case 0: /* ldrex */
                                 tmp = gen_ld32(addr, IS_USER(s));
+                                gen_load_exclusive(tmp, 0);
                                 break;
                             case 1: /* ldrexd */
                                 tmp = gen_ld32(addr, IS_USER(s));
+                                gen_load_exclusive(tmp, 0);
                                 store_reg(s, rd, tmp);
                                 tcg_gen_addi_i32(addr, addr, 4);
                                 tmp = gen_ld32(addr, IS_USER(s));
+                                gen_load_exclusive(tmp, 1);
                                 rd++;
                                 break;
                             case 2: /* ldrexb */
                                 tmp = gen_ld8u(addr, IS_USER(s));
+                                gen_load_exclusive(tmp, 0);
                                 break;
                             case 3: /* ldrexh */
                                 tmp = gen_ld16u(addr, IS_USER(s));
+                                gen_load_exclusive(tmp, 0);
                                 break;
                             default:
                                 abort();
@@ -6329,19 +6383,21 @@ static void disas_arm_insn(CPUState * env, DisasContext *s)
                             tmp = load_reg(s,rm);
                             switch (op1) {
                             case 0:  /*  strex */
-                                gen_st32(tmp, addr, IS_USER(s));
+                                gen_store_exclusive(tmp, tmp, addr, 4,
+                                                    IS_USER(s));
                                 break;
                             case 1: /*  strexd */
-                                gen_st32(tmp, addr, IS_USER(s));
-                                tcg_gen_addi_i32(addr, addr, 4);
-                                tmp = load_reg(s, rm + 1);
-                                gen_st32(tmp, addr, IS_USER(s));
+                                tmp2 = load_reg(s, rm + 1);
+                                gen_store_exclusive(tmp, tmp2, addr, 8,
+                                                    IS_USER(s));
                                 break;
                             case 2: /*  strexb */
-                                gen_st8(tmp, addr, IS_USER(s));
+                                gen_store_exclusive(tmp, tmp, addr, 1,
+                                                    IS_USER(s));
                                 break;
                             case 3: /* strexh */
-                                gen_st16(tmp, addr, IS_USER(s));
+                                gen_store_exclusive(tmp, tmp, addr, 2,
+                                                    IS_USER(s));
                                 break;
                             default:
                                 abort();
@@ -7095,6 +7151,7 @@ static int disas_thumb2_insn(CPUState *env, DisasContext *s, uint16_t insn_hw1)
                 if (insn & (1 << 20)) {
                     gen_helper_mark_exclusive(cpu_env, cpu_T[1]);
                     tmp = gen_ld32(addr, IS_USER(s));
+                    gen_load_exclusive(tmp, 0);
                     store_reg(s, rd, tmp);
                 } else {
                     int label = gen_new_label();
@@ -7102,7 +7159,7 @@ static int disas_thumb2_insn(CPUState *env, DisasContext *s, uint16_t insn_hw1)
                     tcg_gen_brcondi_i32(TCG_COND_NE, cpu_T[0],
                                         0, label);
                     tmp = load_reg(s, rs);
-                    gen_st32(tmp, cpu_T[1], IS_USER(s));
+                    gen_store_exclusive(tmp, tmp, cpu_T[1], 4, IS_USER(s));
                     gen_set_label(label);
                     gen_movl_reg_T0(s, rd);
                 }
@@ -7131,9 +7188,8 @@ static int disas_thumb2_insn(CPUState *env, DisasContext *s, uint16_t insn_hw1)
                 store_reg(s, 15, tmp);
             } else {
                 /* Load/store exclusive byte/halfword/doubleword.  */
-                /* ??? These are not really atomic.  However we know
-                   we never have multiple CPUs running in parallel,
-                   so it is good enough.  */
+                /* These are only atomic with -vcpu-threads, which is the
+                   only case where multiple CPUs run in parallel.  */
                 op = (insn >> 4) & 0x3;
                 /* Must use a global reg for the address because we have
                    a conditional branch in the store instruction.  */
@@ -7152,11 +7208,13 @@ static int disas_thumb2_insn(CPUState *env, DisasContext *s, uint16_t insn_hw1)
                         tmp = gen_ld32(addr, IS_USER(s));
                         tcg_gen_addi_i32(addr, addr, 4);
                         tmp2 = gen_ld32(addr, IS_USER(s));
+                        gen_load_exclusive(tmp2, 1);
                         store_reg(s, rd, tmp2);
                         break;
                     default:
                         goto illegal_op;
                     }
+                    gen_load_exclusive(tmp, 0);
                     store_reg(s, rs, tmp);
                 } else {
                     int label = gen_new_label();
@@ -7166,16 +7224,14 @@ static int disas_thumb2_insn(CPUState *env, DisasContext *s, uint16_t insn_hw1)
                     tmp = load_reg(s, rs);
                     switch (op) {
                     case 0:
-                        gen_st8(tmp, addr, IS_USER(s));
+                        gen_store_exclusive(tmp, tmp, addr, 1, IS_USER(s));
                         break;
                     case 1:
-                        gen_st16(tmp, addr, IS_USER(s));
+                        gen_store_exclusive(tmp, tmp, addr, 2, IS_USER(s));
                         break;
                     case 3:
-                        gen_st32(tmp, addr, IS_USER(s));
-                        tcg_gen_addi_i32(addr, addr, 4);
-                        tmp = load_reg(s, rd);
-                        gen_st32(tmp, addr, IS_USER(s));
+                        tmp2 = load_reg(s, rd);
+                        gen_store_exclusive(tmp, tmp2, addr, 8, IS_USER(s));
                         break;
                     default:
                         goto illegal_op;
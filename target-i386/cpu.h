@@ -593,6 +593,7 @@ typedef struct CPUX86State {
     XMMReg xmm_t0;
     MMXReg mmx_t0;
     target_ulong cc_tmp; /* temporary for rcr/rcl */
+    target_ulong lock_value; /* operand loaded by a locked instruction */
 
     /* sysenter registers */
     uint32_t sysenter_cs;
@@ -5,6 +5,9 @@ DEF_HELPER_FLAGS_1(cc_compute_c, TCG_CALL_PURE, i32, int)
 
 DEF_HELPER_0(lock, void)
 DEF_HELPER_0(unlock, void)
+#ifdef USE_VCPU_THREADS
+DEF_HELPER_3(atomic_st, void, tl, tl, i32)
+#endif
 DEF_HELPER_2(write_eflags, void, tl, i32)
 DEF_HELPER_0(read_eflags, tl)
 DEF_HELPER_1(divb_AL, void, tl)
@@ -111,11 +111,23 @@ static spinlock_t global_cpu_lock = SPIN_LOCK_UNLOCKED;
 
 void helper_lock(void)
 {
+#ifdef USE_VCPU_THREADS
+    if (vcpu_threads) {
+        cpu_atomic_lock();
+        return;
+    }
+#endif
     spin_lock(&global_cpu_lock);
 }
 
 void helper_unlock(void)
 {
+#ifdef USE_VCPU_THREADS
+    if (vcpu_threads) {
+        cpu_atomic_unlock();
+        return;
+    }
+#endif
     spin_unlock(&global_cpu_lock);
 }
 
@@ -1856,6 +1868,26 @@ void helper_cmpxchg8b(target_ulong a0)
     int eflags;
 
     eflags = helper_cc_compute_all(CC_OP);
+#ifdef USE_VCPU_THREADS
+    if (vcpu_threads) {
+        /* retry until the memory is not modified by another VCPU between
+           the load and the store. No store is done on mismatch. */
+        for(;;) {
+            d = ldq(a0);
+            if (d != (((uint64_t)EDX << 32) | (uint32_t)EAX))
+                break;
+            if (__cmpxchgq_mmu(a0, d, ((uint64_t)ECX << 32) | (uint32_t)EBX,
+                               cpu_mmu_index(env), GETPC())) {
+                CC_SRC = eflags | CC_Z;
+                return;
+            }
+        }
+        EDX = (uint32_t)(d >> 32);
+        EAX = (uint32_t)d;
+        CC_SRC = eflags & ~CC_Z;
+        return;
+    }
+#endif
     d = ldq(a0);
     if (d == (((uint64_t)EDX << 32) | (uint32_t)EAX)) {
         stq(a0, ((uint64_t)ECX << 32) | (uint32_t)EBX);
@@ -2911,7 +2943,9 @@ void helper_write_crN(int reg, target_ulong t0)
         break;
     case 8:
         if (!(env->hflags2 & HF2_VINTR_MASK)) {
+            qemu_mutex_lock_iothread();
             cpu_set_apic_tpr(env, t0);
+            qemu_mutex_unlock_iothread();
         }
         env->v_tpr = t0 & 0x0f;
         break;
@@ -3013,7 +3047,9 @@ void helper_wrmsr(void)
         env->sysenter_eip = val;
         break;
     case MSR_IA32_APICBASE:
+        qemu_mutex_lock_iothread();
         cpu_set_apic_base(env, val);
+        qemu_mutex_unlock_iothread();
         break;
     case MSR_EFER:
         {
@@ -3408,7 +3444,9 @@ static void fpu_raise_exception(void)
     }
 #if !defined(CONFIG_USER_ONLY)
     else {
+        qemu_mutex_lock_iothread();
         cpu_set_ferr(env);
+        qemu_mutex_unlock_iothread();
     }
 #endif
 }
@@ -4787,6 +4825,37 @@ void tlb_fill(target_ulong addr, int is_write, int mmu_idx, void *retaddr)
 }
 #endif
 
+#ifdef USE_VCPU_THREADS
+/* store of a locked read-modify-write instruction: it is restarted if
+   another VCPU modified the memory since the load */
+void helper_atomic_st(target_ulong a0, target_ulong t0, uint32_t idx)
+{
+    target_ulong old = env->lock_value;
+    int mmu_idx = (idx >> 2) - 1;
+    void *retaddr = GETPC();
+    int ok;
+
+    switch(idx & 3) {
+    case 0:
+        ok = __cmpxchgb_mmu(a0, old, t0, mmu_idx, retaddr);
+        break;
+    case 1:
+        ok = __cmpxchgw_mmu(a0, old, t0, mmu_idx, retaddr);
+        break;
+    case 2:
+        ok = __cmpxchgl_mmu(a0, old, t0, mmu_idx, retaddr);
+        break;
+    default:
+        ok = __cmpxchgq_mmu(a0, old, t0, mmu_idx, retaddr);
+        break;
+    }
+    if (!ok) {
+        env->exception_index = -1;
+        cpu_loop_exit();
+    }
+}
+#endif
+
 /* Secure Virtual Machine helpers */
 
 #if defined(CONFIG_USER_ONLY)
@@ -4983,7 +5052,7 @@ void helper_vmrun(int aflag, int next_eip_addend)
     env->hflags2 |= HF2_GIF_MASK;
 
     if (int_ctl & V_IRQ_MASK) {
-        env->interrupt_request |= CPU_INTERRUPT_VIRQ;
+        cpu_interrupt(env, CPU_INTERRUPT_VIRQ);
     }
 
     /* maybe we need to inject an event */
@@ -5288,7 +5357,7 @@ void helper_vmexit(uint32_t exit_code, uint64_t exit_info_1)
     env->hflags &= ~HF_SVMI_MASK;
     env->intercept = 0;
     env->intercept_exceptions = 0;
-    env->interrupt_request &= ~CPU_INTERRUPT_VIRQ;
+    cpu_reset_interrupt(env, CPU_INTERRUPT_VIRQ);
     env->tsc_offset = 0;
 
     env->gdt.base  = ldq_phys(env->vm_hsave + offsetof(struct vmcb, save.gdtr.base));
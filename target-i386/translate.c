@@ -80,6 +80,12 @@ static TCGv cpu_tmp5, cpu_tmp6;
 static int x86_64_hregs;
 #endif
 
+#ifdef USE_VCPU_THREADS
+/* with -vcpu-threads, 1 while translating a locked instruction and 2
+   once its memory operand has been loaded */
+static int x86_lock_insn;
+#endif
+
 typedef struct DisasContext {
     /* current insn context */
     int override; /* -1 if no override */
@@ -549,6 +555,13 @@ static inline void gen_op_ld_v(int idx, TCGv t0, TCGv a0)
 #endif
         break;
     }
+#ifdef USE_VCPU_THREADS
+    if (x86_lock_insn) {
+        /* the store checks that the memory still holds this value */
+        tcg_gen_st_tl(t0, cpu_env, offsetof(CPUState, lock_value));
+        x86_lock_insn = 2;
+    }
+#endif
 }
 
 /* XXX: always use ldu or lds */
@@ -570,6 +583,14 @@ static inline void gen_op_ld_T1_A0(int idx)
 static inline void gen_op_st_v(int idx, TCGv t0, TCGv a0)
 {
     int mem_index = (idx >> 2) - 1;
+#ifdef USE_VCPU_THREADS
+    if (x86_lock_insn == 2) {
+        TCGv_i32 tmp = tcg_const_i32(idx);
+        gen_helper_atomic_st(a0, t0, tmp);
+        tcg_temp_free_i32(tmp);
+        return;
+    }
+#endif
     switch(idx & 3) {
     case 0:
         tcg_gen_qemu_st8(t0, a0, mem_index);
@@ -4086,6 +4107,16 @@ static target_ulong disas_insn(DisasContext *s, target_ulong pc_start)
     /* lock generation */
     if (prefixes & PREFIX_LOCK)
         gen_helper_lock();
+#ifdef USE_VCPU_THREADS
+    /* the atomic store restarts the instruction if another VCPU
+       modified its memory operand */
+    x86_lock_insn = 0;
+    if ((prefixes & PREFIX_LOCK) && vcpu_threads) {
+        gen_update_cc_op(s);
+        gen_jmp_im(pc_start - s->cs_base);
+        x86_lock_insn = 1;
+    }
+#endif
 
     /* now check op code */
  reswitch:
@@ -4765,10 +4796,14 @@ static target_ulong disas_insn(DisasContext *s, target_ulong pc_start)
                 gen_set_label(label2);
             } else {
                 tcg_gen_mov_tl(t1, t0);
-                gen_op_mov_reg_v(ot, R_EAX, t0);
                 gen_set_label(label1);
-                /* always store */
+                /* always store, before EAX so that a faulting store
+                   can restart the instruction */
                 gen_op_st_v(ot + s->mem_index, t1, a0);
+                label2 = gen_new_label();
+                tcg_gen_brcondi_tl(TCG_COND_EQ, t2, 0, label2);
+                gen_op_mov_reg_v(ot, R_EAX, t0);
+                gen_set_label(label2);
             }
             tcg_gen_mov_tl(cpu_cc_src, t0);
             tcg_gen_mov_tl(cpu_cc_dst, t2);
@@ -5199,6 +5234,13 @@ static target_ulong disas_insn(DisasContext *s, target_ulong pc_start)
             /* for xchg, lock is implicit */
             if (!(prefixes & PREFIX_LOCK))
                 gen_helper_lock();
+#ifdef USE_VCPU_THREADS
+            if (vcpu_threads && !x86_lock_insn) {
+                gen_update_cc_op(s);
+                gen_jmp_im(pc_start - s->cs_base);
+                x86_lock_insn = 1;
+            }
+#endif
             gen_op_ld_T1_A0(ot + s->mem_index);
             gen_op_st_T0_A0(ot + s->mem_index);
             if (!(prefixes & PREFIX_LOCK))
@@ -7490,10 +7532,16 @@ static target_ulong disas_insn(DisasContext *s, target_ulong pc_start)
     /* lock generation */
     if (s->prefix & PREFIX_LOCK)
         gen_helper_unlock();
+#ifdef USE_VCPU_THREADS
+    x86_lock_insn = 0;
+#endif
     return s->pc;
  illegal_op:
     if (s->prefix & PREFIX_LOCK)
         gen_helper_unlock();
+#ifdef USE_VCPU_THREADS
+    x86_lock_insn = 0;
+#endif
     /* XXX: ensure that no lock was generated */
     gen_exception(s, EXCP06_ILLOP, pc_start - s->cs_base);
     return s->pc;
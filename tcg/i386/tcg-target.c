@@ -433,12 +433,9 @@ static void tcg_out_qemu_ld(TCGContext *s, const TCGArg *args,
 {
     int addr_reg, data_reg, data_reg2, r0, r1, mem_index, s_bits, bswap;
 #if defined(CONFIG_SOFTMMU)
-    uint8_t *label1_ptr, *label2_ptr;
+    TCGLdstSlowPath *l;
 #endif
 #if TARGET_LONG_BITS == 64
-#if defined(CONFIG_SOFTMMU)
-    uint8_t *label3_ptr;
-#endif
     int addr_reg2;
 #endif
 
@@ -480,80 +477,32 @@ static void tcg_out_qemu_ld(TCGContext *s, const TCGArg *args,
     tcg_out_modrm_offset(s, 0x3b, r0, r1, 0);
     
     tcg_out_mov(s, r0, addr_reg);
-    
-#if TARGET_LONG_BITS == 32
-    /* je label1 */
-    tcg_out8(s, 0x70 + JCC_JE);
-    label1_ptr = s->code_ptr;
-    s->code_ptr++;
-#else
-    /* jne label3 */
-    tcg_out8(s, 0x70 + JCC_JNE);
-    label3_ptr = s->code_ptr;
-    s->code_ptr++;
-    
+
+    l = tcg_new_ldst_slow_path();
+    l->is_ld = 1;
+    l->opc = opc;
+    l->mem_index = mem_index;
+    l->data_reg = data_reg;
+    l->data_reg2 = data_reg2;
+    l->addr_reg = addr_reg;
+
+    /* jne slow_path */
+    tcg_out8(s, 0x0f);
+    tcg_out8(s, 0x80 + JCC_JNE);
+    l->label_ptr[0] = s->code_ptr;
+    s->code_ptr += 4;
+#if TARGET_LONG_BITS == 64
+    l->addr_reg2 = addr_reg2;
+
     /* cmp 4(r1), addr_reg2 */
     tcg_out_modrm_offset(s, 0x3b, addr_reg2, r1, 4);
 
-    /* je label1 */
-    tcg_out8(s, 0x70 + JCC_JE);
-    label1_ptr = s->code_ptr;
-    s->code_ptr++;
-    
-    /* label3: */
-    *label3_ptr = s->code_ptr - label3_ptr - 1;
-#endif
-
-    /* XXX: move that code at the end of the TB */
-#if TARGET_LONG_BITS == 32
-    tcg_out_movi(s, TCG_TYPE_I32, TCG_REG_EDX, mem_index);
-#else
-    tcg_out_mov(s, TCG_REG_EDX, addr_reg2);
-    tcg_out_movi(s, TCG_TYPE_I32, TCG_REG_ECX, mem_index);
+    /* jne slow_path */
+    tcg_out8(s, 0x0f);
+    tcg_out8(s, 0x80 + JCC_JNE);
+    l->label_ptr[1] = s->code_ptr;
+    s->code_ptr += 4;
 #endif
-    tcg_out8(s, 0xe8);
-    tcg_out32(s, (tcg_target_long)qemu_ld_helpers[s_bits] - 
-              (tcg_target_long)s->code_ptr - 4);
-
-    switch(opc) {
-    case 0 | 4:
-        /* movsbl */
-        tcg_out_modrm(s, 0xbe | P_EXT, data_reg, TCG_REG_EAX);
-        break;
-    case 1 | 4:
-        /* movswl */
-        tcg_out_modrm(s, 0xbf | P_EXT, data_reg, TCG_REG_EAX);
-        break;
-    case 0:
-        /* movzbl */
-        tcg_out_modrm(s, 0xb6 | P_EXT, data_reg, TCG_REG_EAX);
-        break;
-    case 1:
-        /* movzwl */
-        tcg_out_modrm(s, 0xb7 | P_EXT, data_reg, TCG_REG_EAX);
-        break;
-    case 2:
-    default:
-        tcg_out_mov(s, data_reg, TCG_REG_EAX);
-        break;
-    case 3:
-        if (data_reg == TCG_REG_EDX) {
-            tcg_out_opc(s, 0x90 + TCG_REG_EDX); /* xchg %edx, %eax */
-            tcg_out_mov(s, data_reg2, TCG_REG_EAX);
-        } else {
-            tcg_out_mov(s, data_reg, TCG_REG_EAX);
-            tcg_out_mov(s, data_reg2, TCG_REG_EDX);
-        }
-        break;
-    }
-
-    /* jmp label2 */
-    tcg_out8(s, 0xeb);
-    label2_ptr = s->code_ptr;
-    s->code_ptr++;
-    
-    /* label1: */
-    *label1_ptr = s->code_ptr - label1_ptr - 1;
 
     /* add x(r1), r0 */
     tcg_out_modrm_offset(s, 0x03, r0, r1, offsetof(CPUTLBEntry, addend) - 
@@ -633,8 +582,8 @@ static void tcg_out_qemu_ld(TCGContext *s, const TCGArg *args,
     }
 
 #if defined(CONFIG_SOFTMMU)
-    /* label2: */
-    *label2_ptr = s->code_ptr - label2_ptr - 1;
+    /* the slow path returns here */
+    l->raddr = s->code_ptr;
 #endif
 }
 
@@ -644,12 +593,9 @@ static void tcg_out_qemu_st(TCGContext *s, const TCGArg *args,
 {
     int addr_reg, data_reg, data_reg2, r0, r1, mem_index, s_bits, bswap;
 #if defined(CONFIG_SOFTMMU)
-    uint8_t *label1_ptr, *label2_ptr;
+    TCGLdstSlowPath *l;
 #endif
 #if TARGET_LONG_BITS == 64
-#if defined(CONFIG_SOFTMMU)
-    uint8_t *label3_ptr;
-#endif
     int addr_reg2;
 #endif
 
@@ -692,102 +638,32 @@ static void tcg_out_qemu_st(TCGContext *s, const TCGArg *args,
     tcg_out_modrm_offset(s, 0x3b, r0, r1, 0);
     
     tcg_out_mov(s, r0, addr_reg);
-    
-#if TARGET_LONG_BITS == 32
-    /* je label1 */
-    tcg_out8(s, 0x70 + JCC_JE);
-    label1_ptr = s->code_ptr;
-    s->code_ptr++;
-#else
-    /* jne label3 */
-    tcg_out8(s, 0x70 + JCC_JNE);
-    label3_ptr = s->code_ptr;
-    s->code_ptr++;
-    
+
+    l = tcg_new_ldst_slow_path();
+    l->is_ld = 0;
+    l->opc = opc;
+    l->mem_index = mem_index;
+    l->data_reg = data_reg;
+    l->data_reg2 = data_reg2;
+    l->addr_reg = addr_reg;
+
+    /* jne slow_path */
+    tcg_out8(s, 0x0f);
+    tcg_out8(s, 0x80 + JCC_JNE);
+    l->label_ptr[0] = s->code_ptr;
+    s->code_ptr += 4;
+#if TARGET_LONG_BITS == 64
+    l->addr_reg2 = addr_reg2;
+
     /* cmp 4(r1), addr_reg2 */
     tcg_out_modrm_offset(s, 0x3b, addr_reg2, r1, 4);
 
-    /* je label1 */
-    tcg_out8(s, 0x70 + JCC_JE);
-    label1_ptr = s->code_ptr;
-    s->code_ptr++;
-    
-    /* label3: */
-    *label3_ptr = s->code_ptr - label3_ptr - 1;
-#endif
-
-    /* XXX: move that code at the end of the TB */
-#if TARGET_LONG_BITS == 32
-    if (opc == 3) {
-        tcg_out_mov(s, TCG_REG_EDX, data_reg);
-        tcg_out_mov(s, TCG_REG_ECX, data_reg2);
-        tcg_out8(s, 0x6a); /* push Ib */
-        tcg_out8(s, mem_index);
-        tcg_out8(s, 0xe8);
-        tcg_out32(s, (tcg_target_long)qemu_st_helpers[s_bits] - 
-                  (tcg_target_long)s->code_ptr - 4);
-        tcg_out_addi(s, TCG_REG_ESP, 4);
-    } else {
-        switch(opc) {
-        case 0:
-            /* movzbl */
-            tcg_out_modrm(s, 0xb6 | P_EXT, TCG_REG_EDX, data_reg);
-            break;
-        case 1:
-            /* movzwl */
-            tcg_out_modrm(s, 0xb7 | P_EXT, TCG_REG_EDX, data_reg);
-            break;
-        case 2:
-            tcg_out_mov(s, TCG_REG_EDX, data_reg);
-            break;
-        }
-        tcg_out_movi(s, TCG_TYPE_I32, TCG_REG_ECX, mem_index);
-        tcg_out8(s, 0xe8);
-        tcg_out32(s, (tcg_target_long)qemu_st_helpers[s_bits] - 
-                  (tcg_target_long)s->code_ptr - 4);
-    }
-#else
-    if (opc == 3) {
-        tcg_out_mov(s, TCG_REG_EDX, addr_reg2);
-        tcg_out8(s, 0x6a); /* push Ib */
-        tcg_out8(s, mem_index);
-        tcg_out_opc(s, 0x50 + data_reg2); /* push */
-        tcg_out_opc(s, 0x50 + data_reg); /* push */
-        tcg_out8(s, 0xe8);
-        tcg_out32(s, (tcg_target_long)qemu_st_helpers[s_bits] - 
-                  (tcg_target_long)s->code_ptr - 4);
-        tcg_out_addi(s, TCG_REG_ESP, 12);
-    } else {
-        tcg_out_mov(s, TCG_REG_EDX, addr_reg2);
-        switch(opc) {
-        case 0:
-            /* movzbl */
-            tcg_out_modrm(s, 0xb6 | P_EXT, TCG_REG_ECX, data_reg);
-            break;
-        case 1:
-            /* movzwl */
-            tcg_out_modrm(s, 0xb7 | P_EXT, TCG_REG_ECX, data_reg);
-            break;
-        case 2:
-            tcg_out_mov(s, TCG_REG_ECX, data_reg);
-            break;
-        }
-        tcg_out8(s, 0x6a); /* push Ib */
-        tcg_out8(s, mem_index);
-        tcg_out8(s, 0xe8);
-        tcg_out32(s, (tcg_target_long)qemu_st_helpers[s_bits] - 
-                  (tcg_target_long)s->code_ptr - 4);
-        tcg_out_addi(s, TCG_REG_ESP, 4);
-    }
+    /* jne slow_path */
+    tcg_out8(s, 0x0f);
+    tcg_out8(s, 0x80 + JCC_JNE);
+    l->label_ptr[1] = s->code_ptr;
+    s->code_ptr += 4;
 #endif
-    
-    /* jmp label2 */
-    tcg_out8(s, 0xeb);
-    label2_ptr = s->code_ptr;
-    s->code_ptr++;
-    
-    /* label1: */
-    *label1_ptr = s->code_ptr - label1_ptr - 1;
 
     /* add x(r1), r0 */
     tcg_out_modrm_offset(s, 0x03, r0, r1, offsetof(CPUTLBEntry, addend) - 
@@ -848,10 +724,147 @@ static void tcg_out_qemu_st(TCGContext *s, const TCGArg *args,
     }
 
 #if defined(CONFIG_SOFTMMU)
-    /* label2: */
-    *label2_ptr = s->code_ptr - label2_ptr - 1;
+    /* the slow path returns here */
+    l->raddr = s->code_ptr;
+#endif
+}
+
+#if defined(CONFIG_SOFTMMU)
+/* TLB miss: the address is in r0 (EAX), call the helper and go back
+   to the end of the fast path */
+static void tcg_out_ldst_slow_path(TCGContext *s, TCGLdstSlowPath *l)
+{
+    int opc, s_bits, mem_index, data_reg, data_reg2;
+#if TARGET_LONG_BITS == 64
+    int addr_reg2 = l->addr_reg2;
+#endif
+
+    opc = l->opc;
+    s_bits = opc & 3;
+    mem_index = l->mem_index;
+    data_reg = l->data_reg;
+    data_reg2 = l->data_reg2;
+
+    /* slow_path: */
+    *(uint32_t *)l->label_ptr[0] = s->code_ptr - l->label_ptr[0] - 4;
+    if (l->label_ptr[1]) {
+        *(uint32_t *)l->label_ptr[1] = s->code_ptr - l->label_ptr[1] - 4;
+    }
+
+    if (l->is_ld) {
+#if TARGET_LONG_BITS == 32
+        tcg_out_movi(s, TCG_TYPE_I32, TCG_REG_EDX, mem_index);
+#else
+        tcg_out_mov(s, TCG_REG_EDX, addr_reg2);
+        tcg_out_movi(s, TCG_TYPE_I32, TCG_REG_ECX, mem_index);
+#endif
+        tcg_out8(s, 0xe8);
+        tcg_out32(s, (tcg_target_long)qemu_ld_helpers[s_bits] - 
+                  (tcg_target_long)s->code_ptr - 4);
+
+        switch(opc) {
+        case 0 | 4:
+            /* movsbl */
+            tcg_out_modrm(s, 0xbe | P_EXT, data_reg, TCG_REG_EAX);
+            break;
+        case 1 | 4:
+            /* movswl */
+            tcg_out_modrm(s, 0xbf | P_EXT, data_reg, TCG_REG_EAX);
+            break;
+        case 0:
+            /* movzbl */
+            tcg_out_modrm(s, 0xb6 | P_EXT, data_reg, TCG_REG_EAX);
+            break;
+        case 1:
+            /* movzwl */
+            tcg_out_modrm(s, 0xb7 | P_EXT, data_reg, TCG_REG_EAX);
+            break;
+        case 2:
+        default:
+            tcg_out_mov(s, data_reg, TCG_REG_EAX);
+            break;
+        case 3:
+            if (data_reg == TCG_REG_EDX) {
+                tcg_out_opc(s, 0x90 + TCG_REG_EDX); /* xchg %edx, %eax */
+                tcg_out_mov(s, data_reg2, TCG_REG_EAX);
+            } else {
+                tcg_out_mov(s, data_reg, TCG_REG_EAX);
+                tcg_out_mov(s, data_reg2, TCG_REG_EDX);
+            }
+            break;
+        }
+    } else {
+#if TARGET_LONG_BITS == 32
+        if (opc == 3) {
+            tcg_out_mov(s, TCG_REG_EDX, data_reg);
+            tcg_out_mov(s, TCG_REG_ECX, data_reg2);
+            tcg_out8(s, 0x6a); /* push Ib */
+            tcg_out8(s, mem_index);
+            tcg_out8(s, 0xe8);
+            tcg_out32(s, (tcg_target_long)qemu_st_helpers[s_bits] - 
+                      (tcg_target_long)s->code_ptr - 4);
+            tcg_out_addi(s, TCG_REG_ESP, 4);
+        } else {
+            switch(opc) {
+            case 0:
+                /* movzbl */
+                tcg_out_modrm(s, 0xb6 | P_EXT, TCG_REG_EDX, data_reg);
+                break;
+            case 1:
+                /* movzwl */
+                tcg_out_modrm(s, 0xb7 | P_EXT, TCG_REG_EDX, data_reg);
+                break;
+            case 2:
+                tcg_out_mov(s, TCG_REG_EDX, data_reg);
+                break;
+            }
+            tcg_out_movi(s, TCG_TYPE_I32, TCG_REG_ECX, mem_index);
+            tcg_out8(s, 0xe8);
+            tcg_out32(s, (tcg_target_long)qemu_st_helpers[s_bits] - 
+                      (tcg_target_long)s->code_ptr - 4);
+        }
+#else
+        if (opc == 3) {
+            tcg_out_mov(s, TCG_REG_EDX, addr_reg2);
+            tcg_out8(s, 0x6a); /* push Ib */
+            tcg_out8(s, mem_index);
+            tcg_out_opc(s, 0x50 + data_reg2); /* push */
+            tcg_out_opc(s, 0x50 + data_reg); /* push */
+            tcg_out8(s, 0xe8);
+            tcg_out32(s, (tcg_target_long)qemu_st_helpers[s_bits] - 
+                      (tcg_target_long)s->code_ptr - 4);
+            tcg_out_addi(s, TCG_REG_ESP, 12);
+        } else {
+            tcg_out_mov(s, TCG_REG_EDX, addr_reg2);
+            switch(opc) {
+            case 0:
+                /* movzbl */
+                tcg_out_modrm(s, 0xb6 | P_EXT, TCG_REG_ECX, data_reg);
+                break;
+            case 1:
+                /* movzwl */
+                tcg_out_modrm(s, 0xb7 | P_EXT, TCG_REG_ECX, data_reg);
+                break;
+            case 2:
+                tcg_out_mov(s, TCG_REG_ECX, data_reg);
+                break;
+            }
+            tcg_out8(s, 0x6a); /* push Ib */
+            tcg_out8(s, mem_index);
+            tcg_out8(s, 0xe8);
+            tcg_out32(s, (tcg_target_long)qemu_st_helpers[s_bits] - 
+                      (tcg_target_long)s->code_ptr - 4);
+            tcg_out_addi(s, TCG_REG_ESP, 4);
+        }
 #endif
+    
+    }
+
+    /* jmp raddr */
+    tcg_out8(s, 0xe9);
+    tcg_out32(s, l->raddr - s->code_ptr - 4);
 }
+#endif
 
 static inline void tcg_out_op(TCGContext *s, int opc, 
                               const TCGArg *args, const int *const_args)
@@ -867,6 +880,10 @@ static inline void tcg_out_op(TCGContext *s, int opc,
     case INDEX_op_goto_tb:
         if (s->tb_jmp_offset) {
             /* direct jump method */
+            /* align the displacement so that other VCPU threads never
+               see a partially patched jump */
+            while (((tcg_target_long)s->code_ptr + 1) & 3)
+                tcg_out8(s, 0x90); /* nop */
             tcg_out8(s, 0xe9); /* jmp im */
             s->tb_jmp_offset[args[0]] = s->code_ptr - s->code_buf;
             tcg_out32(s, 0);
@@ -44,6 +44,9 @@ enum {
 #define TCG_TARGET_STACK_ALIGN 16
 #define TCG_TARGET_CALL_STACK_OFFSET 0
 
+/* the TLB miss paths of qemu_ld/st are emitted after the code of the TB */
+#define TCG_TARGET_QEMU_LDST_SLOW_PATH
+
 /* Note: must be synced with dyngen-exec.h */
 #define TCG_AREG0 TCG_REG_EBP
 #define TCG_AREG1 TCG_REG_EBX
@@ -0,0 +1,801 @@
+/*
+ * Tiny Code Generator for QEMU
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL
+ * THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+ * THE SOFTWARE.
+ */
+
+#include <stdarg.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <inttypes.h>
+
+#include "config.h"
+#include "qemu-common.h"
+
+#define NO_CPU_IO_DEFS
+#include "cpu.h"
+#include "exec-all.h"
+
+#include "tcg-op.h"
+
+/* The optimizer runs on the intermediate code once the translation of
+   a TB is done, before the liveness analysis. It works on one basic
+   block at a time and does:
+
+   - constant folding and propagation: an operation whose inputs are
+     all known constants is replaced by a movi,
+   - copy propagation: the inputs which are copies of another
+     temporary are replaced by the original one, so that the moves
+     become dead and are removed by the liveness analysis,
+   - algebraic simplifications (add x, 0 / and x, -1 / xor x, x ...),
+   - removal of the stores to the CPU state which are overwritten
+     before being read.
+
+   The operations are never moved nor added, so that the index of an
+   operation stays the same (tcg_gen_code_search_pc() relies on
+   it). The parameters are compacted in place: an operation is never
+   rewritten with more parameters than it had. */
+
+#if TCG_TARGET_REG_BITS == 64
+#define CASE_OP_32_64(x)                        \
+        glue(glue(case INDEX_op_, x), _i32):    \
+        glue(glue(case INDEX_op_, x), _i64)
+#else
+#define CASE_OP_32_64(x)                        \
+        glue(glue(case INDEX_op_, x), _i32)
+#endif
+
+#define TCG_OPT_UNDEF    0 /* nothing known about the value */
+#define TCG_OPT_CONST    1 /* 'val' holds the value */
+#define TCG_OPT_COPY     2 /* copy of the temporary 'val' */
+#define TCG_OPT_HAS_COPY 3 /* other temporaries are copies of this one */
+
+typedef struct TCGOptTemp {
+    int state;
+    tcg_target_ulong val;
+    /* circular list of the temporaries holding the same value */
+    uint16_t prev_copy;
+    uint16_t next_copy;
+} TCGOptTemp;
+
+/* maximum number of pending stores tracked in a basic block */
+#define TCG_OPT_MAX_STORES 8
+
+typedef struct TCGOptStore {
+    uint16_t *opc_ptr;
+    TCGArg *args;
+    int nb_args;
+    TCGArg base;
+    tcg_target_long offset;
+    int size;
+} TCGOptStore;
+
+static TCGOptTemp opt_temps[TCG_MAX_TEMPS];
+static TCGOptStore opt_stores[TCG_OPT_MAX_STORES];
+static int nb_opt_stores;
+
+static void tcg_opt_reset_temp(TCGArg t)
+{
+    TCGOptTemp *ts = &opt_temps[t];
+    TCGArg root, i;
+
+    if (ts->state == TCG_OPT_HAS_COPY) {
+        /* the next copy becomes the original of the remaining ones */
+        root = ts->next_copy;
+        if (opt_temps[root].next_copy == t) {
+            opt_temps[root].state = TCG_OPT_UNDEF;
+        } else {
+            for (i = opt_temps[root].next_copy; i != t;
+                 i = opt_temps[i].next_copy) {
+                opt_temps[i].val = root;
+            }
+            opt_temps[root].state = TCG_OPT_HAS_COPY;
+        }
+    } else if (ts->state == TCG_OPT_COPY) {
+        /* the original loses its last copy */
+        if (ts->next_copy == ts->prev_copy) {
+            opt_temps[ts->val].state = TCG_OPT_UNDEF;
+        }
+    }
+    opt_temps[ts->prev_copy].next_copy = ts->next_copy;
+    opt_temps[ts->next_copy].prev_copy = ts->prev_copy;
+    ts->prev_copy = t;
+    ts->next_copy = t;
+    ts->state = TCG_OPT_UNDEF;
+}
+
+static void tcg_opt_reset_all(TCGContext *s)
+{
+    int i;
+
+    for (i = 0; i < s->nb_temps; i++) {
+        opt_temps[i].state = TCG_OPT_UNDEF;
+        opt_temps[i].prev_copy = i;
+        opt_temps[i].next_copy = i;
+    }
+    nb_opt_stores = 0;
+}
+
+/* globals may be modified by helpers */
+static void tcg_opt_reset_globals(TCGContext *s)
+{
+    int i;
+
+    for (i = 0; i < s->nb_globals; i++) {
+        tcg_opt_reset_temp(i);
+    }
+    nb_opt_stores = 0;
+}
+
+static inline int tcg_opt_is_const(TCGArg t)
+{
+    return opt_temps[t].state == TCG_OPT_CONST;
+}
+
+static inline int tcg_opt_are_copies(TCGArg t1, TCGArg t2)
+{
+    TCGArg i;
+
+    if (t1 == t2) {
+        return 1;
+    }
+    if (opt_temps[t1].state != TCG_OPT_COPY &&
+        opt_temps[t1].state != TCG_OPT_HAS_COPY) {
+        return 0;
+    }
+    for (i = opt_temps[t1].next_copy; i != t1; i = opt_temps[i].next_copy) {
+        if (i == t2) {
+            return 1;
+        }
+    }
+    return 0;
+}
+
+static int tcg_opt_is_i64(int op)
+{
+#if TCG_TARGET_REG_BITS == 64
+    switch (op) {
+    case INDEX_op_mov_i64:
+    case INDEX_op_movi_i64:
+    case INDEX_op_add_i64:
+    case INDEX_op_sub_i64:
+    case INDEX_op_mul_i64:
+    case INDEX_op_and_i64:
+    case INDEX_op_or_i64:
+    case INDEX_op_xor_i64:
+    case INDEX_op_shl_i64:
+    case INDEX_op_shr_i64:
+    case INDEX_op_sar_i64:
+    case INDEX_op_brcond_i64:
+#ifdef TCG_TARGET_HAS_ext8s_i64
+    case INDEX_op_ext8s_i64:
+#endif
+#ifdef TCG_TARGET_HAS_ext16s_i64
+    case INDEX_op_ext16s_i64:
+#endif
+#ifdef TCG_TARGET_HAS_ext32s_i64
+    case INDEX_op_ext32s_i64:
+#endif
+#ifdef TCG_TARGET_HAS_neg_i64
+    case INDEX_op_neg_i64:
+#endif
+        return 1;
+    default:
+        break;
+    }
+#endif
+    return 0;
+}
+
+/* constants of 32 bit operations are kept sign extended, as
+   tcg_gen_movi_i32() does */
+static inline tcg_target_ulong tcg_opt_val(int op, tcg_target_ulong val)
+{
+    if (!tcg_opt_is_i64(op)) {
+        val = (int32_t)val;
+    }
+    return val;
+}
+
+static inline int tcg_opt_is_const_val(int op, TCGArg t, tcg_target_ulong val)
+{
+    return tcg_opt_is_const(t) &&
+        tcg_opt_val(op, opt_temps[t].val) == tcg_opt_val(op, val);
+}
+
+static tcg_target_ulong tcg_opt_fold(int op, tcg_target_ulong x,
+                                     tcg_target_ulong y)
+{
+    switch (op) {
+    CASE_OP_32_64(add):
+        return x + y;
+    CASE_OP_32_64(sub):
+        return x - y;
+    CASE_OP_32_64(mul):
+        return x * y;
+    CASE_OP_32_64(and):
+        return x & y;
+    CASE_OP_32_64(or):
+        return x | y;
+    CASE_OP_32_64(xor):
+        return x ^ y;
+    case INDEX_op_shl_i32:
+        return (uint32_t)x << (y & 31);
+    case INDEX_op_shr_i32:
+        return (uint32_t)x >> (y & 31);
+    case INDEX_op_sar_i32:
+        return (int32_t)x >> (y & 31);
+#if TCG_TARGET_REG_BITS == 64
+    case INDEX_op_shl_i64:
+        return (uint64_t)x << (y & 63);
+    case INDEX_op_shr_i64:
+        return (uint64_t)x >> (y & 63);
+    case INDEX_op_sar_i64:
+        return (int64_t)x >> (y & 63);
+#endif
+#ifdef TCG_TARGET_HAS_neg_i32
+    case INDEX_op_neg_i32:
+#endif
+#ifdef TCG_TARGET_HAS_neg_i64
+    case INDEX_op_neg_i64:
+#endif
+        return -x;
+#ifdef TCG_TARGET_HAS_ext8s_i32
+    case INDEX_op_ext8s_i32:
+#endif
+#ifdef TCG_TARGET_HAS_ext8s_i64
+    case INDEX_op_ext8s_i64:
+#endif
+        return (int8_t)x;
+#ifdef TCG_TARGET_HAS_ext16s_i32
+    case INDEX_op_ext16s_i32:
+#endif
+#ifdef TCG_TARGET_HAS_ext16s_i64
+    case INDEX_op_ext16s_i64:
+#endif
+        return (int16_t)x;
+#ifdef TCG_TARGET_HAS_ext32s_i64
+    case INDEX_op_ext32s_i64:
+        return (int32_t)x;
+#endif
+    default:
+        tcg_abort();
+    }
+}
+
+/* return 1 or 0 if the condition is known, -1 otherwise */
+static int tcg_opt_fold_cond(int op, TCGArg a, TCGArg b, TCGCond cond)
+{
+    tcg_target_ulong x, y;
+
+    if (tcg_opt_are_copies(a, b)) {
+        switch (cond) {
+        case TCG_COND_EQ:
+        case TCG_COND_GE:
+        case TCG_COND_LE:
+        case TCG_COND_GEU:
+        case TCG_COND_LEU:
+            return 1;
+        default:
+            return 0;
+        }
+    }
+    if (!tcg_opt_is_const(a) || !tcg_opt_is_const(b)) {
+        return -1;
+    }
+    x = opt_temps[a].val;
+    y = opt_temps[b].val;
+    if (!tcg_opt_is_i64(op)) {
+        switch (cond) {
+        case TCG_COND_EQ: return (uint32_t)x == (uint32_t)y;
+        case TCG_COND_NE: return (uint32_t)x != (uint32_t)y;
+        case TCG_COND_LT: return (int32_t)x < (int32_t)y;
+        case TCG_COND_GE: return (int32_t)x >= (int32_t)y;
+        case TCG_COND_LE: return (int32_t)x <= (int32_t)y;
+        case TCG_COND_GT: return (int32_t)x > (int32_t)y;
+        case TCG_COND_LTU: return (uint32_t)x < (uint32_t)y;
+        case TCG_COND_GEU: return (uint32_t)x >= (uint32_t)y;
+        case TCG_COND_LEU: return (uint32_t)x <= (uint32_t)y;
+        case TCG_COND_GTU: return (uint32_t)x > (uint32_t)y;
+        }
+    } else {
+        switch (cond) {
+        case TCG_COND_EQ: return (uint64_t)x == (uint64_t)y;
+        case TCG_COND_NE: return (uint64_t)x != (uint64_t)y;
+        case TCG_COND_LT: return (int64_t)x < (int64_t)y;
+        case TCG_COND_GE: return (int64_t)x >= (int64_t)y;
+        case TCG_COND_LE: return (int64_t)x <= (int64_t)y;
+        case TCG_COND_GT: return (int64_t)x > (int64_t)y;
+        case TCG_COND_LTU: return (uint64_t)x < (uint64_t)y;
+        case TCG_COND_GEU: return (uint64_t)x >= (uint64_t)y;
+        case TCG_COND_LEU: return (uint64_t)x <= (uint64_t)y;
+        case TCG_COND_GTU: return (uint64_t)x > (uint64_t)y;
+        }
+    }
+    return -1;
+}
+
+static void tcg_opt_gen_movi(uint16_t *opc_ptr, TCGArg *gen_args, int op,
+                             TCGArg dst, tcg_target_ulong val)
+{
+    val = tcg_opt_val(op, val);
+    *opc_ptr = INDEX_op_movi_i32;
+#if TCG_TARGET_REG_BITS == 64
+    if (tcg_opt_is_i64(op))
+        *opc_ptr = INDEX_op_movi_i64;
+#endif
+    gen_args[0] = dst;
+    gen_args[1] = val;
+    tcg_opt_reset_temp(dst);
+    opt_temps[dst].state = TCG_OPT_CONST;
+    opt_temps[dst].val = val;
+}
+
+/* return the number of parameters used */
+static int tcg_opt_gen_mov(TCGContext *s, uint16_t *opc_ptr,
+                           TCGArg *gen_args, int op, TCGArg dst, TCGArg src)
+{
+    TCGArg root;
+
+    if (tcg_opt_is_const(src)) {
+        tcg_opt_gen_movi(opc_ptr, gen_args, op, dst, opt_temps[src].val);
+        return 2;
+    }
+    if (tcg_opt_are_copies(dst, src)) {
+        *opc_ptr = INDEX_op_nop;
+        return 0;
+    }
+    *opc_ptr = INDEX_op_mov_i32;
+#if TCG_TARGET_REG_BITS == 64
+    if (tcg_opt_is_i64(op))
+        *opc_ptr = INDEX_op_mov_i64;
+#endif
+    gen_args[0] = dst;
+    gen_args[1] = src;
+    tcg_opt_reset_temp(dst);
+    /* a move between a 32 and a 64 bit temporary is a truncation,
+       not a copy */
+    if (s->temps[dst].type == s->temps[src].type) {
+        root = src;
+        if (opt_temps[src].state == TCG_OPT_COPY) {
+            root = opt_temps[src].val;
+        }
+        opt_temps[dst].state = TCG_OPT_COPY;
+        opt_temps[dst].val = root;
+        opt_temps[root].state = TCG_OPT_HAS_COPY;
+        opt_temps[dst].prev_copy = root;
+        opt_temps[dst].next_copy = opt_temps[root].next_copy;
+        opt_temps[opt_temps[root].next_copy].prev_copy = dst;
+        opt_temps[root].next_copy = dst;
+    }
+    return 2;
+}
+
+/* Pending stores: a store to the CPU state (fixed register base) is
+   removed when a later store of the basic block overwrites it before
+   anything can read it. */
+
+static void tcg_opt_kill_stores(TCGArg base, tcg_target_long offset,
+                                int size)
+{
+    TCGOptStore *st;
+    int i;
+
+    for (i = 0; i < nb_opt_stores;) {
+        st = &opt_stores[i];
+        if (st->base == base &&
+            st->offset < offset + size && offset < st->offset + st->size) {
+            *st = opt_stores[--nb_opt_stores];
+        } else {
+            i++;
+        }
+    }
+}
+
+/* a global living in memory is read from the CPU state when it is
+   used as input */
+static void tcg_opt_read_global(TCGContext *s, TCGArg arg)
+{
+    TCGTemp *ts;
+    int i;
+
+    if (arg >= s->nb_globals || nb_opt_stores == 0)
+        return;
+    ts = &s->temps[arg];
+    if (ts->fixed_reg)
+        return;
+    for (i = 0; i < nb_opt_stores; i++) {
+        if (s->temps[opt_stores[i].base].reg == ts->mem_reg) {
+            tcg_opt_kill_stores(opt_stores[i].base, ts->mem_offset,
+                                ts->type == TCG_TYPE_I64 ? 8 : 4);
+            break;
+        }
+    }
+}
+
+static int tcg_opt_mem_size(int op)
+{
+    switch (op) {
+    case INDEX_op_ld8u_i32:
+    case INDEX_op_ld8s_i32:
+    case INDEX_op_st8_i32:
+#if TCG_TARGET_REG_BITS == 64
+    case INDEX_op_ld8u_i64:
+    case INDEX_op_ld8s_i64:
+    case INDEX_op_st8_i64:
+#endif
+        return 1;
+    case INDEX_op_ld16u_i32:
+    case INDEX_op_ld16s_i32:
+    case INDEX_op_st16_i32:
+#if TCG_TARGET_REG_BITS == 64
+    case INDEX_op_ld16u_i64:
+    case INDEX_op_ld16s_i64:
+    case INDEX_op_st16_i64:
+#endif
+        return 2;
+    case INDEX_op_ld_i32:
+    case INDEX_op_st_i32:
+#if TCG_TARGET_REG_BITS == 64
+    case INDEX_op_ld32u_i64:
+    case INDEX_op_ld32s_i64:
+    case INDEX_op_st32_i64:
+#endif
+        return 4;
+#if TCG_TARGET_REG_BITS == 64
+    case INDEX_op_ld_i64:
+    case INDEX_op_st_i64:
+        return 8;
+#endif
+    default:
+        return 0;
+    }
+}
+
+static void tcg_opt_store(TCGContext *s, uint16_t *opc_ptr, TCGArg *args,
+                          int nb_args, int size)
+{
+    TCGOptStore *st;
+    TCGArg base = args[1];
+    tcg_target_long offset = args[2];
+    int i;
+
+    if (!s->temps[base].fixed_reg)
+        return;
+    /* the stores entirely overwritten by this one are dead */
+    for (i = 0; i < nb_opt_stores;) {
+        st = &opt_stores[i];
+        if (st->base == base && st->offset >= offset &&
+            st->offset + st->size <= offset + size) {
+            *st->opc_ptr = INDEX_op_nopn;
+            st->args[0] = st->nb_args;
+            st->args[st->nb_args - 1] = st->nb_args;
+#ifdef CONFIG_PROFILER
+            s->opt_op_count_out--;
+#endif
+            *st = opt_stores[--nb_opt_stores];
+        } else {
+            i++;
+        }
+    }
+    if (nb_opt_stores == TCG_OPT_MAX_STORES) {
+        memmove(opt_stores, opt_stores + 1,
+                (TCG_OPT_MAX_STORES - 1) * sizeof(TCGOptStore));
+        nb_opt_stores--;
+    }
+    st = &opt_stores[nb_opt_stores++];
+    st->opc_ptr = opc_ptr;
+    st->args = args;
+    st->nb_args = nb_args;
+    st->base = base;
+    st->offset = offset;
+    st->size = size;
+}
+
+/* Optimize the operations in gen_opc_buf up to 'opc_end' (the
+   INDEX_op_end operation), whose parameters start at 'args'. Return
+   the new end of the parameters. */
+TCGArg *tcg_optimize(TCGContext *s, uint16_t *opc_end, TCGArg *args)
+{
+    uint16_t *opc_ptr;
+    TCGArg *gen_args;
+    const TCGOpDef *def;
+    int op, i, nb_args, nb_oargs, nb_iargs, size, res;
+    TCGArg tmp;
+
+    tcg_opt_reset_all(s);
+    gen_args = args;
+    for (opc_ptr = gen_opc_buf; opc_ptr <= opc_end; opc_ptr++) {
+        op = *opc_ptr;
+        def = &tcg_op_defs[op];
+        if (op == INDEX_op_call) {
+            nb_oargs = args[0] >> 16;
+            nb_iargs = args[0] & 0xffff;
+            nb_args = nb_oargs + nb_iargs + def->nb_cargs + 1;
+        } else if (op == INDEX_op_nopn) {
+            nb_oargs = nb_iargs = 0;
+            nb_args = args[0];
+        } else {
+            nb_oargs = def->nb_oargs;
+            nb_iargs = def->nb_iargs;
+            nb_args = def->nb_args;
+        }
+
+        switch (op) {
+        case INDEX_op_end:
+            return gen_args;
+        case INDEX_op_nop:
+        case INDEX_op_nop1:
+        case INDEX_op_nop2:
+        case INDEX_op_nop3:
+        case INDEX_op_nopn:
+            *opc_ptr = INDEX_op_nop;
+            args += nb_args;
+            continue;
+        case INDEX_op_debug_insn_start:
+        case INDEX_op_discard:
+            break;
+        case INDEX_op_set_label:
+            tcg_opt_reset_all(s);
+            break;
+        case INDEX_op_call:
+            for (i = 0; i < nb_iargs; i++) {
+                tmp = args[1 + nb_oargs + i];
+                if (tmp != TCG_CALL_DUMMY_ARG &&
+                    opt_temps[tmp].state == TCG_OPT_COPY) {
+                    args[1 + nb_oargs + i] = opt_temps[tmp].val;
+                }
+            }
+            memmove(gen_args, args, nb_args * sizeof(TCGArg));
+            if (!(gen_args[1 + nb_oargs + nb_iargs] & TCG_CALL_PURE)) {
+                tcg_opt_reset_globals(s);
+            }
+            nb_opt_stores = 0;
+            for (i = 0; i < nb_oargs; i++) {
+                tcg_opt_reset_temp(gen_args[1 + i]);
+            }
+#ifdef CONFIG_PROFILER
+            s->opt_op_count_in++;
+            s->opt_op_count_out++;
+#endif
+            args += nb_args;
+            gen_args += nb_args;
+            continue;
+        default:
+            break;
+        }
+
+        if (op != INDEX_op_debug_insn_start && op != INDEX_op_set_label) {
+            /* copy propagation */
+            for (i = nb_oargs; i < nb_oargs + nb_iargs; i++) {
+                tmp = args[i];
+                if (opt_temps[tmp].state == TCG_OPT_COPY) {
+                    args[i] = opt_temps[tmp].val;
+                }
+                tcg_opt_read_global(s, args[i]);
+            }
+#ifdef CONFIG_PROFILER
+            s->opt_op_count_in++;
+#endif
+        }
+
+        /* move the commutative constant operand second */
+        switch (op) {
+        CASE_OP_32_64(add):
+        CASE_OP_32_64(mul):
+        CASE_OP_32_64(and):
+        CASE_OP_32_64(or):
+        CASE_OP_32_64(xor):
+            if (tcg_opt_is_const(args[1]) && !tcg_opt_is_const(args[2])) {
+                tmp = args[1];
+                args[1] = args[2];
+                args[2] = tmp;
+            }
+            break;
+        default:
+            break;
+        }
+
+        /* simplifications */
+        switch (op) {
+        CASE_OP_32_64(mov):
+            i = tcg_opt_gen_mov(s, opc_ptr, gen_args, op, args[0], args[1]);
+            goto done;
+        CASE_OP_32_64(movi):
+            tcg_opt_gen_movi(opc_ptr, gen_args, op, args[0], args[1]);
+            i = 2;
+            goto done;
+        CASE_OP_32_64(add):
+        CASE_OP_32_64(sub):
+        CASE_OP_32_64(mul):
+        CASE_OP_32_64(and):
+        CASE_OP_32_64(or):
+        CASE_OP_32_64(xor):
+        CASE_OP_32_64(shl):
+        CASE_OP_32_64(shr):
+        CASE_OP_32_64(sar):
+            if (tcg_opt_is_const(args[1]) && tcg_opt_is_const(args[2])) {
+                tcg_opt_gen_movi(opc_ptr, gen_args, op, args[0],
+                                 tcg_opt_fold(op, opt_temps[args[1]].val,
+                                              opt_temps[args[2]].val));
+                i = 2;
+                goto done;
+            }
+            break;
+#ifdef TCG_TARGET_HAS_neg_i32
+        case INDEX_op_neg_i32:
+#endif
+#ifdef TCG_TARGET_HAS_neg_i64
+        case INDEX_op_neg_i64:
+#endif
+#ifdef TCG_TARGET_HAS_ext8s_i32
+        case INDEX_op_ext8s_i32:
+#endif
+#ifdef TCG_TARGET_HAS_ext8s_i64
+        case INDEX_op_ext8s_i64:
+#endif
+#ifdef TCG_TARGET_HAS_ext16s_i32
+        case INDEX_op_ext16s_i32:
+#endif
+#ifdef TCG_TARGET_HAS_ext16s_i64
+        case INDEX_op_ext16s_i64:
+#endif
+#ifdef TCG_TARGET_HAS_ext32s_i64
+        case INDEX_op_ext32s_i64:
+#endif
+            if (tcg_opt_is_const(args[1])) {
+                tcg_opt_gen_movi(opc_ptr, gen_args, op, args[0],
+                                 tcg_opt_fold(op, opt_temps[args[1]].val, 0));
+                i = 2;
+                goto done;
+            }
+            break;
+        CASE_OP_32_64(brcond):
+            res = tcg_opt_fold_cond(op, args[0], args[1], args[2]);
+            if (res == 1) {
+                *opc_ptr = INDEX_op_br;
+                gen_args[0] = args[3];
+                i = 1;
+                tcg_opt_reset_all(s);
+                goto done;
+            } else if (res == 0) {
+                *opc_ptr = INDEX_op_nop;
+                i = 0;
+                tcg_opt_reset_all(s);
+                goto done;
+            }
+            break;
+        default:
+            break;
+        }
+
+        /* algebraic simplifications with one constant operand */
+        switch (op) {
+        CASE_OP_32_64(add):
+        CASE_OP_32_64(sub):
+        CASE_OP_32_64(or):
+        CASE_OP_32_64(xor):
+        CASE_OP_32_64(shl):
+        CASE_OP_32_64(shr):
+        CASE_OP_32_64(sar):
+            if (tcg_opt_is_const_val(op, args[2], 0)) {
+                i = tcg_opt_gen_mov(s, opc_ptr, gen_args, op,
+                                    args[0], args[1]);
+                goto done;
+            }
+            break;
+        CASE_OP_32_64(mul):
+            if (tcg_opt_is_const_val(op, args[2], 1)) {
+                i = tcg_opt_gen_mov(s, opc_ptr, gen_args, op,
+                                    args[0], args[1]);
+                goto done;
+            }
+            break;
+        CASE_OP_32_64(and):
+            if (tcg_opt_is_const_val(op, args[2], -1)) {
+                i = tcg_opt_gen_mov(s, opc_ptr, gen_args, op,
+                                    args[0], args[1]);
+                goto done;
+            }
+            break;
+        default:
+            break;
+        }
+
+        switch (op) {
+        CASE_OP_32_64(and):
+        CASE_OP_32_64(mul):
+            if (tcg_opt_is_const_val(op, args[2], 0)) {
+                tcg_opt_gen_movi(opc_ptr, gen_args, op, args[0], 0);
+                i = 2;
+                goto done;
+            }
+            break;
+        CASE_OP_32_64(or):
+            if (tcg_opt_is_const_val(op, args[2], -1)) {
+                tcg_opt_gen_movi(opc_ptr, gen_args, op, args[0], -1);
+                i = 2;
+                goto done;
+            }
+            break;
+        default:
+            break;
+        }
+
+        /* identical operands */
+        switch (op) {
+        CASE_OP_32_64(and):
+        CASE_OP_32_64(or):
+            if (tcg_opt_are_copies(args[1], args[2])) {
+                i = tcg_opt_gen_mov(s, opc_ptr, gen_args, op,
+                                    args[0], args[1]);
+                goto done;
+            }
+            break;
+        CASE_OP_32_64(sub):
+        CASE_OP_32_64(xor):
+            if (tcg_opt_are_copies(args[1], args[2])) {
+                tcg_opt_gen_movi(opc_ptr, gen_args, op, args[0], 0);
+                i = 2;
+                goto done;
+            }
+            break;
+        default:
+            break;
+        }
+
+        /* the operation is kept (the parameters may overlap) */
+        memmove(gen_args, args, nb_args * sizeof(TCGArg));
+        size = tcg_opt_mem_size(op);
+        if (size != 0 && nb_oargs == 0) {
+            tcg_opt_store(s, opc_ptr, gen_args, nb_args, size);
+        } else if (size != 0) {
+            if (s->temps[gen_args[1]].fixed_reg)
+                tcg_opt_kill_stores(gen_args[1], gen_args[2], size);
+            else
+                nb_opt_stores = 0;
+        }
+        if (def->flags & TCG_OPF_BB_END) {
+            tcg_opt_reset_all(s);
+        } else {
+            if (def->flags & TCG_OPF_CALL_CLOBBER) {
+                tcg_opt_reset_globals(s);
+            }
+            for (i = 0; i < nb_oargs; i++) {
+                /* the stores are relative to the old value of a
+                   modified base register */
+                if (s->temps[gen_args[i]].fixed_reg)
+                    nb_opt_stores = 0;
+                tcg_opt_reset_temp(gen_args[i]);
+            }
+        }
+        i = nb_args;
+    done:
+#ifdef CONFIG_PROFILER
+        if (*opc_ptr != INDEX_op_nop && op != INDEX_op_debug_insn_start &&
+            op != INDEX_op_set_label) {
+            s->opt_op_count_out++;
+        }
+#endif
+        args += nb_args;
+        gen_args += i;
+    }
+    tcg_abort();
+}
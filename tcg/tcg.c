@@ -28,6 +28,9 @@
 /* define it to use liveness analysis (better code) */
 #define USE_LIVENESS_ANALYSIS
 
+/* define it to use the intermediate code optimizer (better code) */
+#define USE_TCG_OPTIMIZATIONS
+
 #include <assert.h>
 #include <stdarg.h>
 #include <stdlib.h>
@@ -60,7 +63,7 @@
 static void patch_reloc(uint8_t *code_ptr, int type, 
                         tcg_target_long value, tcg_target_long addend);
 
-static TCGOpDef tcg_op_defs[] = {
+TCGOpDef tcg_op_defs[] = {
 #define DEF(s, n, copy_size) { #s, 0, 0, n, n, 0, copy_size },
 #define DEF2(s, iargs, oargs, cargs, flags) { #s, iargs, oargs, cargs, iargs + oargs + cargs, flags, 0 },
 #include "tcg-opc.h"
@@ -150,6 +153,41 @@ int gen_new_label(void)
     return idx;
 }
 
+#if defined(CONFIG_SOFTMMU) && defined(TCG_TARGET_QEMU_LDST_SLOW_PATH)
+#define USE_QEMU_LDST_SLOW_PATH
+
+/* TLB miss path of a qemu_ld/st operation. It is emitted after the
+   code of the TB so that the fast path falls through. */
+typedef struct TCGLdstSlowPath {
+    int op_index; /* operation the slow path belongs to */
+    int is_ld;
+    int opc; /* size and sign of the access */
+    int mem_index;
+    int data_reg;
+    int data_reg2;
+    int addr_reg;
+    int addr_reg2;
+    uint8_t *label_ptr[2]; /* 32 bit displacements of the branches from
+                              the fast path */
+    uint8_t *raddr; /* end of the fast path */
+} TCGLdstSlowPath;
+
+static TCGLdstSlowPath ldst_slow_paths[OPC_BUF_SIZE];
+static int nb_ldst_slow_paths;
+
+static inline TCGLdstSlowPath *tcg_new_ldst_slow_path(void)
+{
+    TCGLdstSlowPath *l;
+
+    l = &ldst_slow_paths[nb_ldst_slow_paths++];
+    l->op_index = -1;
+    l->label_ptr[1] = NULL;
+    return l;
+}
+
+static void tcg_out_ldst_slow_path(TCGContext *s, TCGLdstSlowPath *l);
+#endif
+
 #include "tcg-target.c"
 
 /* pool based memory allocation */
@@ -1887,6 +1925,16 @@ static inline int tcg_gen_code_common(TCGContext *s, uint8_t *gen_code_buf,
     }
 #endif
 
+#ifdef USE_TCG_OPTIMIZATIONS
+#ifdef CONFIG_PROFILER
+    s->opt_time -= profile_getclock();
+#endif
+    gen_opparam_ptr = tcg_optimize(s, gen_opc_ptr, gen_opparam_buf);
+#ifdef CONFIG_PROFILER
+    s->opt_time += profile_getclock();
+#endif
+#endif
+
 #ifdef CONFIG_PROFILER
     s->la_time -= profile_getclock();
 #endif
@@ -1910,6 +1958,9 @@ static inline int tcg_gen_code_common(TCGContext *s, uint8_t *gen_code_buf,
 
     args = gen_opparam_buf;
     op_index = 0;
+#ifdef USE_QEMU_LDST_SLOW_PATH
+    nb_ldst_slow_paths = 0;
+#endif
 
     for(;;) {
         opc = gen_opc_buf[op_index];
@@ -1975,6 +2026,12 @@ static inline int tcg_gen_code_common(TCGContext *s, uint8_t *gen_code_buf,
                some common argument patterns */
             dead_iargs = s->op_dead_iargs[op_index];
             tcg_reg_alloc_op(s, def, opc, args, dead_iargs);
+#ifdef USE_QEMU_LDST_SLOW_PATH
+            if (nb_ldst_slow_paths > 0 &&
+                ldst_slow_paths[nb_ldst_slow_paths - 1].op_index < 0) {
+                ldst_slow_paths[nb_ldst_slow_paths - 1].op_index = op_index;
+            }
+#endif
             break;
         }
         args += def->nb_args;
@@ -1988,6 +2045,20 @@ static inline int tcg_gen_code_common(TCGContext *s, uint8_t *gen_code_buf,
 #endif
     }
  the_end:
+#ifdef USE_QEMU_LDST_SLOW_PATH
+    /* the host pc of a helper called from a slow path must be mapped
+       back to the qemu_ld/st operation */
+    {
+        int i;
+
+        for(i = 0; i < nb_ldst_slow_paths; i++) {
+            tcg_out_ldst_slow_path(s, &ldst_slow_paths[i]);
+            if (search_pc >= 0 && search_pc < s->code_ptr - gen_code_buf) {
+                return ldst_slow_paths[i].op_index;
+            }
+        }
+    }
+#endif
     return -1;
 }
 
@@ -2040,6 +2111,9 @@ void tcg_dump_info(FILE *f,
                 s->tb_count1 ? (double)(s->tb_count1 - s->tb_count) / s->tb_count1 * 100.0 : 0);
     cpu_fprintf(f, "avg ops/TB          %0.1f max=%d\n", 
                 s->tb_count ? (double)s->op_count / s->tb_count : 0, s->op_count_max);
+    cpu_fprintf(f, "optimizer ops/TB    %0.1f -> %0.1f\n",
+                s->tb_count ? (double)s->opt_op_count_in / s->tb_count : 0,
+                s->tb_count ? (double)s->opt_op_count_out / s->tb_count : 0);
     cpu_fprintf(f, "deleted ops/TB      %0.2f\n",
                 s->tb_count ? 
                 (double)s->del_op_count / s->tb_count : 0);
@@ -2060,6 +2134,8 @@ void tcg_dump_info(FILE *f,
                 (double)s->interm_time / tot * 100.0);
     cpu_fprintf(f, "  gen_code time     %0.1f%%\n", 
                 (double)s->code_time / tot * 100.0);
+    cpu_fprintf(f, "optimize/code time  %0.1f%%\n",
+                (double)s->opt_time / (s->code_time ? s->code_time : 1) * 100.0);
     cpu_fprintf(f, "liveness/code time  %0.1f%%\n", 
                 (double)s->la_time / (s->code_time ? s->code_time : 1) * 100.0);
     cpu_fprintf(f, "cpu_restore count   %" PRId64 "\n",
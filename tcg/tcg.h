@@ -279,6 +279,9 @@ struct TCGContext {
     int64_t interm_time;
     int64_t code_time;
     int64_t la_time;
+    int64_t opt_time;
+    int64_t opt_op_count_in; /* ops seen by the optimizer */
+    int64_t opt_op_count_out; /* ops left after the optimizer */
     int64_t restore_count;
     int64_t restore_time;
 #endif
@@ -384,6 +387,8 @@ typedef struct TCGOpDef {
     int *sorted_args;
 } TCGOpDef;
         
+extern TCGOpDef tcg_op_defs[];
+
 typedef struct TCGTargetOpDef {
     int op;
     const char *args_ct_str[TCG_MAX_OP_ARGS];
@@ -445,6 +450,9 @@ void tcg_out_reloc(TCGContext *s, uint8_t *code_ptr, int type,
 const TCGArg *tcg_gen_code_op(TCGContext *s, int opc, const TCGArg *args1,
                               unsigned int dead_iargs);
 
+/* optimize.c */
+TCGArg *tcg_optimize(TCGContext *s, uint16_t *opc_end, TCGArg *args);
+
 /* tcg-runtime.c */
 int64_t tcg_helper_shl_i64(int64_t arg1, int64_t arg2);
 int64_t tcg_helper_shr_i64(int64_t arg1, int64_t arg2);
@@ -508,7 +508,7 @@ static void tcg_out_qemu_ld(TCGContext *s, const TCGArg *args,
 {
     int addr_reg, data_reg, r0, r1, mem_index, s_bits, bswap, rexw;
 #if defined(CONFIG_SOFTMMU)
-    uint8_t *label1_ptr, *label2_ptr;
+    TCGLdstSlowPath *l;
 #endif
 
     data_reg = *args++;
@@ -550,55 +550,17 @@ static void tcg_out_qemu_ld(TCGContext *s, const TCGArg *args,
     /* mov */
     tcg_out_modrm(s, 0x8b | rexw, r0, addr_reg);
     
-    /* je label1 */
-    tcg_out8(s, 0x70 + JCC_JE);
-    label1_ptr = s->code_ptr;
-    s->code_ptr++;
-
-    /* XXX: move that code at the end of the TB */
-    tcg_out_movi(s, TCG_TYPE_I32, TCG_REG_RSI, mem_index);
-    tcg_out8(s, 0xe8);
-    tcg_out32(s, (tcg_target_long)qemu_ld_helpers[s_bits] - 
-              (tcg_target_long)s->code_ptr - 4);
-
-    switch(opc) {
-    case 0 | 4:
-        /* movsbq */
-        tcg_out_modrm(s, 0xbe | P_EXT | P_REXW, data_reg, TCG_REG_RAX);
-        break;
-    case 1 | 4:
-        /* movswq */
-        tcg_out_modrm(s, 0xbf | P_EXT | P_REXW, data_reg, TCG_REG_RAX);
-        break;
-    case 2 | 4:
-        /* movslq */
-        tcg_out_modrm(s, 0x63 | P_REXW, data_reg, TCG_REG_RAX);
-        break;
-    case 0:
-        /* movzbq */
-        tcg_out_modrm(s, 0xb6 | P_EXT | P_REXW, data_reg, TCG_REG_RAX);
-        break;
-    case 1:
-        /* movzwq */
-        tcg_out_modrm(s, 0xb7 | P_EXT | P_REXW, data_reg, TCG_REG_RAX);
-        break;
-    case 2:
-    default:
-        /* movl */
-        tcg_out_modrm(s, 0x8b, data_reg, TCG_REG_RAX);
-        break;
-    case 3:
-        tcg_out_mov(s, data_reg, TCG_REG_RAX);
-        break;
-    }
-
-    /* jmp label2 */
-    tcg_out8(s, 0xeb);
-    label2_ptr = s->code_ptr;
-    s->code_ptr++;
-    
-    /* label1: */
-    *label1_ptr = s->code_ptr - label1_ptr - 1;
+    /* jne slow_path */
+    tcg_out8(s, 0x0f);
+    tcg_out8(s, 0x80 + JCC_JNE);
+    l = tcg_new_ldst_slow_path();
+    l->is_ld = 1;
+    l->opc = opc;
+    l->mem_index = mem_index;
+    l->data_reg = data_reg;
+    l->addr_reg = addr_reg;
+    l->label_ptr[0] = s->code_ptr;
+    s->code_ptr += 4;
 
     /* add x(r1), r0 */
     tcg_out_modrm_offset(s, 0x03 | P_REXW, r0, r1, offsetof(CPUTLBEntry, addend) - 
@@ -681,8 +643,8 @@ static void tcg_out_qemu_ld(TCGContext *s, const TCGArg *args,
     }
 
 #if defined(CONFIG_SOFTMMU)
-    /* label2: */
-    *label2_ptr = s->code_ptr - label2_ptr - 1;
+    /* the slow path returns here */
+    l->raddr = s->code_ptr;
 #endif
 }
 
@@ -691,7 +653,7 @@ static void tcg_out_qemu_st(TCGContext *s, const TCGArg *args,
 {
     int addr_reg, data_reg, r0, r1, mem_index, s_bits, bswap, rexw;
 #if defined(CONFIG_SOFTMMU)
-    uint8_t *label1_ptr, *label2_ptr;
+    TCGLdstSlowPath *l;
 #endif
 
     data_reg = *args++;
@@ -734,42 +696,17 @@ static void tcg_out_qemu_st(TCGContext *s, const TCGArg *args,
     /* mov */
     tcg_out_modrm(s, 0x8b | rexw, r0, addr_reg);
     
-    /* je label1 */
-    tcg_out8(s, 0x70 + JCC_JE);
-    label1_ptr = s->code_ptr;
-    s->code_ptr++;
-
-    /* XXX: move that code at the end of the TB */
-    switch(opc) {
-    case 0:
-        /* movzbl */
-        tcg_out_modrm(s, 0xb6 | P_EXT | P_REXB, TCG_REG_RSI, data_reg);
-        break;
-    case 1:
-        /* movzwl */
-        tcg_out_modrm(s, 0xb7 | P_EXT, TCG_REG_RSI, data_reg);
-        break;
-    case 2:
-        /* movl */
-        tcg_out_modrm(s, 0x8b, TCG_REG_RSI, data_reg);
-        break;
-    default:
-    case 3:
-        tcg_out_mov(s, TCG_REG_RSI, data_reg);
-        break;
-    }
-    tcg_out_movi(s, TCG_TYPE_I32, TCG_REG_RDX, mem_index);
-    tcg_out8(s, 0xe8);
-    tcg_out32(s, (tcg_target_long)qemu_st_helpers[s_bits] - 
-              (tcg_target_long)s->code_ptr - 4);
-
-    /* jmp label2 */
-    tcg_out8(s, 0xeb);
-    label2_ptr = s->code_ptr;
-    s->code_ptr++;
-    
-    /* label1: */
-    *label1_ptr = s->code_ptr - label1_ptr - 1;
+    /* jne slow_path */
+    tcg_out8(s, 0x0f);
+    tcg_out8(s, 0x80 + JCC_JNE);
+    l = tcg_new_ldst_slow_path();
+    l->is_ld = 0;
+    l->opc = opc;
+    l->mem_index = mem_index;
+    l->data_reg = data_reg;
+    l->addr_reg = addr_reg;
+    l->label_ptr[0] = s->code_ptr;
+    s->code_ptr += 4;
 
     /* add x(r1), r0 */
     tcg_out_modrm_offset(s, 0x03 | P_REXW, r0, r1, offsetof(CPUTLBEntry, addend) - 
@@ -825,11 +762,88 @@ static void tcg_out_qemu_st(TCGContext *s, const TCGArg *args,
     }
 
 #if defined(CONFIG_SOFTMMU)
-    /* label2: */
-    *label2_ptr = s->code_ptr - label2_ptr - 1;
+    /* the slow path returns here */
+    l->raddr = s->code_ptr;
 #endif
 }
 
+#if defined(CONFIG_SOFTMMU)
+/* TLB miss: the address is in r0 (RDI), call the helper and go back
+   to the end of the fast path */
+static void tcg_out_ldst_slow_path(TCGContext *s, TCGLdstSlowPath *l)
+{
+    int data_reg = l->data_reg;
+
+    /* slow_path: */
+    *(uint32_t *)l->label_ptr[0] = s->code_ptr - l->label_ptr[0] - 4;
+
+    if (l->is_ld) {
+        tcg_out_movi(s, TCG_TYPE_I32, TCG_REG_RSI, l->mem_index);
+        tcg_out8(s, 0xe8);
+        tcg_out32(s, (tcg_target_long)qemu_ld_helpers[l->opc & 3] - 
+                  (tcg_target_long)s->code_ptr - 4);
+
+        switch(l->opc) {
+        case 0 | 4:
+            /* movsbq */
+            tcg_out_modrm(s, 0xbe | P_EXT | P_REXW, data_reg, TCG_REG_RAX);
+            break;
+        case 1 | 4:
+            /* movswq */
+            tcg_out_modrm(s, 0xbf | P_EXT | P_REXW, data_reg, TCG_REG_RAX);
+            break;
+        case 2 | 4:
+            /* movslq */
+            tcg_out_modrm(s, 0x63 | P_REXW, data_reg, TCG_REG_RAX);
+            break;
+        case 0:
+            /* movzbq */
+            tcg_out_modrm(s, 0xb6 | P_EXT | P_REXW, data_reg, TCG_REG_RAX);
+            break;
+        case 1:
+            /* movzwq */
+            tcg_out_modrm(s, 0xb7 | P_EXT | P_REXW, data_reg, TCG_REG_RAX);
+            break;
+        case 2:
+        default:
+            /* movl */
+            tcg_out_modrm(s, 0x8b, data_reg, TCG_REG_RAX);
+            break;
+        case 3:
+            tcg_out_mov(s, data_reg, TCG_REG_RAX);
+            break;
+        }
+    } else {
+        switch(l->opc) {
+        case 0:
+            /* movzbl */
+            tcg_out_modrm(s, 0xb6 | P_EXT | P_REXB, TCG_REG_RSI, data_reg);
+            break;
+        case 1:
+            /* movzwl */
+            tcg_out_modrm(s, 0xb7 | P_EXT, TCG_REG_RSI, data_reg);
+            break;
+        case 2:
+            /* movl */
+            tcg_out_modrm(s, 0x8b, TCG_REG_RSI, data_reg);
+            break;
+        default:
+        case 3:
+            tcg_out_mov(s, TCG_REG_RSI, data_reg);
+            break;
+        }
+        tcg_out_movi(s, TCG_TYPE_I32, TCG_REG_RDX, l->mem_index);
+        tcg_out8(s, 0xe8);
+        tcg_out32(s, (tcg_target_long)qemu_st_helpers[l->opc] - 
+                  (tcg_target_long)s->code_ptr - 4);
+    }
+
+    /* jmp raddr */
+    tcg_out8(s, 0xe9);
+    tcg_out32(s, l->raddr - s->code_ptr - 4);
+}
+#endif
+
 static inline void tcg_out_op(TCGContext *s, int opc, const TCGArg *args,
                               const int *const_args)
 {
@@ -844,6 +858,10 @@ static inline void tcg_out_op(TCGContext *s, int opc, const TCGArg *args,
     case INDEX_op_goto_tb:
         if (s->tb_jmp_offset) {
             /* direct jump method */
+            /* align the displacement so that other VCPU threads never
+               see a partially patched jump */
+            while (((tcg_target_long)s->code_ptr + 1) & 3)
+                tcg_out8(s, 0x90); /* nop */
             tcg_out8(s, 0xe9); /* jmp im */
             s->tb_jmp_offset[args[0]] = s->code_ptr - s->code_buf;
             tcg_out32(s, 0);
@@ -29,7 +29,7 @@
 #include "cpu.h"
 #include "exec-all.h"
 #include "disas.h"
-#include "tcg.h"
+#include "tcg-op.h"
 
 /* code generation context */
 TCGContext tcg_ctx;
@@ -65,6 +65,26 @@ unsigned long code_gen_max_block_size(void)
     return max;
 }
 
+/* Increment the execution counter of the TB.  This must be generated
+   the same way when the TB is retranslated by cpu_restore_state().
+   The increment is not atomic: with -vcpu-threads, VCPUs running the
+   same TB at once can lose counts, so the counts are approximate. */
+static void gen_tb_profile(TranslationBlock *tb)
+{
+    TCGv_ptr ptr;
+    TCGv_i64 count;
+
+    if (!tb_profile_enabled)
+        return;
+    ptr = tcg_const_ptr((tcg_target_long)&tb->exec_count);
+    count = tcg_temp_new_i64();
+    tcg_gen_ld_i64(count, ptr, 0);
+    tcg_gen_addi_i64(count, count, 1);
+    tcg_gen_st_i64(count, ptr, 0);
+    tcg_temp_free_i64(count);
+    tcg_temp_free_ptr(ptr);
+}
+
 void cpu_gen_init(void)
 {
     tcg_context_init(&tcg_ctx); 
@@ -94,6 +114,7 @@ int cpu_gen_code(CPUState *env, TranslationBlock *tb, int *gen_code_size_ptr)
 #endif
     tcg_func_start(s);
 
+    gen_tb_profile(tb);
     gen_intermediate_code(env, tb);
 
     /* generate machine code */
@@ -139,9 +160,9 @@ int cpu_gen_code(CPUState *env, TranslationBlock *tb, int *gen_code_size_ptr)
 
 /* The cpu state corresponding to 'searched_pc' is restored.
  */
-int cpu_restore_state(TranslationBlock *tb,
-                      CPUState *env, unsigned long searched_pc,
-                      void *puc)
+static int do_restore_state(TranslationBlock *tb,
+                            CPUState *env, unsigned long searched_pc,
+                            void *puc)
 {
     TCGContext *s = &tcg_ctx;
     int j;
@@ -155,6 +176,7 @@ int cpu_restore_state(TranslationBlock *tb,
 #endif
     tcg_func_start(s);
 
+    gen_tb_profile(tb);
     gen_intermediate_code_pc(env, tb);
 
     if (use_icount) {
@@ -193,3 +215,20 @@ int cpu_restore_state(TranslationBlock *tb,
 #endif
     return 0;
 }
+
+int cpu_restore_state(TranslationBlock *tb,
+                      CPUState *env, unsigned long searched_pc,
+                      void *puc)
+{
+#ifdef USE_VCPU_THREADS
+    int ret;
+
+    /* the VCPU threads share tcg_ctx */
+    tb_lock_acquire();
+    ret = do_restore_state(tb, env, searched_pc, puc);
+    tb_lock_release();
+    return ret;
+#else
+    return do_restore_state(tb, env, searched_pc, puc);
+#endif
+}
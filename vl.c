@@ -40,6 +40,8 @@
 #include "block.h"
 #include "audio/audio.h"
 #include "migration.h"
+#include "postcopy-ram.h"
+#include "xbzrle.h"
 #include "kvm.h"
 #include "balloon.h"
 
@@ -136,6 +138,10 @@
 #define memalign(align, size) malloc(size)
 #endif
 
+#ifdef USE_VCPU_THREADS
+#include <pthread.h>
+#endif
+
 #ifdef CONFIG_SDL
 #ifdef __APPLE__
 #include <SDL/SDL.h>
@@ -247,6 +253,8 @@ int old_param = 0;
 #endif
 const char *qemu_name;
 int alt_grab = 0;
+int virtio_coalesce_max_pending = 0;
+int virtio_coalesce_max_delay = 0;
 #if defined(TARGET_SPARC) || defined(TARGET_PPC)
 unsigned int nb_prom_envs = 0;
 const char *prom_envs[MAX_PROM_ENVS];
@@ -257,6 +265,9 @@ struct drive_opt drives_opt[MAX_DRIVES];
 static CPUState *cur_cpu;
 static CPUState *next_cpu;
 static int event_pending = 1;
+#ifdef USE_VCPU_THREADS
+int vcpu_threads;
+#endif
 /* Conversion factor from emulated instructions to virtual clock ticks.  */
 static int icount_time_shift;
 /* Arbitrarily pick 1MIPS as the minimum allowable speed.  */
@@ -286,9 +297,13 @@ static uint32_t ioport_read(int index, uint32_t address)
         default_ioport_readl
     };
     IOPortReadFunc *func = ioport_read_table[index][address];
+    uint32_t val;
     if (!func)
         func = default_func[index];
-    return func(ioport_opaque[address], address);
+    qemu_mutex_lock_iothread();
+    val = func(ioport_opaque[address], address);
+    qemu_mutex_unlock_iothread();
+    return val;
 }
 
 static void ioport_write(int index, uint32_t address, uint32_t data)
@@ -301,7 +316,9 @@ static void ioport_write(int index, uint32_t address, uint32_t data)
     IOPortWriteFunc *func = ioport_write_table[index][address];
     if (!func)
         func = default_func[index];
+    qemu_mutex_lock_iothread();
     func(ioport_opaque[address], address, data);
+    qemu_mutex_unlock_iothread();
 }
 
 static uint32_t default_ioport_readb(void *opaque, uint32_t address)
@@ -2247,6 +2264,17 @@ BlockInterfaceErrorAction drive_get_onerror(BlockDriverState *bdrv)
     return BLOCK_ERR_REPORT;
 }
 
+int drive_get_merge_max(BlockDriverState *bdrv)
+{
+    int index;
+
+    for (index = 0; index < nb_drives; index++)
+        if (drives_table[index].bdrv == bdrv)
+            return drives_table[index].merge_max;
+
+    return DRIVE_DEFAULT_MERGE_MAX;
+}
+
 static void bdrv_format_print(void *opaque, const char *name)
 {
     fprintf(stderr, " %s", name);
@@ -2283,6 +2311,9 @@ int drive_init(struct drive_opt *arg, int snapshot, void *opaque)
     int max_devs;
     int index;
     int cache;
+    int l2_cache_size;
+    int native_aio;
+    int merge_max;
     int bdrv_flags, onerror;
     int drives_table_idx;
     char *str = arg->opt;
@@ -2290,6 +2321,7 @@ int drive_init(struct drive_opt *arg, int snapshot, void *opaque)
                                            "cyls", "heads", "secs", "trans",
                                            "media", "snapshot", "file",
                                            "cache", "format", "serial", "werror",
+                                           "l2_cache", "aio", "merge_max",
                                            NULL };
 
     if (check_params(buf, sizeof(buf), params, str) < 0) {
@@ -2305,6 +2337,9 @@ int drive_init(struct drive_opt *arg, int snapshot, void *opaque)
     translation = BIOS_ATA_TRANSLATION_AUTO;
     index = -1;
     cache = 3;
+    l2_cache_size = 0;
+    native_aio = 0;
+    merge_max = DRIVE_DEFAULT_MERGE_MAX;
 
     if (machine->use_scsi) {
         type = IF_SCSI;
@@ -2458,6 +2493,38 @@ int drive_init(struct drive_opt *arg, int snapshot, void *opaque)
         }
     }
 
+    if (get_param_value(buf, sizeof(buf), "l2_cache", str)) {
+        l2_cache_size = strtol(buf, NULL, 0);
+        if (l2_cache_size <= 0) {
+            fprintf(stderr, "qemu: '%s' invalid l2_cache size\n", str);
+            return -1;
+        }
+    }
+
+    if (get_param_value(buf, sizeof(buf), "aio", str)) {
+        if (!strcmp(buf, "threads"))
+            native_aio = 0;
+        else if (!strcmp(buf, "native"))
+            native_aio = 1;
+        else {
+           fprintf(stderr, "qemu: invalid aio option\n");
+           return -1;
+        }
+    }
+
+    if (get_param_value(buf, sizeof(buf), "merge_max", str)) {
+        if (type != IF_VIRTIO) {
+            fprintf(stderr, "qemu: merge_max is only supported by virtio\n");
+            return -1;
+        }
+        merge_max = strtol(buf, NULL, 0);
+        if (merge_max < 0) {
+            fprintf(stderr, "qemu: '%s' invalid merge_max size\n", str);
+            return -1;
+        }
+        merge_max *= 1024;
+    }
+
     if (get_param_value(buf, sizeof(buf), "format", str)) {
        if (strcmp(buf, "?") == 0) {
             fprintf(stderr, "qemu: Supported formats:");
@@ -2565,6 +2632,7 @@ int drive_init(struct drive_opt *arg, int snapshot, void *opaque)
     drives_table[drives_table_idx].bus = bus_id;
     drives_table[drives_table_idx].unit = unit_id;
     drives_table[drives_table_idx].onerror = onerror;
+    drives_table[drives_table_idx].merge_max = merge_max;
     drives_table[drives_table_idx].drive_opt_idx = arg - drives_opt;
     strncpy(drives_table[nb_drives].serial, serial, sizeof(serial));
     nb_drives++;
@@ -2608,6 +2676,9 @@ int drive_init(struct drive_opt *arg, int snapshot, void *opaque)
         bdrv_flags |= BDRV_O_CACHE_WB;
     else if (cache == 3) /* not specified */
         bdrv_flags |= BDRV_O_CACHE_DEF;
+    if (native_aio)
+        bdrv_flags |= BDRV_O_NATIVE_AIO;
+    bdrv_set_l2_cache_hint(bdrv, l2_cache_size);
     if (bdrv_open2(bdrv, file, bdrv_flags, drv) < 0 || qemu_key_check(bdrv, file)) {
         fprintf(stderr, "qemu: could not open disk image %s\n",
                         file);
@@ -2925,6 +2996,9 @@ int qemu_set_fd_handler2(int fd,
         ioh->opaque = opaque;
         ioh->deleted = 0;
     }
+    /* a VCPU thread changed the set of descriptors to select() */
+    if (cpu_single_env)
+        qemu_notify_event();
     return 0;
 }
 
@@ -3114,6 +3188,23 @@ static void ram_decompress_close(RamDecompressState *s)
 #define RAM_SAVE_FLAG_MEM_SIZE	0x04
 #define RAM_SAVE_FLAG_PAGE	0x08
 #define RAM_SAVE_FLAG_EOS	0x10
+#define RAM_SAVE_FLAG_XBZRLE	0x20
+#define RAM_SAVE_FLAG_ZERO	0x40
+#define RAM_SAVE_FLAG_POSTCOPY	0x80
+#define RAM_SAVE_FLAG_IMAGE	0x100
+
+/* maximum number of pages in one RAM_SAVE_FLAG_ZERO record */
+#define RAM_SAVE_ZERO_MAX	4096
+
+/* deltas larger than this are sent as whole pages */
+#define XBZRLE_MAX_LEN		(TARGET_PAGE_SIZE * 3 / 4)
+
+/* copies of the pages as last sent, if XBZRLE is enabled */
+static PageCache *xbzrle_cache;
+static uint8_t *xbzrle_buf;
+/* the page being sent: guest RAM is read once, so that what goes out and
+   what is cached cannot differ if the guest writes to it meanwhile */
+static uint8_t *xbzrle_page;
 
 static int is_dup_page(uint8_t *page, uint8_t ch)
 {
@@ -3129,79 +3220,730 @@ static int is_dup_page(uint8_t *page, uint8_t ch)
     return 1;
 }
 
-static int ram_save_block(QEMUFile *f)
+static void xbzrle_init(void)
 {
-    static ram_addr_t current_addr = 0;
-    ram_addr_t saved_addr = current_addr;
-    ram_addr_t addr = 0;
-    int found = 0;
+    int64_t size = migrate_xbzrle_cache_size();
 
-    while (addr < phys_ram_size) {
-        if (cpu_physical_memory_get_dirty(current_addr, MIGRATION_DIRTY_FLAG)) {
-            uint8_t ch;
+    if (xbzrle_cache) {
+        page_cache_fini(xbzrle_cache);
+        xbzrle_cache = NULL;
+    }
+    memset(&xbzrle_stats, 0, sizeof(xbzrle_stats));
 
-            cpu_physical_memory_reset_dirty(current_addr,
-                                            current_addr + TARGET_PAGE_SIZE,
-                                            MIGRATION_DIRTY_FLAG);
+    if (size < TARGET_PAGE_SIZE)
+        return;
 
-            ch = *(phys_ram_base + current_addr);
+    xbzrle_cache = page_cache_init(size / TARGET_PAGE_SIZE, TARGET_PAGE_SIZE);
+    if (!xbzrle_buf) {
+        xbzrle_buf = qemu_malloc(XBZRLE_MAX_LEN);
+        xbzrle_page = qemu_malloc(TARGET_PAGE_SIZE);
+    }
+}
 
-            if (is_dup_page(phys_ram_base + current_addr, ch)) {
-                qemu_put_be64(f, current_addr | RAM_SAVE_FLAG_COMPRESS);
-                qemu_put_byte(f, ch);
-            } else {
-                qemu_put_be64(f, current_addr | RAM_SAVE_FLAG_PAGE);
-                qemu_put_buffer(f, phys_ram_base + current_addr, TARGET_PAGE_SIZE);
-            }
+static void xbzrle_cleanup(void)
+{
+    if (xbzrle_cache) {
+        page_cache_fini(xbzrle_cache);
+        xbzrle_cache = NULL;
+    }
+}
 
-            found = 1;
-            break;
+/* send p, the contents of the page at addr, as a delta against cached,
+   what was last sent for it.  Returns 0 if the delta is too large. */
+static int ram_save_xbzrle(QEMUFile *f, ram_addr_t addr, uint8_t *p,
+                           uint8_t *cached)
+{
+    int len;
+
+    len = xbzrle_encode_buffer(cached, p, TARGET_PAGE_SIZE,
+                               xbzrle_buf, XBZRLE_MAX_LEN);
+    if (len < 0) {
+        xbzrle_stats.overflow++;
+        return 0;
+    }
+
+    qemu_put_be64(f, addr | RAM_SAVE_FLAG_XBZRLE);
+    qemu_put_be16(f, len);
+    qemu_put_buffer(f, xbzrle_buf, len);
+    memcpy(cached, p, TARGET_PAGE_SIZE);
+
+    xbzrle_stats.pages++;
+    xbzrle_stats.bytes_saved += TARGET_PAGE_SIZE - len - 2;
+    return 1;
+}
+
+/* The pages left to send, one byte per target page.  The migration thread
+   works from this copy of the MIGRATION_DIRTY_FLAG bits: the dirty flags,
+   and the TLB entries that keep them up to date, are only touched by the
+   main loop, in ram_save_sync(). */
+static uint8_t *ram_dirty;
+static ram_addr_t ram_dirty_pages;
+/* pages sent since the start of the migration */
+static uint64_t ram_pages_sent;
+
+static inline int ram_dirty_get(ram_addr_t addr)
+{
+    return ram_dirty[addr >> TARGET_PAGE_BITS];
+}
+
+static inline void ram_dirty_reset(ram_addr_t addr)
+{
+    uint8_t *p = &ram_dirty[addr >> TARGET_PAGE_BITS];
+
+    if (*p) {
+        *p = 0;
+        ram_dirty_pages--;
+    }
+}
+
+/* first page in [start, end) left to send, or end */
+static ram_addr_t ram_dirty_find(ram_addr_t start, ram_addr_t end)
+{
+    uint8_t *p;
+
+    if (start >= end)
+        return end;
+    p = memchr(ram_dirty + (start >> TARGET_PAGE_BITS), 1,
+               (end - start) >> TARGET_PAGE_BITS);
+    return p ? (ram_addr_t)(p - ram_dirty) << TARGET_PAGE_BITS : end;
+}
+
+/* Add the pages dirtied since the last call to ram_dirty.  Runs in the
+   main loop. */
+static void ram_save_sync(void *opaque)
+{
+    ram_addr_t addr = 0;
+
+    /* a page a running VCPU dirties after the scan would lose its flag
+       in the reset below without being added */
+    pause_all_vcpus();
+    while ((addr = cpu_physical_memory_find_dirty(addr, phys_ram_size,
+                                                  MIGRATION_DIRTY_FLAG))
+           < phys_ram_size) {
+        if (!ram_dirty_get(addr)) {
+            ram_dirty[addr >> TARGET_PAGE_BITS] = 1;
+            ram_dirty_pages++;
         }
         addr += TARGET_PAGE_SIZE;
-        current_addr = (saved_addr + addr) % phys_ram_size;
+    }
+    cpu_physical_memory_reset_dirty(0, phys_ram_size, MIGRATION_DIRTY_FLAG);
+    resume_all_vcpus();
+
+#ifdef USE_KQEMU
+    /* kqemu sets the flags without counting them, none is set now */
+    migration_dirty_pages = 0;
+#endif
+}
+
+/* Send the zero page at addr together with the dirty zero pages that
+   follow it as one record.  Returns the number of pages sent. */
+static ram_addr_t ram_save_zero_pages(QEMUFile *f, ram_addr_t addr)
+{
+    ram_addr_t n, a;
+    uint8_t *cached;
+
+    for (n = 1; n < RAM_SAVE_ZERO_MAX; n++) {
+        a = addr + n * TARGET_PAGE_SIZE;
+        if (a >= phys_ram_size || !ram_dirty_get(a) ||
+            !buffer_is_zero(phys_ram_base + a, TARGET_PAGE_SIZE))
+            break;
+    }
+
+    for (a = addr; a < addr + n * TARGET_PAGE_SIZE; a += TARGET_PAGE_SIZE)
+        ram_dirty_reset(a);
+
+    if (xbzrle_cache) {
+        for (a = addr; a < addr + n * TARGET_PAGE_SIZE; a += TARGET_PAGE_SIZE) {
+            cached = page_cache_lookup(xbzrle_cache, a);
+            if (cached)
+                memset(cached, 0, TARGET_PAGE_SIZE);
+        }
+    }
+
+    if (n == 1) {
+        qemu_put_be64(f, addr | RAM_SAVE_FLAG_COMPRESS);
+        qemu_put_byte(f, 0);
+    } else {
+        qemu_put_be64(f, addr | RAM_SAVE_FLAG_ZERO);
+        qemu_put_be32(f, n);
+    }
+
+    ram_pages_sent += n;
+    return n;
+}
+
+/* zero a page on the destination, leaving untouched pages unallocated */
+static void ram_load_zero_page(ram_addr_t addr)
+{
+    if (!buffer_is_zero(phys_ram_base + addr, TARGET_PAGE_SIZE))
+        memset(phys_ram_base + addr, 0, TARGET_PAGE_SIZE);
+}
+
+/* where the next search for dirty pages starts */
+static ram_addr_t current_addr;
+/* number of times the search went through all of RAM */
+static int ram_passes;
+
+static void ram_save_advance(ram_addr_t addr)
+{
+    if (addr >= phys_ram_size) {
+        addr = 0;
+        ram_passes++;
+    }
+    current_addr = addr;
+}
+
+static int ram_save_block(QEMUFile *f)
+{
+    ram_addr_t addr;
+    uint8_t *p, *cached = NULL;
+    uint8_t ch;
+
+    if (ram_dirty_pages == 0)
+        return 0;
+
+    /* continue where the last call stopped, wrapping around once */
+    addr = ram_dirty_find(current_addr, phys_ram_size);
+    if (addr == phys_ram_size) {
+        ram_passes++;
+        addr = ram_dirty_find(0, current_addr);
+        if (addr == current_addr)
+            return 0;
+    }
+
+    p = phys_ram_base + addr;
+    if (buffer_is_zero(p, TARGET_PAGE_SIZE)) {
+        addr += ram_save_zero_pages(f, addr) * TARGET_PAGE_SIZE;
+        ram_save_advance(addr);
+        return 1;
+    }
+
+    ram_dirty_reset(addr);
+
+    if (xbzrle_cache) {
+        memcpy(xbzrle_page, p, TARGET_PAGE_SIZE);
+        p = xbzrle_page;
+        cached = page_cache_lookup(xbzrle_cache, addr);
+        if (!cached)
+            xbzrle_stats.cache_miss++;
     }
 
-    return found;
+    ch = *p;
+
+    if (is_dup_page(p, ch)) {
+        qemu_put_be64(f, addr | RAM_SAVE_FLAG_COMPRESS);
+        qemu_put_byte(f, ch);
+        /* the destination decodes later deltas against what it has */
+        if (cached)
+            memset(cached, ch, TARGET_PAGE_SIZE);
+    } else if (!cached || !ram_save_xbzrle(f, addr, p, cached)) {
+        qemu_put_be64(f, addr | RAM_SAVE_FLAG_PAGE);
+        if (xbzrle_cache) {
+            /* later deltas are against the cached copy, send the same */
+            qemu_put_buffer(f, p, TARGET_PAGE_SIZE);
+            if (!cached)
+                cached = page_cache_insert(xbzrle_cache, addr);
+            memcpy(cached, p, TARGET_PAGE_SIZE);
+        } else {
+            /* sent from guest RAM, the page is dirty again if it changes
+               before it goes out */
+            qemu_put_buffer_async(f, p, TARGET_PAGE_SIZE);
+        }
+    }
+
+    ram_save_advance(addr + TARGET_PAGE_SIZE);
+
+    ram_pages_sent++;
+    return 1;
 }
 
 static ram_addr_t ram_save_threshold = 10;
 
+/* the pages left plus those dirtied since the last sync, an estimate: a
+   page can be in both, and kqemu does not count the pages it dirties */
 static ram_addr_t ram_save_remaining(void)
+{
+    return ram_dirty_pages + migration_dirty_pages;
+}
+
+uint64_t ram_bytes_remaining(void)
+{
+    return (uint64_t)ram_save_remaining() * TARGET_PAGE_SIZE;
+}
+
+uint64_t ram_bytes_sent(void)
+{
+    return ram_pages_sent * TARGET_PAGE_SIZE;
+}
+
+uint64_t ram_bytes_total(void)
+{
+    return phys_ram_size;
+}
+
+int ram_save_pass_complete(void)
+{
+    return ram_passes > 0;
+}
+
+/* Post-copy: the pages still dirty when the source stops are sent while
+   the destination runs, in units of a host page so that the destination
+   can install them atomically. */
+
+static int ram_postcopy;
+/* destination: the pages to fetch, one bit per target page */
+static uint8_t *ram_postcopy_bitmap;
+static uint8_t *ram_postcopy_buf;
+
+/* hand the pages left at completion over to post-copy */
+int ram_save_postcopy(void)
+{
+    if (phys_ram_size & (qemu_host_page_size - 1))
+        return -ENOTSUP;
+    ram_postcopy = 1;
+    return 0;
+}
+
+static void ram_save_postcopy_bitmap(QEMUFile *f)
 {
     ram_addr_t addr;
-    ram_addr_t count = 0;
+    uint8_t byte = 0;
+    int bit = 0;
 
+    qemu_put_be64(f, RAM_SAVE_FLAG_POSTCOPY);
+    qemu_put_be32(f, qemu_host_page_size);
     for (addr = 0; addr < phys_ram_size; addr += TARGET_PAGE_SIZE) {
-        if (cpu_physical_memory_get_dirty(addr, MIGRATION_DIRTY_FLAG))
-            count++;
+        if (ram_dirty_get(addr))
+            byte |= 1 << bit;
+        if (++bit == 8) {
+            qemu_put_byte(f, byte);
+            byte = bit = 0;
+        }
     }
+    if (bit)
+        qemu_put_byte(f, byte);
+}
+
+/* send the host page containing addr if part of it is still dirty */
+static int ram_save_postcopy_page(QEMUFile *f, ram_addr_t addr)
+{
+    ram_addr_t a, end;
+
+    addr &= ~(ram_addr_t)(qemu_host_page_size - 1);
+    end = addr + qemu_host_page_size;
+    if (ram_dirty_find(addr, end) == end)
+        return 0;
 
-    return count;
+    for (a = addr; a < end; a += TARGET_PAGE_SIZE)
+        ram_dirty_reset(a);
+
+    if (buffer_is_zero(phys_ram_base + addr, qemu_host_page_size)) {
+        qemu_put_be64(f, addr | RAM_SAVE_FLAG_COMPRESS);
+        qemu_put_byte(f, 0);
+    } else {
+        qemu_put_be64(f, addr | RAM_SAVE_FLAG_PAGE);
+        qemu_put_buffer_async(f, phys_ram_base + addr, qemu_host_page_size);
+    }
+
+    ram_pages_sent += qemu_host_page_size / TARGET_PAGE_SIZE;
+    ram_save_advance(end);
+    return 1;
 }
 
-static int ram_save_live(QEMUFile *f, int stage, void *opaque)
+/* a page the destination is waiting for, send it ahead of the others and
+   go on with its neighbours */
+void ram_save_postcopy_request(QEMUFile *f, uint64_t addr)
+{
+    if (addr < phys_ram_size)
+        ram_save_postcopy_page(f, addr);
+}
+
+/* push pages in the background, returns 1 once all of them are sent */
+int ram_save_postcopy_iterate(QEMUFile *f)
 {
     ram_addr_t addr;
 
-    if (stage == 1) {
-        /* Make sure all dirty bits are set */
-        for (addr = 0; addr < phys_ram_size; addr += TARGET_PAGE_SIZE) {
-            if (!cpu_physical_memory_get_dirty(addr, MIGRATION_DIRTY_FLAG))
-                cpu_physical_memory_set_dirty(addr);
+    while (!qemu_file_rate_limit(f)) {
+        addr = ram_dirty_find(current_addr, phys_ram_size);
+        if (addr == phys_ram_size)
+            addr = ram_dirty_find(0, phys_ram_size);
+        if (addr == phys_ram_size) {
+            qemu_put_be64(f, RAM_SAVE_FLAG_EOS);
+            ram_postcopy = 0;
+            return 1;
         }
-        
+        ram_save_postcopy_page(f, addr);
+    }
+    return 0;
+}
+
+static int ram_load_postcopy_bitmap(QEMUFile *f)
+{
+    size_t len = (phys_ram_size / TARGET_PAGE_SIZE + 7) / 8;
+
+    if (qemu_get_be32(f) != qemu_host_page_size) {
+        fprintf(stderr, "post-copy needs the same host page size on both "
+                "sides\n");
+        return -EINVAL;
+    }
+
+    qemu_free(ram_postcopy_bitmap);
+    ram_postcopy_bitmap = qemu_malloc(len);
+    qemu_get_buffer(f, ram_postcopy_bitmap, len);
+    return 0;
+}
+
+/* runs in the post-copy receive thread */
+static int ram_load_postcopy_page(QEMUFile *f)
+{
+    ram_addr_t addr;
+    int flags, ret;
+
+    addr = qemu_get_be64(f);
+    flags = addr & ~TARGET_PAGE_MASK;
+    addr &= TARGET_PAGE_MASK;
+
+    if (flags & RAM_SAVE_FLAG_EOS)
+        return 0;
+    if (addr >= phys_ram_size || (addr & (qemu_host_page_size - 1)))
+        return -EINVAL;
+
+    if (flags & RAM_SAVE_FLAG_COMPRESS) {
+        if (qemu_get_byte(f) != 0)
+            return -EINVAL;
+        ret = postcopy_ram_place_zero_page(addr);
+    } else if (flags & RAM_SAVE_FLAG_PAGE) {
+        qemu_get_buffer(f, ram_postcopy_buf, qemu_host_page_size);
+        ret = postcopy_ram_place_page(addr, ram_postcopy_buf);
+    } else {
+        return -EINVAL;
+    }
+
+    if (qemu_file_has_error(f))
+        return -EIO;
+    return ret < 0 ? ret : 1;
+}
+
+/* Start fetching the pages announced by the source in the background and
+   on demand.  Returns 0 if the migration was not post-copy, 1 once the
+   post-copy threads own f and fd, or a negative errno. */
+int ram_load_postcopy(QEMUFile *f, int fd)
+{
+    size_t i, nb_pages = phys_ram_size / qemu_host_page_size;
+    int per_page = qemu_host_page_size / TARGET_PAGE_SIZE;
+    uint8_t *missing;
+    size_t page;
+    int ret;
+
+    if (!ram_postcopy_bitmap)
+        return 0;
+
+    if (fd < 0 || !postcopy_ram_supported()) {
+        fprintf(stderr, "post-copy migration is not supported here\n");
+        ret = -ENOTSUP;
+        goto out;
+    }
+
+    missing = qemu_mallocz(nb_pages);
+    for (i = 0; i < phys_ram_size / TARGET_PAGE_SIZE; i++) {
+        if (ram_postcopy_bitmap[i / 8] & (1 << (i % 8))) {
+            page = i / per_page;
+            missing[page] = 1;
+        }
+    }
+
+    if (!ram_postcopy_buf)
+        ram_postcopy_buf = qemu_vmalloc(qemu_host_page_size);
+
+    ret = postcopy_ram_incoming_start(phys_ram_base, phys_ram_size,
+                                      qemu_host_page_size, missing, f, fd,
+                                      ram_load_postcopy_page);
+    if (ret < 0)
+        qemu_free(missing);
+    else
+        ret = 1;
+
+out:
+    qemu_free(ram_postcopy_bitmap);
+    ram_postcopy_bitmap = NULL;
+    return ret;
+}
+
+/* Snapshots keep guest RAM as a plain image in the VM state area, beside
+   the state stream and always at the same offset.  Taking a snapshot makes
+   qcow2 share the clusters of the image between the snapshot and the
+   current state, so the next snapshot only rewrites the pages that changed
+   since and the others stay references to the parent snapshot's clusters.
+   The pages that changed are tracked with SNAPSHOT_DIRTY_FLAG. */
+
+/* the state stream in front of the image is far smaller than that */
+#define RAM_IMAGE_OFFSET	(1ULL << 30)
+/* largest single read or write of the image */
+#define RAM_IMAGE_RUN_MAX	(1 << 24)
+
+/* the snapshot device whose RAM image holds guest RAM, but for the pages
+   with SNAPSHOT_DIRTY_FLAG set */
+static BlockDriverState *ram_image_bs;
+
+void ram_snapshot_invalidate(void)
+{
+    ram_image_bs = NULL;
+}
+
+static int ram_image_write(BlockDriverState *bs, int64_t base,
+                           ram_addr_t start, ram_addr_t end)
+{
+    if (start == end)
+        return 0;
+    if (bdrv_pwrite(bs, base + start, phys_ram_base + start, end - start) < 0)
+        return -EIO;
+    return 0;
+}
+
+/* Bring the image at offset base of bs up to date with guest RAM */
+static int ram_save_image(BlockDriverState *bs, int64_t base)
+{
+    ram_addr_t addr, start, end, alloc_end;
+    int dirty_only, allocated, n;
+
+    dirty_only = (bs == ram_image_bs);
+    ram_image_bs = NULL;
+
+    start = end = alloc_end = 0;
+    allocated = 1;
+    for (addr = 0; addr < phys_ram_size; addr += TARGET_PAGE_SIZE) {
+        if (dirty_only) {
+            addr = cpu_physical_memory_find_dirty(addr, phys_ram_size,
+                                                  SNAPSHOT_DIRTY_FLAG);
+            if (addr == phys_ram_size)
+                break;
+        }
+
+        /* unallocated clusters read as zeroes, no need to write zero
+           pages there */
+        if (addr >= alloc_end) {
+            n = MIN(phys_ram_size - addr, RAM_IMAGE_RUN_MAX) >> 9;
+            allocated = bdrv_is_allocated(bs, (base + addr) >> 9, n, &n);
+            alloc_end = addr + ((ram_addr_t)MAX(n, 1) << 9);
+        }
+        if (!allocated && addr + TARGET_PAGE_SIZE <= alloc_end &&
+            buffer_is_zero(phys_ram_base + addr, TARGET_PAGE_SIZE))
+            continue;
+
+        if (addr != end || end - start >= RAM_IMAGE_RUN_MAX) {
+            if (ram_image_write(bs, base, start, end) < 0)
+                return -EIO;
+            start = addr;
+        }
+        end = addr + TARGET_PAGE_SIZE;
+    }
+    if (ram_image_write(bs, base, start, end) < 0)
+        return -EIO;
+
+    cpu_physical_memory_reset_dirty(0, phys_ram_size, SNAPSHOT_DIRTY_FLAG);
+    /* KVM only logs the pages it dirties while migrating */
+    if (!kvm_enabled())
+        ram_image_bs = bs;
+    return 0;
+}
+
+/* zero [addr, addr + len) without touching the pages already zero */
+static void ram_load_zero_range(ram_addr_t addr, ram_addr_t len)
+{
+    ram_addr_t end = addr + len, next;
+
+    for (; addr < end; addr = next) {
+        next = MIN((addr & TARGET_PAGE_MASK) + TARGET_PAGE_SIZE, end);
+        if (next - addr == TARGET_PAGE_SIZE)
+            ram_load_zero_page(addr);
+        else
+            memset(phys_ram_base + addr, 0, next - addr);
+    }
+}
+
+/* A lazy loadvm starts the guest before the image is read: its pages are
+   read on first touch and in the background by the post-copy threads,
+   straight from the image file since these threads cannot use the block
+   layer.  The clusters they read stay where they are until the next savevm
+   or loadvm, which wait for the threads to finish. */
+static int ram_lazy_fd = -1;
+/* offset in the image file of each missing host page */
+static int64_t *ram_lazy_map;
+
+static int ram_lazy_read(uint64_t offset, uint8_t *buf, size_t len)
+{
+    size_t page = qemu_host_page_size, i, n;
+    int64_t pos;
+    ssize_t ret;
+
+    for (i = 0; i < len; i += n) {
+        /* pages that follow each other in the file are read at once */
+        pos = ram_lazy_map[(offset + i) / page];
+        for (n = page; i + n < len &&
+             ram_lazy_map[(offset + i + n) / page] == pos + n; n += page)
+            ;
+
+        do {
+            ret = pread(ram_lazy_fd, buf + i, n, pos);
+        } while (ret < 0 && errno == EINTR);
+        if (ret != (ssize_t)n)
+            return -EIO;
+    }
+    return 0;
+}
+
+static void ram_lazy_done(void)
+{
+    close(ram_lazy_fd);
+    ram_lazy_fd = -1;
+    qemu_free(ram_lazy_map);
+    ram_lazy_map = NULL;
+}
+
+static int ram_load_image_lazy(BlockDriverState *bs, int64_t base)
+{
+    size_t page = qemu_host_page_size, nb_pages = phys_ram_size / page;
+    size_t i, j, n;
+    uint8_t *missing;
+    int64_t pos;
+    int sectors, ret;
+
+    if (!postcopy_ram_supported())
+        return -ENOTSUP;
+    ret = bdrv_open_image_file(bs);
+    if (ret < 0)
+        return ret;
+    ram_lazy_fd = ret;
+
+    ram_lazy_map = qemu_malloc(nb_pages * sizeof(int64_t));
+    missing = qemu_mallocz(nb_pages);
+    for (i = 0; i < nb_pages; i += n) {
+        n = MIN(nb_pages - i, RAM_IMAGE_RUN_MAX / page);
+        pos = bdrv_get_file_offset(bs, (base + i * page) >> 9,
+                                   n * (page >> 9), &sectors);
+        /* whole pages only, clusters smaller than a page are not mapped */
+        n = ((size_t)sectors << 9) / page;
+        if (pos < 0 || n == 0) {
+            ret = -ENOTSUP;
+            goto fail;
+        }
+        if (pos == 0) {
+            ram_load_zero_range(i * page, n * page);
+            continue;
+        }
+        for (j = 0; j < n; j++) {
+            ram_lazy_map[i + j] = pos + j * page;
+            missing[i + j] = 1;
+        }
+    }
+
+    ret = postcopy_ram_local_start(phys_ram_base, phys_ram_size, page,
+                                   missing, ram_lazy_read, ram_lazy_done);
+    if (ret < 0)
+        goto fail;
+    return 0;
+
+fail:
+    qemu_free(missing);
+    ram_lazy_done();
+    return ret;
+}
+
+/* Read guest RAM from the image at offset base of bs, lazily if asked to
+   and possible */
+static int ram_load_image(BlockDriverState *bs, int64_t base, int lazy)
+{
+    ram_addr_t addr, len;
+    int n;
+
+    if (lazy && ram_load_image_lazy(bs, base) == 0)
+        goto done;
+
+    for (addr = 0; addr < phys_ram_size; addr += len) {
+        n = MIN(phys_ram_size - addr, RAM_IMAGE_RUN_MAX) >> 9;
+        if (bdrv_is_allocated(bs, (base + addr) >> 9, n, &n)) {
+            len = (ram_addr_t)MAX(n, 1) << 9;
+            if (bdrv_pread(bs, base + addr, phys_ram_base + addr, len) < 0)
+                return -EIO;
+        } else {
+            /* never written, reads as zeroes */
+            len = (ram_addr_t)MAX(n, 1) << 9;
+            ram_load_zero_range(addr, len);
+        }
+    }
+
+done:
+    cpu_physical_memory_reset_dirty(0, phys_ram_size, SNAPSHOT_DIRTY_FLAG);
+    if (!kvm_enabled())
+        ram_image_bs = bs;
+    return 0;
+}
+
+/* For a snapshot, all of RAM goes to the image once the VM is stopped */
+static int ram_save_snapshot(QEMUFile *f, int stage, BlockDriverState *bs,
+                             int64_t base)
+{
+    if (stage == 1)
+        qemu_put_be64(f, phys_ram_size | RAM_SAVE_FLAG_MEM_SIZE);
+
+    if (stage == 3) {
+        if (ram_save_image(bs, base + RAM_IMAGE_OFFSET) < 0)
+            qemu_file_set_error(f);
+        else
+            qemu_put_be64(f, RAM_IMAGE_OFFSET | RAM_SAVE_FLAG_IMAGE);
+    }
+
+    qemu_put_be64(f, RAM_SAVE_FLAG_EOS);
+    return 1;
+}
+
+/* Stage 1 and 3 run in the main loop, stage 2 may run in the migration
+   thread. */
+static int ram_save_live(QEMUFile *f, int stage, void *opaque)
+{
+    BlockDriverState *bs;
+    int64_t base;
+    int synced = 0;
+    uint64_t bw;
+
+    bs = qemu_savevm_snapshot_area(f, &base);
+    if (bs)
+        return ram_save_snapshot(f, stage, bs, base);
+
+    if (stage == 1) {
+        /* All of RAM is sent, the dirty flags track what changes after */
+        qemu_free(ram_dirty);
+        ram_dirty = qemu_malloc(phys_ram_size >> TARGET_PAGE_BITS);
+        memset(ram_dirty, 1, phys_ram_size >> TARGET_PAGE_BITS);
+        ram_dirty_pages = phys_ram_size >> TARGET_PAGE_BITS;
+        cpu_physical_memory_reset_dirty(0, phys_ram_size,
+                                        MIGRATION_DIRTY_FLAG);
+
         /* Enable dirty memory tracking */
         cpu_physical_memory_set_dirty_tracking(1);
 
+        xbzrle_init();
+        ram_pages_sent = 0;
+        current_addr = 0;
+        ram_passes = 0;
+        ram_postcopy = 0;
+
         qemu_put_be64(f, phys_ram_size | RAM_SAVE_FLAG_MEM_SIZE);
     }
 
-    while (!qemu_file_rate_limit(f)) {
-        int ret;
+    if (stage == 3)
+        ram_save_sync(NULL);
 
-        ret = ram_save_block(f);
-        if (ret == 0) /* no more blocks */
-            break;
+    /* the pages are sent from stage 2 on, away from the main loop */
+    while (stage != 1 && !(stage == 3 && ram_postcopy) &&
+           !qemu_file_rate_limit(f)) {
+        if (ram_save_block(f) == 0) {
+            /* pick up the pages dirtied meanwhile, once per call */
+            if (stage == 3 || synced ||
+                migrate_run_in_main_loop(ram_save_sync, NULL) < 0)
+                break;
+            synced = 1;
+        }
     }
 
     /* try transferring iterative blocks of memory */
@@ -3209,13 +3951,27 @@ static int ram_save_live(QEMUFile *f, int stage, void *opaque)
     if (stage == 3) {
         cpu_physical_memory_set_dirty_tracking(0);
 
-        /* flush all remaining blocks regardless of rate limiting */
-        while (ram_save_block(f) != 0);
+        if (ram_postcopy) {
+            /* the destination fetches the rest once it runs */
+            ram_save_postcopy_bitmap(f);
+        } else {
+            /* flush all remaining blocks regardless of rate limiting */
+            while (ram_save_block(f) != 0);
+        }
+
+        xbzrle_cleanup();
     }
 
     qemu_put_be64(f, RAM_SAVE_FLAG_EOS);
 
-    return (stage == 2) && (ram_save_remaining() < ram_save_threshold);
+    if (stage != 2)
+        return 0;
+    if (ram_save_remaining() < ram_save_threshold)
+        return 1;
+
+    /* stop once the rest can be sent within the allowed downtime */
+    bw = migrate_bandwidth();
+    return bw && ram_bytes_remaining() / bw <= migrate_max_downtime();
 }
 
 static int ram_load_dead(QEMUFile *f, void *opaque)
@@ -3249,9 +4005,13 @@ static int ram_load_dead(QEMUFile *f, void *opaque)
 
 static int ram_load(QEMUFile *f, void *opaque, int version_id)
 {
+    BlockDriverState *bs;
+    int64_t base;
     ram_addr_t addr;
     int flags;
 
+    ram_image_bs = NULL;
+
     if (version_id == 1)
         return ram_load_v1(f, opaque);
 
@@ -3261,7 +4021,7 @@ static int ram_load(QEMUFile *f, void *opaque, int version_id)
         return ram_load_dead(f, opaque);
     }
 
-    if (version_id != 3)
+    if (version_id < 3 || version_id > 5)
         return -EINVAL;
 
     do {
@@ -3279,12 +4039,48 @@ static int ram_load(QEMUFile *f, void *opaque, int version_id)
             if (ram_load_dead(f, opaque) < 0)
                 return -EINVAL;
         }
-        
+
+        if (flags & RAM_SAVE_FLAG_POSTCOPY) {
+            if (ram_load_postcopy_bitmap(f) < 0)
+                return -EINVAL;
+        }
+
+        if (flags & RAM_SAVE_FLAG_IMAGE) {
+            bs = qemu_savevm_snapshot_area(f, &base);
+            if (!bs || ram_load_image(bs, base + addr,
+                                      qemu_loadvm_snapshot_lazy(f)) < 0)
+                return -EINVAL;
+        }
+
         if (flags & RAM_SAVE_FLAG_COMPRESS) {
             uint8_t ch = qemu_get_byte(f);
-            memset(phys_ram_base + addr, ch, TARGET_PAGE_SIZE);
-        } else if (flags & RAM_SAVE_FLAG_PAGE)
+            if (ch == 0)
+                ram_load_zero_page(addr);
+            else
+                memset(phys_ram_base + addr, ch, TARGET_PAGE_SIZE);
+        } else if (flags & RAM_SAVE_FLAG_ZERO) {
+            uint32_t n = qemu_get_be32(f);
+
+            if (n > RAM_SAVE_ZERO_MAX ||
+                addr + (ram_addr_t)n * TARGET_PAGE_SIZE > phys_ram_size)
+                return -EINVAL;
+            while (n--) {
+                ram_load_zero_page(addr);
+                addr += TARGET_PAGE_SIZE;
+            }
+        } else if (flags & RAM_SAVE_FLAG_PAGE) {
             qemu_get_buffer(f, phys_ram_base + addr, TARGET_PAGE_SIZE);
+        } else if (flags & RAM_SAVE_FLAG_XBZRLE) {
+            uint8_t buf[XBZRLE_MAX_LEN];
+            int len = qemu_get_be16(f);
+
+            if (len > XBZRLE_MAX_LEN)
+                return -EINVAL;
+            qemu_get_buffer(f, buf, len);
+            if (xbzrle_decode_buffer(buf, len, phys_ram_base + addr,
+                                     TARGET_PAGE_SIZE) < 0)
+                return -EINVAL;
+        }
     } while (!(flags & RAM_SAVE_FLAG_EOS));
 
     return 0;
@@ -3374,7 +4170,9 @@ void qemu_bh_schedule(QEMUBH *bh)
     bh->scheduled = 1;
     bh->idle = 0;
     /* stop the currently executing CPU to execute the BH ASAP */
-    if (env) {
+    if (vcpu_threads) {
+        qemu_notify_event();
+    } else if (env) {
         cpu_interrupt(env, CPU_INTERRUPT_EXIT);
     }
 }
@@ -3501,6 +4299,150 @@ static void vm_state_notify(int running, int reason)
     }
 }
 
+/***********************************************************/
+/* VCPU threads */
+
+#ifdef USE_VCPU_THREADS
+
+/* With -vcpu-threads each VCPU runs cpu_exec() in its own thread.  The
+   device models, the timers and the main loop are protected by
+   qemu_global_mutex, which the VCPU threads only take for I/O.  The
+   lock is recursive: a device callback may run into code that takes it
+   again. */
+static pthread_mutex_t qemu_global_mutex = PTHREAD_MUTEX_INITIALIZER;
+static __thread int qemu_global_mutex_depth;
+
+/* signalled when the VCPUs may have to stop waiting, and when a VCPU
+   has parked */
+static pthread_cond_t qemu_vcpu_cond = PTHREAD_COND_INITIALIZER;
+static pthread_cond_t qemu_pause_cond = PTHREAD_COND_INITIALIZER;
+
+static int vcpu_threads_started;
+static int vcpu_pause_count;
+static unsigned int vcpu_kicks;
+
+/* requests a VCPU thread makes to the main loop */
+static CPUState *vcpu_debug_env;
+static int vmstop_requested;
+static int vmstop_reason;
+
+void qemu_mutex_lock_iothread(void)
+{
+    if (!vcpu_threads)
+        return;
+    if (qemu_global_mutex_depth++ == 0)
+        pthread_mutex_lock(&qemu_global_mutex);
+}
+
+void qemu_mutex_unlock_iothread(void)
+{
+    if (!vcpu_threads)
+        return;
+    if (--qemu_global_mutex_depth == 0)
+        pthread_mutex_unlock(&qemu_global_mutex);
+}
+
+/* release the lock when cpu_exec() longjmp()ed out of a device
+   callback */
+void qemu_mutex_reset_iothread(void)
+{
+    if (qemu_global_mutex_depth > 0) {
+        qemu_global_mutex_depth = 0;
+        pthread_mutex_unlock(&qemu_global_mutex);
+    }
+}
+
+/* wake up the main loop from a VCPU thread */
+void qemu_notify_event(void)
+{
+    static const char byte = 0;
+
+    if (!vcpu_threads)
+        return;
+    write(alarm_timer_wfd, &byte, sizeof(byte));
+}
+
+/* wake up the thread of a halted VCPU.  A VCPU does not need to wake
+   itself up, the other callers hold the global mutex (cross CPU
+   interrupts come from the device models). */
+void qemu_cpu_kick(CPUState *env)
+{
+    if (!vcpu_threads || env == cpu_single_env)
+        return;
+    qemu_mutex_lock_iothread();
+    vcpu_kicks++;
+    pthread_cond_broadcast(&qemu_vcpu_cond);
+    qemu_mutex_unlock_iothread();
+}
+
+static int all_vcpus_stopped(void)
+{
+    CPUState *env;
+
+    for (env = first_cpu; env != NULL; env = env->next_cpu) {
+        if (!env->stopped)
+            return 0;
+    }
+    return 1;
+}
+
+/* park all the VCPU threads outside of cpu_exec().  Must be called from
+   the main thread with the global mutex held; the calls nest. */
+void pause_all_vcpus(void)
+{
+    CPUState *env;
+
+    if (!vcpu_threads)
+        return;
+    vcpu_pause_count++;
+    if (!vcpu_threads_started)
+        return;
+    for (env = first_cpu; env != NULL; env = env->next_cpu)
+        cpu_interrupt(env, CPU_INTERRUPT_EXIT);
+    while (!all_vcpus_stopped())
+        pthread_cond_wait(&qemu_pause_cond, &qemu_global_mutex);
+}
+
+void resume_all_vcpus(void)
+{
+    if (!vcpu_threads)
+        return;
+    if (--vcpu_pause_count == 0)
+        pthread_cond_broadcast(&qemu_vcpu_cond);
+}
+
+#else
+
+void qemu_mutex_lock_iothread(void)
+{
+}
+
+void qemu_mutex_unlock_iothread(void)
+{
+}
+
+void qemu_mutex_reset_iothread(void)
+{
+}
+
+void qemu_notify_event(void)
+{
+}
+
+void qemu_cpu_kick(CPUState *env)
+{
+}
+
+void pause_all_vcpus(void)
+{
+}
+
+void resume_all_vcpus(void)
+{
+}
+
+#endif /* USE_VCPU_THREADS */
+
 void vm_start(void)
 {
     if (!vm_running) {
@@ -3508,14 +4450,32 @@ void vm_start(void)
         vm_running = 1;
         vm_state_notify(1, 0);
         qemu_rearm_alarm_timer(alarm_timer);
+#ifdef USE_VCPU_THREADS
+        if (vcpu_threads)
+            pthread_cond_broadcast(&qemu_vcpu_cond);
+#endif
     }
 }
 
 void vm_stop(int reason)
 {
+#ifdef USE_VCPU_THREADS
+    if (vcpu_threads && cpu_single_env) {
+        /* a VCPU thread cannot park the others, the main loop stops
+           the VM on its behalf */
+        vmstop_requested = 1;
+        vmstop_reason = reason;
+        cpu_interrupt(cpu_single_env, CPU_INTERRUPT_EXIT);
+        qemu_notify_event();
+        return;
+    }
+#endif
     if (vm_running) {
         cpu_disable_ticks();
         vm_running = 0;
+        /* wait for the VCPU threads to leave cpu_exec() */
+        pause_all_vcpus();
+        resume_all_vcpus();
         vm_state_notify(0, reason);
     }
 }
@@ -3587,6 +4547,7 @@ void qemu_system_reset_request(void)
     }
     if (cpu_single_env)
         cpu_interrupt(cpu_single_env, CPU_INTERRUPT_EXIT);
+    qemu_notify_event();
 }
 
 void qemu_system_shutdown_request(void)
@@ -3594,6 +4555,7 @@ void qemu_system_shutdown_request(void)
     shutdown_requested = 1;
     if (cpu_single_env)
         cpu_interrupt(cpu_single_env, CPU_INTERRUPT_EXIT);
+    qemu_notify_event();
 }
 
 void qemu_system_powerdown_request(void)
@@ -3601,6 +4563,7 @@ void qemu_system_powerdown_request(void)
     powerdown_requested = 1;
     if (cpu_single_env)
         cpu_interrupt(cpu_single_env, CPU_INTERRUPT_EXIT);
+    qemu_notify_event();
 }
 
 #ifdef _WIN32
@@ -3695,7 +4658,9 @@ void main_loop_wait(int timeout)
         slirp_select_fill(&nfds, &rfds, &wfds, &xfds);
     }
 #endif
+    qemu_mutex_unlock_iothread();
     ret = select(nfds + 1, &rfds, &wfds, &xfds, &tv);
+    qemu_mutex_lock_iothread();
     if (ret > 0) {
         IOHandlerRecord **pioh;
 
@@ -3745,6 +4710,150 @@ void main_loop_wait(int timeout)
 
 }
 
+int cpu_throttle_percentage;
+
+/* the CPUs sleep for cpu_throttle_percentage ms out of every 100 */
+static int cpu_throttled(void)
+{
+    return cpu_throttle_percentage &&
+           qemu_get_clock(rt_clock) % 100 < cpu_throttle_percentage;
+}
+
+#ifdef USE_VCPU_THREADS
+
+static int vcpu_can_run(void)
+{
+    return vm_running && !vcpu_pause_count && !tb_flush_requested &&
+           !vcpu_debug_env && !vmstop_requested && !cpu_throttled();
+}
+
+static void *vcpu_thread_fn(void *opaque)
+{
+    CPUState *env = opaque;
+    sigset_t set;
+    unsigned int kicks;
+    int ret;
+
+    /* the main thread handles the signals, except for the ones raised
+       by the generated code itself */
+    sigfillset(&set);
+    sigdelset(&set, SIGSEGV);
+    sigdelset(&set, SIGBUS);
+    sigdelset(&set, SIGFPE);
+    sigdelset(&set, SIGILL);
+    pthread_sigmask(SIG_BLOCK, &set, NULL);
+
+    qemu_mutex_lock_iothread();
+    for(;;) {
+        if (!vcpu_can_run()) {
+            env->stopped = 1;
+            pthread_cond_broadcast(&qemu_pause_cond);
+            pthread_cond_wait(&qemu_vcpu_cond, &qemu_global_mutex);
+            continue;
+        }
+        env->stopped = 0;
+        kicks = vcpu_kicks;
+        qemu_mutex_unlock_iothread();
+        ret = cpu_exec(env);
+        qemu_mutex_lock_iothread();
+        if (ret == EXCP_DEBUG) {
+            if (!vcpu_debug_env)
+                vcpu_debug_env = env;
+            qemu_notify_event();
+        } else if (ret == EXCP_HALTED) {
+            /* sleep until an interrupt is raised for this CPU */
+            while (kicks == vcpu_kicks && vcpu_can_run())
+                pthread_cond_wait(&qemu_vcpu_cond, &qemu_global_mutex);
+        }
+    }
+    return NULL;
+}
+
+static void start_vcpu_threads(void)
+{
+    pthread_attr_t attr;
+    pthread_t thread;
+    CPUState *env;
+
+    pthread_attr_init(&attr);
+    pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_DETACHED);
+    for (env = first_cpu; env != NULL; env = env->next_cpu) {
+        if (pthread_create(&thread, &attr, vcpu_thread_fn, env)) {
+            fprintf(stderr, "qemu: could not create the VCPU threads\n");
+            exit(1);
+        }
+    }
+    pthread_attr_destroy(&attr);
+    vcpu_threads_started = 1;
+}
+
+/* the main loop only services the devices and the requests of the
+   VCPU threads */
+static int vcpu_main_loop(void)
+{
+    CPUState *env;
+    int timeout;
+
+    qemu_mutex_lock_iothread();
+    cur_cpu = first_cpu;
+    start_vcpu_threads();
+    for(;;) {
+        if (tb_flush_requested == TB_FLUSH_ALL)
+            tb_flush(first_cpu);
+        else if (tb_flush_requested)
+            tb_flush_region(first_cpu);
+        if (vcpu_debug_env) {
+            gdb_set_stop_cpu(vcpu_debug_env);
+            vcpu_debug_env = NULL;
+            vm_stop(EXCP_DEBUG);
+        }
+        if (vmstop_requested) {
+            vmstop_requested = 0;
+            vm_stop(vmstop_reason);
+        }
+        if (vm_running) {
+            if (shutdown_requested) {
+                if (no_shutdown) {
+                    vm_stop(0);
+                    no_shutdown = 0;
+                } else
+                    break;
+            }
+            if (reset_requested) {
+                reset_requested = 0;
+                pause_all_vcpus();
+                qemu_system_reset();
+                resume_all_vcpus();
+            }
+            if (powerdown_requested) {
+                powerdown_requested = 0;
+                qemu_system_powerdown();
+            }
+            timeout = 5000;
+            if (cpu_throttle_percentage) {
+                /* park the VCPUs for the throttled part of the period */
+                if (cpu_throttled()) {
+                    for (env = first_cpu; env != NULL; env = env->next_cpu)
+                        cpu_interrupt(env, CPU_INTERRUPT_EXIT);
+                } else {
+                    pthread_cond_broadcast(&qemu_vcpu_cond);
+                }
+                timeout = 1;
+            }
+        } else {
+            if (shutdown_requested)
+                break;
+            timeout = 5000;
+        }
+        main_loop_wait(timeout);
+    }
+    pause_all_vcpus();
+    cpu_disable_ticks();
+    return EXCP_INTERRUPT;
+}
+
+#endif /* USE_VCPU_THREADS */
+
 static int main_loop(void)
 {
     int ret, timeout;
@@ -3753,10 +4862,14 @@ static int main_loop(void)
 #endif
     CPUState *env;
 
+#ifdef USE_VCPU_THREADS
+    if (vcpu_threads)
+        return vcpu_main_loop();
+#endif
     cur_cpu = first_cpu;
     next_cpu = cur_cpu->next_cpu ?: first_cpu;
     for(;;) {
-        if (vm_running) {
+        if (vm_running && likely(!cpu_throttled())) {
 
             for(;;) {
                 /* get next cpu */
@@ -3875,6 +4988,9 @@ static int main_loop(void)
             } else {
                 timeout = 0;
             }
+        } else if (vm_running) {
+            /* throttled: keep servicing I/O and timers, not the CPUs */
+            timeout = 1;
         } else {
             if (shutdown_requested) {
                 ret = EXCP_INTERRUPT;
@@ -3908,6 +5024,9 @@ static void help(int exitcode)
            "-M machine      select emulated machine (-M ? for list)\n"
            "-cpu cpu        select CPU (-cpu ? for list)\n"
            "-smp n          set the number of CPUs to 'n' [default=1]\n"
+#ifdef USE_VCPU_THREADS
+           "-vcpu-threads   run each CPU in its own host thread\n"
+#endif
            "-fda/-fdb file  use 'file' as floppy disk 0/1 image\n"
            "-hda/-hdb file  use 'file' as IDE hard disk 0/1 image\n"
            "-hdc/-hdd file  use 'file' as IDE hard disk 2/3 image\n"
@@ -3915,6 +5034,7 @@ static void help(int exitcode)
 	   "-drive [file=file][,if=type][,bus=n][,unit=m][,media=d][,index=i]\n"
            "       [,cyls=c,heads=h,secs=s[,trans=t]][,snapshot=on|off]\n"
            "       [,cache=writethrough|writeback|none][,format=f][,serial=s]\n"
+           "       [,l2_cache=n][,aio=threads|native][,merge_max=kb]\n"
 	   "                use 'file' as a drive image\n"
            "-mtdblock file  use 'file' as on-board Flash memory image\n"
            "-sd file        use 'file' as SecureDigital card image\n"
@@ -4049,6 +5169,7 @@ static void help(int exitcode)
            "-no-shutdown    stop before shutdown\n"
            "-loadvm [tag|id]\n"
            "                start right away with a saved state (loadvm in monitor)\n"
+           "-loadvm-lazy    start the guest before the RAM of the -loadvm state is read\n"
 #ifndef _WIN32
 	   "-daemonize      daemonize QEMU after initializing\n"
 #endif
@@ -4074,6 +5195,11 @@ static void help(int exitcode)
            "-old-param      old param mode\n"
 #endif
            "-tb-size n      set TB size\n"
+           "-tb-size-max n  let the TB cache grow up to n MB\n"
+           "-tb-profile     count the executions of each TB (see 'info tbprofile')\n"
+           "-virtio-coalesce [pending=n][,delay=us]\n"
+           "                delay the virtio interrupts by up to 'us' microseconds\n"
+           "                or 'n' notifications\n"
            "-incoming p     prepare for incoming migration, listen on port p\n"
            "\n"
            "During emulation, the following keys are useful:\n"
@@ -4104,6 +5230,7 @@ enum {
     QEMU_OPTION_M,
     QEMU_OPTION_cpu,
     QEMU_OPTION_smp,
+    QEMU_OPTION_vcpu_threads,
     QEMU_OPTION_fda,
     QEMU_OPTION_fdb,
     QEMU_OPTION_hda,
@@ -4177,6 +5304,7 @@ enum {
     QEMU_OPTION_no_reboot,
     QEMU_OPTION_no_shutdown,
     QEMU_OPTION_loadvm,
+    QEMU_OPTION_loadvm_lazy,
     QEMU_OPTION_daemonize,
     QEMU_OPTION_option_rom,
     QEMU_OPTION_prom_env,
@@ -4190,6 +5318,9 @@ enum {
     QEMU_OPTION_semihosting,
     QEMU_OPTION_old_param,
     QEMU_OPTION_tb_size,
+    QEMU_OPTION_tb_size_max,
+    QEMU_OPTION_tb_profile,
+    QEMU_OPTION_virtio_coalesce,
     QEMU_OPTION_incoming,
 };
 
@@ -4208,6 +5339,9 @@ static const QEMUOption qemu_options[] = {
     { "M", HAS_ARG, QEMU_OPTION_M },
     { "cpu", HAS_ARG, QEMU_OPTION_cpu },
     { "smp", HAS_ARG, QEMU_OPTION_smp },
+#ifdef USE_VCPU_THREADS
+    { "vcpu-threads", 0, QEMU_OPTION_vcpu_threads },
+#endif
     { "fda", HAS_ARG, QEMU_OPTION_fda },
     { "fdb", HAS_ARG, QEMU_OPTION_fdb },
     { "hda", HAS_ARG, QEMU_OPTION_hda },
@@ -4300,6 +5434,7 @@ static const QEMUOption qemu_options[] = {
     { "no-reboot", 0, QEMU_OPTION_no_reboot },
     { "no-shutdown", 0, QEMU_OPTION_no_shutdown },
     { "loadvm", HAS_ARG, QEMU_OPTION_loadvm },
+    { "loadvm-lazy", 0, QEMU_OPTION_loadvm_lazy },
     { "daemonize", 0, QEMU_OPTION_daemonize },
     { "option-rom", HAS_ARG, QEMU_OPTION_option_rom },
 #if defined(TARGET_SPARC) || defined(TARGET_PPC)
@@ -4319,6 +5454,9 @@ static const QEMUOption qemu_options[] = {
     { "old-param", 0, QEMU_OPTION_old_param },
 #endif
     { "tb-size", HAS_ARG, QEMU_OPTION_tb_size },
+    { "tb-size-max", HAS_ARG, QEMU_OPTION_tb_size_max },
+    { "tb-profile", 0, QEMU_OPTION_tb_profile },
+    { "virtio-coalesce", HAS_ARG, QEMU_OPTION_virtio_coalesce },
     { "incoming", HAS_ARG, QEMU_OPTION_incoming },
     { NULL },
 };
@@ -4621,12 +5759,13 @@ int main(int argc, char **argv, char **envp)
     const char *virtio_consoles[MAX_VIRTIO_CONSOLES];
     int virtio_console_index;
     const char *loadvm = NULL;
+    int loadvm_lazy = 0;
     QEMUMachine *machine;
     const char *cpu_model;
     const char *usb_devices[MAX_USB_CMDLINE];
     int usb_devices_index;
     int fds[2];
-    int tb_size;
+    int tb_size, tb_size_max;
     const char *pid_file = NULL;
     int autostart;
     const char *incoming = NULL;
@@ -4709,6 +5848,7 @@ int main(int argc, char **argv, char **envp)
     nb_nics = 0;
 
     tb_size = 0;
+    tb_size_max = 0;
     autostart= 1;
 
     optind = 1;
@@ -5103,6 +6243,9 @@ int main(int argc, char **argv, char **envp)
 	    case QEMU_OPTION_loadvm:
 		loadvm = optarg;
 		break;
+            case QEMU_OPTION_loadvm_lazy:
+                loadvm_lazy = 1;
+                break;
             case QEMU_OPTION_full_screen:
                 full_screen = 1;
                 break;
@@ -5166,6 +6309,11 @@ int main(int argc, char **argv, char **envp)
                     exit(1);
                 }
                 break;
+#ifdef USE_VCPU_THREADS
+            case QEMU_OPTION_vcpu_threads:
+                vcpu_threads = 1;
+                break;
+#endif
 	    case QEMU_OPTION_vnc:
 		vnc_display = optarg;
 		break;
@@ -5269,6 +6417,36 @@ int main(int argc, char **argv, char **envp)
                 if (tb_size < 0)
                     tb_size = 0;
                 break;
+            case QEMU_OPTION_tb_size_max:
+                tb_size_max = strtol(optarg, NULL, 0);
+                if (tb_size_max < 0)
+                    tb_size_max = 0;
+                break;
+            case QEMU_OPTION_tb_profile:
+                tb_profile_enabled = 1;
+                break;
+            case QEMU_OPTION_virtio_coalesce:
+                {
+                    static const char * const params[] = { "pending", "delay",
+                                                           NULL };
+                    char buf[32];
+
+                    if (check_params(buf, sizeof(buf), params, optarg) < 0) {
+                        fprintf(stderr, "qemu: unknown parameter '%s' in '%s'\n",
+                                buf, optarg);
+                        exit(1);
+                    }
+                    if (get_param_value(buf, sizeof(buf), "pending", optarg))
+                        virtio_coalesce_max_pending = strtol(buf, NULL, 0);
+                    if (get_param_value(buf, sizeof(buf), "delay", optarg))
+                        virtio_coalesce_max_delay = strtol(buf, NULL, 0);
+                    if (virtio_coalesce_max_pending < 0 ||
+                        virtio_coalesce_max_delay < 0) {
+                        fprintf(stderr, "qemu: invalid virtio-coalesce value\n");
+                        exit(1);
+                    }
+                }
+                break;
             case QEMU_OPTION_icount:
                 use_icount = 1;
                 if (strcmp(optarg, "auto") == 0) {
@@ -5365,8 +6543,20 @@ int main(int argc, char **argv, char **envp)
         exit(1);
     }
 
+#ifdef USE_VCPU_THREADS
+    if (vcpu_threads) {
+        if (use_icount) {
+            fprintf(stderr, "-vcpu-threads cannot be used with -icount\n");
+            exit(1);
+        }
+        if (kvm_enabled()) {
+            fprintf(stderr, "-vcpu-threads cannot be used with KVM\n");
+            exit(1);
+        }
+    }
+#endif
 #ifdef USE_KQEMU
-    if (smp_cpus > 1)
+    if (smp_cpus > 1 || vcpu_threads)
         kqemu_allowed = 0;
 #endif
     linux_boot = (kernel_filename != NULL);
@@ -5486,6 +6676,7 @@ int main(int argc, char **argv, char **envp)
     }
 
     /* init the dynamic translator */
+    tb_size_limit = (unsigned long)tb_size_max * 1024 * 1024;
     cpu_exec_init_all(tb_size * 1024 * 1024);
 
     bdrv_init();
@@ -5512,7 +6703,7 @@ int main(int argc, char **argv, char **envp)
 	    exit(1);
 
     register_savevm("timer", 0, 2, timer_save, timer_load, NULL);
-    register_savevm_live("ram", 0, 3, ram_save_live, NULL, ram_load, NULL);
+    register_savevm_live("ram", 0, 5, ram_save_live, NULL, ram_load, NULL);
 
 #ifndef _WIN32
     /* must be after terminal init, SDL library changes signal handlers */
@@ -5716,7 +6907,7 @@ int main(int argc, char **argv, char **envp)
 #endif
 
     if (loadvm)
-        do_loadvm(loadvm);
+        do_loadvm(loadvm_lazy, loadvm);
 
     if (incoming) {
         autostart = 0; /* fixme how to deal with -daemonize */
@@ -0,0 +1,222 @@
+/*
+ * XBZRLE page delta encoding and the page cache used by live migration
+ *
+ * This work is licensed under the terms of the GNU GPL, version 2.  See
+ * the COPYING file in the top-level directory.
+ *
+ */
+
+#include "qemu-common.h"
+#include "sys-queue.h"
+#include "xbzrle.h"
+
+/* Encoding: records of
+ *
+ *   uleb128 number of unchanged bytes
+ *   uleb128 number of changed bytes (n)
+ *   n bytes of new data
+ *
+ * Unchanged bytes at the end of the buffer are not encoded.
+ */
+
+static int uleb128_encode(uint8_t *dst, int dlen, uint32_t val)
+{
+    int n = 0;
+
+    do {
+        if (n >= dlen)
+            return -1;
+        dst[n] = val & 0x7f;
+        val >>= 7;
+        if (val)
+            dst[n] |= 0x80;
+        n++;
+    } while (val);
+
+    return n;
+}
+
+static int uleb128_decode(const uint8_t *src, int slen, uint32_t *val)
+{
+    int n = 0, shift = 0;
+
+    *val = 0;
+    do {
+        if (n >= slen || shift > 28)
+            return -1;
+        *val |= (uint32_t)(src[n] & 0x7f) << shift;
+        shift += 7;
+    } while (src[n++] & 0x80);
+
+    return n;
+}
+
+int xbzrle_encode_buffer(const uint8_t *old_buf, const uint8_t *new_buf,
+                         int slen, uint8_t *dst, int dlen)
+{
+    int i = 0, d = 0, zrun, nzrun, n;
+
+    while (i < slen) {
+        /* unchanged run, a word at a time where possible */
+        zrun = 0;
+        while (i + zrun < slen && old_buf[i + zrun] == new_buf[i + zrun] &&
+               ((unsigned long)(new_buf + i + zrun) % sizeof(long)) != 0)
+            zrun++;
+        while (i + zrun + sizeof(long) <= slen &&
+               *(const long *)(old_buf + i + zrun) ==
+               *(const long *)(new_buf + i + zrun))
+            zrun += sizeof(long);
+        while (i + zrun < slen && old_buf[i + zrun] == new_buf[i + zrun])
+            zrun++;
+
+        i += zrun;
+        if (i == slen)
+            break;
+
+        nzrun = 0;
+        while (i + nzrun < slen && old_buf[i + nzrun] != new_buf[i + nzrun])
+            nzrun++;
+
+        n = uleb128_encode(dst + d, dlen - d, zrun);
+        if (n < 0)
+            return -1;
+        d += n;
+        n = uleb128_encode(dst + d, dlen - d, nzrun);
+        if (n < 0 || d + n + nzrun > dlen)
+            return -1;
+        d += n;
+        memcpy(dst + d, new_buf + i, nzrun);
+        d += nzrun;
+        i += nzrun;
+    }
+
+    return d;
+}
+
+int xbzrle_decode_buffer(const uint8_t *src, int slen, uint8_t *dst,
+                         int dlen)
+{
+    int i = 0, d = 0, n;
+    uint32_t zrun, nzrun;
+
+    while (i < slen) {
+        n = uleb128_decode(src + i, slen - i, &zrun);
+        if (n < 0 || zrun > dlen - d)
+            return -1;
+        i += n;
+        d += zrun;
+
+        n = uleb128_decode(src + i, slen - i, &nzrun);
+        if (n < 0 || nzrun == 0 || nzrun > dlen - d ||
+            nzrun > slen - i - n)
+            return -1;
+        i += n;
+        memcpy(dst + d, src + i, nzrun);
+        i += nzrun;
+        d += nzrun;
+    }
+
+    return 0;
+}
+
+/* page cache */
+
+typedef struct PageCacheEntry PageCacheEntry;
+
+struct PageCacheEntry {
+    uint64_t addr;
+    uint8_t *data;
+    LIST_ENTRY(PageCacheEntry) hash_link;
+    TAILQ_ENTRY(PageCacheEntry) lru_link;
+};
+
+LIST_HEAD(PageCacheBucket, PageCacheEntry);
+
+struct PageCache {
+    size_t page_size;
+    int64_t num_pages;
+    int64_t used;
+    unsigned long hash_mask;
+    struct PageCacheBucket *hash;
+    /* most recently used first */
+    TAILQ_HEAD(PageCacheLRU, PageCacheEntry) lru;
+    PageCacheEntry *entries;
+    uint8_t *data;
+};
+
+static struct PageCacheBucket *page_cache_bucket(PageCache *cache,
+                                                 uint64_t addr)
+{
+    return &cache->hash[(addr / cache->page_size) & cache->hash_mask];
+}
+
+PageCache *page_cache_init(int64_t num_pages, size_t page_size)
+{
+    PageCache *cache;
+    unsigned long nb_buckets;
+    int64_t i;
+
+    if (num_pages < 1)
+        return NULL;
+
+    cache = qemu_mallocz(sizeof(*cache));
+    cache->page_size = page_size;
+    cache->num_pages = num_pages;
+
+    for (nb_buckets = 1; nb_buckets < num_pages; nb_buckets <<= 1)
+        ;
+    cache->hash_mask = nb_buckets - 1;
+    cache->hash = qemu_malloc(nb_buckets * sizeof(*cache->hash));
+    for (i = 0; i < nb_buckets; i++)
+        LIST_INIT(&cache->hash[i]);
+
+    TAILQ_INIT(&cache->lru);
+    cache->entries = qemu_mallocz(num_pages * sizeof(*cache->entries));
+    cache->data = qemu_malloc(num_pages * page_size);
+    for (i = 0; i < num_pages; i++)
+        cache->entries[i].data = cache->data + i * page_size;
+
+    return cache;
+}
+
+void page_cache_fini(PageCache *cache)
+{
+    qemu_free(cache->data);
+    qemu_free(cache->entries);
+    qemu_free(cache->hash);
+    qemu_free(cache);
+}
+
+uint8_t *page_cache_lookup(PageCache *cache, uint64_t addr)
+{
+    PageCacheEntry *e;
+
+    LIST_FOREACH(e, page_cache_bucket(cache, addr), hash_link) {
+        if (e->addr == addr) {
+            TAILQ_REMOVE(&cache->lru, e, lru_link);
+            TAILQ_INSERT_HEAD(&cache->lru, e, lru_link);
+            return e->data;
+        }
+    }
+
+    return NULL;
+}
+
+uint8_t *page_cache_insert(PageCache *cache, uint64_t addr)
+{
+    PageCacheEntry *e;
+
+    if (cache->used < cache->num_pages) {
+        e = &cache->entries[cache->used++];
+    } else {
+        e = TAILQ_LAST(&cache->lru, PageCacheLRU);
+        TAILQ_REMOVE(&cache->lru, e, lru_link);
+        LIST_REMOVE(e, hash_link);
+    }
+
+    e->addr = addr;
+    LIST_INSERT_HEAD(page_cache_bucket(cache, addr), e, hash_link);
+    TAILQ_INSERT_HEAD(&cache->lru, e, lru_link);
+
+    return e->data;
+}
@@ -0,0 +1,42 @@
+/*
+ * XBZRLE page delta encoding and the page cache used by live migration
+ *
+ * This work is licensed under the terms of the GNU GPL, version 2.  See
+ * the COPYING file in the top-level directory.
+ *
+ */
+
+#ifndef QEMU_XBZRLE_H
+#define QEMU_XBZRLE_H
+
+#include <stdint.h>
+#include <stddef.h>
+
+/* Encode the difference between old_buf and new_buf (both slen bytes) as
+   a sequence of (unchanged run, changed run, changed bytes) records into
+   dst.  Returns the encoded length, 0 if the buffers are equal, or -1 if
+   the encoding does not fit in dlen bytes. */
+int xbzrle_encode_buffer(const uint8_t *old_buf, const uint8_t *new_buf,
+                         int slen, uint8_t *dst, int dlen);
+
+/* Apply an encoded delta of slen bytes to dst, which holds dlen bytes of
+   the old contents.  Returns 0, or -1 if the encoding is malformed. */
+int xbzrle_decode_buffer(const uint8_t *src, int slen, uint8_t *dst,
+                         int dlen);
+
+typedef struct PageCache PageCache;
+
+/* an LRU cache of num_pages copies of page_size bytes, keyed by address */
+PageCache *page_cache_init(int64_t num_pages, size_t page_size);
+void page_cache_fini(PageCache *cache);
+
+/* Return the copy of the page at addr and make it the most recently used,
+   or NULL if it is not cached. */
+uint8_t *page_cache_lookup(PageCache *cache, uint64_t addr);
+
+/* Return the buffer for a new copy of the page at addr, which must not be
+   cached yet, evicting the least recently used page if needed.  The caller
+   fills it in. */
+uint8_t *page_cache_insert(PageCache *cache, uint64_t addr);
+
+#endif